@@ -2,27 +2,490 @@
  * simple_process.c - Cross-platform process execution wrapper for Eiffel
  *
  * Windows: Uses Win32 CreateProcess API
- * Linux: Uses POSIX fork/exec with pipes
+ * Linux: Uses clone(CLONE_VM|CLONE_VFORK) + exec with pipes
+ * Other POSIX: Uses fork/exec with pipes
  *
  * Provides SCOOP-compatible process execution without thread dependencies.
  * Uses synchronous I/O for output capture.
  *
+ * Reentrant: any number of threads may call in at once. Each result and
+ * async process carries its own error message, sp_get_last_error reports
+ * the calling thread's last failure, and pipe ends are never inherited by
+ * a child another thread is starting.
+ *
  * Copyright (c) 2025 Larry Rix - MIT License
  */
 
+#if !defined(_WIN32) && !defined(EIF_WINDOWS) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* clone, pipe2 */
+#endif
+
 #include "simple_process.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdarg.h>
 
 #define BUFFER_SIZE 4096
-#define MAX_OUTPUT_SIZE (1024 * 1024)  /* 1MB max output */
+#define MAX_OUTPUT_SIZE (1024 * 1024)  /* Default capture limit (1MB) */
+#define KILL_DRAIN_MS 100  /* Output still read after a timed-out run is killed */
+#define KILL_REAP_MS 5000  /* Wait for a killed process to finish (sp_terminate) */
+
+#if defined(_MSC_VER)
+#define SP_THREAD_LOCAL __declspec(thread)
+#else
+#define SP_THREAD_LOCAL __thread
+#endif
+
+/* Text of the last failure, kept per thread */
+static SP_THREAD_LOCAL char last_error_msg[512] = {0};
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+#define sp_strdup _strdup
+#else
+#define sp_strdup strdup
+#endif
+
+/* ============ METRICS ============ */
+
+/*
+ * Counters shared by every thread. Updates are single atomic adds on
+ * fields that are all long long, so recording costs a few uncontended
+ * instructions per spawn, read or reap, and nothing is locked.
+ */
+static sp_metrics metrics;
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+#define metrics_add(counter, n) InterlockedExchangeAdd64((volatile LONG64*)&(counter), (n))
+#else
+#define metrics_add(counter, n) __sync_fetch_and_add(&(counter), (long long)(n))
+#endif
+
+#define METRICS_WORDS ((int)(sizeof(sp_metrics) / sizeof(long long)))
+
+static long long monotonic_ns(void);
+
+/* Add `value' to histogram `h'. */
+static void metrics_record(sp_histogram* h, long long value) {
+    long long bound = 1LL << SP_HISTOGRAM_FIRST_SHIFT;
+    int bucket = 0;
+
+    if (value < 0) value = 0;
+    while (bucket < SP_HISTOGRAM_BUCKETS - 1 && value > bound) {
+        bucket++;
+        bound <<= 1;
+    }
+    metrics_add(h->count, 1);
+    metrics_add(h->sum, value);
+    metrics_add(h->buckets[bucket], 1);
+}
+
+/* Count a failed spawn with error code `error'. */
+static void metrics_spawn_failed(int error) {
+    metrics_add(metrics.spawn_failures, 1);
+    metrics_add(metrics.failures_by_error[(error > 0 && error < SP_METRICS_ERROR_CODES) ? error : 0], 1);
+}
+
+/* Count a child started in `latency_ns'. */
+static void metrics_spawned(long long latency_ns) {
+    metrics_add(metrics.spawns, 1);
+    metrics_add(metrics.live_children, 1);
+    metrics_record(&metrics.spawn_latency_ns, latency_ns);
+}
+
+/* Count a child reaped, or closed before it was. */
+static void metrics_ended(void) {
+    metrics_add(metrics.live_children, -1);
+}
+
+/* Count the end of a synchronous run started at `start_ns': its runtime,
+ * the first output byte of either stream (0: none), the bytes captured and
+ * whether any were dropped. */
+static void metrics_run(long long start_ns, long long wall_time_ns, long long first_output_ns,
+                        long long first_error_ns, long long bytes, int truncated) {
+    if (first_output_ns == 0 || (first_error_ns != 0 && first_error_ns < first_output_ns)) {
+        first_output_ns = first_error_ns;
+    }
+    metrics_record(&metrics.runtime_ns, wall_time_ns);
+    if (first_output_ns != 0) metrics_record(&metrics.first_output_ns, first_output_ns - start_ns);
+    metrics_record(&metrics.output_bytes, bytes);
+    if (truncated) metrics_add(metrics.truncations, 1);
+}
+
+void sp_metrics_snapshot(sp_metrics* snapshot) {
+    long long* from = (long long*)&metrics;
+    long long* to = (long long*)snapshot;
+    int i;
+
+    if (!snapshot) return;
+    for (i = 0; i < METRICS_WORDS; i++) to[i] = metrics_add(from[i], 0);
+}
+
+void sp_metrics_reset(void) {
+    long long* words = (long long*)&metrics;
+    long long* live = &metrics.live_children;
+    int i;
+
+    for (i = 0; i < METRICS_WORDS; i++) {
+        if (&words[i] != live) metrics_add(words[i], -metrics_add(words[i], 0));
+    }
+}
+
+/* Growable text for sp_metrics_prometheus */
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    int failed;
+} metrics_text;
+
+/* Append one formatted line of at most 255 bytes to `text'. */
+static void text_line(metrics_text* text, const char* format, ...) {
+    va_list args;
+    char* grown;
+    int n;
+
+    if (text->failed) return;
+    if (text->capacity - text->length < 256) {
+        grown = (char*)realloc(text->data, text->capacity * 2);
+        if (!grown) {
+            text->failed = 1;
+            return;
+        }
+        text->data = grown;
+        text->capacity *= 2;
+    }
+    va_start(args, format);
+    n = vsnprintf(text->data + text->length, 256, format, args);
+    va_end(args);
+    if (n > 0) text->length += (n < 256) ? (size_t)n : 255;
+}
+
+/* Append histogram `h' named `name'; `scale' divides values and bounds
+ * (1e9 for nanoseconds shown as seconds, 1 for bytes). */
+static void text_histogram(metrics_text* text, const char* name, const char* help,
+                           const sp_histogram* h, double scale) {
+    long long cumulative = 0;
+    int i;
+
+    text_line(text, "# HELP simple_process_%s %s\n", name, help);
+    text_line(text, "# TYPE simple_process_%s histogram\n", name);
+    for (i = 0; i < SP_HISTOGRAM_BUCKETS - 1; i++) {
+        cumulative += h->buckets[i];
+        text_line(text, "simple_process_%s_bucket{le=\"%.9g\"} %lld\n", name,
+                  (double)(1LL << (SP_HISTOGRAM_FIRST_SHIFT + i)) / scale, cumulative);
+    }
+    text_line(text, "simple_process_%s_bucket{le=\"+Inf\"} %lld\n", name, h->count);
+    text_line(text, "simple_process_%s_sum %.9g\n", name, (double)h->sum / scale);
+    text_line(text, "simple_process_%s_count %lld\n", name, h->count);
+}
+
+char* sp_metrics_prometheus(void) {
+    sp_metrics m;
+    metrics_text text;
+    int i;
+
+    sp_metrics_snapshot(&m);
+    text.capacity = 16384;
+    text.length = 0;
+    text.failed = 0;
+    text.data = (char*)malloc(text.capacity);
+    if (!text.data) return NULL;
+
+    text_line(&text, "# HELP simple_process_spawns_total Children started.\n");
+    text_line(&text, "# TYPE simple_process_spawns_total counter\n");
+    text_line(&text, "simple_process_spawns_total %lld\n", m.spawns);
+    text_line(&text, "# HELP simple_process_spawn_failures_total Spawns that failed, by error code (0: other).\n");
+    text_line(&text, "# TYPE simple_process_spawn_failures_total counter\n");
+    for (i = 0; i < SP_METRICS_ERROR_CODES; i++) {
+        if (m.failures_by_error[i] != 0) {
+            text_line(&text, "simple_process_spawn_failures_total{error=\"%d\"} %lld\n", i, m.failures_by_error[i]);
+        }
+    }
+    text_line(&text, "# HELP simple_process_live_children Children started and not yet reaped.\n");
+    text_line(&text, "# TYPE simple_process_live_children gauge\n");
+    text_line(&text, "simple_process_live_children %lld\n", m.live_children);
+    text_line(&text, "# HELP simple_process_truncations_total Runs whose output passed the capture limit.\n");
+    text_line(&text, "# TYPE simple_process_truncations_total counter\n");
+    text_line(&text, "simple_process_truncations_total %lld\n", m.truncations);
+    text_histogram(&text, "spawn_latency_seconds", "Time from spawn call to its return.", &m.spawn_latency_ns, 1e9);
+    text_histogram(&text, "first_output_seconds", "Time from spawn to the first output byte.", &m.first_output_ns, 1e9);
+    text_histogram(&text, "runtime_seconds", "Time from spawn to exit.", &m.runtime_ns, 1e9);
+    text_histogram(&text, "output_bytes", "Output bytes captured per run.", &m.output_bytes, 1);
+
+    if (text.failed) {
+        free(text.data);
+        return NULL;
+    }
+    return text.data;
+}
+
+/* ============ TRACING ============ */
+
+/*
+ * Lifecycle events of every child, written as a Chrome trace (JSON array
+ * format) for chrome://tracing or ui.perfetto.dev. Each child gets its own
+ * track (tid = child pid) named after its command, with instants for spawn
+ * requested, forked, exec done or failed, first output byte, end of output and
+ * reaped, and a "process" slice from request to reap. When no trace runs,
+ * every hook costs one load of `tracing'.
+ */
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+static SRWLOCK trace_lock = SRWLOCK_INIT;
+#define trace_lock_acquire() AcquireSRWLockExclusive(&trace_lock)
+#define trace_lock_release() ReleaseSRWLockExclusive(&trace_lock)
+#define trace_own_pid() ((long long)GetCurrentProcessId())
+#else
+#include <pthread.h>
+#include <fcntl.h>
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#define trace_lock_acquire() pthread_mutex_lock(&trace_lock)
+#define trace_lock_release() pthread_mutex_unlock(&trace_lock)
+#define trace_own_pid() ((long long)getpid())
+#endif
+
+#define TRACE_COMMAND_SIZE 256
+
+static volatile int tracing = 0;
+static FILE* trace_file = NULL;
+
+/* Children traced and not yet reaped, with the time they were requested */
+typedef struct {
+    long long pid;
+    long long requested_ns;
+} trace_child;
+
+static trace_child* trace_children = NULL;
+static int trace_child_count = 0;
+static int trace_child_capacity = 0;
+
+/* Length of the well-formed UTF-8 sequence at `s' (lead byte >= 0x80), or
+ * 0 if it is invalid: a stray continuation byte, an overlong form, a
+ * surrogate, a value above U+10FFFF or a sequence cut short. */
+static int trace_utf8_length(const unsigned char* s) {
+    unsigned char low = 0x80, high = 0xBF;
+    int n, i;
+
+    if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+        n = 2;
+    } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+        n = 3;
+        if (s[0] == 0xE0) low = 0xA0;
+        if (s[0] == 0xED) high = 0x9F;
+    } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+        n = 4;
+        if (s[0] == 0xF0) low = 0x90;
+        if (s[0] == 0xF4) high = 0x8F;
+    } else {
+        return 0;
+    }
+    if (s[1] < low || s[1] > high) return 0;
+    for (i = 2; i < n; i++) {
+        if (s[i] < 0x80 || s[i] > 0xBF) return 0;
+    }
+    return n;
+}
+
+/* Append `text' to `out' (`size' bytes, `*length' used) as JSON string
+ * content, cutting it short at a character boundary rather than
+ * overflowing. Bytes that are not valid UTF-8 become U+FFFD. */
+static void trace_escape(char* out, size_t size, size_t* length, const char* text) {
+    const unsigned char* c = (const unsigned char*)text;
+    int n;
+
+    /* Each step appends at most 6 bytes (an escape or a 4-byte sequence) */
+    while (c && *c && *length + 7 < size) {
+        if (*c == '"' || *c == '\\') {
+            out[(*length)++] = '\\';
+            out[(*length)++] = (char)*c++;
+        } else if (*c < 0x20) {
+            *length += (size_t)snprintf(out + *length, size - *length, "\\u%04x", *c++);
+        } else if (*c < 0x80) {
+            out[(*length)++] = (char)*c++;
+        } else if ((n = trace_utf8_length(c)) > 0) {
+            memcpy(out + *length, c, n);
+            *length += n;
+            c += n;
+        } else {
+            memcpy(out + *length, "\\ufffd", 6);
+            *length += 6;
+            c++;
+        }
+    }
+    out[*length] = '\0';
+}
+
+/* Write one event on the track of child `pid' (0: the caller's track).
+ * `args' is a JSON object body or NULL. Call with `trace_lock' held. */
+static void trace_write(long long pid, const char* name, char phase, long long ts_ns,
+                        long long duration_ns, const char* args) {
+    if (!trace_file) return;
+    fprintf(trace_file, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%lld,\"tid\":%lld",
+            name, phase, ts_ns / 1e3, trace_own_pid(), pid);
+    if (phase == 'X') fprintf(trace_file, ",\"dur\":%.3f", duration_ns / 1e3);
+    if (phase == 'i') fputs(",\"s\":\"t\"", trace_file);
+    if (args) fprintf(trace_file, ",\"args\":{%s}", args);
+    fputs("},\n", trace_file);
+}
+
+/* Trace a child started as `pid' for `argv' (or `command_line' when
+ * NULL). Zero times are unknown and left out: a child started by the spawn
+ * server or CreateProcess has only `started_ns'. A nonzero `exec_error' is
+ * the errno the child gave up with at `exec_ns'. */
+static void trace_spawned(long long pid, char* const* argv, const char* command_line, long long requested_ns,
+                          long long fork_ns, long long exec_ns, int exec_error, long long started_ns) {
+    char args[TRACE_COMMAND_SIZE + 64];
+    char error_args[32];
+    size_t length;
+    trace_child* grown;
+    int i;
+
+    length = (size_t)snprintf(args, sizeof(args), "\"name\":\"");
+    if (argv) {
+        for (i = 0; argv[i]; i++) {
+            if (i > 0) trace_escape(args, TRACE_COMMAND_SIZE, &length, " ");
+            trace_escape(args, TRACE_COMMAND_SIZE, &length, argv[i]);
+        }
+    } else {
+        trace_escape(args, TRACE_COMMAND_SIZE, &length, command_line);
+    }
+    snprintf(args + length, sizeof(args) - length, " [%lld]\"", pid);
+
+    trace_lock_acquire();
+    if (trace_child_count == trace_child_capacity) {
+        int capacity = trace_child_capacity ? trace_child_capacity * 2 : 64;
+        grown = (trace_child*)realloc(trace_children, capacity * sizeof(trace_child));
+        if (grown) {
+            trace_children = grown;
+            trace_child_capacity = capacity;
+        }
+    }
+    if (trace_child_count < trace_child_capacity) {
+        trace_children[trace_child_count].pid = pid;
+        trace_children[trace_child_count++].requested_ns = requested_ns;
+    }
+    trace_write(pid, "thread_name", 'M', requested_ns, 0, args);
+    trace_write(pid, "spawn requested", 'i', requested_ns, 0, NULL);
+    if (fork_ns) trace_write(pid, "forked", 'i', fork_ns, 0, NULL);
+    if (exec_ns && exec_error) {
+        snprintf(error_args, sizeof(error_args), "\"error\":%d", exec_error);
+        trace_write(pid, "exec failed", 'i', exec_ns, 0, error_args);
+    } else if (exec_ns) {
+        trace_write(pid, "exec done", 'i', exec_ns, 0, NULL);
+    }
+    if (started_ns) trace_write(pid, "started", 'i', started_ns, 0, NULL);
+    trace_lock_release();
+}
+
+/* Trace a spawn that failed with `error' on the caller's track. */
+static void trace_spawn_failed(long long requested_ns, int error) {
+    char args[32];
+
+    snprintf(args, sizeof(args), "\"error\":%d", error);
+    trace_lock_acquire();
+    trace_write(0, "spawn failed", 'i', requested_ns, 0, args);
+    trace_lock_release();
+}
+
+/* Trace event `name' ("first output" or "eof") of `stream' of child `pid'. */
+static void trace_output(long long pid, const char* name, int stream, long long ts_ns) {
+    trace_lock_acquire();
+    trace_write(pid, name, 'i', ts_ns, 0, stream == SP_STREAM_ERROR ? "\"stream\":\"stderr\"" : "\"stream\":\"stdout\"");
+    trace_lock_release();
+}
+
+/* Trace child `pid' reaped with `exit_code' (or killed by `signal'). */
+static void trace_reaped(long long pid, int exit_code, int signal) {
+    char args[48];
+    long long now = monotonic_ns();
+    int i;
+
+    if (signal) {
+        snprintf(args, sizeof(args), "\"signal\":%d", signal);
+    } else {
+        snprintf(args, sizeof(args), "\"exit_code\":%d", exit_code);
+    }
+    trace_lock_acquire();
+    trace_write(pid, "reaped", 'i', now, 0, args);
+    for (i = 0; i < trace_child_count; i++) {
+        if (trace_children[i].pid != pid) continue;
+        trace_write(pid, "process", 'X', trace_children[i].requested_ns,
+                    now - trace_children[i].requested_ns, args);
+        trace_children[i] = trace_children[--trace_child_count];
+        break;
+    }
+    trace_lock_release();
+}
+
+int sp_trace_start(const char* path) {
+    FILE* file;
+#if !defined(_WIN32) && !defined(EIF_WINDOWS)
+    int fd;
+#endif
+
+    if (!path || !path[0]) {
+        snprintf(last_error_msg, sizeof(last_error_msg), "No trace file");
+        return 0;
+    }
+    /* Not inherited: children must not hold the trace open */
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+    file = fopen(path, "wN");
+#else
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    file = (fd >= 0) ? fdopen(fd, "w") : NULL;
+    if (!file && fd >= 0) close(fd);
+#endif
+    if (!file) {
+        snprintf(last_error_msg, sizeof(last_error_msg), "Cannot create trace file %s", path);
+        return 0;
+    }
+    sp_trace_stop();
+    trace_lock_acquire();
+    trace_file = file;
+    fputs("[\n", trace_file);
+    fprintf(trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lld,\"tid\":0,"
+            "\"args\":{\"name\":\"simple_process\"}},\n", trace_own_pid());
+    tracing = 1;
+    trace_lock_release();
+    return 1;
+}
+
+void sp_trace_stop(void) {
+    trace_lock_acquire();
+    tracing = 0;
+    if (trace_file) {
+        /* A last event without a trailing comma closes the array */
+        fprintf(trace_file, "{\"name\":\"trace stopped\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,\"pid\":%lld,\"tid\":0}\n]\n",
+                monotonic_ns() / 1e3, trace_own_pid());
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    free(trace_children);
+    trace_children = NULL;
+    trace_child_count = 0;
+    trace_child_capacity = 0;
+    trace_lock_release();
+}
+
+int sp_trace_is_active(void) {
+    return tracing;
+}
 
-static char last_error_msg[512] = {0};
+#if defined(__GNUC__)
+/* SP_TRACE=<path> traces the whole run of the program into <path> */
+__attribute__((constructor)) static void trace_autostart(void) {
+    const char* path = getenv("SP_TRACE");
+    if (path && path[0] && sp_trace_start(path)) atexit(sp_trace_stop);
+}
+#endif
 
 #if defined(_WIN32) || defined(EIF_WINDOWS)
 /* ============ WINDOWS ERROR HANDLING ============ */
 
+#include <io.h>
+#include <psapi.h>
+
 /* Store last error message */
 static void store_last_error(void) {
     DWORD err = GetLastError();
@@ -45,762 +508,5790 @@ static void store_last_error(void) {
 #include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
 static void store_last_error(void) {
-    const char* err = strerror(errno);
-    strncpy(last_error_msg, err, sizeof(last_error_msg) - 1);
-    last_error_msg[sizeof(last_error_msg) - 1] = '\0';
+    int err = errno;
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+    /* GNU strerror_r may return a static string instead of filling ours */
+    const char* msg = strerror_r(err, last_error_msg, sizeof(last_error_msg));
+    if (msg != last_error_msg) snprintf(last_error_msg, sizeof(last_error_msg), "%s", msg);
+#else
+    if (strerror_r(err, last_error_msg, sizeof(last_error_msg)) != 0) {
+        snprintf(last_error_msg, sizeof(last_error_msg), "Error %d", err);
+    }
+#endif
+    errno = err;
 }
 
+/* ============ DESCRIPTOR INHERITANCE ============ */
+
+/*
+ * Every descriptor the library creates is close-on-exec, so a child never
+ * holds on to another call's pipes (which would hide EOF from that call).
+ * Where pipe2, SOCK_CLOEXEC and MSG_CMSG_CLOEXEC set the flag atomically
+ * nothing more is needed. Elsewhere a descriptor is briefly inheritable
+ * between its creation and fcntl, so creation holds `fd_lock' shared and
+ * fork holds it exclusive: concurrent callers never fork inside that window.
+ */
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__) || defined(__DragonFly__)
+#define SP_HAVE_PIPE2 1
+#endif
+
+#if defined(SP_HAVE_PIPE2) && defined(SOCK_CLOEXEC) && defined(MSG_CMSG_CLOEXEC)
+#define SP_ATOMIC_CLOEXEC 1
+#else
+static pthread_rwlock_t fd_lock = PTHREAD_RWLOCK_INITIALIZER;
 #endif
 
-const char* sp_get_last_error(void) {
-    return last_error_msg;
+/* Enter a window in which new descriptors are still inheritable. */
+static void fd_creation_begin(void) {
+#ifndef SP_ATOMIC_CLOEXEC
+    pthread_rwlock_rdlock(&fd_lock);
+#endif
 }
 
-#if defined(_WIN32) || defined(EIF_WINDOWS)
-/* ============ WINDOWS sp_execute_command ============ */
+/* Leave the window entered by fd_creation_begin. */
+static void fd_creation_end(void) {
+#ifndef SP_ATOMIC_CLOEXEC
+    pthread_rwlock_unlock(&fd_lock);
+#endif
+}
 
-sp_result* sp_execute_command(const char* command, const char* working_dir, int show_window) {
-    sp_result* result;
-    SECURITY_ATTRIBUTES sa;
-    HANDLE hStdOutRead = NULL, hStdOutWrite = NULL;
-    HANDLE hStdErrRead = NULL, hStdErrWrite = NULL;
-    STARTUPINFOA si;
-    PROCESS_INFORMATION pi;
-    char* cmd_copy = NULL;
-    char* output_buffer = NULL;
-    int output_size = 0;
-    int output_capacity = BUFFER_SIZE;
-    DWORD bytes_read;
-    char read_buffer[BUFFER_SIZE];
-    BOOL success;
+/* ============ POSIX SPAWN BACKEND ============ */
 
-    /* Allocate result structure */
-    result = (sp_result*)malloc(sizeof(sp_result));
-    if (!result) return NULL;
-    memset(result, 0, sizeof(sp_result));
+/*
+ * fork() has to copy the page tables of the whole parent, so its cost grows
+ * with the parent's RSS. On Linux children are created with
+ * clone(CLONE_VM|CLONE_VFORK) instead: the child borrows the parent's memory
+ * until it calls exec, and the calling thread is suspended until then.
+ * Spawn cost is therefore independent of heap size. Other POSIX systems
+ * fall back to fork().
+ */
 
-    /* Set up security attributes for inheritable handles */
-    sa.nLength = sizeof(SECURITY_ATTRIBUTES);
-    sa.bInheritHandle = TRUE;
-    sa.lpSecurityDescriptor = NULL;
+#define SPAWN_STACK_SIZE (64 * 1024)
 
-    /* Create pipes for stdout */
-    if (!CreatePipe(&hStdOutRead, &hStdOutWrite, &sa, 0)) {
-        store_last_error();
-        result->error_message = _strdup(last_error_msg);
-        result->success = 0;
-        return result;
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+extern char** environ;
+
+#define CONTROL_LIMITS 3        /* RLIMIT_AS, RLIMIT_CPU, RLIMIT_NOFILE */
+
+/* Scheduling and resource controls a child applies to itself before exec */
+typedef struct {
+    int nice_increment;         /* Added with nice(), or 0 */
+    int io_priority;            /* ioprio_set value, or 0 (Linux) */
+    long long limits[CONTROL_LIMITS];  /* Caps on the resources above, 0: inherited */
+    int has_cpu_set;            /* Apply `cpu_set'? (Linux) */
+#ifdef __linux__
+    cpu_set_t cpu_set;          /* CPUs the child may run on */
+#endif
+    int has_cgroup;             /* Join the cgroup in the spec's cgroup_procs? (Linux) */
+} sp_child_controls;
+
+/* Description of a child to spawn. The child reads it before exec. */
+typedef struct {
+    const char* path;           /* Program to exec */
+    char* const* argv;          /* Argument vector (NULL terminated) */
+    const char* working_dir;    /* Directory to chdir into, or NULL */
+    int stdin_fd;               /* Fd to install as stdin, or -1 to inherit */
+    int stdout_fd;              /* Fd to install as stdout, or -1 to inherit */
+    int stderr_fd;              /* Fd to install as stderr, or -1 to inherit */
+    int new_group;              /* Start a process group led by the child? */
+    char* const* envp;          /* Environment, or NULL for `environ' */
+    const sp_child_controls* controls;  /* Controls to apply, or NULL */
+    const char* cgroup_procs;   /* cgroup.procs file of the cgroup to join, when controls->has_cgroup */
+    const sigset_t* child_mask; /* Signal mask for the child, or NULL for the caller's */
+    int set_ignored;            /* Apply `ignored' to signals 1..31 in the child? */
+    unsigned int ignored;       /* Bit n set: signal n is ignored */
+    sigset_t parent_mask;       /* Signal mask to restore in the child */
+    volatile int child_errno;   /* Set by the child if setup or exec failed */
+    int status_fd;              /* Out: exit status pipe of a served child, or -1 */
+    int exec_fd;                /* Tracing: close-on-exec pipe the child writes its errno to on failure, or -1 */
+    volatile long long fork_ns; /* Tracing out: monotonic time the child started, or 0 */
+    long long exec_ns;          /* Tracing out: monotonic time exec closed `exec_fd', or 0 */
+} sp_spawn_spec;
+
+/* Create a pipe whose ends are not inherited by unrelated children. */
+static int make_pipe(int fds[2]) {
+#ifdef SP_HAVE_PIPE2
+    return pipe2(fds, O_CLOEXEC);
+#else
+    int saved_errno;
+
+    fd_creation_begin();
+    if (pipe(fds) < 0) {
+        saved_errno = errno;
+        fd_creation_end();
+        errno = saved_errno;
+        return -1;
     }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fd_creation_end();
+    return 0;
+#endif
+}
 
-    /* Ensure read handle is not inherited */
-    SetHandleInformation(hStdOutRead, HANDLE_FLAG_INHERIT, 0);
+/* Install `fd' as `target' in the child (clearing close-on-exec). */
+static int child_install_fd(int fd, int target) {
+    if (fd < 0) return 0;
+    if (fd == target) {
+        return fcntl(fd, F_SETFD, 0);
+    }
+    return dup2(fd, target) < 0 ? -1 : 0;
+}
 
-    /* Create pipes for stderr (redirect to stdout) */
-    if (!DuplicateHandle(GetCurrentProcess(), hStdOutWrite,
-                         GetCurrentProcess(), &hStdErrWrite,
-                         0, TRUE, DUPLICATE_SAME_ACCESS)) {
-        store_last_error();
-        result->error_message = _strdup(last_error_msg);
-        result->success = 0;
-        CloseHandle(hStdOutRead);
-        CloseHandle(hStdOutWrite);
-        return result;
+/* Fill `controls' from `options', and `cgroup_procs' (`size' bytes) with
+ * the cgroup.procs path of options->cgroup.
+ * Returns: 1 if there is anything to apply, 0 if not, -1 on invalid
+ *          options (error stored)
+ */
+static int prepare_controls(const sp_options* options, sp_child_controls* controls,
+                            char* cgroup_procs, size_t size) {
+    int i, any = 0;
+
+    memset(controls, 0, sizeof(sp_child_controls));
+    controls->nice_increment = options->nice_increment;
+    controls->limits[0] = options->max_address_space;
+    controls->limits[1] = options->max_cpu_seconds;
+    controls->limits[2] = options->max_open_files;
+    any = controls->nice_increment != 0 || controls->limits[0] > 0 ||
+          controls->limits[1] > 0 || controls->limits[2] > 0;
+#ifdef __linux__
+    if (options->io_priority_class > 0) {
+        controls->io_priority = (options->io_priority_class << 13) | (options->io_priority_level & 7);
+        any = 1;
+    }
+    if (options->cpus && options->cpu_count > 0) {
+        CPU_ZERO(&controls->cpu_set);
+        for (i = 0; i < options->cpu_count; i++) {
+            if (options->cpus[i] < 0 || options->cpus[i] >= CPU_SETSIZE) {
+                snprintf(last_error_msg, sizeof(last_error_msg), "No CPU %d", options->cpus[i]);
+                return -1;
+            }
+            CPU_SET(options->cpus[i], &controls->cpu_set);
+        }
+        controls->has_cpu_set = 1;
+        any = 1;
+    }
+    if (options->cgroup && options->cgroup[0]) {
+        if ((size_t)snprintf(cgroup_procs, size, "%s/cgroup.procs", options->cgroup) >= size) {
+            snprintf(last_error_msg, sizeof(last_error_msg), "cgroup path too long");
+            return -1;
+        }
+        controls->has_cgroup = 1;
+        any = 1;
     }
+#else
+    (void)i;
+    (void)cgroup_procs;
+    (void)size;
+#endif
+    return any;
+}
 
-    /* Set up startup info */
-    memset(&si, 0, sizeof(si));
-    si.cb = sizeof(si);
-    si.hStdOutput = hStdOutWrite;
-    si.hStdError = hStdErrWrite;
-    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-    si.dwFlags |= STARTF_USESTDHANDLES;
+/* Apply spec->controls in the child. Async-signal-safe.
+ * Returns: 0 on success, -1 with errno set
+ */
+static int child_apply_controls(const sp_spawn_spec* spec) {
+    static const int resources[CONTROL_LIMITS] = {RLIMIT_AS, RLIMIT_CPU, RLIMIT_NOFILE};
+    const sp_child_controls* controls = spec->controls;
+    struct rlimit limit;
+    rlim_t cap;
+    int fd, i;
+
+    if (!controls) return 0;
+#ifdef __linux__
+    if (controls->has_cgroup) {
+        /* Writing 0 moves the writer itself */
+        fd = open(spec->cgroup_procs, O_WRONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        i = (int)write(fd, "0", 1);
+        close(fd);
+        if (i != 1) return -1;
+    }
+    if (controls->has_cpu_set && sched_setaffinity(0, sizeof(cpu_set_t), &controls->cpu_set) < 0) return -1;
+    if (controls->io_priority && syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, controls->io_priority) < 0) {
+        return -1;
+    }
+#else
+    (void)fd;
+#endif
+    if (controls->nice_increment) {
+        errno = 0;
+        if (nice(controls->nice_increment) == -1 && errno != 0) return -1;
+    }
+    for (i = 0; i < CONTROL_LIMITS; i++) {
+        if (controls->limits[i] <= 0) continue;
+        if (getrlimit(resources[i], &limit) < 0) return -1;
+        /* Lower both limits; a hard limit already below the cap stays */
+        cap = (rlim_t)controls->limits[i];
+        if (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > cap) limit.rlim_max = cap;
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(resources[i], &limit) < 0) return -1;
+    }
+    return 0;
+}
 
-    if (!show_window) {
-        si.dwFlags |= STARTF_USESHOWWINDOW;
-        si.wShowWindow = SW_HIDE;
+/* Give up in the child: report `error' and exit with 127. */
+static void child_fail(sp_spawn_spec* spec, int error) {
+    ssize_t ignored;
+
+    spec->child_errno = error;
+    if (spec->exec_fd >= 0) {
+        ignored = write(spec->exec_fd, &error, sizeof(error));
+        (void)ignored;
     }
+    _exit(127);
+}
 
-    /* CreateProcess needs a modifiable string */
-    cmd_copy = _strdup(command);
-    if (!cmd_copy) {
-        result->error_message = _strdup("Memory allocation failed");
-        result->success = 0;
-        CloseHandle(hStdOutRead);
-        CloseHandle(hStdOutWrite);
-        CloseHandle(hStdErrWrite);
-        return result;
+/* Child side: runs on a borrowed stack, so only async-signal-safe calls. */
+static int spawn_child_main(void* arg) {
+    sp_spawn_spec* spec = (sp_spawn_spec*)arg;
+    struct sigaction sa;
+    int sig;
+
+    if (spec->exec_fd >= 0) spec->fork_ns = monotonic_ns();
+    /* Handlers must not run in the child while it shares our memory */
+    for (sig = 1; sig < NSIG; sig++) {
+        if (sigaction(sig, NULL, &sa) == 0 &&
+            sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL) {
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = SIG_DFL;
+            sigaction(sig, &sa, NULL);
+        }
+    }
+    if (spec->set_ignored) {
+        /* Dispositions of the process that asked the spawn server */
+        for (sig = 1; sig < 32; sig++) {
+            if (sig == SIGKILL || sig == SIGSTOP) continue;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = (spec->ignored & (1u << sig)) ? SIG_IGN : SIG_DFL;
+            sigaction(sig, &sa, NULL);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, spec->child_mask ? spec->child_mask : &spec->parent_mask, NULL);
+
+    if (spec->new_group) setpgid(0, 0);
+    if (child_apply_controls(spec) < 0) child_fail(spec, errno);
+    if (child_install_fd(spec->stdin_fd, STDIN_FILENO) < 0 ||
+        child_install_fd(spec->stdout_fd, STDOUT_FILENO) < 0 ||
+        child_install_fd(spec->stderr_fd, STDERR_FILENO) < 0) {
+        child_fail(spec, errno);
     }
 
-    memset(&pi, 0, sizeof(pi));
+    /* Change working directory if specified */
+    if (spec->working_dir && spec->working_dir[0]) {
+        if (chdir(spec->working_dir) < 0) child_fail(spec, errno);
+    }
 
-    /* Create the process */
-    success = CreateProcessA(
-        NULL,           /* Application name (use command line) */
-        cmd_copy,       /* Command line */
-        NULL,           /* Process security attributes */
-        NULL,           /* Thread security attributes */
-        TRUE,           /* Inherit handles */
-        CREATE_NO_WINDOW, /* Creation flags */
-        NULL,           /* Environment (inherit) */
-        working_dir,    /* Working directory */
-        &si,            /* Startup info */
-        &pi             /* Process info */
-    );
+    execve(spec->path, spec->argv, spec->envp ? spec->envp : environ);
+    child_fail(spec, errno);  /* exec failed */
+    return 127;
+}
 
-    free(cmd_copy);
+/* Spawn the child described by `spec' from this process.
+ * Returns: child pid, or -1 with errno set if no child could be created.
+ * Setup or exec failures inside the child are reported as exit code 127.
+ */
+static pid_t spawn_local(sp_spawn_spec* spec) {
+    sigset_t all_signals;
+    pid_t pid;
+    int exec_pipe[2] = {-1, -1};
+    int saved_errno, error;
+    ssize_t n;
+#ifdef __linux__
+    char* stack;
+#endif
+
+    spec->child_errno = 0;
+    spec->exec_fd = -1;
+    /* Tracing: the pipe closes when exec succeeds (close-on-exec) */
+    if (tracing && make_pipe(exec_pipe) == 0) spec->exec_fd = exec_pipe[1];
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &spec->parent_mask);
+
+#ifdef __linux__
+    stack = (char*)mmap(NULL, SPAWN_STACK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        saved_errno = errno;
+        pthread_sigmask(SIG_SETMASK, &spec->parent_mask, NULL);
+        if (exec_pipe[0] >= 0) {
+            close(exec_pipe[0]);
+            close(exec_pipe[1]);
+        }
+        errno = saved_errno;
+        return -1;
+    }
+    /* Stack grows down: hand clone the top of the region */
+    pid = clone(spawn_child_main, stack + SPAWN_STACK_SIZE,
+                CLONE_VM | CLONE_VFORK | SIGCHLD, spec);
+    saved_errno = errno;
+    munmap(stack, SPAWN_STACK_SIZE);
+#else
+#ifndef SP_ATOMIC_CLOEXEC
+    /* Exclusive: no other thread has an inheritable descriptor open */
+    pthread_rwlock_wrlock(&fd_lock);
+#endif
+    pid = fork();
+    if (pid == 0) {
+        spawn_child_main(spec);
+    }
+    saved_errno = errno;
+    if (pid > 0 && spec->exec_fd >= 0) spec->fork_ns = monotonic_ns();
+#ifndef SP_ATOMIC_CLOEXEC
+    pthread_rwlock_unlock(&fd_lock);
+#endif
+    /* Also from this side, so the group exists before fork() returns */
+    if (pid > 0 && spec->new_group) setpgid(pid, pid);
+#endif
+
+    pthread_sigmask(SIG_SETMASK, &spec->parent_mask, NULL);
+    if (exec_pipe[0] >= 0) {
+        close(exec_pipe[1]);
+        if (pid > 0) {
+            do {
+                n = read(exec_pipe[0], &error, sizeof(error));
+            } while (n < 0 && errno == EINTR);
+            if (n == 0 || n == (ssize_t)sizeof(error)) spec->exec_ns = monotonic_ns();
+            if (n == (ssize_t)sizeof(error)) spec->child_errno = error;
+        }
+        close(exec_pipe[0]);
+        spec->exec_fd = -1;
+    }
+    errno = saved_errno;
+    return pid;
+}
+
+/* Should a child whose stdin is `stdin_fd' (-1: ours) lead its own process
+ * group? A group lets timeouts and kills reach everything the child starts,
+ * but a background group that reads the terminal is stopped by SIGTTIN, so
+ * a child sharing our foreground terminal stays in our group.
+ */
+static int wants_new_group(int stdin_fd) {
+    if (stdin_fd >= 0) return 1;
+    return !(isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp());
+}
+
+/* Fill `argv' (4 slots) with the `/bin/sh -c command' vector. */
+static void shell_argv(const char* command, char* argv[4]) {
+    argv[0] = (char*)"sh";
+    argv[1] = (char*)"-c";
+    argv[2] = (char*)command;
+    argv[3] = NULL;
+}
+
+/* Is `path' an executable regular file? */
+static int is_executable_file(const char* path) {
+    struct stat st;
+    return access(path, X_OK) == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* Resolve `name' against PATH the way execvp does, into `out'.
+ * Names containing a slash are used as-is.
+ * Returns: 1 if an executable was found, 0 otherwise.
+ */
+static int resolve_in_path(const char* name, char* out, size_t out_size) {
+    const char* path_env;
+    const char* dir;
+    const char* end;
+    size_t dir_len, name_len;
+
+    if (!name || !name[0]) return 0;
+    name_len = strlen(name);
+
+    if (strchr(name, '/')) {
+        if (name_len + 1 > out_size) return 0;
+        memcpy(out, name, name_len + 1);
+        return is_executable_file(out);
+    }
+
+    path_env = getenv("PATH");
+    if (!path_env) path_env = "/usr/local/bin:/usr/bin:/bin";
+
+    for (dir = path_env; ; dir = end + 1) {
+        end = strchr(dir, ':');
+        if (!end) end = dir + strlen(dir);
+        dir_len = (size_t)(end - dir);
+        if (dir_len == 0) {
+            /* Empty PATH entry means the current directory */
+            dir = ".";
+            dir_len = 1;
+        }
+        if (dir_len + 1 + name_len + 1 <= out_size) {
+            memcpy(out, dir, dir_len);
+            out[dir_len] = '/';
+            memcpy(out + dir_len + 1, name, name_len + 1);
+            if (is_executable_file(out)) return 1;
+        }
+        if (*end == '\0') break;
+    }
+    return 0;
+}
+
+/* Resolve argv[0] for a direct exec into `out'.
+ * Unresolvable names are passed through so exec fails with exit code 127.
+ */
+static const char* argv_program_path(const char* const* argv, char* out, size_t out_size) {
+    if (resolve_in_path(argv[0], out, out_size)) {
+        return out;
+    }
+    return argv[0];
+}
+
+/* ============ POSIX SPAWN SERVER ============ */
+
+/*
+ * In server mode the calling process does not create children itself. A
+ * helper forked early (sp_spawn_server_start, or at load time when
+ * SP_SPAWN_SERVER=1), while the caller is still small and single-threaded,
+ * spawns them on its behalf. A request carries the program, arguments,
+ * environment, working directory and signal state over a Unix socket, and
+ * the child's stdio fds as SCM_RIGHTS. The server answers with the pid and
+ * the read end of a status pipe. When the child exits, the server reaps it
+ * and writes its wait status and rusage to that pipe, so the pipe stands in
+ * for a pidfd. The server is not our child: it exits once the socket is
+ * closed and its last child has been reported.
+ */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  /* SO_NOSIGPIPE is set on the socket instead */
+#endif
+
+#define SERVER_MAX_FDS 3
+#define SERVER_UNAVAILABLE (-2)
+
+/* Header of a spawn request; NUL-terminated strings follow: path, working
+ * directory, `argc' arguments, `envc' environment entries, then the
+ * cgroup.procs path when `controls' has a cgroup */
+typedef struct {
+    int length;             /* Bytes of strings after the header */
+    int argc;
+    int envc;
+    int fd_mask;            /* Bit 0/1/2: stdin/stdout/stderr attached, in order */
+    int new_group;          /* Start a process group led by the child? */
+    unsigned int ignored;   /* Signals 1..31 the caller ignores */
+    sigset_t blocked;       /* Caller's signal mask */
+    int has_controls;       /* Apply `controls'? */
+    sp_child_controls controls;
+} sp_server_request;
+
+typedef struct {
+    pid_t pid;              /* Child pid, or -1 */
+    int error;              /* errno when the spawn failed */
+} sp_server_reply;
+
+/* Written to a child's status pipe once the server has reaped it */
+typedef struct {
+    int wait_status;
+    struct rusage usage;
+} sp_child_status;
+
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+static int server_socket = -1;
+
+/* Send `length' bytes of `data' on `sock', attaching `fds' to the first part.
+ * Returns: 1 on success, 0 on failure
+ */
+static int send_with_fds(int sock, const char* data, size_t length, const int* fds, int nfds) {
+    union {
+        char buffer[CMSG_SPACE(SERVER_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    ssize_t n;
+
+    while (length > 0) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = (void*)data;
+        iov.iov_len = length;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (nfds > 0) {
+            memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+            memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+        }
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        data += n;
+        length -= (size_t)n;
+        nfds = 0;  /* Descriptors travel with the first byte */
+    }
+    return 1;
+}
+
+/* Receive exactly `length' bytes into `data', collecting up to `max_fds'
+ * descriptors (close-on-exec) into `fds'.
+ * Returns: 1 on success, 0 at end of stream or on error
+ */
+static int receive_with_fds(int sock, char* data, size_t length, int* fds, int max_fds, int* nfds) {
+    union {
+        char buffer[CMSG_SPACE(SERVER_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    ssize_t n;
+    int count, i, flags = 0;
+
+#ifdef MSG_CMSG_CLOEXEC
+    flags = MSG_CMSG_CLOEXEC;
+#endif
+    if (nfds) *nfds = 0;
+    fd_creation_begin();
+    while (length > 0) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = data;
+        iov.iov_len = length;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        n = recvmsg(sock, &msg, flags);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (fds && nfds && *nfds < max_fds) {
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    fds[(*nfds)++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+        data += n;
+        length -= (size_t)n;
+    }
+    fd_creation_end();
+    return length == 0;
+}
+
+/* ---- Server side (runs in the helper process) ---- */
+
+static int server_sigchld_pipe[2] = {-1, -1};
+
+static void server_sigchld(int sig) {
+    int saved_errno = errno;
+    ssize_t ignored = write(server_sigchld_pipe[1], "x", 1);
+    (void)ignored;
+    (void)sig;
+    errno = saved_errno;
+}
+
+typedef struct {
+    pid_t* pids;            /* Running children */
+    int* status_fds;        /* Write end of each child's status pipe */
+    int count;
+    int capacity;
+} sp_server_children;
+
+/* Reap every exited child and report it on its status pipe. */
+static void server_reap(sp_server_children* children) {
+    sp_child_status record;
+    pid_t pid;
+    ssize_t ignored;
+    int status, i;
+
+    while ((pid = wait4(-1, &status, WNOHANG, &record.usage)) > 0) {
+        record.wait_status = status;
+        for (i = 0; i < children->count; i++) {
+            if (children->pids[i] != pid) continue;
+            ignored = write(children->status_fds[i], &record, sizeof(record));
+            (void)ignored;  /* The caller may have closed its end */
+            close(children->status_fds[i]);
+            children->count--;
+            children->pids[i] = children->pids[children->count];
+            children->status_fds[i] = children->status_fds[children->count];
+            break;
+        }
+    }
+}
+
+/* Serve one spawn request from `sock'.
+ * Returns: 0 once the caller has closed the socket
+ */
+static int server_handle_request(int sock, sp_server_children* children) {
+    sp_server_request request;
+    sp_server_reply reply;
+    sp_spawn_spec spec;
+    int fds[SERVER_MAX_FDS];
+    int slots[SERVER_MAX_FDS] = {-1, -1, -1};
+    int status_pipe[2] = {-1, -1};
+    char** vectors = NULL;
+    char* strings = NULL;
+    char* p;
+    int nfds, i, next = 0;
+
+    if (!receive_with_fds(sock, (char*)&request, sizeof(request), fds, SERVER_MAX_FDS, &nfds)) return 0;
+    reply.pid = -1;
+    reply.error = ENOMEM;
+    if (request.length > 0 && request.argc > 0 && request.envc >= 0) {
+        strings = (char*)malloc(request.length);
+        vectors = (char**)malloc((request.argc + request.envc + 2) * sizeof(char*));
+    }
+    if (!strings || !vectors || !receive_with_fds(sock, strings, request.length, NULL, 0, NULL)) {
+        /* Cannot stay in step with the caller: hang up, it spawns locally */
+        for (i = 0; i < nfds; i++) close(fds[i]);
+        free(strings);
+        free(vectors);
+        return 0;
+    }
+
+    for (i = 0; i < SERVER_MAX_FDS; i++) {
+        if ((request.fd_mask & (1 << i)) && next < nfds) slots[i] = fds[next++];
+    }
+    /* The peer is our own caller, so the strings are well formed */
+    memset(&spec, 0, sizeof(spec));
+    strings[request.length - 1] = '\0';
+    p = strings;
+    spec.path = p;
+    p += strlen(p) + 1;
+    spec.working_dir = p;
+    p += strlen(p) + 1;
+    for (i = 0; i < request.argc + request.envc; i++) {
+        vectors[i + (i >= request.argc)] = p;  /* Skip the argv terminator */
+        p += strlen(p) + 1;
+    }
+    vectors[request.argc] = NULL;
+    vectors[request.argc + request.envc + 1] = NULL;
+    spec.argv = vectors;
+    spec.envp = vectors + request.argc + 1;
+    spec.stdin_fd = slots[0];
+    spec.stdout_fd = slots[1];
+    spec.stderr_fd = slots[2];
+    spec.new_group = request.new_group;
+    spec.child_mask = &request.blocked;
+    spec.set_ignored = 1;
+    spec.ignored = request.ignored;
+    if (request.has_controls) {
+        spec.controls = &request.controls;
+        spec.cgroup_procs = p;
+        if (request.controls.has_cgroup && p >= strings + request.length) request.controls.has_cgroup = 0;
+    }
+    if (make_pipe(status_pipe) == 0) {
+        reply.pid = spawn_local(&spec);
+    }
+    reply.error = errno;
+    for (i = 0; i < nfds; i++) close(fds[i]);
+    free(strings);
+    free(vectors);
+
+    if (reply.pid > 0 && children->count == children->capacity) {
+        int capacity = children->capacity ? children->capacity * 2 : 16;
+        pid_t* pids = (pid_t*)realloc(children->pids, capacity * sizeof(pid_t));
+        int* status_fds = pids ? (int*)realloc(children->status_fds, capacity * sizeof(int)) : NULL;
+        if (pids) children->pids = pids;
+        if (status_fds) {
+            children->status_fds = status_fds;
+            children->capacity = capacity;
+        }
+    }
+    if (reply.pid > 0 && children->count < children->capacity) {
+        children->pids[children->count] = reply.pid;
+        children->status_fds[children->count++] = status_pipe[1];
+        status_pipe[1] = -1;
+    } else if (reply.pid > 0) {
+        /* No slot to report its exit from: the spawn fails instead */
+        if (request.new_group) kill(-reply.pid, SIGKILL);
+        kill(reply.pid, SIGKILL);
+        while (waitpid(reply.pid, NULL, 0) < 0 && errno == EINTR) {
+            /* Retry */
+        }
+        reply.pid = -1;
+        reply.error = ENOMEM;
+    }
+    if (status_pipe[1] >= 0) close(status_pipe[1]);
+    i = send_with_fds(sock, (const char*)&reply, sizeof(reply), status_pipe, reply.pid > 0 ? 1 : 0);
+    if (status_pipe[0] >= 0) close(status_pipe[0]);
+    return i;
+}
+
+/* Main loop of the helper process; never returns. */
+static void server_main(int sock) {
+    sp_server_children children;
+    struct sigaction sa;
+    struct pollfd fds[2];
+    sigset_t none;
+    char drain[64];
+    long max_fd, fd;
+    int sig, nfds;
+
+    /* Keep only stdio and the socket: children must not inherit the
+     * caller's other descriptors through us */
+    max_fd = sysconf(_SC_OPEN_MAX);
+    if (max_fd < 0 || max_fd > 65536) max_fd = 65536;
+    for (fd = 3; fd < max_fd; fd++) {
+        if (fd != sock) close((int)fd);
+    }
+#ifndef SP_ATOMIC_CLOEXEC
+    /* Another thread of the caller may have held it across our fork */
+    pthread_rwlock_init(&fd_lock, NULL);
+#endif
+    tracing = 0;  /* The caller traces the children we start for it */
+    if (make_pipe(server_sigchld_pipe) < 0) _exit(1);
+    fcntl(server_sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(server_sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+
+    for (sig = 1; sig < NSIG; sig++) {
+        if (sig == SIGKILL || sig == SIGSTOP) continue;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = SIG_DFL;
+        sigaction(sig, &sa, NULL);
+    }
+    /* Terminal signals are for the caller; its exit closes the socket */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGQUIT, &sa, NULL);
+    sigaction(SIGTSTP, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGPIPE, &sa, NULL);
+    sa.sa_handler = server_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    memset(&children, 0, sizeof(children));
+    while (sock >= 0 || children.count > 0) {
+        nfds = 0;
+        fds[nfds].fd = server_sigchld_pipe[0];
+        fds[nfds++].events = POLLIN;
+        if (sock >= 0) {
+            fds[nfds].fd = sock;
+            fds[nfds++].events = POLLIN;
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[0].revents) {
+            while (read(server_sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+                /* Drain wakeups */
+            }
+            server_reap(&children);
+        }
+        if (nfds > 1 && fds[1].revents && !server_handle_request(sock, &children)) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    _exit(0);
+}
+
+/* ---- Client side ---- */
+
+/* Ask the spawn server to start the child described by `spec'.
+ * Returns: child pid with spec->status_fd set, -1 with errno if the spawn
+ *          failed, SERVER_UNAVAILABLE if there is no working server
+ */
+static pid_t server_spawn(sp_spawn_spec* spec) {
+    sp_server_request* request;
+    sp_server_reply reply;
+    struct sigaction sa;
+    char cwd[PATH_MAX];
+    const char* working_dir = spec->working_dir;
+    char* const* envp;
+    char* message;
+    char* p;
+    size_t length, size;
+    int fds[SERVER_MAX_FDS];
+    int status_fd = -1;
+    int nfds = 0, received = 0, argc, envc, sig, ok;
+
+    if (!working_dir || !working_dir[0]) {
+        working_dir = getcwd(cwd, sizeof(cwd)) ? cwd : "";
+    }
+    length = strlen(spec->path) + 1 + strlen(working_dir) + 1;
+    for (argc = 0; spec->argv[argc]; argc++) length += strlen(spec->argv[argc]) + 1;
+    envp = spec->envp ? spec->envp : environ;
+    for (envc = 0; envp && envp[envc]; envc++) length += strlen(envp[envc]) + 1;
+    if (spec->controls && spec->controls->has_cgroup) length += strlen(spec->cgroup_procs) + 1;
+
+    message = (char*)malloc(sizeof(sp_server_request) + length);
+    if (!message) return SERVER_UNAVAILABLE;
+    request = (sp_server_request*)message;
+    memset(request, 0, sizeof(sp_server_request));
+    request->length = (int)length;
+    request->argc = argc;
+    request->envc = envc;
+    request->new_group = spec->new_group;
+    if (spec->controls) {
+        request->has_controls = 1;
+        request->controls = *spec->controls;
+    }
+    for (sig = 1; sig < 32; sig++) {
+        if (sigaction(sig, NULL, &sa) == 0 && sa.sa_handler == SIG_IGN) request->ignored |= 1u << sig;
+    }
+    pthread_sigmask(SIG_BLOCK, NULL, &request->blocked);
+
+    p = message + sizeof(sp_server_request);
+    size = strlen(spec->path) + 1;
+    memcpy(p, spec->path, size);
+    p += size;
+    size = strlen(working_dir) + 1;
+    memcpy(p, working_dir, size);
+    p += size;
+    for (sig = 0; sig < argc; sig++) {
+        size = strlen(spec->argv[sig]) + 1;
+        memcpy(p, spec->argv[sig], size);
+        p += size;
+    }
+    for (sig = 0; sig < envc; sig++) {
+        size = strlen(envp[sig]) + 1;
+        memcpy(p, envp[sig], size);
+        p += size;
+    }
+    if (spec->controls && spec->controls->has_cgroup) {
+        memcpy(p, spec->cgroup_procs, strlen(spec->cgroup_procs) + 1);
+    }
+    if (spec->stdin_fd >= 0) { fds[nfds++] = spec->stdin_fd; request->fd_mask |= 1; }
+    if (spec->stdout_fd >= 0) { fds[nfds++] = spec->stdout_fd; request->fd_mask |= 2; }
+    if (spec->stderr_fd >= 0) { fds[nfds++] = spec->stderr_fd; request->fd_mask |= 4; }
+
+    pthread_mutex_lock(&server_lock);
+    ok = server_socket >= 0 &&
+         send_with_fds(server_socket, message, sizeof(sp_server_request) + length, fds, nfds) &&
+         receive_with_fds(server_socket, (char*)&reply, sizeof(reply), &status_fd, 1, &received);
+    if (!ok && server_socket >= 0) {
+        /* The server is gone: spawn locally from now on */
+        close(server_socket);
+        server_socket = -1;
+    }
+    pthread_mutex_unlock(&server_lock);
+    free(message);
+
+    if (!ok) {
+        if (received) close(status_fd);
+        return SERVER_UNAVAILABLE;
+    }
+    if (reply.pid < 0) {
+        if (received) close(status_fd);
+        errno = reply.error;
+        return -1;
+    }
+    if (!received) {
+        errno = EIO;
+        return -1;
+    }
+    fcntl(status_fd, F_SETFL, fcntl(status_fd, F_GETFL) | O_NONBLOCK);
+    spec->status_fd = status_fd;
+    return reply.pid;
+}
+
+/* Spawn the child described by `spec', through the spawn server if one runs.
+ * Returns: child pid, or -1 with errno set if no child could be created.
+ */
+static pid_t spawn_process(sp_spawn_spec* spec) {
+    long long start_ns = monotonic_ns();
+    pid_t pid = SERVER_UNAVAILABLE;
+    int saved_errno;
+
+    spec->status_fd = -1;
+    spec->child_errno = 0;
+    spec->exec_fd = -1;
+    spec->fork_ns = 0;
+    spec->exec_ns = 0;
+    if (server_socket >= 0) pid = server_spawn(spec);
+    if (pid == SERVER_UNAVAILABLE) pid = spawn_local(spec);
+    saved_errno = errno;
+    if (pid > 0) {
+        metrics_spawned(monotonic_ns() - start_ns);
+        /* Visible here only when the child shared our memory (clone) or
+         * wrote it to the exec pipe (tracing) */
+        if (spec->child_errno) metrics_spawn_failed(spec->child_errno);
+        if (tracing) {
+            trace_spawned(pid, spec->argv, NULL, start_ns, spec->fork_ns, spec->exec_ns,
+                          spec->child_errno, spec->status_fd >= 0 ? monotonic_ns() : 0);
+        }
+    } else {
+        metrics_spawn_failed(saved_errno);
+        if (tracing) trace_spawn_failed(start_ns, saved_errno);
+    }
+    errno = saved_errno;
+    return pid;
+}
+
+/* Account for child `pid' reaped with wait status `status'. */
+static void child_reaped(pid_t pid, int status) {
+    metrics_ended();
+    if (tracing) {
+        trace_reaped(pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+                     WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    }
+}
+
+/* Wait for child `pid' (`flags': 0 or WNOHANG). A served child (status_fd
+ * >= 0) was reaped by the spawn server, which reports it on `status_fd';
+ * if the server died first the status is lost and reads as SIGKILL.
+ * Returns: `pid' once reaped, 0 if still running, -1 on error
+ */
+static pid_t reap_child(pid_t pid, int status_fd, int flags, int* status, struct rusage* usage) {
+    sp_child_status record;
+    struct pollfd pfd;
+    pid_t result;
+    ssize_t n;
+    int rc;
+
+    if (status_fd < 0) {
+        do {
+            result = wait4(pid, status, flags, usage);
+        } while (result < 0 && errno == EINTR);
+        if (result == pid) child_reaped(pid, *status);
+        return result;
+    }
+    pfd.fd = status_fd;
+    pfd.events = POLLIN;
+    do {
+        rc = poll(&pfd, 1, (flags & WNOHANG) ? 0 : -1);
+    } while (rc < 0 && errno == EINTR);
+    if (rc <= 0) return rc;
+    do {
+        n = read(status_fd, &record, sizeof(record));
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno == EAGAIN) return 0;
+    if (n == (ssize_t)sizeof(record)) {
+        *status = record.wait_status;
+        *usage = record.usage;
+    } else {
+        *status = SIGKILL;
+        memset(usage, 0, sizeof(*usage));
+    }
+    child_reaped(pid, *status);
+    return pid;
+}
+
+/* Has served child reported its exit on `status_fd'? */
+static int served_child_exited(int status_fd) {
+    struct pollfd pfd;
+    pfd.fd = status_fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* Send `sig' to child `pid' and, when it leads its own group, to every
+ * process in that group. A served child (status_fd >= 0) is reaped by the
+ * server as soon as it exits, so once it has, its pid may already belong
+ * to another process and only the group is signalled.
+ * Returns: 1 if a signal was sent, 0 otherwise
+ */
+static int signal_child(pid_t pid, int own_group, int status_fd, int sig) {
+    if (own_group && kill(-pid, sig) == 0) return 1;
+    if (status_fd >= 0 && served_child_exited(status_fd)) return 0;
+    return kill(pid, sig) == 0;
+}
+
+int sp_spawn_server_start(void) {
+    int fds[2];
+    pid_t pid;
+    int status;
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+#endif
+
+    pthread_mutex_lock(&server_lock);
+    if (server_socket >= 0) {
+        pthread_mutex_unlock(&server_lock);
+        return 1;
+    }
+#ifdef SOCK_CLOEXEC
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        store_last_error();
+        pthread_mutex_unlock(&server_lock);
+        return 0;
+    }
+#else
+    fd_creation_begin();
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        store_last_error();
+        fd_creation_end();
+        pthread_mutex_unlock(&server_lock);
+        return 0;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fd_creation_end();
+#endif
+#ifdef SO_NOSIGPIPE
+    setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+    setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    /* Fork twice so the server is not our child and never needs reaping */
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        if (fork() == 0) server_main(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        store_last_error();
+        close(fds[0]);
+        pthread_mutex_unlock(&server_lock);
+        return 0;
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        /* Retry */
+    }
+    server_socket = fds[0];
+    pthread_mutex_unlock(&server_lock);
+    return 1;
+}
+
+int sp_spawn_server_is_running(void) {
+    return server_socket >= 0;
+}
+
+void sp_spawn_server_stop(void) {
+    pthread_mutex_lock(&server_lock);
+    if (server_socket >= 0) {
+        close(server_socket);
+        server_socket = -1;
+    }
+    pthread_mutex_unlock(&server_lock);
+}
+
+#if defined(__GNUC__)
+/* SP_SPAWN_SERVER=1 starts the server when the library is loaded, before
+ * the program has grown or started threads */
+__attribute__((constructor)) static void spawn_server_autostart(void) {
+    const char* value = getenv("SP_SPAWN_SERVER");
+    if (value && strcmp(value, "1") == 0) sp_spawn_server_start();
+}
+#endif
+
+#endif
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+/* CreateProcess does not copy the parent, so there is no spawn server */
+int sp_spawn_server_start(void) {
+    snprintf(last_error_msg, sizeof(last_error_msg), "No spawn server on Windows");
+    return 0;
+}
+
+int sp_spawn_server_is_running(void) {
+    return 0;
+}
+
+void sp_spawn_server_stop(void) {
+}
+#endif
+
+const char* sp_get_last_error(void) {
+    return last_error_msg;
+}
+
+/* Allocate a failed result carrying `message'. */
+static sp_result* error_result(const char* message) {
+    sp_result* result = (sp_result*)malloc(sizeof(sp_result));
+    if (result) {
+        memset(result, 0, sizeof(sp_result));
+        result->error_message = sp_strdup(message);
+    }
+    return result;
+}
+
+void sp_options_init(sp_options* options) {
+    if (options) {
+        memset(options, 0, sizeof(sp_options));
+        options->max_output = MAX_OUTPUT_SIZE;
+        options->input_fd = -1;
+        options->kill_grace_ms = SP_DEFAULT_KILL_GRACE_MS;
+    }
+}
+
+/* `options', or defaults stored in `fallback' when NULL. */
+static const sp_options* options_or_default(const sp_options* options, sp_options* fallback) {
+    if (options) return options;
+    sp_options_init(fallback);
+    return fallback;
+}
+
+/* Does `options' name an output file when output goes to one? */
+static int valid_output(const sp_options* options) {
+    return options->output_mode != SP_OUTPUT_FILE || (options->output_path && options->output_path[0]);
+}
+
+/* Is `argv' a usable argument vector? */
+static int valid_argv(const char* const* argv) {
+    return argv && argv[0] && argv[0][0];
+}
+
+/* Are `stages' `count' usable argument vectors? */
+static int valid_stages(const char* const* const* stages, int count) {
+    int i;
+
+    if (!stages || count <= 0) return 0;
+    for (i = 0; i < count; i++) {
+        if (!valid_argv(stages[i])) return 0;
+    }
+    return 1;
+}
+
+/* ============ CHILD ENVIRONMENT ============ */
+
+/*
+ * An environment keeps its changes as "NAME=VALUE" (set) and "NAME"
+ * (removed) entries, and after every change lays out the whole result in
+ * one arena: the NULL-terminated envp array, then its strings back to back
+ * with a final extra NUL, which is also the environment block CreateProcess
+ * takes. Spawns read the arena and never parse or copy anything.
+ */
+struct sp_environment {
+    int inherit;            /* Start from the caller's environment? */
+    char** changes;         /* "NAME=VALUE" or "NAME" (removed), one per name */
+    int change_count;
+    int change_capacity;
+    char* arena;            /* envp pointers followed by their strings */
+    char** envp;            /* Start of `arena' */
+    char* block;            /* First string in `arena' (Windows environment block) */
+    int count;              /* Variables in `envp' */
+};
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+#define env_names_match(a, b, n) (_strnicmp((a), (b), (n)) == 0)
+#else
+#define env_names_match(a, b, n) (strncmp((a), (b), (n)) == 0)
+#endif
+
+/* Length of the name of "NAME=VALUE" `entry' (Windows "=C:=..." included). */
+static size_t env_name_length(const char* entry) {
+    const char* equals = strchr(entry + (entry[0] == '='), '=');
+    return equals ? (size_t)(equals - entry) : strlen(entry);
+}
+
+/* Index in env->changes of the change to `name' (`length' bytes), or -1. */
+static int env_find_change(const sp_environment* env, const char* name, size_t length) {
+    int i;
+
+    for (i = 0; i < env->change_count; i++) {
+        if (env_name_length(env->changes[i]) == length && env_names_match(env->changes[i], name, length)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* The caller's environment as a NULL-terminated array (free with
+ * env_release_inherited), or NULL. */
+static char** env_inherited(void** handle) {
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+    char* block = GetEnvironmentStringsA();
+    char** vector;
+    char* p;
+    int n = 0;
+
+    *handle = block;
+    if (!block) return NULL;
+    for (p = block; *p; p += strlen(p) + 1) n++;
+    vector = (char**)malloc((n + 1) * sizeof(char*));
+    if (!vector) return NULL;
+    n = 0;
+    for (p = block; *p; p += strlen(p) + 1) vector[n++] = p;
+    vector[n] = NULL;
+    return vector;
+#else
+    *handle = NULL;
+    return environ;
+#endif
+}
+
+static void env_release_inherited(char** vector, void* handle) {
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+    free(vector);
+    if (handle) FreeEnvironmentStringsA((char*)handle);
+#else
+    (void)vector;
+    (void)handle;
+#endif
+}
+
+/* Lay out the inherited variables not changed, then the ones set, in a
+ * new arena for `env'.
+ * Returns: 1 on success, 0 on allocation failure (`env' unchanged)
+ */
+static int env_build(sp_environment* env) {
+    char** base = NULL;
+    void* handle = NULL;
+    char** envp = NULL;
+    char* arena = NULL;
+    char* p = NULL;
+    size_t size = 0, length;
+    int count = 0, pass, i, n;
+
+    if (env->inherit) base = env_inherited(&handle);
+    /* Pass 0 measures, pass 1 copies */
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            arena = (char*)malloc((count + 1) * sizeof(char*) + size + 2);
+            if (!arena) {
+                env_release_inherited(base, handle);
+                return 0;
+            }
+            envp = (char**)arena;
+            p = arena + (count + 1) * sizeof(char*);
+            env->block = p;
+        }
+        n = 0;
+        for (i = 0; base && base[i]; i++) {
+            if (env_find_change(env, base[i], env_name_length(base[i])) >= 0) continue;
+            length = strlen(base[i]) + 1;
+            if (pass == 0) {
+                size += length;
+                count++;
+            } else {
+                memcpy(p, base[i], length);
+                envp[n++] = p;
+                p += length;
+            }
+        }
+        for (i = 0; i < env->change_count; i++) {
+            if (!strchr(env->changes[i], '=')) continue;  /* Removed */
+            length = strlen(env->changes[i]) + 1;
+            if (pass == 0) {
+                size += length;
+                count++;
+            } else {
+                memcpy(p, env->changes[i], length);
+                envp[n++] = p;
+                p += length;
+            }
+        }
+    }
+    envp[count] = NULL;
+    p[0] = '\0';  /* Ends the block (an empty block is two NULs) */
+    p[1] = '\0';
+    env_release_inherited(base, handle);
+
+    free(env->arena);
+    env->arena = arena;
+    env->envp = envp;
+    env->count = count;
+    return 1;
+}
+
+/* Record `change' ("NAME=VALUE" or "NAME") for `name', replacing an earlier
+ * one, and rebuild.
+ * Returns: 1 on success, 0 on invalid name or allocation failure
+ */
+static int env_change(sp_environment* env, const char* name, const char* value) {
+    size_t length;
+    char** grown;
+    char* change;
+    char* previous = NULL;
+    int i;
+
+    if (!env || !name || !name[0] || strchr(name, '=')) {
+        snprintf(last_error_msg, sizeof(last_error_msg), "Invalid environment variable name");
+        return 0;
+    }
+    length = strlen(name);
+    change = (char*)malloc(length + (value ? strlen(value) + 2 : 1));
+    if (!change) return 0;
+    memcpy(change, name, length);
+    if (value) {
+        change[length] = '=';
+        strcpy(change + length + 1, value);
+    } else {
+        change[length] = '\0';
+    }
+
+    i = env_find_change(env, name, length);
+    if (i < 0) {
+        if (env->change_count == env->change_capacity) {
+            grown = (char**)realloc(env->changes, (env->change_capacity * 2 + 8) * sizeof(char*));
+            if (!grown) {
+                free(change);
+                return 0;
+            }
+            env->changes = grown;
+            env->change_capacity = env->change_capacity * 2 + 8;
+        }
+        i = env->change_count++;
+    } else {
+        previous = env->changes[i];
+    }
+    env->changes[i] = change;
+    if (!env_build(env)) {
+        /* Keep the arena and the changes consistent */
+        if (previous) {
+            env->changes[i] = previous;
+        } else {
+            env->change_count--;
+        }
+        free(change);
+        return 0;
+    }
+    free(previous);
+    return 1;
+}
+
+sp_environment* sp_env_create(int inherit) {
+    sp_environment* env = (sp_environment*)calloc(1, sizeof(sp_environment));
+
+    if (!env) return NULL;
+    env->inherit = inherit;
+    if (!env_build(env)) {
+        free(env);
+        return NULL;
+    }
+    return env;
+}
+
+int sp_env_set(sp_environment* env, const char* name, const char* value) {
+    return env_change(env, name, value ? value : "");
+}
+
+int sp_env_unset(sp_environment* env, const char* name) {
+    return env_change(env, name, NULL);
+}
+
+const char* sp_env_get(const sp_environment* env, const char* name) {
+    size_t length;
+    int i;
+
+    if (!env || !name) return NULL;
+    length = strlen(name);
+    for (i = 0; i < env->count; i++) {
+        if (env_name_length(env->envp[i]) == length && env_names_match(env->envp[i], name, length)) {
+            return env->envp[i] + length + 1;
+        }
+    }
+    return NULL;
+}
+
+int sp_env_count(const sp_environment* env) {
+    return env ? env->count : 0;
+}
+
+char* const* sp_env_vector(const sp_environment* env) {
+    return env ? env->envp : NULL;
+}
+
+void sp_env_free(sp_environment* env) {
+    int i;
+
+    if (!env) return;
+    for (i = 0; i < env->change_count; i++) free(env->changes[i]);
+    free(env->changes);
+    free(env->arena);
+    free(env);
+}
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+/* Environment block for CreateProcess, or NULL for the caller's. */
+static void* options_environment_block(const sp_options* options) {
+    return options->environment ? options->environment->block : NULL;
+}
+#else
+/* Environment for execve, or NULL for `environ'. */
+static char* const* options_environment(const sp_options* options) {
+    return options->environment ? options->environment->envp : NULL;
+}
+#endif
+
+/* ============ RESOURCE USAGE ============ */
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+
+/* Nanoseconds from the performance counter. */
+static long long monotonic_ns(void) {
+    LARGE_INTEGER now, frequency;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return (now.QuadPart / frequency.QuadPart) * 1000000000LL +
+           (now.QuadPart % frequency.QuadPart) * 1000000000LL / frequency.QuadPart;
+}
+
+/* FILETIME as a count of 100ns ticks. */
+static long long filetime_ticks(const FILETIME* time) {
+    return ((long long)time->dwHighDateTime << 32) | time->dwLowDateTime;
+}
+
+/* Add the CPU times, peak working set and faults of exited `process' to `usage'.
+ * Returns: 1 on success, 0 on failure
+ */
+static int add_process_usage(HANDLE process, sp_usage* usage) {
+    FILETIME created, exited, kernel, user;
+    PROCESS_MEMORY_COUNTERS memory;
+
+    if (!GetProcessTimes(process, &created, &exited, &kernel, &user)) return 0;
+    usage->user_time_us += filetime_ticks(&user) / 10;
+    usage->system_time_us += filetime_ticks(&kernel) / 10;
+    memset(&memory, 0, sizeof(memory));
+    memory.cb = sizeof(memory);
+    if (GetProcessMemoryInfo(process, &memory, sizeof(memory))) {
+        if ((long long)(memory.PeakWorkingSetSize / 1024) > usage->max_rss_kb) {
+            usage->max_rss_kb = (long long)(memory.PeakWorkingSetSize / 1024);
+        }
+        usage->minor_faults += memory.PageFaultCount;
+    }
+    return 1;
+}
+
+#else
+
+/* Nanoseconds from the monotonic clock. */
+static long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Add the rusage `ru' of one reaped child to `usage'. */
+static void add_rusage(sp_usage* usage, const struct rusage* ru) {
+    long long rss = ru->ru_maxrss;
+
+#ifdef __APPLE__
+    rss /= 1024;  /* Bytes on macOS, KB elsewhere */
+#endif
+    usage->user_time_us += (long long)ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec;
+    usage->system_time_us += (long long)ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec;
+    if (rss > usage->max_rss_kb) usage->max_rss_kb = rss;
+    usage->minor_faults += ru->ru_minflt;
+    usage->major_faults += ru->ru_majflt;
+}
+
+#endif
+
+long long sp_monotonic_ns(void) {
+    return monotonic_ns();
+}
+
+/* ============ CAPTURE BUFFERS ============ */
+
+/* Growable buffer for captured output of one stream. Data past `limit'
+ * is not kept but still read (and streamed), so the child never sees a
+ * closed pipe.
+ */
+typedef struct {
+    char* data;
+    int length;
+    int capacity;
+    int limit;          /* Bytes to keep */
+    int truncated;      /* Was data dropped past `limit'? */
+    long long first_output_ns;  /* Monotonic time of the first data, or 0 */
+    int stream;         /* SP_STREAM_* passed to the callback */
+    const sp_options* options;
+} sp_buffer;
+
+static int buffer_init(sp_buffer* buffer, int stream, const sp_options* options) {
+    buffer->length = 0;
+    buffer->truncated = 0;
+    buffer->first_output_ns = 0;
+    buffer->stream = stream;
+    buffer->options = options;
+    buffer->limit = (options->max_output < 0) ? INT_MAX - 1 : options->max_output;
+    buffer->capacity = (buffer->limit < BUFFER_SIZE) ? buffer->limit + 1 : BUFFER_SIZE;
+    buffer->data = (char*)malloc(buffer->capacity);
+    return buffer->data != NULL;
+}
+
+/* Make room for more data, keeping one byte for the terminator.
+ * Returns: writable bytes at data + length (0 when the limit is reached)
+ */
+static int buffer_space(sp_buffer* buffer) {
+    if (buffer->length + 1 >= buffer->capacity) {
+        int new_capacity;
+        char* new_data;
+        if (buffer->capacity > buffer->limit / 2) {
+            new_capacity = buffer->limit + 1;
+        } else {
+            new_capacity = buffer->capacity * 2;
+        }
+        if (new_capacity <= buffer->capacity) {
+            return 0;  /* Limit reached */
+        }
+        new_data = (char*)realloc(buffer->data, new_capacity);
+        if (!new_data) return 0;
+        buffer->data = new_data;
+        buffer->capacity = new_capacity;
+    }
+    return buffer->capacity - 1 - buffer->length;
+}
+
+/* Where the next read goes: the buffer tail, or `scratch' (BUFFER_SIZE bytes)
+ * once the limit is reached. Sets `*size' to the room available.
+ */
+static char* buffer_target(sp_buffer* buffer, char* scratch, int* size) {
+    int space = buffer_space(buffer);
+    if (space > 0) {
+        *size = space;
+        return buffer->data + buffer->length;
+    }
+    *size = BUFFER_SIZE;
+    return scratch;
+}
+
+/* Account for `count' bytes just read into `target' and stream them. */
+static void buffer_commit(sp_buffer* buffer, char* target, int count) {
+    if (buffer->first_output_ns == 0 && count > 0) buffer->first_output_ns = monotonic_ns();
+    if (target == buffer->data + buffer->length) {
+        buffer->length += count;
+    } else {
+        buffer->truncated = 1;
+    }
+    if (buffer->options->on_output) {
+        buffer->options->on_output(buffer->options->callback_context, buffer->stream, target, count);
+    }
+}
+
+/* Copy `count' bytes at `data' into the buffer, dropping what passes the limit. */
+static void buffer_append(sp_buffer* buffer, const char* data, int count) {
+    int space, chunk;
+
+    while (count > 0) {
+        space = buffer_space(buffer);
+        if (space <= 0) {
+            buffer_commit(buffer, (char*)data, count);  /* Dropped, still streamed */
+            return;
+        }
+        chunk = (count < space) ? count : space;
+        memcpy(buffer->data + buffer->length, data, chunk);
+        buffer_commit(buffer, buffer->data + buffer->length, chunk);
+        data += chunk;
+        count -= chunk;
+    }
+}
+
+/* Trace the first bytes of `output' and `error_output' of a synchronous run
+ * as output of child `pid', and the end of its output at `eof_ns' (0: none). */
+static void trace_run_output(long long pid, const sp_buffer* output, const sp_buffer* error_output,
+                             long long eof_ns) {
+    if (output->first_output_ns) trace_output(pid, "first output", SP_STREAM_OUTPUT, output->first_output_ns);
+    if (error_output->first_output_ns) {
+        trace_output(pid, "first output", SP_STREAM_ERROR, error_output->first_output_ns);
+    }
+    if (eof_ns) trace_output(pid, "eof", SP_STREAM_OUTPUT, eof_ns);
+}
+
+/* Null-terminate and hand over the data. */
+static char* buffer_finish(sp_buffer* buffer, int* out_length) {
+    buffer->data[buffer->length] = '\0';
+    *out_length = buffer->length;
+    return buffer->data;
+}
+
+/* ============ INPUT FEED ============ */
+
+/* Input on its way to a child's stdin: in-memory data first, then the
+ * contents of `source'. It is written without blocking whenever the pipe
+ * has room, in between reads of the child's output, so a child that only
+ * reads more input after writing output cannot deadlock against us.
+ */
+struct sp_input_feed {
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+    HANDLE pipe;            /* Write end of the child's stdin (non-blocking), NULL once closed */
+    HANDLE source;          /* File copied after `data', or NULL */
+#else
+    int pipe;               /* Write end of the child's stdin (non-blocking), -1 once closed */
+    int source;             /* Fd copied after `data', or -1 */
+    int use_splice;         /* Move `source' into the pipe with splice()? */
+#endif
+    const char* data;       /* In-memory input not yet written */
+    int remaining;          /* Bytes left at `data' */
+    char* queue;            /* Storage owning `data' (async), or NULL */
+    int queue_capacity;
+    int close_when_done;    /* Close the pipe once all input is written? */
+    int stage_length;       /* Bytes read from `source' into `stage' */
+    int stage_offset;       /* Bytes of `stage' already written */
+    char stage[BUFFER_SIZE];
+};
+
+typedef struct sp_input_feed sp_input_feed;
+
+/* Bytes waiting to be written (not counting unread `source' contents). */
+static int feed_pending(sp_input_feed* feed) {
+    return feed->remaining + (feed->stage_length - feed->stage_offset);
+}
+
+/* Append a copy of `data' to the owned queue.
+ * Returns: 1 on success, 0 if out of memory
+ */
+static int feed_queue(sp_input_feed* feed, const char* data, int length) {
+    char* queue;
+    int capacity;
+
+    if (length > INT_MAX - feed->remaining) return 0;
+    if (feed->remaining > 0 && feed->data != feed->queue) {
+        memmove(feed->queue, feed->data, feed->remaining);
+    }
+    feed->data = feed->queue;
+    if (feed->remaining + length > feed->queue_capacity) {
+        capacity = feed->queue_capacity > INT_MAX / 2 ? INT_MAX : feed->queue_capacity * 2;
+        if (capacity < feed->remaining + length) capacity = feed->remaining + length;
+        queue = (char*)realloc(feed->queue, capacity);
+        if (!queue) return 0;
+        feed->queue = queue;
+        feed->queue_capacity = capacity;
+        feed->data = queue;
+    }
+    memcpy(feed->queue + feed->remaining, data, length);
+    feed->remaining += length;
+    return 1;
+}
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+/* ============ WINDOWS sp_execute_command ============ */
+
+/* Read what `pipe' holds into `buffer' without blocking.
+ * Returns: 1 if data was read, 0 if none was available, -1 at end of stream.
+ */
+static int read_pipe_available(HANDLE pipe, sp_buffer* buffer) {
+    char scratch[BUFFER_SIZE];
+    DWORD available, bytes_read;
+    char* target;
+    int size;
+
+    if (!PeekNamedPipe(pipe, NULL, 0, NULL, &available, NULL)) return -1;
+    if (available == 0) return 0;
+    target = buffer_target(buffer, scratch, &size);
+    if ((DWORD)size > available) size = (int)available;
+    if (!ReadFile(pipe, target, (DWORD)size, &bytes_read, NULL) || bytes_read == 0) {
+        return -1;
+    }
+    buffer_commit(buffer, target, (int)bytes_read);
+    return 1;
+}
+
+/* Read `*pipe' into `buffer' with blocking reads to end of stream, then close it. */
+static void read_pipe_to_end(HANDLE* pipe, sp_buffer* buffer) {
+    char scratch[BUFFER_SIZE];
+    DWORD bytes_read;
+    char* target;
+    int size;
+
+    while (1) {
+        target = buffer_target(buffer, scratch, &size);
+        if (!ReadFile(*pipe, target, (DWORD)size, &bytes_read, NULL) || bytes_read == 0) {
+            break;
+        }
+        buffer_commit(buffer, target, (int)bytes_read);
+    }
+    CloseHandle(*pipe);
+    *pipe = NULL;
+}
+
+/* Create a stdin pipe: inheritable `*read_end' for the child and a
+ * non-blocking `*write_end' kept by us.
+ */
+static BOOL create_input_pipe(SECURITY_ATTRIBUTES* sa, HANDLE* read_end, HANDLE* write_end) {
+    DWORD mode = PIPE_READMODE_BYTE | PIPE_NOWAIT;
+
+    if (!CreatePipe(read_end, write_end, sa, 0)) return FALSE;
+    SetHandleInformation(*write_end, HANDLE_FLAG_INHERIT, 0);
+    SetNamedPipeHandleState(*write_end, &mode, NULL, NULL);
+    return TRUE;
+}
+
+/* CreateProcess for `command_line' inheriting only the standard handles
+ * in `si'. Plain bInheritHandles hands the child every inheritable handle
+ * in the process, including pipe ends another thread is still setting up,
+ * and a child holding those would keep that thread from ever seeing EOF.
+ */
+static BOOL create_inheriting_std_handles(char* command_line, const char* working_dir, DWORD flags,
+                                          void* environment, STARTUPINFOA* si, PROCESS_INFORMATION* pi) {
+    STARTUPINFOEXA six;
+    HANDLE candidates[3];
+    HANDLE handles[3];
+    SIZE_T size = 0;
+    DWORD handle_flags, count = 0, i, j;
+    BOOL success = FALSE;
+
+    candidates[0] = si->hStdInput;
+    candidates[1] = si->hStdOutput;
+    candidates[2] = si->hStdError;
+    for (i = 0; i < 3; i++) {
+        if (!candidates[i] || candidates[i] == INVALID_HANDLE_VALUE) continue;
+        if (!GetHandleInformation(candidates[i], &handle_flags) ||
+            !(handle_flags & HANDLE_FLAG_INHERIT)) continue;
+        for (j = 0; j < count && handles[j] != candidates[i]; j++) { }
+        if (j == count) handles[count++] = candidates[i];
+    }
+    if (count == 0) {
+        return CreateProcessA(NULL, command_line, NULL, NULL, FALSE, flags,
+                              environment, working_dir, si, pi);
+    }
+
+    memset(&six, 0, sizeof(six));
+    six.StartupInfo = *si;
+    six.StartupInfo.cb = sizeof(six);
+    InitializeProcThreadAttributeList(NULL, 1, 0, &size);
+    six.lpAttributeList = (LPPROC_THREAD_ATTRIBUTE_LIST)malloc(size);
+    if (!six.lpAttributeList) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    if (InitializeProcThreadAttributeList(six.lpAttributeList, 1, 0, &size)) {
+        if (UpdateProcThreadAttribute(six.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+                                      handles, count * sizeof(HANDLE), NULL, NULL)) {
+            success = CreateProcessA(NULL, command_line, NULL, NULL, TRUE,
+                                     flags | EXTENDED_STARTUPINFO_PRESENT,
+                                     environment, working_dir, &six.StartupInfo, pi);
+        }
+        DeleteProcThreadAttributeList(six.lpAttributeList);
+    }
+    free(six.lpAttributeList);
+    return success;
+}
+
+/* Priority class standing for a nice increment of `increment'. */
+static DWORD priority_class(int increment) {
+    if (increment >= 10) return IDLE_PRIORITY_CLASS;
+    if (increment > 0) return BELOW_NORMAL_PRIORITY_CLASS;
+    if (increment <= -10) return HIGH_PRIORITY_CLASS;
+    if (increment < 0) return ABOVE_NORMAL_PRIORITY_CLASS;
+    return 0;
+}
+
+/* Limit every process of `job' as `options' asks: CPUs, address space and
+ * CPU time. I/O priority, open files and cgroups have no job equivalent.
+ * Returns: nonzero on success, 0 with GetLastError set
+ */
+static BOOL apply_job_limits(HANDLE job, const sp_options* options) {
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION info;
+    int i;
+
+    memset(&info, 0, sizeof(info));
+    for (i = 0; options->cpus && i < options->cpu_count; i++) {
+        if (options->cpus[i] < 0 || options->cpus[i] >= (int)(sizeof(ULONG_PTR) * 8)) {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        info.BasicLimitInformation.Affinity |= (ULONG_PTR)1 << options->cpus[i];
+    }
+    if (info.BasicLimitInformation.Affinity) {
+        info.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_AFFINITY;
+    }
+    if (options->max_address_space > 0) {
+        info.ProcessMemoryLimit = (SIZE_T)options->max_address_space;
+        info.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_PROCESS_MEMORY;
+    }
+    if (options->max_cpu_seconds > 0) {
+        info.BasicLimitInformation.PerProcessUserTimeLimit.QuadPart = options->max_cpu_seconds * 10000000LL;
+        info.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_PROCESS_TIME;
+    }
+    if (!info.BasicLimitInformation.LimitFlags) return TRUE;
+    return SetInformationJobObject(job, JobObjectExtendedLimitInformation, &info, sizeof(info));
+}
+
+/* Start `command_line' as create_inheriting_std_handles does, in the
+ * environment, priority and limits of `options'. With `job', the child is
+ * put in the job before it runs, so every process it starts belongs to the
+ * job too and terminating the job stops them all.
+ */
+static BOOL create_process(char* command_line, const char* working_dir, DWORD flags, HANDLE job,
+                           const sp_options* options, STARTUPINFOA* si, PROCESS_INFORMATION* pi) {
+    long long start_ns = monotonic_ns();
+    BOOL success;
+
+    if (job && !apply_job_limits(job, options)) return FALSE;
+    flags |= priority_class(options->nice_increment);
+    if (job) flags |= CREATE_SUSPENDED;
+    success = create_inheriting_std_handles(command_line, working_dir, flags, options_environment_block(options), si, pi);
+    if (success && job) {
+        AssignProcessToJobObject(job, pi->hProcess);
+        ResumeThread(pi->hThread);
+    }
+    if (success) {
+        metrics_spawned(monotonic_ns() - start_ns);
+        if (tracing) trace_spawned(pi->dwProcessId, NULL, command_line, start_ns, 0, 0, 0, monotonic_ns());
+    } else {
+        metrics_spawn_failed((int)GetLastError());
+        if (tracing) trace_spawn_failed(start_ns, (int)GetLastError());
+    }
+    return success;
+}
+
+/* Start `feed' on `pipe', copying CRT descriptor `source_fd' (-1 for none). */
+static void feed_init(sp_input_feed* feed, HANDLE pipe, int source_fd) {
+    HANDLE source = NULL;
+
+    if (source_fd >= 0) {
+        source = (HANDLE)_get_osfhandle(source_fd);
+        if (source == INVALID_HANDLE_VALUE) source = NULL;
+    }
+    memset(feed, 0, sizeof(sp_input_feed));
+    feed->pipe = pipe;
+    feed->source = source;
+    feed->close_when_done = 1;
+}
+
+static int feed_is_open(sp_input_feed* feed) {
+    return feed->pipe != NULL;
+}
+
+static void feed_close(sp_input_feed* feed) {
+    if (feed->pipe) {
+        CloseHandle(feed->pipe);
+        feed->pipe = NULL;
+    }
+}
+
+/* Write as much input as the pipe takes without blocking. Closes the pipe
+ * when all input is written (if `close_when_done') or the child has gone.
+ * Returns: 1 if anything was written, 0 otherwise
+ */
+static int feed_input(sp_input_feed* feed) {
+    DWORD bytes;
+    int progress = 0;
+
+    while (feed->pipe) {
+        if (feed->remaining > 0) {
+            if (!WriteFile(feed->pipe, feed->data, (DWORD)feed->remaining, &bytes, NULL)) {
+                feed_close(feed);  /* Child closed its stdin */
+                break;
+            }
+            feed->data += bytes;
+            feed->remaining -= (int)bytes;
+        } else if (feed->stage_offset < feed->stage_length) {
+            if (!WriteFile(feed->pipe, feed->stage + feed->stage_offset,
+                           (DWORD)(feed->stage_length - feed->stage_offset), &bytes, NULL)) {
+                feed_close(feed);
+                break;
+            }
+            feed->stage_offset += (int)bytes;
+        } else if (feed->source) {
+            if (!ReadFile(feed->source, feed->stage, sizeof(feed->stage), &bytes, NULL) || bytes == 0) {
+                feed->source = NULL;  /* End of file (or read error) */
+            } else {
+                feed->stage_length = (int)bytes;
+                feed->stage_offset = 0;
+            }
+            continue;
+        } else {
+            if (feed->close_when_done) feed_close(feed);
+            break;
+        }
+        if (bytes == 0) break;  /* Pipe full */
+        progress = 1;
+    }
+    return progress;
+}
+
+/* Read `*out_pipe' (and `*err_pipe' when given) to end of stream, closing
+ * each handle as it finishes, while writing `feed' (when given) to the
+ * child's stdin. Pipes are serviced alternately so none can fill up and
+ * block the child. Stops early at `deadline_ns' on the monotonic clock
+ * (0: no limit), leaving the open handles to the caller.
+ * Returns: 1 once every stream has ended, 0 if the deadline passed first
+ */
+static int drain_pipes(HANDLE* out_pipe, sp_buffer* out, HANDLE* err_pipe, sp_buffer* err,
+                       sp_input_feed* feed, long long deadline_ns) {
+    int progress, rc;
+    int feed_only = !*out_pipe && !(err_pipe && *err_pipe);  /* Output goes to a file */
+
+    while (*out_pipe || (err_pipe && *err_pipe) || (feed_only && feed && feed->pipe)) {
+        if (deadline_ns != 0 && monotonic_ns() >= deadline_ns) return 0;
+        if (deadline_ns == 0 && !(feed && feed->pipe) && !(*out_pipe && err_pipe && *err_pipe)) {
+            /* Single pipe left, nothing to write, no deadline: blocking reads */
+            if (*out_pipe) {
+                read_pipe_to_end(out_pipe, out);
+            } else {
+                read_pipe_to_end(err_pipe, err);
+            }
+            continue;
+        }
+
+        /* Anonymous pipes cannot be waited on: service all, nap when idle */
+        progress = feed ? feed_input(feed) : 0;
+        if (*out_pipe) {
+            rc = read_pipe_available(*out_pipe, out);
+            if (rc < 0) {
+                CloseHandle(*out_pipe);
+                *out_pipe = NULL;
+            } else {
+                progress |= rc;
+            }
+        }
+        if (err_pipe && *err_pipe) {
+            rc = read_pipe_available(*err_pipe, err);
+            if (rc < 0) {
+                CloseHandle(*err_pipe);
+                *err_pipe = NULL;
+            } else {
+                progress |= rc;
+            }
+        }
+        if (!progress && (*out_pipe || (err_pipe && *err_pipe) || (feed && feed->pipe))) {
+            Sleep(1);
+        }
+    }
+    if (feed) feed_close(feed);  /* Output ended: the child is done reading */
+    return 1;
+}
+
+/* Milliseconds left until `deadline_ns' for a wait (INFINITE for 0). */
+static DWORD wait_ms_until(long long deadline_ns) {
+    long long remaining;
+
+    if (deadline_ns == 0) return INFINITE;
+    remaining = deadline_ns - monotonic_ns();
+    return remaining > 0 ? (DWORD)((remaining + 999999) / 1000000) : 0;
+}
+
+/* Terminate the `count' started `processes' and, through `job', all
+ * processes they started. */
+static void terminate_stages(HANDLE job, HANDLE* processes, int count) {
+    int i;
+
+    if (job && TerminateJobObject(job, 1)) return;
+    for (i = 0; i < count; i++) TerminateProcess(processes[i], 1);
+}
+
+/* Open the file children write their output to instead of a capture pipe:
+ * options->output_path, or an anonymous temporary file deleted once the
+ * last handle (or mapped view) of it is closed. The handle is inheritable
+ * through `sa'.
+ * Returns: file handle, or NULL with the error stored
+ */
+static HANDLE open_output_file(const sp_options* options, SECURITY_ATTRIBUTES* sa) {
+    char dir[MAX_PATH];
+    char path[MAX_PATH];
+    HANDLE file;
+    DWORD access = GENERIC_WRITE;
+    DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+
+    if (options->output_mode == SP_OUTPUT_FILE) {
+        if (options->map_output) access |= GENERIC_READ;
+        file = CreateFileA(options->output_path, access, share, sa, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    } else if (GetTempPathA(sizeof(dir), dir) == 0 || GetTempFileNameA(dir, "spo", 0, path) == 0) {
+        file = INVALID_HANDLE_VALUE;
+    } else {
+        file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, share, sa, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    }
+    if (file == INVALID_HANDLE_VALUE) {
+        store_last_error();
+        return NULL;
+    }
+    return file;
+}
+
+/* Record the size of output file `file' in `result', map it when asked
+ * (always for an anonymous one), and close it. */
+static void finish_output_file(sp_result* result, HANDLE file, const sp_options* options) {
+    LARGE_INTEGER size;
+    HANDLE mapping;
+
+    if (GetFileSizeEx(file, &size)) result->output_size = (long long)size.QuadPart;
+    if (result->output_size > 0 && (unsigned long long)result->output_size <= (SIZE_T)-1 &&
+        (options->map_output || options->output_mode == SP_OUTPUT_MEMORY)) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            result->output_map = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);  /* The view keeps the mapping alive */
+        }
+    }
+    CloseHandle(file);
+}
+
+/* Run the `count' command lines with CreateProcess, each stage's stdout
+ * feeding the next stage's stdin through a pipe, and capture the output of
+ * the last stage. One command line is a plain execution. The stages run in
+ * one job, which is terminated if they outlast options->timeout_ms.
+ */
+static sp_result* execute_command_lines(const char* const* command_lines, int count,
+                                        const char* working_dir, const sp_options* options) {
+    sp_result* result;
+    SECURITY_ATTRIBUTES sa;
+    HANDLE hStdOutRead = NULL, hStdOutWrite = NULL;
+    HANDLE hOutputFile = NULL;  /* Output file instead of the stdout pipe, or NULL */
+    HANDLE hStdErrRead = NULL, hStdErrWrite = NULL;
+    HANDLE hStdInWrite = NULL;
+    HANDLE hStageIn = NULL;     /* Our handle to the next stage's stdin, or NULL */
+    HANDLE hLinkRead, hLinkWrite;
+    HANDLE* processes;
+    HANDLE job;
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    char* cmd_copy;
+    sp_buffer output;
+    sp_buffer error_output;
+    sp_input_feed feed;
+    const char* failure = NULL;
+    long long start_ns, deadline_ns = 0;
+    int started = 0;
+    BOOL success;
+    int drained, i;
+
+    /* Allocate result structure */
+    result = (sp_result*)malloc(sizeof(sp_result));
+    if (!result) return NULL;
+    memset(result, 0, sizeof(sp_result));
+    result->stage_exit_codes = (int*)malloc(count * sizeof(int));
+    processes = (HANDLE*)malloc(count * sizeof(HANDLE));
+    if (!result->stage_exit_codes || !processes) {
+        free(processes);
+        result->error_message = _strdup("Memory allocation failed");
+        result->success = 0;
+        return result;
+    }
+
+    /* Set up security attributes for inheritable handles */
+    sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+    sa.bInheritHandle = TRUE;
+    sa.lpSecurityDescriptor = NULL;
+
+    /* Create pipes for stdout (or open its file) */
+    if (options->output_mode != SP_OUTPUT_CAPTURE) {
+        hOutputFile = open_output_file(options, &sa);
+        hStdOutWrite = hOutputFile;
+    } else if (CreatePipe(&hStdOutRead, &hStdOutWrite, &sa, 0)) {
+        /* Ensure read handle is not inherited */
+        SetHandleInformation(hStdOutRead, HANDLE_FLAG_INHERIT, 0);
+    } else {
+        store_last_error();
+    }
+    if (!hStdOutWrite) {
+        result->error_message = _strdup(last_error_msg);
+        result->success = 0;
+        free(processes);
+        return result;
+    }
+
+    if (options->separate_stderr) {
+        /* Create pipes for stderr */
+        success = CreatePipe(&hStdErrRead, &hStdErrWrite, &sa, 0);
+        if (success) {
+            SetHandleInformation(hStdErrRead, HANDLE_FLAG_INHERIT, 0);
+        }
+    } else {
+        /* Create pipes for stderr (redirect to stdout) */
+        success = DuplicateHandle(GetCurrentProcess(), hStdOutWrite,
+                                  GetCurrentProcess(), &hStdErrWrite,
+                                  0, TRUE, DUPLICATE_SAME_ACCESS);
+    }
+    if (!success) {
+        failure = last_error_msg;
+    }
+
+    /* Create pipe for stdin when there is input to feed; its read end is
+     * made inheritable only while the first stage starts */
+    if (!failure && (options->input_data || options->input_fd >= 0)) {
+        if (create_input_pipe(&sa, &hStageIn, &hStdInWrite)) {
+            SetHandleInformation(hStageIn, HANDLE_FLAG_INHERIT, 0);
+        } else {
+            failure = last_error_msg;
+        }
+    }
+    if (failure) store_last_error();
+
+    /* Set up startup info shared by the stages */
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    si.hStdError = hStdErrWrite;
+    si.dwFlags |= STARTF_USESTDHANDLES;
+
+    if (!options->show_window) {
+        si.dwFlags |= STARTF_USESHOWWINDOW;
+        si.wShowWindow = SW_HIDE;
+    }
+
+    /* Start the stages: stage i reads `hStageIn' and writes to a new link
+     * pipe (or the output pipe for the last) */
+    job = CreateJobObjectA(NULL, NULL);
+    start_ns = monotonic_ns();
+    for (i = 0; !failure && i < count; i++) {
+        hLinkRead = NULL;
+        hLinkWrite = NULL;
+        if (i < count - 1) {
+            if (!CreatePipe(&hLinkRead, &hLinkWrite, &sa, 0)) {
+                store_last_error();
+                failure = last_error_msg;
+                break;
+            }
+            SetHandleInformation(hLinkRead, HANDLE_FLAG_INHERIT, 0);
+        }
+        if (hStageIn) {
+            SetHandleInformation(hStageIn, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+        }
+        si.hStdInput = hStageIn ? hStageIn : GetStdHandle(STD_INPUT_HANDLE);
+        si.hStdOutput = hLinkWrite ? hLinkWrite : hStdOutWrite;
+
+        /* CreateProcess needs a modifiable string */
+        cmd_copy = _strdup(command_lines[i]);
+        memset(&pi, 0, sizeof(pi));
+        success = cmd_copy && create_process(cmd_copy, working_dir, CREATE_NO_WINDOW, job, options, &si, &pi);
+        if (!success) {
+            if (cmd_copy) {
+                store_last_error();
+                failure = last_error_msg;
+            } else {
+                failure = "Memory allocation failed";
+            }
+        }
+        free(cmd_copy);
+
+        /* This stage's ends belong to the child now, so later stages
+         * cannot inherit them */
+        if (hStageIn) CloseHandle(hStageIn);
+        if (hLinkWrite) CloseHandle(hLinkWrite);
+        hStageIn = hLinkRead;
+        if (!success) break;
+        CloseHandle(pi.hThread);
+        processes[started++] = pi.hProcess;
+    }
+    if (hStageIn) CloseHandle(hStageIn);
+
+    /* Close write ends of pipes (children have them now) */
+    if (!hOutputFile) CloseHandle(hStdOutWrite);
+    if (hStdErrWrite) CloseHandle(hStdErrWrite);
+
+    /* Allocate output buffers */
+    output.data = NULL;
+    error_output.data = NULL;
+    output.first_output_ns = 0;
+    error_output.first_output_ns = 0;
+    if (!failure &&
+        ((hStdOutRead && !buffer_init(&output, SP_STREAM_OUTPUT, options)) ||
+         (hStdErrRead && !buffer_init(&error_output, SP_STREAM_ERROR, options)))) {
+        failure = "Memory allocation failed";
+    }
+
+    if (failure) {
+        result->error_message = _strdup(failure);
+        result->success = 0;
+        if (hStdOutRead) CloseHandle(hStdOutRead);
+        if (hOutputFile) CloseHandle(hOutputFile);
+        if (hStdErrRead) CloseHandle(hStdErrRead);
+        if (hStdInWrite) CloseHandle(hStdInWrite);
+        /* Stages already running would wait on pipes nobody serves */
+        terminate_stages(job, processes, started);
+        for (i = 0; i < started; i++) {
+            WaitForSingleObject(processes[i], INFINITE);
+            if (tracing) trace_reaped(GetProcessId(processes[i]), -1, 0);
+            CloseHandle(processes[i]);
+            metrics_ended();
+        }
+        if (job) CloseHandle(job);
+        free(processes);
+        free(output.data);
+        free(error_output.data);
+        return result;
+    }
+
+    /* Read output from pipes, feeding stdin in between */
+    if (hStdInWrite) {
+        feed_init(&feed, hStdInWrite, options->input_fd);
+        feed.data = options->input_data;
+        feed.remaining = options->input_data ? options->input_length : 0;
+    }
+    if (options->timeout_ms > 0) {
+        deadline_ns = start_ns + (long long)options->timeout_ms * 1000000;
+    }
+    drained = drain_pipes(&hStdOutRead, &output, hStdErrRead ? &hStdErrRead : NULL, &error_output,
+                          hStdInWrite ? &feed : NULL, deadline_ns);
+    if (tracing) {
+        trace_run_output(GetProcessId(processes[count - 1]), &output, &error_output, drained ? monotonic_ns() : 0);
+    }
+    for (i = 0; drained && i < count; i++) {
+        drained = WaitForSingleObject(processes[i], wait_ms_until(deadline_ns)) == WAIT_OBJECT_0;
+    }
+    if (!drained) {
+        /* Past the deadline. There is no SIGTERM to send first, so the job
+         * (the stages and everything they started) is terminated at once */
+        result->timed_out = 1;
+        terminate_stages(job, processes, count);
+        drain_pipes(&hStdOutRead, &output, hStdErrRead ? &hStdErrRead : NULL, &error_output,
+                    hStdInWrite ? &feed : NULL, monotonic_ns() + (long long)KILL_DRAIN_MS * 1000000);
+        if (hStdOutRead) CloseHandle(hStdOutRead);
+        if (hStdErrRead) CloseHandle(hStdErrRead);
+        if (hStdInWrite) feed_close(&feed);
+    }
+
+    /* Wait for every stage to complete, collecting its usage */
+    for (i = 0; i < count; i++) {
+        WaitForSingleObject(processes[i], INFINITE);
+        GetExitCodeProcess(processes[i], (DWORD*)&result->stage_exit_codes[i]);
+        metrics_ended();
+        if (tracing) trace_reaped(GetProcessId(processes[i]), result->stage_exit_codes[i], 0);
+        add_process_usage(processes[i], &result->usage);
+        CloseHandle(processes[i]);
+    }
+    result->usage.wall_time_ns = monotonic_ns() - start_ns;
+    if (job) CloseHandle(job);
+    free(processes);
+
+    result->success = 1;
+    result->stage_count = count;
+    result->exit_code = result->stage_exit_codes[count - 1];
+    if (output.data) {
+        result->output = buffer_finish(&output, &result->output_length);
+        result->output_truncated = output.truncated;
+    } else {
+        finish_output_file(result, hOutputFile, options);
+    }
+    if (error_output.data) {
+        result->error_output = buffer_finish(&error_output, &result->error_output_length);
+        result->output_truncated |= error_output.truncated;
+    }
+    metrics_run(start_ns, result->usage.wall_time_ns, output.first_output_ns, error_output.first_output_ns,
+                result->output_length + result->error_output_length + result->output_size,
+                result->output_truncated);
+
+    return result;
+}
+
+/* Run one command line; see execute_command_lines. */
+static sp_result* execute_command_line(const char* command_line, const char* working_dir, const sp_options* options) {
+    return execute_command_lines(&command_line, 1, working_dir, options);
+}
+
+/* Append `arg' to `out' quoted so CommandLineToArgvW yields it unchanged.
+ * Returns: number of characters written (or needed if `out' is NULL).
+ */
+static size_t quote_argument(const char* arg, char* out) {
+    size_t n = 0;
+    size_t backslashes;
+    const char* p;
+
+    if (arg[0] && !strpbrk(arg, " \t\n\v\"")) {
+        n = strlen(arg);
+        if (out) memcpy(out, arg, n);
+        return n;
+    }
+
+    if (out) out[n] = '"';
+    n++;
+    for (p = arg; ; p++) {
+        backslashes = 0;
+        while (*p == '\\') {
+            p++;
+            backslashes++;
+        }
+        if (*p == '\0') {
+            /* Double trailing backslashes so the closing quote survives */
+            backslashes *= 2;
+        } else if (*p == '"') {
+            /* Escape the backslashes and the quote itself */
+            backslashes = backslashes * 2 + 1;
+        }
+        while (backslashes-- > 0) {
+            if (out) out[n] = '\\';
+            n++;
+        }
+        if (*p == '\0') break;
+        if (out) out[n] = *p;
+        n++;
+    }
+    if (out) out[n] = '"';
+    n++;
+    return n;
+}
+
+/* Build a CreateProcess command line from `argv'.
+ * Returns: heap string (caller must free) or NULL on allocation failure.
+ */
+static char* build_command_line(const char* const* argv) {
+    size_t length = 0;
+    char* line;
+    char* p;
+    int i;
+
+    for (i = 0; argv[i]; i++) {
+        length += quote_argument(argv[i], NULL) + 1;
+    }
+    line = (char*)malloc(length + 1);
+    if (!line) return NULL;
+
+    p = line;
+    for (i = 0; argv[i]; i++) {
+        if (i > 0) *p++ = ' ';
+        p += quote_argument(argv[i], p);
+    }
+    *p = '\0';
+    return line;
+}
+
+sp_result* sp_execute_ex(const char* command, const char* const* argv, const char* working_dir, const sp_options* options) {
+    sp_options defaults;
+    sp_result* result;
+    char* command_line;
+
+    options = options_or_default(options, &defaults);
+    if (!valid_output(options)) {
+        return error_result("No output file");
+    }
+    if (command) {
+        return execute_command_line(command, working_dir, options);
+    }
+    if (!valid_argv(argv)) {
+        return error_result("Empty argument vector");
+    }
+    command_line = build_command_line(argv);
+    if (!command_line) {
+        return error_result("Memory allocation failed");
+    }
+    /* CreateProcess runs the program directly and searches PATH for it */
+    result = execute_command_line(command_line, working_dir, options);
+    free(command_line);
+    return result;
+}
+
+sp_result* sp_execute_pipeline(const char* const* const* stages, int stage_count, const char* working_dir, const sp_options* options) {
+    sp_options defaults;
+    sp_result* result;
+    char** command_lines;
+    int i, built;
+
+    options = options_or_default(options, &defaults);
+    if (!valid_output(options)) {
+        return error_result("No output file");
+    }
+    if (!valid_stages(stages, stage_count)) {
+        return error_result("Empty pipeline stage");
+    }
+    command_lines = (char**)malloc(stage_count * sizeof(char*));
+    if (!command_lines) {
+        return error_result("Memory allocation failed");
+    }
+    for (built = 0; built < stage_count; built++) {
+        command_lines[built] = build_command_line(stages[built]);
+        if (!command_lines[built]) break;
+    }
+    if (built < stage_count) {
+        result = error_result("Memory allocation failed");
+    } else {
+        result = execute_command_lines((const char* const*)command_lines, stage_count, working_dir, options);
+    }
+    for (i = 0; i < built; i++) {
+        free(command_lines[i]);
+    }
+    free(command_lines);
+    return result;
+}
+
+#else
+/* ============ POSIX sp_execute_command ============ */
+
+/* Read once from `fd' into `buffer', retrying on EINTR.
+ * Returns: 1 if data was read, 0 at end of stream or error.
+ */
+static int buffer_read_fd(sp_buffer* buffer, int fd) {
+    char scratch[BUFFER_SIZE];
+    ssize_t bytes_read;
+    char* target;
+    int size;
+
+    target = buffer_target(buffer, scratch, &size);
+    do {
+        bytes_read = read(fd, target, size);
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read <= 0) return 0;
+    buffer_commit(buffer, target, (int)bytes_read);
+    return 1;
+}
+
+#define FEED_SPLICE_SIZE (64 * 1024)
+
+/* Writing to a pipe whose reader has exited raises SIGPIPE, which would
+ * kill the whole application. Block it around such writes and discard a
+ * SIGPIPE they leave pending, so they just fail with EPIPE.
+ */
+typedef struct {
+    sigset_t previous_mask;
+    int was_pending;
+} sp_sigpipe_guard;
+
+static void sigpipe_block(sp_sigpipe_guard* guard) {
+    sigset_t pipe_signal, pending;
+
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    sigpending(&pending);
+    guard->was_pending = sigismember(&pending, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, &guard->previous_mask);
+}
+
+static void sigpipe_restore(sp_sigpipe_guard* guard) {
+    sigset_t pipe_signal, pending;
+    int sig;
+
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    sigpending(&pending);
+    if (!guard->was_pending && sigismember(&pending, SIGPIPE)) {
+        sigwait(&pipe_signal, &sig);  /* Pending, so returns at once */
+    }
+    pthread_sigmask(SIG_SETMASK, &guard->previous_mask, NULL);
+}
+
+/* Create a stdin pipe whose write end (fds[1]) does not block. */
+static int make_input_pipe(int fds[2]) {
+    if (make_pipe(fds) < 0) return -1;
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+/* Start `feed' on `pipe_fd', copying `source_fd' (-1 for none). */
+static void feed_init(sp_input_feed* feed, int pipe_fd, int source_fd) {
+#ifdef __linux__
+    struct stat st;
+#endif
+
+    memset(feed, 0, sizeof(sp_input_feed));
+    feed->pipe = pipe_fd;
+    feed->source = source_fd;
+    feed->close_when_done = 1;
+#ifdef __linux__
+    /* Regular files are spliced into the pipe without a copy through us */
+    feed->use_splice = source_fd >= 0 && fstat(source_fd, &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+static int feed_is_open(sp_input_feed* feed) {
+    return feed->pipe >= 0;
+}
+
+static void feed_close(sp_input_feed* feed) {
+    if (feed->pipe >= 0) {
+        close(feed->pipe);
+        feed->pipe = -1;
+    }
+}
+
+/* Write as much input as the pipe takes without blocking. Closes the pipe
+ * when all input is written (if `close_when_done') or the child has gone.
+ * Returns: 1 if anything was written, 0 otherwise
+ */
+static int feed_input(sp_input_feed* feed) {
+    sp_sigpipe_guard guard;
+    ssize_t n;
+    int progress = 0;
+
+    if (feed->pipe < 0) return 0;
+    sigpipe_block(&guard);
+    while (feed->pipe >= 0) {
+        if (feed->remaining > 0) {
+            n = write(feed->pipe, feed->data, feed->remaining);
+            if (n > 0) {
+                feed->data += n;
+                feed->remaining -= (int)n;
+            }
+        } else if (feed->stage_offset < feed->stage_length) {
+            n = write(feed->pipe, feed->stage + feed->stage_offset,
+                      feed->stage_length - feed->stage_offset);
+            if (n > 0) feed->stage_offset += (int)n;
+#ifdef __linux__
+        } else if (feed->source >= 0 && feed->use_splice) {
+            n = splice(feed->source, NULL, feed->pipe, NULL, FEED_SPLICE_SIZE,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0) {
+                feed->source = -1;  /* End of file */
+                continue;
+            }
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                feed->use_splice = 0;  /* Not spliceable: copy instead */
+                continue;
+            }
+#endif
+        } else if (feed->source >= 0) {
+            do {
+                n = read(feed->source, feed->stage, sizeof(feed->stage));
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0) {
+                feed->source = -1;  /* End of file (or read error) */
+            } else {
+                feed->stage_length = (int)n;
+                feed->stage_offset = 0;
+            }
+            continue;
+        } else {
+            if (feed->close_when_done) feed_close(feed);
+            break;
+        }
+
+        if (n > 0) {
+            progress = 1;
+        } else if (n < 0 && errno == EINTR) {
+            /* Retry */
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;  /* Pipe full */
+        } else {
+            feed_close(feed);  /* Child closed its stdin (EPIPE) */
+        }
+    }
+    sigpipe_restore(&guard);
+    return progress;
+}
+
+/* Read `*out_fd' (and `*err_fd' when >= 0) to end of stream, closing each
+ * fd and setting it to -1 as it finishes, while writing `feed' (when given)
+ * to the child's stdin. The pipes are serviced concurrently with poll() so
+ * none can fill up and block the child. Stops early at `deadline_ns' on the
+ * monotonic clock (0: no limit), leaving the open fds to the caller.
+ * Returns: 1 once every stream has ended, 0 if the deadline passed first
+ */
+static int drain_fds(int* out_fd, sp_buffer* out, int* err_fd, sp_buffer* err,
+                     sp_input_feed* feed, long long deadline_ns) {
+    int* fds_open[2];
+    sp_buffer* buffers[2];
+    struct pollfd fds[3];
+    int slots[3];
+    long long remaining;
+    int nfds, slot, i, rc, timeout = -1;
+    int feed_only = (*out_fd < 0 && *err_fd < 0);  /* Output goes to a file */
+
+    fds_open[0] = out_fd;
+    fds_open[1] = err_fd;
+    buffers[0] = out;
+    buffers[1] = err;
+    if (feed) feed_input(feed);
+
+    while (*fds_open[0] >= 0 || *fds_open[1] >= 0 || (feed_only && feed && feed->pipe >= 0)) {
+        if (deadline_ns == 0 && (*fds_open[0] < 0 || *fds_open[1] < 0) && !(feed && feed->pipe >= 0)) {
+            /* Single pipe left, nothing to write, no deadline: blocking reads */
+            i = (*fds_open[0] >= 0) ? 0 : 1;
+            while (buffer_read_fd(buffers[i], *fds_open[i])) {
+                /* Keep reading */
+            }
+            close(*fds_open[i]);
+            *fds_open[i] = -1;
+            break;
+        }
+        if (deadline_ns != 0) {
+            remaining = deadline_ns - monotonic_ns();
+            if (remaining <= 0) return 0;
+            timeout = (int)((remaining + 999999) / 1000000);
+        }
+
+        nfds = 0;
+        for (i = 0; i < 2; i++) {
+            if (*fds_open[i] >= 0) {
+                fds[nfds].fd = *fds_open[i];
+                fds[nfds].events = POLLIN;
+                slots[nfds++] = i;
+            }
+        }
+        if (feed && feed->pipe >= 0) {
+            fds[nfds].fd = feed->pipe;
+            fds[nfds].events = POLLOUT;
+            slots[nfds++] = 2;
+        }
+        rc = poll(fds, nfds, timeout);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (i = 0; i < nfds; i++) {
+            if (!fds[i].revents) continue;
+            slot = slots[i];
+            if (slot == 2) {
+                feed_input(feed);
+            } else if (!buffer_read_fd(buffers[slot], *fds_open[slot])) {
+                close(*fds_open[slot]);
+                *fds_open[slot] = -1;
+            }
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (*fds_open[i] >= 0) close(*fds_open[i]);
+        *fds_open[i] = -1;
+    }
+    if (feed) feed_close(feed);  /* Output ended: the child is done reading */
+    return 1;
+}
+
+static int open_pidfd(pid_t pid);
+
+/* Wait for child `pid' as reap_child does, until `deadline_ns' on the
+ * monotonic clock (0: no limit). Waits on `status_fd' or a pidfd; without
+ * either (kernels before Linux 5.3, other systems) it polls, backing off.
+ * Returns: `pid' once reaped, 0 if the deadline passed, -1 on error
+ */
+static pid_t reap_child_until(pid_t pid, int status_fd, long long deadline_ns,
+                              int* status, struct rusage* usage) {
+    struct timespec pause;
+    struct pollfd pfd;
+    long long remaining, pause_ns = 50000;
+    int pidfd = -2;  /* -2: not opened yet */
+    pid_t result;
+
+    if (deadline_ns == 0) return reap_child(pid, status_fd, 0, status, usage);
+    while (1) {
+        result = reap_child(pid, status_fd, WNOHANG, status, usage);
+        if (result != 0) break;
+        remaining = deadline_ns - monotonic_ns();
+        if (remaining <= 0) break;
+        if (status_fd < 0 && pidfd == -2) pidfd = open_pidfd(pid);  /* Still unreaped: `pid' is ours */
+        if (status_fd >= 0 || pidfd >= 0) {
+            pfd.fd = status_fd >= 0 ? status_fd : pidfd;
+            pfd.events = POLLIN;
+            poll(&pfd, 1, (int)((remaining + 999999) / 1000000));
+            continue;
+        }
+        /* Most children exit right after closing their output: back off
+         * from a short first pause */
+        if (pause_ns > remaining) pause_ns = remaining;
+        pause.tv_sec = 0;
+        pause.tv_nsec = (long)pause_ns;
+        nanosleep(&pause, NULL);
+        if (pause_ns < 10000000) pause_ns *= 2;
+    }
+    if (pidfd >= 0) close(pidfd);
+    return result;
+}
+
+/* A stage started by execute_spawn */
+typedef struct {
+    pid_t pid;              /* Child pid, or 0 once reaped */
+    int status_fd;          /* Status pipe of a served child, or -1 */
+    int own_group;          /* Leads its own process group? */
+} sp_stage;
+
+/* Send `sig' to every stage not yet reaped, and to its process group. */
+static void signal_stages(sp_stage* stages, int count, int sig) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (stages[i].pid > 0) {
+            signal_child(stages[i].pid, stages[i].own_group, stages[i].status_fd, sig);
+        }
+    }
+}
+
+/* Reap the stages not yet reaped, recording exit codes and usage in
+ * `result', until `deadline_ns' (0: no limit).
+ * Returns: 1 once every stage is reaped, 0 if the deadline passed first
+ */
+static int reap_stages(sp_stage* stages, int count, long long deadline_ns, sp_result* result) {
+    struct rusage ru;
+    pid_t reaped;
+    int status, i;
+
+    for (i = 0; i < count; i++) {
+        if (stages[i].pid <= 0) continue;
+        reaped = reap_child_until(stages[i].pid, stages[i].status_fd, deadline_ns, &status, &ru);
+        if (reaped == 0) return 0;
+        if (stages[i].status_fd >= 0) close(stages[i].status_fd);
+        stages[i].status_fd = -1;
+        stages[i].pid = 0;
+        if (reaped > 0) add_rusage(&result->usage, &ru);
+        if (reaped > 0 && WIFEXITED(status)) {
+            result->stage_exit_codes[i] = WEXITSTATUS(status);
+        } else {
+            result->stage_exit_codes[i] = -1;
+        }
+    }
+    return 1;
+}
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+/* Open the file children write their output to instead of a capture pipe:
+ * options->output_path, or an anonymous memory file (memfd on Linux, an
+ * unlinked temporary file elsewhere).
+ * Returns: close-on-exec fd, or -1 with the error stored
+ */
+static int open_output_file(const sp_options* options) {
+    char path[PATH_MAX];
+    const char* dir;
+    int fd;
+
+    if (options->output_mode == SP_OUTPUT_FILE) {
+        fd = open(options->output_path, (options->map_output ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) store_last_error();
+        return fd;
+    }
+#if defined(__linux__) && defined(SYS_memfd_create)
+    fd = (int)syscall(SYS_memfd_create, "simple_process-output", MFD_CLOEXEC);
+    if (fd >= 0) return fd;
+#endif
+    dir = getenv("TMPDIR");
+    snprintf(path, sizeof(path), "%s/simple_process-XXXXXX", (dir && dir[0]) ? dir : "/tmp");
+#ifdef SP_HAVE_PIPE2
+    fd = mkostemp(path, O_CLOEXEC);
+#else
+    fd_creation_begin();
+    fd = mkstemp(path);
+    if (fd >= 0) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fd_creation_end();
+#endif
+    if (fd < 0) {
+        store_last_error();
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+/* Record the size of output file `fd' in `result', map it when asked
+ * (always for an anonymous one), and close it. */
+static void finish_output_file(sp_result* result, int fd, const sp_options* options) {
+    struct stat st;
+    void* map;
+
+    if (fstat(fd, &st) == 0) result->output_size = (long long)st.st_size;
+    if (result->output_size > 0 && (unsigned long long)result->output_size <= (size_t)-1 &&
+        (options->map_output || options->output_mode == SP_OUTPUT_MEMORY)) {
+        map = mmap(NULL, (size_t)result->output_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) result->output_map = (const char*)map;
+    }
+    close(fd);
+}
+
+/* Spawn the `count' stages `paths[i]' with `argvs[i]', each stage's stdout
+ * feeding the next stage's stdin through a pipe, and capture the output of
+ * the last stage synchronously. One stage is a plain execution.
+ */
+static sp_result* execute_spawn(int count, const char* const* paths, char* const* const* argvs,
+                                const char* working_dir, const sp_options* options) {
+    sp_result* result;
+    sp_spawn_spec spec;
+    int out_pipe[2] = {-1, -1};
+    int out_file = -1;          /* Output file instead of `out_pipe', or -1 */
+    int err_pipe[2] = {-1, -1};
+    int in_pipe[2] = {-1, -1};
+    int link[2];
+    int stage_in, out_write;
+    sp_child_controls controls;
+    char cgroup_procs[PATH_MAX];
+    int controlled;
+    sp_buffer output;
+    sp_buffer error_output;
+    sp_input_feed feed;
+    sp_input_feed* feeding = NULL;
+    sp_stage* stages;
+    long long start_ns, deadline_ns = 0;
+    int started = 0;
+    const char* failure = NULL;
+    int drained, i;
+
+    controlled = prepare_controls(options, &controls, cgroup_procs, sizeof(cgroup_procs));
+    if (controlled < 0) return error_result(last_error_msg);
+
+    /* Allocate result structure */
+    result = (sp_result*)malloc(sizeof(sp_result));
+    if (!result) return NULL;
+    memset(result, 0, sizeof(sp_result));
+    result->stage_exit_codes = (int*)malloc(count * sizeof(int));
+    stages = (sp_stage*)malloc(count * sizeof(sp_stage));
+    if (!result->stage_exit_codes || !stages) {
+        free(stages);
+        result->error_message = strdup("Memory allocation failed");
+        result->success = 0;
+        return result;
+    }
+
+    /* Create pipes for stdout (or open its file) and, if separate, stderr */
+    if (options->output_mode != SP_OUTPUT_CAPTURE) {
+        out_file = open_output_file(options);
+    } else if (make_pipe(out_pipe) < 0) {
+        store_last_error();
+    }
+    if (out_pipe[1] < 0 && out_file < 0) {
+        result->error_message = strdup(last_error_msg);
+        result->success = 0;
+        free(stages);
+        return result;
+    }
+    if (options->separate_stderr && make_pipe(err_pipe) < 0) {
+        failure = last_error_msg;
+    }
+    /* Create pipe for stdin when there is input to feed */
+    if (!failure && (options->input_data || options->input_fd >= 0) && make_input_pipe(in_pipe) < 0) {
+        failure = last_error_msg;
+    }
+    if (failure) store_last_error();
+
+    /* Start the stages: stage i reads `stage_in' and writes to a new link
+     * pipe (or the output pipe for the last); every stage shares stderr */
+    memset(&spec, 0, sizeof(spec));
+    spec.working_dir = working_dir;
+    spec.envp = options_environment(options);
+    spec.controls = controlled ? &controls : NULL;
+    spec.cgroup_procs = cgroup_procs;
+    out_write = (out_file >= 0) ? out_file : out_pipe[1];
+    spec.stderr_fd = (err_pipe[1] >= 0) ? err_pipe[1] : out_write;
+    stage_in = in_pipe[0];
+    start_ns = monotonic_ns();
+    for (i = 0; !failure && i < count; i++) {
+        link[0] = -1;
+        link[1] = -1;
+        if (i < count - 1 && make_pipe(link) < 0) {
+            store_last_error();
+            failure = last_error_msg;
+            break;
+        }
+        spec.path = paths[i];
+        spec.argv = argvs[i];
+        spec.stdin_fd = stage_in;
+        spec.stdout_fd = (link[1] >= 0) ? link[1] : out_write;
+        spec.new_group = wants_new_group(stage_in);
+        stages[i].pid = spawn_process(&spec);
+        stages[i].status_fd = spec.status_fd;
+        stages[i].own_group = spec.new_group;
+        if (stages[i].pid < 0) store_last_error();
+
+        /* Parent process: this stage's ends belong to the child now */
+        if (stage_in >= 0) close(stage_in);
+        if (link[1] >= 0) close(link[1]);
+        stage_in = link[0];
+        if (stages[i].pid < 0) {
+            failure = last_error_msg;
+            break;
+        }
+        started++;
+    }
+    if (stage_in >= 0) close(stage_in);
+    if (out_pipe[1] >= 0) close(out_pipe[1]);
+    if (err_pipe[1] >= 0) close(err_pipe[1]);
+
+    /* Allocate output buffers */
+    output.data = NULL;
+    error_output.data = NULL;
+    output.first_output_ns = 0;
+    error_output.first_output_ns = 0;
+    if (!failure &&
+        ((out_pipe[0] >= 0 && !buffer_init(&output, SP_STREAM_OUTPUT, options)) ||
+         (err_pipe[0] >= 0 && !buffer_init(&error_output, SP_STREAM_ERROR, options)))) {
+        failure = "Memory allocation failed";
+    }
+
+    if (failure) {
+        result->error_message = strdup(failure);
+        result->success = 0;
+        if (out_pipe[0] >= 0) close(out_pipe[0]);
+        if (out_file >= 0) close(out_file);
+        if (err_pipe[0] >= 0) close(err_pipe[0]);
+        if (in_pipe[1] >= 0) close(in_pipe[1]);
+        /* Stages already running would wait on pipes nobody serves */
+        signal_stages(stages, started, SIGKILL);
+        reap_stages(stages, started, 0, result);
+        free(stages);
+        free(output.data);
+        free(error_output.data);
+        return result;
+    }
+
+    /* Read output from pipes, feeding stdin in between, then wait for
+     * every stage to exit, collecting its rusage */
+    if (in_pipe[1] >= 0) {
+        feed_init(&feed, in_pipe[1], options->input_fd);
+        feed.data = options->input_data;
+        feed.remaining = options->input_data ? options->input_length : 0;
+        feeding = &feed;
+    }
+    if (options->timeout_ms > 0) {
+        deadline_ns = start_ns + (long long)options->timeout_ms * 1000000;
+    }
+    drained = drain_fds(&out_pipe[0], &output, &err_pipe[0], &error_output, feeding, deadline_ns);
+    if (tracing) trace_run_output(stages[count - 1].pid, &output, &error_output, drained ? monotonic_ns() : 0);
+    if (!drained || !reap_stages(stages, count, deadline_ns, result)) {
+        /* Past the deadline: ask every group to stop, then force it */
+        result->timed_out = 1;
+        signal_stages(stages, count, SIGTERM);
+        deadline_ns = monotonic_ns() + (long long)(options->kill_grace_ms > 0 ? options->kill_grace_ms : 0) * 1000000;
+        if (!drained) drained = drain_fds(&out_pipe[0], &output, &err_pipe[0], &error_output, feeding, deadline_ns);
+        if (!drained || !reap_stages(stages, count, deadline_ns, result)) {
+            signal_stages(stages, count, SIGKILL);
+            if (!drained) {
+                drain_fds(&out_pipe[0], &output, &err_pipe[0], &error_output, feeding,
+                          monotonic_ns() + (long long)KILL_DRAIN_MS * 1000000);
+            }
+            reap_stages(stages, count, 0, result);
+        }
+        if (out_pipe[0] >= 0) close(out_pipe[0]);
+        if (err_pipe[0] >= 0) close(err_pipe[0]);
+        if (feeding) feed_close(feeding);
+    }
+    result->usage.wall_time_ns = monotonic_ns() - start_ns;
+    free(stages);
+
+    result->success = 1;
+    result->stage_count = count;
+    result->exit_code = result->stage_exit_codes[count - 1];
+    if (output.data) {
+        result->output = buffer_finish(&output, &result->output_length);
+        result->output_truncated = output.truncated;
+    } else {
+        finish_output_file(result, out_file, options);
+    }
+    if (error_output.data) {
+        result->error_output = buffer_finish(&error_output, &result->error_output_length);
+        result->output_truncated |= error_output.truncated;
+    }
+    metrics_run(start_ns, result->usage.wall_time_ns, output.first_output_ns, error_output.first_output_ns,
+                result->output_length + result->error_output_length + result->output_size,
+                result->output_truncated);
+
+    return result;
+}
+
+sp_result* sp_execute_ex(const char* command, const char* const* argv, const char* working_dir, const sp_options* options) {
+    sp_options defaults;
+    char* shell[4];
+    char path_buffer[PATH_MAX];
+    const char* path;
+    char* const* vector;
+
+    options = options_or_default(options, &defaults);
+    if (!valid_output(options)) {
+        return error_result("No output file");
+    }
+    if (command) {
+        shell_argv(command, shell);
+        path = "/bin/sh";
+        vector = shell;
+    } else if (!valid_argv(argv)) {
+        return error_result("Empty argument vector");
+    } else {
+        path = argv_program_path(argv, path_buffer, sizeof(path_buffer));
+        vector = (char* const*)argv;
+    }
+    return execute_spawn(1, &path, &vector, working_dir, options);
+}
+
+sp_result* sp_execute_pipeline(const char* const* const* stages, int stage_count, const char* working_dir, const sp_options* options) {
+    sp_options defaults;
+    sp_result* result;
+    char* path_buffers;
+    const char** paths;
+    int i;
+
+    options = options_or_default(options, &defaults);
+    if (!valid_output(options)) {
+        return error_result("No output file");
+    }
+    if (!valid_stages(stages, stage_count)) {
+        return error_result("Empty pipeline stage");
+    }
+    path_buffers = (char*)malloc((size_t)stage_count * PATH_MAX);
+    paths = (const char**)malloc(stage_count * sizeof(char*));
+    if (!path_buffers || !paths) {
+        free(path_buffers);
+        free(paths);
+        return error_result("Memory allocation failed");
+    }
+    for (i = 0; i < stage_count; i++) {
+        paths[i] = argv_program_path(stages[i], path_buffers + (size_t)i * PATH_MAX, PATH_MAX);
+    }
+    result = execute_spawn(stage_count, paths, (char* const* const*)stages, working_dir, options);
+    free(paths);
+    free(path_buffers);
+    return result;
+}
+
+#endif
+
+sp_result* sp_execute_command(const char* command, const char* working_dir, int show_window) {
+    sp_options options;
+
+    sp_options_init(&options);
+    options.show_window = show_window;
+    return sp_execute_ex(command, NULL, working_dir, &options);
+}
+
+sp_result* sp_execute_argv(const char* const* argv, const char* working_dir, int show_window) {
+    sp_options options;
+
+    sp_options_init(&options);
+    options.show_window = show_window;
+    return sp_execute_ex(NULL, argv, working_dir, &options);
+}
+
+sp_result* sp_execute_with_args(const char* program, const char* args, const char* working_dir, int show_window) {
+    char* full_command;
+    sp_result* result;
+    size_t len;
+
+    if (args && args[0]) {
+        len = strlen(program) + strlen(args) + 2;
+        full_command = (char*)malloc(len);
+        if (!full_command) {
+            result = (sp_result*)malloc(sizeof(sp_result));
+            if (result) {
+                memset(result, 0, sizeof(sp_result));
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+                result->error_message = _strdup("Memory allocation failed");
+#else
+                result->error_message = strdup("Memory allocation failed");
+#endif
+            }
+            return result;
+        }
+        sprintf(full_command, "%s %s", program, args);
+    } else {
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+        full_command = _strdup(program);
+#else
+        full_command = strdup(program);
+#endif
+    }
+
+    result = sp_execute_command(full_command, working_dir, show_window);
+    free(full_command);
+    return result;
+}
+
+void sp_unmap_output(const char* map, long long size) {
+    if (!map) return;
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+    (void)size;
+    UnmapViewOfFile(map);
+#else
+    munmap((void*)map, (size_t)size);
+#endif
+}
+
+void sp_free_result(sp_result* result) {
+    if (result) {
+        sp_unmap_output(result->output_map, result->output_size);
+        if (result->output) free(result->output);
+        if (result->error_output) free(result->error_output);
+        if (result->stage_exit_codes) free(result->stage_exit_codes);
+        if (result->error_message) free(result->error_message);
+        free(result);
+    }
+}
+
+/* ============ COMMAND LOOKUP ============ */
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+
+int sp_resolve_command(const char* name, char* out, int out_size) {
+    DWORD length;
+
+    if (!name || !name[0] || !out || out_size <= 0) return 0;
+    length = SearchPathA(NULL, name, ".exe", (DWORD)out_size, out, NULL);
+    return (length > 0 && length < (DWORD)out_size) ? (int)length : 0;
+}
+
+#else
+
+/*
+ * Lookups are cached per name, found or not, for the PATH value they were
+ * made with. Before each lookup every PATH directory is stat'ed: a changed
+ * PATH or a changed directory mtime (an entry added, removed or renamed)
+ * drops the whole cache. PATHs with relative entries are not cached, since
+ * their results depend on the current directory.
+ */
+
+#define PATH_CACHE_BUCKETS 256
+#define PATH_CACHE_LIMIT 1024     /* Entries kept before the cache starts over */
+#define PATH_CACHE_MAX_DIRS 64    /* PATH directories watched for changes */
+
+typedef struct path_cache_entry {
+    struct path_cache_entry* next;
+    char* path;                   /* Resolved path, or NULL when not found */
+    char name[1];                 /* Command name (allocated with the entry) */
+} path_cache_entry;
+
+static struct {
+    pthread_mutex_t lock;
+    char* path_env;               /* PATH the entries were resolved with */
+    struct timespec dir_mtimes[PATH_CACHE_MAX_DIRS];
+    int dir_count;
+    int entry_count;
+    path_cache_entry* buckets[PATH_CACHE_BUCKETS];
+} path_cache = {PTHREAD_MUTEX_INITIALIZER, NULL, {{0, 0}}, 0, 0, {NULL}};
+
+static unsigned int path_cache_hash(const char* name) {
+    unsigned int hash = 2166136261u;  /* FNV-1a */
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash % PATH_CACHE_BUCKETS;
+}
+
+static void path_cache_clear(void) {
+    path_cache_entry* entry;
+    int i;
+
+    for (i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        while ((entry = path_cache.buckets[i]) != NULL) {
+            path_cache.buckets[i] = entry->next;
+            free(entry->path);
+            free(entry);
+        }
+    }
+    free(path_cache.path_env);
+    path_cache.path_env = NULL;
+    path_cache.dir_count = 0;
+    path_cache.entry_count = 0;
+}
+
+/* Modification times of the directories of `path_env' into `mtimes'
+ * (PATH_CACHE_MAX_DIRS entries).
+ * Returns: number of directories, or -1 if `path_env' has a relative entry
+ *          or more directories (or a longer one) than can be watched, so
+ *          lookups in it are not cached
+ */
+static int path_dir_mtimes(const char* path_env, struct timespec* mtimes) {
+    char dir[PATH_MAX];
+    const char* start;
+    const char* end;
+    struct stat st;
+    size_t length;
+    int count = 0;
+
+    for (start = path_env; ; start = end + 1) {
+        end = strchr(start, ':');
+        if (!end) end = start + strlen(start);
+        length = (size_t)(end - start);
+        if (length == 0 || start[0] != '/') return -1;
+        if (count == PATH_CACHE_MAX_DIRS || length >= sizeof(dir)) return -1;
+        memcpy(dir, start, length);
+        dir[length] = '\0';
+        if (stat(dir, &st) == 0) {
+#if defined(__APPLE__)
+            mtimes[count] = st.st_mtimespec;
+#else
+            mtimes[count] = st.st_mtim;
+#endif
+        } else {
+            mtimes[count].tv_sec = -1;  /* Missing; watch for it to appear */
+            mtimes[count].tv_nsec = 0;
+        }
+        count++;
+        if (*end == '\0') break;
+    }
+    return count;
+}
+
+/* Drop cached entries unless they still hold for `path_env'.
+ * Returns: 1 if `path_env' can be cached, 0 otherwise
+ */
+static int path_cache_validate(const char* path_env) {
+    struct timespec mtimes[PATH_CACHE_MAX_DIRS];
+    int count = path_dir_mtimes(path_env, mtimes);
+
+    if (count < 0) {
+        if (path_cache.path_env) path_cache_clear();
+        return 0;
+    }
+    if (!path_cache.path_env || strcmp(path_cache.path_env, path_env) != 0 ||
+        count != path_cache.dir_count ||
+        memcmp(mtimes, path_cache.dir_mtimes, count * sizeof(struct timespec)) != 0 ||
+        path_cache.entry_count >= PATH_CACHE_LIMIT) {
+        path_cache_clear();
+        path_cache.path_env = strdup(path_env);
+        if (!path_cache.path_env) return 0;
+        memcpy(path_cache.dir_mtimes, mtimes, count * sizeof(struct timespec));
+        path_cache.dir_count = count;
+    }
+    return 1;
+}
+
+int sp_resolve_command(const char* name, char* out, int out_size) {
+    char resolved[PATH_MAX];
+    const char* path_env;
+    const char* found = NULL;
+    path_cache_entry* entry;
+    unsigned int bucket;
+    size_t name_length;
+    int cacheable, hit = 0, length;
+
+    if (!name || !name[0] || !out || out_size <= 0) return 0;
+    if (strchr(name, '/')) {
+        if (!resolve_in_path(name, resolved, sizeof(resolved))) return 0;
+        found = resolved;
+    } else {
+        path_env = getenv("PATH");
+        if (!path_env) path_env = "/usr/local/bin:/usr/bin:/bin";
+        name_length = strlen(name);
+        bucket = path_cache_hash(name);
+
+        pthread_mutex_lock(&path_cache.lock);
+        cacheable = path_cache_validate(path_env);
+        for (entry = cacheable ? path_cache.buckets[bucket] : NULL; entry; entry = entry->next) {
+            if (strcmp(entry->name, name) == 0) {
+                hit = 1;
+                if (entry->path) {
+                    strncpy(resolved, entry->path, sizeof(resolved) - 1);
+                    resolved[sizeof(resolved) - 1] = '\0';
+                    found = resolved;
+                }
+                break;
+            }
+        }
+        if (!hit) {
+            if (resolve_in_path(name, resolved, sizeof(resolved))) found = resolved;
+            entry = cacheable ? (path_cache_entry*)malloc(sizeof(path_cache_entry) + name_length) : NULL;
+            if (entry) {
+                memcpy(entry->name, name, name_length + 1);
+                entry->path = found ? strdup(found) : NULL;
+                if (found && !entry->path) {
+                    free(entry);  /* Not cached; looked up again next time */
+                } else {
+                    entry->next = path_cache.buckets[bucket];
+                    path_cache.buckets[bucket] = entry;
+                    path_cache.entry_count++;
+                }
+            }
+        }
+        pthread_mutex_unlock(&path_cache.lock);
+        if (!found) return 0;
+    }
+
+    length = (int)strlen(found);
+    if (length >= out_size) return 0;
+    memcpy(out, found, length + 1);
+    return length;
+}
+
+#endif
+
+int sp_file_in_path(const char* filename) {
+    char path[4096];
+    return sp_resolve_command(filename, path, sizeof(path)) > 0;
+}
+
+/* ============ OUTPUT RINGS ============ */
+
+/*
+ * Each async stream owns a fixed ring, allocated on first use and kept
+ * until sp_async_close. Data only lands there when the pipe is drained
+ * without a destination (sp_pump_output, legacy sp_read_output); readers
+ * with their own buffer take from the ring first and then read the pipe
+ * straight into their buffer, so steady-state polling never allocates.
+ */
+
+#define SP_RING_SIZE 65536
+
+/* Move up to `capacity' buffered bytes into `out'. Returns: bytes moved. */
+static int ring_take(sp_ring* ring, char* out, int capacity) {
+    int n = (ring->count < capacity) ? ring->count : capacity;
+    int first = SP_RING_SIZE - ring->start;
+
+    if (n <= 0) return 0;
+    if (first > n) first = n;
+    memcpy(out, ring->data + ring->start, first);
+    memcpy(out + first, ring->data, n - first);
+    ring->start = (ring->start + n) % SP_RING_SIZE;
+    ring->count -= n;
+    return n;
+}
+
+/* Contiguous free space after the buffered data, or NULL when full. */
+static char* ring_free_span(sp_ring* ring, int* size) {
+    int tail;
+
+    if (!ring->data) {
+        ring->data = (char*)malloc(SP_RING_SIZE);
+        if (!ring->data) return NULL;
+        ring->start = 0;
+        ring->count = 0;
+    }
+    if (ring->count == SP_RING_SIZE) return NULL;
+    tail = (ring->start + ring->count) % SP_RING_SIZE;
+    *size = (tail >= ring->start) ? SP_RING_SIZE - tail : ring->start - tail;
+    return ring->data + tail;
+}
+
+static void ring_release(sp_ring* ring) {
+    free(ring->data);
+    ring->data = NULL;
+    ring->count = 0;
+}
+
+/* Give started `proc' the stdin `feed' (already on its pipe), queueing
+ * input_data and writing what fits now.
+ */
+static void attach_feed(sp_async_process* proc, sp_input_feed* feed, const sp_options* options) {
+    feed->close_when_done = !options->keep_stdin_open;
+    if (options->input_data && options->input_length > 0) {
+        feed_queue(feed, options->input_data, options->input_length);
+    }
+    proc->input = feed;
+    feed_input(feed);
+}
+
+/* Close the stdin pipe of `feed' and free it. */
+static void release_feed(sp_input_feed* feed) {
+    if (feed) {
+        feed_close(feed);
+        free(feed->queue);
+        free(feed);
+    }
+}
+
+/* ============ ASYNC PROCESS FUNCTIONS ============ */
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+/* ============ WINDOWS ASYNC FUNCTIONS ============ */
+
+/* Start `command_line' with CreateProcess without waiting for it. */
+static sp_async_process* start_command_line(const char* command_line, const char* working_dir, const sp_options* options) {
+    sp_async_process* proc;
+    SECURITY_ATTRIBUTES sa;
+    HANDLE hStdOutWrite = NULL;
+    HANDLE hStdErrWrite = NULL;
+    HANDLE hStdInRead = NULL;
+    HANDLE hStdInWrite = NULL;
+    HANDLE hSource;
+    sp_input_feed* feed = NULL;
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    char* cmd_copy = NULL;
+    BOOL success;
+
+    /* Allocate process structure */
+    proc = (sp_async_process*)malloc(sizeof(sp_async_process));
+    if (!proc) return NULL;
+    memset(proc, 0, sizeof(sp_async_process));
+
+    /* Set up security attributes for inheritable handles */
+    sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+    sa.bInheritHandle = TRUE;
+    sa.lpSecurityDescriptor = NULL;
+
+    /* Create pipe for stdout */
+    if (!CreatePipe(&proc->hStdOutRead, &hStdOutWrite, &sa, 0)) {
+        store_last_error();
+        proc->error_message = _strdup(last_error_msg);
+        proc->started = 0;
+        return proc;
+    }
+
+    /* Ensure read handle is not inherited */
+    SetHandleInformation(proc->hStdOutRead, HANDLE_FLAG_INHERIT, 0);
+
+    /* Create pipe for stderr when it is kept apart */
+    if (options->separate_stderr) {
+        if (!CreatePipe(&proc->hStdErrRead, &hStdErrWrite, &sa, 0)) {
+            store_last_error();
+            proc->error_message = _strdup(last_error_msg);
+            proc->started = 0;
+            CloseHandle(proc->hStdOutRead);
+            CloseHandle(hStdOutWrite);
+            proc->hStdOutRead = NULL;
+            return proc;
+        }
+        SetHandleInformation(proc->hStdErrRead, HANDLE_FLAG_INHERIT, 0);
+    }
+
+    /* Stdin: the given file itself, or a pipe for input */
+    success = TRUE;
+    if (options->input_fd >= 0) {
+        hSource = (HANDLE)_get_osfhandle(options->input_fd);
+        success = hSource != INVALID_HANDLE_VALUE &&
+                  DuplicateHandle(GetCurrentProcess(), hSource,
+                                  GetCurrentProcess(), &hStdInRead,
+                                  0, TRUE, DUPLICATE_SAME_ACCESS);
+    } else if (options->input_data || options->keep_stdin_open) {
+        feed = (sp_input_feed*)malloc(sizeof(sp_input_feed));
+        success = feed && create_input_pipe(&sa, &hStdInRead, &hStdInWrite);
+    }
+    if (!success) {
+        store_last_error();
+        proc->error_message = _strdup(feed ? last_error_msg : "Memory allocation failed");
+        proc->started = 0;
+        CloseHandle(proc->hStdOutRead);
+        CloseHandle(hStdOutWrite);
+        if (proc->hStdErrRead) CloseHandle(proc->hStdErrRead);
+        if (hStdErrWrite) CloseHandle(hStdErrWrite);
+        proc->hStdOutRead = NULL;
+        proc->hStdErrRead = NULL;
+        free(feed);
+        return proc;
+    }
+
+    /* Set up startup info */
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    si.hStdOutput = hStdOutWrite;
+    si.hStdError = hStdErrWrite ? hStdErrWrite : hStdOutWrite;  /* Redirect stderr to stdout unless separate */
+    si.hStdInput = hStdInRead ? hStdInRead : GetStdHandle(STD_INPUT_HANDLE);
+    si.dwFlags |= STARTF_USESTDHANDLES;
+
+    if (!options->show_window) {
+        si.dwFlags |= STARTF_USESHOWWINDOW;
+        si.wShowWindow = SW_HIDE;
+    }
+
+    /* CreateProcess needs a modifiable string */
+    cmd_copy = _strdup(command_line);
+    if (!cmd_copy) {
+        proc->error_message = _strdup("Memory allocation failed");
+        proc->started = 0;
+        CloseHandle(proc->hStdOutRead);
+        CloseHandle(hStdOutWrite);
+        if (proc->hStdErrRead) CloseHandle(proc->hStdErrRead);
+        if (hStdErrWrite) CloseHandle(hStdErrWrite);
+        if (hStdInRead) CloseHandle(hStdInRead);
+        if (hStdInWrite) CloseHandle(hStdInWrite);
+        proc->hStdOutRead = NULL;
+        proc->hStdErrRead = NULL;
+        free(feed);
+        return proc;
+    }
+
+    memset(&pi, 0, sizeof(pi));
+
+    /* Create the process in its own job */
+    proc->hJob = CreateJobObjectA(NULL, NULL);
+    proc->start_ns = monotonic_ns();
+    success = create_process(cmd_copy, working_dir, CREATE_NO_WINDOW, proc->hJob, options, &si, &pi);
+
+    free(cmd_copy);
+    CloseHandle(hStdOutWrite);  /* Close child ends - child has them */
+    if (hStdErrWrite) CloseHandle(hStdErrWrite);
+    if (hStdInRead) CloseHandle(hStdInRead);
+
+    if (!success) {
+        store_last_error();
+        proc->error_message = _strdup(last_error_msg);
+        proc->started = 0;
+        CloseHandle(proc->hStdOutRead);
+        if (proc->hStdErrRead) CloseHandle(proc->hStdErrRead);
+        if (hStdInWrite) CloseHandle(hStdInWrite);
+        if (proc->hJob) CloseHandle(proc->hJob);
+        proc->hJob = NULL;
+        proc->hStdOutRead = NULL;
+        proc->hStdErrRead = NULL;
+        free(feed);
+        return proc;
+    }
+
+    /* Store process info */
+    proc->hProcess = pi.hProcess;
+    proc->hThread = pi.hThread;
+    proc->processId = pi.dwProcessId;
+    proc->started = 1;
+    if (feed) {
+        feed_init(feed, hStdInWrite, -1);
+        attach_feed(proc, feed, options);
+    }
+
+    return proc;
+}
+
+/* Process record that failed to start with `message'. */
+static sp_async_process* failed_process(const char* message) {
+    sp_async_process* proc;
+
+    proc = (sp_async_process*)malloc(sizeof(sp_async_process));
+    if (!proc) return NULL;
+    memset(proc, 0, sizeof(sp_async_process));
+    proc->error_message = _strdup(message);
+    return proc;
+}
+
+sp_async_process* sp_start_async_ex(const char* command, const char* const* argv, const char* working_dir, const sp_options* options) {
+    sp_options defaults;
+    sp_async_process* proc;
+    char* command_line;
+
+    options = options_or_default(options, &defaults);
+    if (command) {
+        return start_command_line(command, working_dir, options);
+    }
+    if (!valid_argv(argv)) {
+        return failed_process("Empty argument vector");
+    }
+    command_line = build_command_line(argv);
+    if (!command_line) {
+        return failed_process("Memory allocation failed");
+    }
+    proc = start_command_line(command_line, working_dir, options);
+    free(command_line);
+    return proc;
+}
+
+/* Wait up to `timeout_ms' for `proc' to end. The first time it has, keep
+ * its exit code and usage so later queries need no system call.
+ * Returns: 1 if finished, 0 if still running, -1 on error
+ */
+static int check_exit(sp_async_process* proc, DWORD timeout_ms) {
+    FILETIME created, exited, kernel, user;
+    DWORD result, exit_code;
+
+    if (proc->state != SP_STATE_RUNNING) return 1;
+    result = WaitForSingleObject(proc->hProcess, timeout_ms);
+    if (result == WAIT_TIMEOUT) return 0;
+    if (result != WAIT_OBJECT_0 || !GetExitCodeProcess(proc->hProcess, &exit_code)) return -1;
+    add_process_usage(proc->hProcess, &proc->usage);
+    if (GetProcessTimes(proc->hProcess, &created, &exited, &kernel, &user)) {
+        proc->usage.wall_time_ns = (filetime_ticks(&exited) - filetime_ticks(&created)) * 100;
+    } else {
+        proc->usage.wall_time_ns = monotonic_ns() - proc->start_ns;
+    }
+    proc->exit_code = (int)exit_code;
+    proc->state = SP_STATE_EXITED;
+    metrics_ended();
+    metrics_record(&metrics.runtime_ns, proc->usage.wall_time_ns);
+    if (tracing) trace_reaped(proc->processId, proc->exit_code, 0);
+    return 1;
+}
+
+int sp_is_running(sp_async_process* proc) {
+    if (!proc || !proc->started || proc->hProcess == NULL) {
+        return 0;
+    }
+    return check_exit(proc, 0) == 0;
+}
+
+DWORD sp_get_pid(sp_async_process* proc) {
+    if (!proc || !proc->started) return 0;
+    return proc->processId;
+}
+
+int sp_wait_timeout(sp_async_process* proc, unsigned int timeout_ms) {
+    if (!proc || !proc->started || proc->hProcess == NULL) {
+        return -1;
+    }
+    return check_exit(proc, (DWORD)timeout_ms);
+}
+
+int sp_kill(sp_async_process* proc) {
+    if (!proc || !proc->started || proc->hProcess == NULL) {
+        return 0;
+    }
+    if (proc->hJob && TerminateJobObject(proc->hJob, 1)) {
+        return 1;
+    }
+    if (TerminateProcess(proc->hProcess, 1)) {
+        return 1;
+    }
+    return 0;
+}
+
+int sp_terminate(sp_async_process* proc, unsigned int grace_ms) {
+    (void)grace_ms;  /* No SIGTERM equivalent for console processes */
+    if (!proc || !proc->started || proc->hProcess == NULL) {
+        return 0;
+    }
+    sp_kill(proc);  /* Even once it has exited: the job may hold what it started */
+    return check_exit(proc, KILL_REAP_MS) == 1;
+}
+
+int sp_get_exit_code(sp_async_process* proc) {
+    if (!proc || !proc->started || proc->hProcess == NULL) {
+        return -1;
+    }
+    if (check_exit(proc, 0) == 1) return proc->exit_code;
+    return -1;  /* Still running, or error */
+}
+
+int sp_get_state(sp_async_process* proc) {
+    if (!proc || !proc->started || proc->hProcess == NULL) return -1;
+    if (check_exit(proc, 0) < 0) return -1;
+    return proc->state;
+}
+
+int sp_get_termination_signal(sp_async_process* proc) {
+    (void)proc;  /* No signals on Windows */
+    return 0;
+}
+
+int sp_core_dumped(sp_async_process* proc) {
+    (void)proc;
+    return 0;
+}
+
+int sp_get_usage(sp_async_process* proc, sp_usage* usage) {
+    if (!proc || !proc->started || proc->hProcess == NULL || !usage) return 0;
+    if (check_exit(proc, 0) != 1) return 0;
+    *usage = proc->usage;
+    return 1;
+}
+
+long long sp_elapsed_ns(sp_async_process* proc) {
+    if (!proc || !proc->started || proc->hProcess == NULL) return 0;
+    if (check_exit(proc, 0) == 1) return proc->usage.wall_time_ns;
+    return monotonic_ns() - proc->start_ns;
+}
+
+/* Pipe handle of `stream'. */
+static HANDLE* stream_pipe(sp_async_process* proc, int stream) {
+    return (stream == SP_STREAM_ERROR) ? &proc->hStdErrRead : &proc->hStdOutRead;
+}
+
+/* Read what the pipe of `stream' holds, up to `capacity', without blocking.
+ * Closes the pipe at end of stream.
+ * Returns: bytes read, 0 if none available, -1 at end of stream
+ */
+static int stream_read(sp_async_process* proc, int stream, char* out, int capacity) {
+    HANDLE* pipe = stream_pipe(proc, stream);
+    DWORD available, bytes_read;
+
+    if (*pipe == NULL) return -1;
+    if (!PeekNamedPipe(*pipe, NULL, 0, NULL, &available, NULL)) {
+        /* Broken pipe: writer closed and all data read */
+        CloseHandle(*pipe);
+        *pipe = NULL;
+        return -1;
+    }
+    if (available == 0) return 0;
+    if ((DWORD)capacity > available) capacity = (int)available;
+    if (!ReadFile(*pipe, out, (DWORD)capacity, &bytes_read, NULL)) return 0;
+    return (int)bytes_read;
+}
+
+static int stream_is_open(sp_async_process* proc, int stream) {
+    return *stream_pipe(proc, stream) != NULL;
+}
+
+/* SP_READY_* flag if the pipe of `stream' has data or has ended, else 0. */
+static int stream_ready(sp_async_process* proc, int stream, int flag) {
+    HANDLE pipe = *stream_pipe(proc, stream);
+    DWORD available;
+    if (pipe == NULL) return 0;
+    if (!PeekNamedPipe(pipe, NULL, 0, NULL, &available, NULL) || available > 0) {
+        return flag;
+    }
+    return 0;
+}
+
+static int buffered_flags(sp_async_process* proc);
+
+int sp_wait_output(sp_async_process* proc, int timeout_ms) {
+    ULONGLONG deadline;
+    int flags;
+
+    if (!proc || !proc->started || !sp_has_open_output(proc)) return -1;
+    deadline = GetTickCount64() + (timeout_ms > 0 ? timeout_ms : 0);
+    while (1) {
+        /* Anonymous pipes cannot be waited on: peek, nap when idle */
+        if (proc->input) feed_input(proc->input);
+        flags = buffered_flags(proc) |
+                stream_ready(proc, SP_STREAM_OUTPUT, SP_READY_OUTPUT) |
+                stream_ready(proc, SP_STREAM_ERROR, SP_READY_ERROR_OUTPUT);
+        if (flags) return flags;
+        if (timeout_ms >= 0 && GetTickCount64() >= deadline) return 0;
+        Sleep(1);
+    }
+}
+
+void sp_async_close(sp_async_process* proc) {
+    if (proc) {
+        if (proc->set) sp_process_set_remove(proc->set, proc);
+        if (proc->started) {
+            if (proc->state == SP_STATE_RUNNING) metrics_ended();
+            metrics_record(&metrics.output_bytes, proc->bytes_read);
+        }
+        if (proc->hProcess) CloseHandle(proc->hProcess);
+        if (proc->hThread) CloseHandle(proc->hThread);
+        if (proc->hJob) CloseHandle(proc->hJob);
+        if (proc->hStdOutRead) CloseHandle(proc->hStdOutRead);
+        if (proc->hStdErrRead) CloseHandle(proc->hStdErrRead);
+        release_feed(proc->input);
+        ring_release(&proc->output_ring);
+        ring_release(&proc->error_ring);
+        if (proc->error_message) free(proc->error_message);
+        free(proc);
+    }
+}
+
+#else
+/* ============ POSIX ASYNC FUNCTIONS ============ */
+
+/* ============ POSIX EXIT NOTIFICATION ============ */
+
+/*
+ * Waiting blocks in poll() until the child exits instead of sleeping in
+ * fixed steps. On Linux 5.3+ each process has a pidfd that becomes readable
+ * when it exits. Elsewhere a SIGCHLD handler writes to a self-pipe that
+ * waiters poll on; the previous SIGCHLD handler is still called.
+ */
+
+/* Milliseconds from the monotonic clock. */
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Open a pidfd for `pid', or -1 if the kernel has none. */
+static int open_pidfd(pid_t pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+/* Poll `fd' for readability for up to `timeout_ms', retrying on EINTR.
+ * Returns: 1 if readable, 0 on timeout, -1 on error.
+ */
+static int poll_readable(int fd, long long timeout_ms) {
+    struct pollfd pfd;
+    long long deadline = monotonic_ms() + timeout_ms;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (1) {
+        rc = poll(&pfd, 1, (int)(timeout_ms > INT_MAX ? INT_MAX : timeout_ms));
+        if (rc > 0) return 1;
+        if (rc == 0) {
+            timeout_ms = deadline - monotonic_ms();
+            if (timeout_ms <= 0) return 0;
+        } else if (errno == EINTR) {
+            timeout_ms = deadline - monotonic_ms();
+            if (timeout_ms < 0) timeout_ms = 0;
+        } else {
+            return -1;
+        }
+    }
+}
+
+/* Slice used when several threads share the SIGCHLD pipe: one waiter may
+ * drain a wakeup meant for another, so none sleeps longer than this. */
+#define SIGCHLD_SHARED_SLICE_MS 50
+
+static int sigchld_pipe[2] = {-1, -1};
+static struct sigaction previous_sigchld;
+static pthread_once_t sigchld_once = PTHREAD_ONCE_INIT;
+static volatile int sigchld_waiters = 0;
+
+static void sigchld_handler(int sig, siginfo_t* info, void* context) {
+    int saved_errno = errno;
+    ssize_t ignored;
+
+    ignored = write(sigchld_pipe[1], "x", 1);
+    (void)ignored;
+
+    /* Chain to whoever was interested in SIGCHLD before us */
+    if (previous_sigchld.sa_flags & SA_SIGINFO) {
+        if (previous_sigchld.sa_sigaction) {
+            previous_sigchld.sa_sigaction(sig, info, context);
+        }
+    } else if (previous_sigchld.sa_handler != SIG_DFL &&
+               previous_sigchld.sa_handler != SIG_IGN) {
+        previous_sigchld.sa_handler(sig);
+    }
+    errno = saved_errno;
+}
+
+static void install_sigchld_pipe(void) {
+    struct sigaction sa;
+    int fds[2];
+
+    if (make_pipe(fds) < 0) return;
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    sigchld_pipe[0] = fds[0];
+    sigchld_pipe[1] = fds[1];
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sigchld_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGCHLD, &sa, &previous_sigchld) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        sigchld_pipe[0] = sigchld_pipe[1] = -1;
+    }
+}
+
+/* Does the process group `proc' leads still have members? Forgets the
+ * group once it is seen empty, so it is never signaled after that.
+ */
+static int group_running(sp_async_process* proc) {
+    if (!proc->own_group) return 0;
+    if (kill(-proc->pid, 0) == 0) return 1;
+    if (errno == ESRCH) proc->own_group = 0;
+    return 0;
+}
+
+/* Reap `proc' once and keep its wait status and usage, so later exit
+ * code queries still see them. `flags' is 0 or WNOHANG.
+ * Returns: 1 if reaped (now or before), 0 if still running, -1 on error
+ */
+static int reap_process(sp_async_process* proc, int flags) {
+    struct rusage ru;
+    int status;
+    pid_t result;
+
+    if (proc->state != SP_STATE_RUNNING) return 1;
+    result = reap_child(proc->pid, proc->served ? proc->pidfd : -1, flags, &status, &ru);
+    if (result == proc->pid) {
+        if (WIFSIGNALED(status)) {
+            proc->exit_code = -1;
+            proc->term_signal = WTERMSIG(status);
+#ifdef WCOREDUMP
+            proc->core_dumped = WCOREDUMP(status) != 0;
+#endif
+            proc->state = SP_STATE_SIGNALED;
+        } else {
+            proc->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            proc->state = SP_STATE_EXITED;
+        }
+        add_rusage(&proc->usage, &ru);
+        proc->usage.wall_time_ns = monotonic_ns() - proc->start_ns;
+        metrics_record(&metrics.runtime_ns, proc->usage.wall_time_ns);
+        group_running(proc);  /* Forget an empty group before its pid can be reused */
+        return 1;
+    }
+    return (result == 0) ? 0 : -1;
+}
+
+/* Wait for `pid' to exit using the SIGCHLD self-pipe.
+ * Returns: 1 if process finished, 0 if timeout, -1 on error.
+ */
+static int wait_sigchld(sp_async_process* proc, unsigned int timeout_ms) {
+    long long deadline = monotonic_ms() + timeout_ms;
+    long long slice;
+    char drain[64];
+    int outcome;
+
+    pthread_once(&sigchld_once, install_sigchld_pipe);
+    if (sigchld_pipe[0] < 0) return -1;
+
+    __sync_fetch_and_add(&sigchld_waiters, 1);
+    while (1) {
+        /* Check after the handler is installed so no exit is missed */
+        outcome = reap_process(proc, WNOHANG);
+        if (outcome != 0) break;
+
+        slice = deadline - monotonic_ms();
+        if (slice <= 0) { outcome = 0; break; }
+        if (sigchld_waiters > 1 && slice > SIGCHLD_SHARED_SLICE_MS) {
+            slice = SIGCHLD_SHARED_SLICE_MS;
+        }
+        if (poll_readable(sigchld_pipe[0], slice) < 0) { outcome = -1; break; }
+        while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+            /* Drain wakeups */
+        }
+    }
+    __sync_fetch_and_sub(&sigchld_waiters, 1);
+    return outcome;
+}
+
+/* Process record with no child and no descriptors. */
+static sp_async_process* new_process(void) {
+    sp_async_process* proc;
+
+    proc = (sp_async_process*)malloc(sizeof(sp_async_process));
+    if (!proc) return NULL;
+    memset(proc, 0, sizeof(sp_async_process));
+    proc->stdout_fd = -1;
+    proc->stderr_fd = -1;
+    proc->pidfd = -1;
+    return proc;
+}
+
+/* Spawn `path' with `argv' without waiting for it. */
+static sp_async_process* start_async_spawn(const char* path, char* const* argv, const char* working_dir, const sp_options* options) {
+    sp_async_process* proc;
+    sp_spawn_spec spec;
+    int out_pipe[2];
+    int err_pipe[2] = {-1, -1};
+    int in_pipe[2] = {-1, -1};
+    sp_input_feed* feed = NULL;
+    sp_child_controls controls;
+    char cgroup_procs[PATH_MAX];
+    int controlled;
+    pid_t pid;
+
+    /* Allocate process structure */
+    proc = new_process();
+    if (!proc) return NULL;
+    controlled = prepare_controls(options, &controls, cgroup_procs, sizeof(cgroup_procs));
+    if (controlled < 0) {
+        proc->error_message = strdup(last_error_msg);
+        return proc;
+    }
+
+    /* Create pipes for stdout and, if separate, stderr */
+    if (make_pipe(out_pipe) < 0) {
+        store_last_error();
+        proc->error_message = strdup(last_error_msg);
+        proc->started = 0;
+        return proc;
+    }
+    if (options->separate_stderr && make_pipe(err_pipe) < 0) {
+        store_last_error();
+        proc->error_message = strdup(last_error_msg);
+        proc->started = 0;
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return proc;
+    }
+    /* Create pipe for stdin unless the child reads input_fd itself */
+    if (options->input_fd < 0 && (options->input_data || options->keep_stdin_open)) {
+        feed = (sp_input_feed*)malloc(sizeof(sp_input_feed));
+        if (!feed || make_input_pipe(in_pipe) < 0) {
+            store_last_error();
+            proc->error_message = strdup(feed ? last_error_msg : "Memory allocation failed");
+            proc->started = 0;
+            close(out_pipe[0]);
+            close(out_pipe[1]);
+            if (err_pipe[0] >= 0) close(err_pipe[0]);
+            if (err_pipe[1] >= 0) close(err_pipe[1]);
+            free(feed);
+            return proc;
+        }
+    }
+
+    /* Child redirects stdio to the pipes, then execs */
+    memset(&spec, 0, sizeof(spec));
+    spec.path = path;
+    spec.argv = argv;
+    spec.working_dir = working_dir;
+    spec.envp = options_environment(options);
+    spec.controls = controlled ? &controls : NULL;
+    spec.cgroup_procs = cgroup_procs;
+    spec.stdin_fd = (options->input_fd >= 0) ? options->input_fd : in_pipe[0];
+    spec.stdout_fd = out_pipe[1];
+    spec.stderr_fd = (err_pipe[1] >= 0) ? err_pipe[1] : out_pipe[1];
+    spec.new_group = wants_new_group(spec.stdin_fd);
+    proc->start_ns = monotonic_ns();
+    pid = spawn_process(&spec);
+
+    /* Parent process: close child ends */
+    close(out_pipe[1]);
+    if (err_pipe[1] >= 0) close(err_pipe[1]);
+    if (in_pipe[0] >= 0) close(in_pipe[0]);
+
+    if (pid < 0) {
+        store_last_error();
+        proc->error_message = strdup(last_error_msg);
+        proc->started = 0;
+        close(out_pipe[0]);
+        if (err_pipe[0] >= 0) close(err_pipe[0]);
+        if (in_pipe[1] >= 0) close(in_pipe[1]);
+        free(feed);
+        return proc;
+    }
+
+    /* Set read ends to non-blocking */
+    fcntl(out_pipe[0], F_SETFL, fcntl(out_pipe[0], F_GETFL) | O_NONBLOCK);
+    if (err_pipe[0] >= 0) {
+        fcntl(err_pipe[0], F_SETFL, fcntl(err_pipe[0], F_GETFL) | O_NONBLOCK);
+    }
+
+    proc->pid = pid;
+    proc->served = spec.status_fd >= 0;
+    proc->own_group = spec.new_group;
+    proc->pidfd = proc->served ? spec.status_fd : open_pidfd(pid);
+    proc->stdout_fd = out_pipe[0];
+    proc->stderr_fd = err_pipe[0];
+    proc->started = 1;
+    if (feed) {
+        feed_init(feed, in_pipe[1], -1);
+        attach_feed(proc, feed, options);
+    }
+
+    return proc;
+}
+
+sp_async_process* sp_start_async_ex(const char* command, const char* const* argv, const char* working_dir, const sp_options* options) {
+    sp_options defaults;
+    sp_async_process* proc;
+    char* shell[4];
+    char path_buffer[PATH_MAX];
+
+    options = options_or_default(options, &defaults);
+    if (command) {
+        shell_argv(command, shell);
+        return start_async_spawn("/bin/sh", shell, working_dir, options);
+    }
+    if (!valid_argv(argv)) {
+        proc = new_process();
+        if (proc) proc->error_message = strdup("Empty argument vector");
+        return proc;
+    }
+    return start_async_spawn(argv_program_path(argv, path_buffer, sizeof(path_buffer)),
+                             (char* const*)argv, working_dir, options);
+}
+
+int sp_is_running(sp_async_process* proc) {
+    if (!proc || !proc->started || proc->pid <= 0) {
+        return 0;
+    }
+    return reap_process(proc, WNOHANG) == 0;  /* 0: still running */
+}
+
+pid_t sp_get_pid(sp_async_process* proc) {
+    if (!proc || !proc->started) return 0;
+    return proc->pid;
+}
+
+int sp_wait_timeout(sp_async_process* proc, unsigned int timeout_ms) {
+    int outcome;
+    int ready;
+
+    if (!proc || !proc->started || proc->pid <= 0) {
+        return -1;
+    }
+
+    outcome = reap_process(proc, WNOHANG);
+    if (outcome != 0 || timeout_ms == 0) {
+        return outcome;  /* Finished, error, or timeout */
+    }
+
+    if (proc->pidfd < 0) {
+        return wait_sigchld(proc, timeout_ms);
+    }
+
+    /* pidfd becomes readable once the child has exited */
+    ready = poll_readable(proc->pidfd, timeout_ms);
+    if (ready <= 0) {
+        return ready;  /* Timeout or error */
+    }
+    return reap_process(proc, 0);
+}
+
+/* Send `sig' to `proc' and its process group. Once `proc' is reaped the
+ * group may still hold what it started; the group is signaled until it is
+ * seen empty (a pid is not reused while it names a live process group).
+ * Returns: 1 if sent or the process is already reaped, 0 otherwise
+ */
+static int signal_process(sp_async_process* proc, int sig) {
+    if (proc->state != SP_STATE_RUNNING) {
+        if (proc->own_group && kill(-proc->pid, sig) < 0 && errno == ESRCH) proc->own_group = 0;
+        return 1;
+    }
+    if (signal_child(proc->pid, proc->own_group, proc->served ? proc->pidfd : -1, sig)) return 1;
+    return proc->served && served_child_exited(proc->pidfd);
+}
+
+/* Wait until the process group of reaped `proc' is empty or `deadline_ms'
+ * passes. Members of the group cannot be waited on, so this polls, backing
+ * off from 1 ms to 10 ms.
+ * Returns: 1 if the group is empty, 0 otherwise
+ */
+static int wait_group_empty(sp_async_process* proc, long long deadline_ms) {
+    struct timespec pause;
+    long long remaining, pause_ms = 1;
+
+    while (group_running(proc)) {
+        remaining = deadline_ms - monotonic_ms();
+        if (remaining <= 0) return 0;
+        if (pause_ms > remaining) pause_ms = remaining;
+        pause.tv_sec = 0;
+        pause.tv_nsec = (long)pause_ms * 1000000;
+        nanosleep(&pause, NULL);
+        if (pause_ms < 10) pause_ms *= 2;
+    }
+    return 1;
+}
+
+int sp_kill(sp_async_process* proc) {
+    if (!proc || !proc->started || proc->pid <= 0) {
+        return 0;
+    }
+    return signal_process(proc, SIGKILL);
+}
+
+int sp_terminate(sp_async_process* proc, unsigned int grace_ms) {
+    long long deadline_ms;
+
+    if (!proc || !proc->started || proc->pid <= 0) {
+        return 0;
+    }
+    deadline_ms = monotonic_ms() + grace_ms;
+    if (reap_process(proc, WNOHANG) == 1 && !group_running(proc)) return 1;
+    signal_process(proc, SIGTERM);
+    if (sp_wait_timeout(proc, grace_ms) == 1 && wait_group_empty(proc, deadline_ms)) return 1;
+    signal_process(proc, SIGKILL);
+    return sp_wait_timeout(proc, KILL_REAP_MS) == 1;
+}
+
+int sp_get_exit_code(sp_async_process* proc) {
+    if (!proc || !proc->started || proc->pid <= 0) {
+        return -1;
+    }
+    if (reap_process(proc, WNOHANG) == 1) return proc->exit_code;
+    return -1;  /* Still running, or error */
+}
+
+int sp_get_state(sp_async_process* proc) {
+    if (!proc || !proc->started || proc->pid <= 0) return -1;
+    if (reap_process(proc, WNOHANG) < 0) return -1;
+    return proc->state;
+}
+
+int sp_get_termination_signal(sp_async_process* proc) {
+    if (sp_get_state(proc) != SP_STATE_SIGNALED) return 0;
+    return proc->term_signal;
+}
+
+int sp_core_dumped(sp_async_process* proc) {
+    if (sp_get_state(proc) != SP_STATE_SIGNALED) return 0;
+    return proc->core_dumped;
+}
+
+int sp_get_usage(sp_async_process* proc, sp_usage* usage) {
+    if (!proc || !proc->started || proc->pid <= 0 || !usage) return 0;
+    if (reap_process(proc, WNOHANG) != 1) return 0;
+    *usage = proc->usage;
+    return 1;
+}
+
+long long sp_elapsed_ns(sp_async_process* proc) {
+    if (!proc || !proc->started || proc->pid <= 0) return 0;
+    if (reap_process(proc, WNOHANG) == 1) return proc->usage.wall_time_ns;
+    return monotonic_ns() - proc->start_ns;
+}
+
+/* Pipe descriptor of `stream'. */
+static int* stream_fd(sp_async_process* proc, int stream) {
+    return (stream == SP_STREAM_ERROR) ? &proc->stderr_fd : &proc->stdout_fd;
+}
+
+/* Read what the pipe of `stream' holds, up to `capacity', without blocking.
+ * Closes the pipe at end of stream.
+ * Returns: bytes read, 0 if none available, -1 at end of stream
+ */
+static int stream_read(sp_async_process* proc, int stream, char* out, int capacity) {
+    int* fd = stream_fd(proc, stream);
+    ssize_t bytes_read;
+
+    if (*fd < 0) return -1;
+    do {
+        bytes_read = read(*fd, out, capacity);
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read > 0) return (int)bytes_read;
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    /* End of stream (or a broken pipe): writer closed */
+    close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+static int stream_is_open(sp_async_process* proc, int stream) {
+    return *stream_fd(proc, stream) >= 0;
+}
+
+static int buffered_flags(sp_async_process* proc);
+
+int sp_wait_output(sp_async_process* proc, int timeout_ms) {
+    struct pollfd fds[3];
+    long long deadline = monotonic_ms() + timeout_ms;
+    long long remaining = timeout_ms;
+    sp_input_feed* feed;
+    int nfds;
+    int flags;
+    int rc, i;
+
+    if (!proc || !proc->started || !sp_has_open_output(proc)) return -1;
+    feed = proc->input;
+    while (1) {
+        flags = buffered_flags(proc);
+        if (flags) return flags;  /* Already pumped into the rings */
+
+        nfds = 0;
+        if (proc->stdout_fd >= 0) {
+            fds[nfds].fd = proc->stdout_fd;
+            fds[nfds++].events = POLLIN;
+        }
+        if (proc->stderr_fd >= 0) {
+            fds[nfds].fd = proc->stderr_fd;
+            fds[nfds++].events = POLLIN;
+        }
+        /* Queued input goes out as stdin drains, so a filter waiting
+         * for more input before it writes cannot stall us */
+        if (feed && feed_is_open(feed) && feed_pending(feed) > 0) {
+            fds[nfds].fd = feed->pipe;
+            fds[nfds++].events = POLLOUT;
+        }
+
+        rc = poll(fds, nfds, timeout_ms < 0 ? -1 : (int)remaining);
+        if (rc < 0 && errno != EINTR) return -1;
+        if (rc == 0) return 0;
+        for (i = 0; i < nfds && rc > 0; i++) {
+            if (!fds[i].revents) continue;
+            if (fds[i].events == POLLOUT) {
+                feed_input(feed);
+            } else {
+                flags |= (fds[i].fd == proc->stdout_fd) ? SP_READY_OUTPUT : SP_READY_ERROR_OUTPUT;
+            }
+        }
+        if (flags) return flags;
+        if (timeout_ms >= 0) {
+            remaining = deadline - monotonic_ms();
+            if (remaining < 0) remaining = 0;
+        }
+    }
+}
+
+void sp_async_close(sp_async_process* proc) {
+    if (proc) {
+        if (proc->set) sp_process_set_remove(proc->set, proc);
+        if (proc->started) {
+            if (proc->state == SP_STATE_RUNNING) metrics_ended();
+            metrics_record(&metrics.output_bytes, proc->bytes_read);
+        }
+        if (proc->stdout_fd >= 0) close(proc->stdout_fd);
+        if (proc->stderr_fd >= 0) close(proc->stderr_fd);
+        if (proc->pidfd >= 0) close(proc->pidfd);
+        release_feed(proc->input);
+        ring_release(&proc->output_ring);
+        ring_release(&proc->error_ring);
+        if (proc->error_message) free(proc->error_message);
+        free(proc);
+    }
+}
+
+#endif
+
+/* Ring of `stream'. */
+static sp_ring* stream_ring(sp_async_process* proc, int stream) {
+    return (stream == SP_STREAM_ERROR) ? &proc->error_ring : &proc->output_ring;
+}
 
-    /* Close write ends of pipes (child has them now) */
-    CloseHandle(hStdOutWrite);
-    CloseHandle(hStdErrWrite);
+/* SP_READY_* flags of streams with data waiting in their rings. */
+static int buffered_flags(sp_async_process* proc) {
+    return (proc->output_ring.count > 0 ? SP_READY_OUTPUT : 0) |
+           (proc->error_ring.count > 0 ? SP_READY_ERROR_OUTPUT : 0);
+}
 
-    if (!success) {
-        store_last_error();
-        result->error_message = _strdup(last_error_msg);
-        result->success = 0;
-        CloseHandle(hStdOutRead);
-        return result;
+/* Account for `count' output bytes just read from a pipe of `proc'. */
+static void note_output(sp_async_process* proc, int stream, int count) {
+    if (proc->first_output_ns == 0) {
+        proc->first_output_ns = monotonic_ns();
+        metrics_record(&metrics.first_output_ns, proc->first_output_ns - proc->start_ns);
+        if (tracing) trace_output(sp_get_pid(proc), "first output", stream, proc->first_output_ns);
     }
+    proc->bytes_read += count;
+}
 
-    /* Allocate output buffer */
-    output_buffer = (char*)malloc(output_capacity);
-    if (!output_buffer) {
-        result->error_message = _strdup("Memory allocation failed");
-        result->success = 0;
-        CloseHandle(hStdOutRead);
-        CloseHandle(pi.hProcess);
-        CloseHandle(pi.hThread);
-        return result;
+/* Trace the end of `stream' if it has closed since it was seen `was_open'. */
+static void note_end(sp_async_process* proc, int stream, int was_open) {
+    if (tracing && was_open && !stream_is_open(proc, stream)) {
+        trace_output(sp_get_pid(proc), "eof", stream, monotonic_ns());
     }
+}
 
-    /* Read output from pipe */
-    while (1) {
-        success = ReadFile(hStdOutRead, read_buffer, BUFFER_SIZE - 1, &bytes_read, NULL);
-        if (!success || bytes_read == 0) break;
+static void set_note_buffered(sp_async_process* proc);
 
-        /* Expand buffer if needed */
-        if (output_size + bytes_read >= output_capacity) {
-            int new_capacity = output_capacity * 2;
-            char* new_buffer;
-            if (new_capacity > MAX_OUTPUT_SIZE) {
-                new_capacity = MAX_OUTPUT_SIZE;
-            }
-            if (output_size + bytes_read >= new_capacity) {
-                break; /* Max size reached */
-            }
-            new_buffer = (char*)realloc(output_buffer, new_capacity);
-            if (!new_buffer) break;
-            output_buffer = new_buffer;
-            output_capacity = new_capacity;
+/* Fill the ring of `stream' from its pipe without blocking.
+ * Returns: bytes buffered
+ */
+static int stream_pump(sp_async_process* proc, int stream) {
+    sp_ring* ring = stream_ring(proc, stream);
+    char* span;
+    int size, n;
+    int total = 0;
+    int was_open = stream_is_open(proc, stream);
+
+    if (proc->input) feed_input(proc->input);
+    while ((span = ring_free_span(ring, &size)) != NULL) {
+        n = stream_read(proc, stream, span, size);
+        if (n <= 0) {
+            if (n < 0) note_end(proc, stream, was_open);
+            break;
         }
+        note_output(proc, stream, n);
+        ring->count += n;
+        total += n;
+    }
+    if (total > 0) set_note_buffered(proc);
+    return total;
+}
 
-        memcpy(output_buffer + output_size, read_buffer, bytes_read);
-        output_size += bytes_read;
+/* Copy buffered data, then read the pipe directly, into `buffer'.
+ * Returns: bytes copied, or -1 if none and the stream has ended
+ */
+static int stream_read_into(sp_async_process* proc, int stream, char* buffer, int capacity) {
+    int total, n, was_open;
+
+    if (!proc || !proc->started || !buffer || capacity <= 0) return 0;
+    if (proc->input) feed_input(proc->input);
+    was_open = stream_is_open(proc, stream);
+    total = ring_take(stream_ring(proc, stream), buffer, capacity);
+    while (total < capacity) {
+        n = stream_read(proc, stream, buffer + total, capacity - total);
+        if (n <= 0) {
+            if (n < 0) note_end(proc, stream, was_open);
+            if (n < 0 && total == 0) return -1;
+            break;
+        }
+        note_output(proc, stream, n);
+        total += n;
     }
+    return total;
+}
 
-    /* Null-terminate output */
-    output_buffer[output_size] = '\0';
+/* Everything available on `stream' as a new null-terminated buffer. */
+static char* stream_read_all(sp_async_process* proc, int stream, int* out_length) {
+    sp_ring* ring = stream_ring(proc, stream);
+    char* buffer = NULL;
+    char* new_buffer;
+    int total = 0;
 
-    CloseHandle(hStdOutRead);
+    *out_length = 0;
+    if (!proc || !proc->started) return NULL;
 
-    /* Wait for process to complete */
-    WaitForSingleObject(pi.hProcess, INFINITE);
+    while (ring->count > 0 || stream_pump(proc, stream) > 0) {
+        new_buffer = (char*)realloc(buffer, total + ring->count + 1);
+        if (!new_buffer) break;
+        buffer = new_buffer;
+        total += ring_take(ring, buffer + total, ring->count);
+    }
+    if (total == 0) {
+        free(buffer);
+        return NULL;
+    }
+    buffer[total] = '\0';
+    *out_length = total;
+    return buffer;
+}
 
-    /* Get exit code */
-    GetExitCodeProcess(pi.hProcess, (DWORD*)&result->exit_code);
+char* sp_read_output(sp_async_process* proc, int* out_length) {
+    return stream_read_all(proc, SP_STREAM_OUTPUT, out_length);
+}
 
-    CloseHandle(pi.hProcess);
-    CloseHandle(pi.hThread);
+char* sp_read_error_output(sp_async_process* proc, int* out_length) {
+    return stream_read_all(proc, SP_STREAM_ERROR, out_length);
+}
 
-    result->success = 1;
-    result->output = output_buffer;
-    result->output_length = output_size;
+int sp_read_output_into(sp_async_process* proc, char* buffer, int capacity) {
+    return stream_read_into(proc, SP_STREAM_OUTPUT, buffer, capacity);
+}
 
-    return result;
+int sp_read_error_output_into(sp_async_process* proc, char* buffer, int capacity) {
+    return stream_read_into(proc, SP_STREAM_ERROR, buffer, capacity);
 }
 
-#else
-/* ============ POSIX sp_execute_command ============ */
+int sp_pump_output(sp_async_process* proc) {
+    if (!proc || !proc->started) return 0;
+    return stream_pump(proc, SP_STREAM_OUTPUT) + stream_pump(proc, SP_STREAM_ERROR);
+}
 
-sp_result* sp_execute_command(const char* command, const char* working_dir, int show_window) {
-    sp_result* result;
-    int pipefd[2];
-    pid_t pid;
-    char* output_buffer = NULL;
-    int output_size = 0;
-    int output_capacity = BUFFER_SIZE;
-    ssize_t bytes_read;
-    char read_buffer[BUFFER_SIZE];
-    int status;
+int sp_has_open_output(sp_async_process* proc) {
+    if (!proc || !proc->started) return 0;
+    return buffered_flags(proc) != 0 ||
+           stream_is_open(proc, SP_STREAM_OUTPUT) || stream_is_open(proc, SP_STREAM_ERROR);
+}
 
-    (void)show_window;  /* Unused on POSIX */
+/* Stdin feed of `proc' if its pipe is still open, else NULL. */
+static sp_input_feed* open_feed(sp_async_process* proc) {
+    if (!proc || !proc->started || !proc->input || !feed_is_open(proc->input)) return NULL;
+    return proc->input;
+}
 
-    /* Allocate result structure */
-    result = (sp_result*)malloc(sizeof(sp_result));
-    if (!result) return NULL;
-    memset(result, 0, sizeof(sp_result));
+int sp_write_input(sp_async_process* proc, const char* data, int length) {
+    sp_input_feed* feed = open_feed(proc);
+    int written;
+
+    if (!feed || feed->close_when_done) return -1;
+    if (!data || length <= 0) return 0;
+    feed_input(feed);
+    if (feed_pending(feed) > 0) return 0;  /* Queued input goes first */
+
+    /* Write straight from the caller's buffer, without queueing */
+    feed->data = data;
+    feed->remaining = length;
+    feed_input(feed);
+    written = length - feed->remaining;
+    feed->data = feed->queue;
+    feed->remaining = 0;
+    return (written == 0 && !feed_is_open(feed)) ? -1 : written;
+}
 
-    /* Create pipe for stdout */
-    if (pipe(pipefd) < 0) {
-        store_last_error();
-        result->error_message = strdup(last_error_msg);
-        result->success = 0;
-        return result;
-    }
+int sp_queue_input(sp_async_process* proc, const char* data, int length) {
+    sp_input_feed* feed = open_feed(proc);
 
-    pid = fork();
-    if (pid < 0) {
-        store_last_error();
-        result->error_message = strdup(last_error_msg);
-        result->success = 0;
-        close(pipefd[0]);
-        close(pipefd[1]);
-        return result;
-    }
+    if (!feed || feed->close_when_done) return -1;
+    if (data && length > 0 && !feed_queue(feed, data, length)) return -1;
+    feed_input(feed);
+    return feed_is_open(feed) ? feed_pending(feed) : -1;
+}
 
-    if (pid == 0) {
-        /* Child process */
-        close(pipefd[0]);  /* Close read end */
+int sp_flush_input(sp_async_process* proc) {
+    sp_input_feed* feed = open_feed(proc);
 
-        /* Redirect stdout and stderr to pipe */
-        dup2(pipefd[1], STDOUT_FILENO);
-        dup2(pipefd[1], STDERR_FILENO);
-        close(pipefd[1]);
+    if (!feed) return -1;
+    feed_input(feed);
+    return feed_is_open(feed) ? feed_pending(feed) : -1;
+}
 
-        /* Change working directory if specified */
-        if (working_dir && working_dir[0]) {
-            if (chdir(working_dir) < 0) {
-                _exit(127);
-            }
-        }
+int sp_close_input(sp_async_process* proc) {
+    sp_input_feed* feed = open_feed(proc);
 
-        /* Execute command via shell */
-        execl("/bin/sh", "sh", "-c", command, (char*)NULL);
-        _exit(127);  /* exec failed */
-    }
+    if (!feed) return -1;
+    feed->close_when_done = 1;
+    feed_input(feed);
+    return feed_is_open(feed) ? 0 : 1;
+}
 
-    /* Parent process */
-    close(pipefd[1]);  /* Close write end */
+int sp_has_open_input(sp_async_process* proc) {
+    return open_feed(proc) != NULL;
+}
 
-    /* Allocate output buffer */
-    output_buffer = (char*)malloc(output_capacity);
-    if (!output_buffer) {
-        result->error_message = strdup("Memory allocation failed");
-        result->success = 0;
-        close(pipefd[0]);
-        waitpid(pid, NULL, 0);
-        return result;
-    }
+sp_async_process* sp_start_async(const char* command, const char* working_dir, int show_window) {
+    sp_options options;
 
-    /* Read output from pipe */
-    while ((bytes_read = read(pipefd[0], read_buffer, BUFFER_SIZE - 1)) > 0) {
-        /* Expand buffer if needed */
-        if (output_size + bytes_read >= output_capacity) {
-            int new_capacity = output_capacity * 2;
-            char* new_buffer;
-            if (new_capacity > MAX_OUTPUT_SIZE) {
-                new_capacity = MAX_OUTPUT_SIZE;
-            }
-            if (output_size + (int)bytes_read >= new_capacity) {
-                break; /* Max size reached */
-            }
-            new_buffer = (char*)realloc(output_buffer, new_capacity);
-            if (!new_buffer) break;
-            output_buffer = new_buffer;
-            output_capacity = new_capacity;
-        }
+    sp_options_init(&options);
+    options.show_window = show_window;
+    return sp_start_async_ex(command, NULL, working_dir, &options);
+}
 
-        memcpy(output_buffer + output_size, read_buffer, bytes_read);
-        output_size += bytes_read;
-    }
+sp_async_process* sp_start_async_argv(const char* const* argv, const char* working_dir, int show_window) {
+    sp_options options;
 
-    /* Null-terminate output */
-    output_buffer[output_size] = '\0';
+    sp_options_init(&options);
+    options.show_window = show_window;
+    return sp_start_async_ex(NULL, argv, working_dir, &options);
+}
 
-    close(pipefd[0]);
+/* ============ PROCESS SETS ============ */
 
-    /* Wait for child to exit */
-    if (waitpid(pid, &status, 0) < 0) {
-        store_last_error();
-        result->error_message = strdup(last_error_msg);
-        result->success = 0;
-        free(output_buffer);
-        return result;
+/*
+ * A process set watches many async processes so a supervisor only touches
+ * the ones that are ready. On Linux the output pipes and pidfds of all
+ * members share one epoll instance, so a wait costs O(ready) instead of
+ * O(members). A wait also visits the members on two short lists: those
+ * whose exit has no pidfd to wait on, and those that pumped output into
+ * their rings. Each process knows its slot, and freed slots are reused, so
+ * add and remove are O(1). Other POSIX systems poll() the same fds and scan
+ * for exits, and Windows scans its members because anonymous pipes cannot
+ * be waited on.
+ */
+
+/* What a member is watched for; SET_WATCH_* and SP_READY_* are 1 << kind */
+#define SET_KIND_OUTPUT 0
+#define SET_KIND_EXIT   1
+#define SET_KIND_ERROR  2
+#define SET_KIND_COUNT  3
+
+#define SET_WATCH_OUTPUT 1
+#define SET_WATCH_EXIT   2
+#define SET_WATCH_ERROR  4
+#define SET_MAX_EVENTS   512
+#define SET_SCAN_SLICE_MS 10  /* Rescan interval when exits cannot be waited on */
+
+/* Lists of slots a set keeps besides its members, each visited by a wait */
+#define SET_LIST_EXIT_SCAN 0  /* Exit must be checked by a scan (no pidfd, or no epoll) */
+#define SET_LIST_BUFFERED  1  /* Output was pumped into the rings */
+#define SET_LIST_COUNT     2
+
+typedef struct {
+    sp_async_process* proc;  /* Member, or NULL for a free slot */
+    int watching;            /* SET_WATCH_* still being watched */
+    int ready_flags;         /* SP_READY_* from the current wait */
+    int next_free;           /* Next free slot when free, or -1 */
+    int position[SET_LIST_COUNT];  /* Index in each of the set's lists, or -1 */
+} sp_set_entry;
+
+struct sp_process_set {
+    sp_set_entry* entries;   /* Slots, indexed by registration */
+    int capacity;            /* Allocated slots */
+    int used;                /* Slots in use or freed (high-water mark) */
+    int count;               /* Members */
+    int free_slot;           /* First free slot below `used', or -1 */
+    int* ready;              /* Slots that became ready in the last wait */
+    int ready_count;
+    int* lists[SET_LIST_COUNT];       /* Slots on each SET_LIST_* list */
+    int list_count[SET_LIST_COUNT];
+#if !defined(_WIN32) && !defined(EIF_WINDOWS)
+    int epoll_fd;            /* -1 when poll() is used */
+#endif
+};
+
+/* Record `flags' for `slot' in the current wait. */
+static void set_mark_ready(sp_process_set* set, int slot, int flags) {
+    sp_set_entry* entry = &set->entries[slot];
+    if (entry->ready_flags == 0) {
+        set->ready[set->ready_count++] = slot;
     }
+    entry->ready_flags |= flags;
+}
 
-    if (WIFEXITED(status)) {
-        result->exit_code = WEXITSTATUS(status);
-    } else {
-        result->exit_code = -1;
+/* Forget the readiness reported by the previous wait. */
+static void set_clear_ready(sp_process_set* set) {
+    int i;
+    for (i = 0; i < set->ready_count; i++) {
+        set->entries[set->ready[i]].ready_flags = 0;
     }
+    set->ready_count = 0;
+}
 
-    result->success = 1;
-    result->output = output_buffer;
-    result->output_length = output_size;
+/* Put `slot' on list `list' unless it is there already. */
+static void set_list_add(sp_process_set* set, int list, int slot) {
+    sp_set_entry* entry = &set->entries[slot];
+    if (entry->position[list] >= 0) return;
+    entry->position[list] = set->list_count[list];
+    set->lists[list][set->list_count[list]++] = slot;
+}
 
-    return result;
+/* Take `slot' off list `list', moving the last slot into its place. */
+static void set_list_remove(sp_process_set* set, int list, int slot) {
+    sp_set_entry* entry = &set->entries[slot];
+    int position = entry->position[list];
+    int last;
+
+    if (position < 0) return;
+    last = set->lists[list][--set->list_count[list]];
+    set->lists[list][position] = last;
+    set->entries[last].position[list] = position;
+    entry->position[list] = -1;
 }
 
-#endif
+/* Member slot of `proc', or -1. */
+static int set_find(sp_process_set* set, sp_async_process* proc) {
+    return proc->set == set ? proc->set_slot : -1;
+}
 
-sp_result* sp_execute_with_args(const char* program, const char* args, const char* working_dir, int show_window) {
-    char* full_command;
-    sp_result* result;
-    size_t len;
+/* Take a free slot, growing the set if there is none. Returns: slot index or -1. */
+static int set_free_slot(sp_process_set* set) {
+    int slot, list;
 
-    if (args && args[0]) {
-        len = strlen(program) + strlen(args) + 2;
-        full_command = (char*)malloc(len);
-        if (!full_command) {
-            result = (sp_result*)malloc(sizeof(sp_result));
-            if (result) {
-                memset(result, 0, sizeof(sp_result));
-#if defined(_WIN32) || defined(EIF_WINDOWS)
-                result->error_message = _strdup("Memory allocation failed");
-#else
-                result->error_message = strdup("Memory allocation failed");
-#endif
+    if (set->free_slot >= 0) {
+        slot = set->free_slot;
+        set->free_slot = set->entries[slot].next_free;
+    } else {
+        if (set->used == set->capacity) {
+            int new_capacity = set->capacity ? set->capacity * 2 : 16;
+            sp_set_entry* entries = (sp_set_entry*)realloc(set->entries, new_capacity * sizeof(sp_set_entry));
+            int* grown;
+            if (!entries) return -1;
+            set->entries = entries;
+            grown = (int*)realloc(set->ready, new_capacity * sizeof(int));
+            if (!grown) return -1;
+            set->ready = grown;
+            for (list = 0; list < SET_LIST_COUNT; list++) {
+                grown = (int*)realloc(set->lists[list], new_capacity * sizeof(int));
+                if (!grown) return -1;
+                set->lists[list] = grown;
             }
-            return result;
+            set->capacity = new_capacity;
         }
-        sprintf(full_command, "%s %s", program, args);
-    } else {
-#if defined(_WIN32) || defined(EIF_WINDOWS)
-        full_command = _strdup(program);
-#else
-        full_command = strdup(program);
-#endif
+        slot = set->used++;
     }
+    memset(&set->entries[slot], 0, sizeof(sp_set_entry));
+    set->entries[slot].next_free = -1;
+    for (list = 0; list < SET_LIST_COUNT; list++) set->entries[slot].position[list] = -1;
+    return slot;
+}
 
-    result = sp_execute_command(full_command, working_dir, show_window);
-    free(full_command);
-    return result;
+/* Give `slot' back to the free list. */
+static void set_release_slot(sp_process_set* set, int slot) {
+    set->entries[slot].proc = NULL;
+    set->entries[slot].next_free = set->free_slot;
+    set->free_slot = slot;
 }
 
-void sp_free_result(sp_result* result) {
-    if (result) {
-        if (result->output) free(result->output);
-        if (result->error_message) free(result->error_message);
-        free(result);
+/* `proc' has pumped output into its rings: its set reports it on the next wait. */
+static void set_note_buffered(sp_async_process* proc) {
+    if (proc->set) set_list_add(proc->set, SET_LIST_BUFFERED, proc->set_slot);
+}
+
+/* Members with output already pumped into their rings are ready now.
+ * Only members that pumped since their rings were last empty are visited. */
+static void set_check_buffered(sp_process_set* set) {
+    int* slots = set->lists[SET_LIST_BUFFERED];
+    int i, flags;
+
+    for (i = set->list_count[SET_LIST_BUFFERED] - 1; i >= 0; i--) {
+        flags = buffered_flags(set->entries[slots[i]].proc);
+        if (flags) {
+            set_mark_ready(set, slots[i], flags);
+        } else {
+            set_list_remove(set, SET_LIST_BUFFERED, slots[i]);
+        }
+    }
+}
+
+/* Free the storage of `set'. */
+static void set_release(sp_process_set* set) {
+    int i;
+
+    for (i = 0; i < set->used; i++) {
+        if (set->entries[i].proc) set->entries[i].proc->set = NULL;
     }
+    for (i = 0; i < SET_LIST_COUNT; i++) free(set->lists[i]);
+    free(set->entries);
+    free(set->ready);
+    free(set);
 }
 
 #if defined(_WIN32) || defined(EIF_WINDOWS)
+/* ============ WINDOWS PROCESS SETS ============ */
+
+static int set_watch(sp_process_set* set, int slot) {
+    sp_set_entry* entry = &set->entries[slot];
+    entry->watching = (entry->proc->hStdOutRead ? SET_WATCH_OUTPUT : 0) |
+                      (entry->proc->hStdErrRead ? SET_WATCH_ERROR : 0) |
+                      (entry->proc->hProcess ? SET_WATCH_EXIT : 0);
+    return 1;
+}
 
-int sp_file_in_path(const char* filename) {
-    char path_buffer[MAX_PATH];
-    DWORD result;
+static void set_unwatch(sp_process_set* set, int slot) {
+    set->entries[slot].watching = 0;
+}
+
+/* Check output pipe `pipe' of `slot', watched as `flag'. */
+static void set_scan_pipe(sp_process_set* set, int slot, HANDLE pipe, int flag) {
+    sp_set_entry* entry = &set->entries[slot];
+    DWORD available;
+
+    if (!(entry->watching & flag)) return;
+    if (pipe == NULL) {
+        entry->watching &= ~flag;  /* End of stream already read */
+        return;
+    }
+    if (!PeekNamedPipe(pipe, NULL, 0, NULL, &available, NULL)) {
+        /* Broken pipe: writer closed, report EOF once */
+        entry->watching &= ~flag;
+        set_mark_ready(set, slot, flag);
+    } else if (available > 0) {
+        set_mark_ready(set, slot, flag);
+    }
+}
 
-    result = SearchPathA(NULL, filename, ".exe", MAX_PATH, path_buffer, NULL);
-    return (result > 0) ? 1 : 0;
+/* Check every member once without blocking. */
+static void set_scan(sp_process_set* set) {
+    int i;
+
+    for (i = 0; i < set->used; i++) {
+        sp_set_entry* entry = &set->entries[i];
+        if (!entry->proc) continue;
+        set_scan_pipe(set, i, entry->proc->hStdOutRead, SET_WATCH_OUTPUT);
+        set_scan_pipe(set, i, entry->proc->hStdErrRead, SET_WATCH_ERROR);
+        if ((entry->watching & SET_WATCH_EXIT) &&
+            WaitForSingleObject(entry->proc->hProcess, 0) == WAIT_OBJECT_0) {
+            entry->watching &= ~SET_WATCH_EXIT;
+            set_mark_ready(set, i, SP_READY_EXITED);
+        }
+    }
 }
 
-#else
+int sp_process_set_wait(sp_process_set* set, int timeout_ms) {
+    ULONGLONG deadline;
+    LONGLONG remaining;
 
-int sp_file_in_path(const char* filename) {
-    char check_cmd[512];
-    snprintf(check_cmd, sizeof(check_cmd), "command -v %s > /dev/null 2>&1", filename);
-    return system(check_cmd) == 0 ? 1 : 0;
+    if (!set) return -1;
+    set_clear_ready(set);
+    set_check_buffered(set);
+    deadline = GetTickCount64() + (timeout_ms > 0 ? timeout_ms : 0);
+    while (1) {
+        set_scan(set);
+        if (set->ready_count > 0) return set->ready_count;
+        remaining = (timeout_ms < 0) ? SET_SCAN_SLICE_MS : (LONGLONG)(deadline - GetTickCount64());
+        if (timeout_ms == 0 || remaining <= 0 || set->count == 0) return 0;
+        Sleep((DWORD)(remaining < SET_SCAN_SLICE_MS ? remaining : SET_SCAN_SLICE_MS));
+    }
 }
 
-#endif
+sp_process_set* sp_process_set_create(void) {
+    sp_process_set* set = (sp_process_set*)malloc(sizeof(sp_process_set));
+    if (!set) return NULL;
+    memset(set, 0, sizeof(sp_process_set));
+    set->free_slot = -1;
+    return set;
+}
 
-/* ============ ASYNC PROCESS FUNCTIONS ============ */
+void sp_process_set_destroy(sp_process_set* set) {
+    if (set) set_release(set);
+}
 
-#if defined(_WIN32) || defined(EIF_WINDOWS)
-/* ============ WINDOWS ASYNC FUNCTIONS ============ */
+#else
+/* ============ POSIX PROCESS SETS ============ */
 
-sp_async_process* sp_start_async(const char* command, const char* working_dir, int show_window) {
-    sp_async_process* proc;
-    SECURITY_ATTRIBUTES sa;
-    HANDLE hStdOutWrite = NULL;
-    STARTUPINFOA si;
-    PROCESS_INFORMATION pi;
-    char* cmd_copy = NULL;
-    BOOL success;
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <stdint.h>
 
-    /* Allocate process structure */
-    proc = (sp_async_process*)malloc(sizeof(sp_async_process));
-    if (!proc) return NULL;
-    memset(proc, 0, sizeof(sp_async_process));
+/* epoll user data: slot in the high bits, SET_KIND_* in the low two bits */
+#define SET_EVENT_DATA(slot, kind) (((uint64_t)(slot) << 2) | (kind))
 
-    /* Set up security attributes for inheritable handles */
-    sa.nLength = sizeof(SECURITY_ATTRIBUTES);
-    sa.bInheritHandle = TRUE;
-    sa.lpSecurityDescriptor = NULL;
+static int set_epoll_ctl(sp_process_set* set, int op, int fd, int slot, int kind) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = SET_EVENT_DATA(slot, kind);
+    return epoll_ctl(set->epoll_fd, op, fd, &event);
+}
+#endif
 
-    /* Create pipe for stdout */
-    if (!CreatePipe(&proc->hStdOutRead, &hStdOutWrite, &sa, 0)) {
-        store_last_error();
-        proc->error_message = _strdup(last_error_msg);
-        proc->started = 0;
-        return proc;
+/* Descriptor watched for `kind', or -1. */
+static int set_kind_fd(sp_async_process* proc, int kind) {
+    switch (kind) {
+    case SET_KIND_OUTPUT: return proc->stdout_fd;
+    case SET_KIND_ERROR:  return proc->stderr_fd;
+    default:              return proc->pidfd;
     }
+}
 
-    /* Ensure read handle is not inherited */
-    SetHandleInformation(proc->hStdOutRead, HANDLE_FLAG_INHERIT, 0);
+static int set_watch(sp_process_set* set, int slot) {
+    sp_set_entry* entry = &set->entries[slot];
+    sp_async_process* proc = entry->proc;
+#ifdef __linux__
+    int kind, fd;
+#endif
 
-    /* Set up startup info */
-    memset(&si, 0, sizeof(si));
-    si.cb = sizeof(si);
-    si.hStdOutput = hStdOutWrite;
-    si.hStdError = hStdOutWrite;  /* Redirect stderr to stdout */
-    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-    si.dwFlags |= STARTF_USESTDHANDLES;
+    entry->watching = (proc->stdout_fd >= 0 ? SET_WATCH_OUTPUT : 0) |
+                      (proc->stderr_fd >= 0 ? SET_WATCH_ERROR : 0) | SET_WATCH_EXIT;
+    if (set->epoll_fd < 0 || proc->pidfd < 0) set_list_add(set, SET_LIST_EXIT_SCAN, slot);
+#ifdef __linux__
+    if (set->epoll_fd >= 0) {
+        for (kind = 0; kind < SET_KIND_COUNT; kind++) {
+            fd = set_kind_fd(proc, kind);
+            if (fd >= 0 && set_epoll_ctl(set, EPOLL_CTL_ADD, fd, slot, kind) < 0) {
+                /* Undo the registrations made so far */
+                while (--kind >= 0) {
+                    fd = set_kind_fd(proc, kind);
+                    if (fd >= 0) set_epoll_ctl(set, EPOLL_CTL_DEL, fd, slot, kind);
+                }
+                set_list_remove(set, SET_LIST_EXIT_SCAN, slot);
+                return 0;
+            }
+        }
+    }
+#endif
+    return 1;
+}
 
-    if (!show_window) {
-        si.dwFlags |= STARTF_USESHOWWINDOW;
-        si.wShowWindow = SW_HIDE;
+/* Stop watching `slot' for `kind'. */
+static void set_unwatch_kind(sp_process_set* set, int slot, int kind) {
+    sp_set_entry* entry = &set->entries[slot];
+    if (!(entry->watching & (1 << kind))) return;
+    entry->watching &= ~(1 << kind);
+    if (kind == SET_KIND_EXIT) set_list_remove(set, SET_LIST_EXIT_SCAN, slot);
+#ifdef __linux__
+    if (set->epoll_fd >= 0 && set_kind_fd(entry->proc, kind) >= 0) {
+        set_epoll_ctl(set, EPOLL_CTL_DEL, set_kind_fd(entry->proc, kind), slot, kind);
     }
+#else
+    (void)set;
+#endif
+}
 
-    /* CreateProcess needs a modifiable string */
-    cmd_copy = _strdup(command);
-    if (!cmd_copy) {
-        proc->error_message = _strdup("Memory allocation failed");
-        proc->started = 0;
-        CloseHandle(proc->hStdOutRead);
-        CloseHandle(hStdOutWrite);
-        return proc;
+static void set_unwatch(sp_process_set* set, int slot) {
+    int kind;
+    for (kind = 0; kind < SET_KIND_COUNT; kind++) {
+        set_unwatch_kind(set, slot, kind);
     }
+}
 
-    memset(&pi, 0, sizeof(pi));
+/* Has the member exited? Checked without reaping it. */
+static int set_has_exited(sp_async_process* proc) {
+    siginfo_t info;
+    if (proc->state != SP_STATE_RUNNING) return 1;
+    if (proc->served) return served_child_exited(proc->pidfd);
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_PID, proc->pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0) {
+        return errno == ECHILD;  /* Already reaped by someone */
+    }
+    return info.si_pid == proc->pid;
+}
 
-    /* Create the process */
-    success = CreateProcessA(
-        NULL,           /* Application name (use command line) */
-        cmd_copy,       /* Command line */
-        NULL,           /* Process security attributes */
-        NULL,           /* Thread security attributes */
-        TRUE,           /* Inherit handles */
-        CREATE_NO_WINDOW, /* Creation flags */
-        NULL,           /* Environment (inherit) */
-        working_dir,    /* Working directory */
-        &si,            /* Startup info */
-        &pi             /* Process info */
-    );
+/* Members whose exit cannot be waited on (no pidfd, or no epoll) are
+ * checked on every wait; members with a watched pidfd are not visited.
+ * Returns: number of such members still being watched. */
+static int set_check_exits(sp_process_set* set) {
+    int* slots = set->lists[SET_LIST_EXIT_SCAN];
+    int i, slot;
+
+    for (i = set->list_count[SET_LIST_EXIT_SCAN] - 1; i >= 0; i--) {
+        slot = slots[i];
+        if (set_has_exited(set->entries[slot].proc)) {
+            set_unwatch_kind(set, slot, SET_KIND_EXIT);
+            set_mark_ready(set, slot, SP_READY_EXITED);
+        }
+    }
+    return set->list_count[SET_LIST_EXIT_SCAN];
+}
 
-    free(cmd_copy);
-    CloseHandle(hStdOutWrite);  /* Close write end - child has it */
+/* Apply one readiness event of `kind' for `slot'. */
+static void set_handle_event(sp_process_set* set, int slot, int kind, int hangup) {
+    sp_set_entry* entry = &set->entries[slot];
+    if (!entry->proc) return;
+    if (kind == SET_KIND_EXIT || hangup) {
+        /* Exit is reported once; after a hangup remaining data can be
+         * read in one go, then EOF */
+        set_unwatch_kind(set, slot, kind);
+    }
+    set_mark_ready(set, slot, 1 << kind);
+}
 
-    if (!success) {
-        store_last_error();
-        proc->error_message = _strdup(last_error_msg);
-        proc->started = 0;
-        CloseHandle(proc->hStdOutRead);
-        return proc;
+/* Milliseconds the next poll of a wait may block: none once `timeout_ms'
+ * is 0 or `deadline' has passed, no limit (-1) when `timeout_ms' is -1,
+ * and at most a scan slice while members' exits must be checked. */
+static long long set_wait_slice(int timeout_ms, long long deadline, int pending) {
+    long long slice = (timeout_ms < 0) ? -1 : (timeout_ms > 0) ? deadline - monotonic_ms() : 0;
+
+    if (timeout_ms >= 0 && slice < 0) slice = 0;
+    if (pending > 0 && (slice < 0 || slice > SET_SCAN_SLICE_MS)) slice = SET_SCAN_SLICE_MS;
+    return slice;
+}
+
+#ifdef __linux__
+static int set_wait_epoll(sp_process_set* set, int timeout_ms) {
+    struct epoll_event events[SET_MAX_EVENTS];
+    long long deadline = monotonic_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+    long long slice;
+    int pending;
+    int n, i;
+
+    while (1) {
+        pending = set_check_exits(set);
+        if (set->ready_count > 0) timeout_ms = 0;
+
+        slice = set_wait_slice(timeout_ms, deadline, pending);
+        n = epoll_wait(set->epoll_fd, events, SET_MAX_EVENTS, (int)slice);
+        if (n < 0 && errno != EINTR) return -1;
+        for (i = 0; i < n; i++) {
+            set_handle_event(set, (int)(events[i].data.u64 >> 2),
+                             (int)(events[i].data.u64 & 3),
+                             (events[i].events & (EPOLLHUP | EPOLLERR)) != 0);
+        }
+        if (set->ready_count > 0) return set->ready_count;
+        if (timeout_ms == 0 || (timeout_ms > 0 && monotonic_ms() >= deadline)) return 0;
     }
+}
+#endif
 
-    /* Store process info */
-    proc->hProcess = pi.hProcess;
-    proc->hThread = pi.hThread;
-    proc->processId = pi.dwProcessId;
-    proc->started = 1;
+static int set_wait_poll(sp_process_set* set, int timeout_ms) {
+    struct pollfd* fds;
+    int* slots;
+    int* kinds;
+    long long deadline = monotonic_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+    long long slice;
+    int pending;
+    int nfds, n, i, kind;
+
+    fds = (struct pollfd*)malloc((2 * set->used + 1) * sizeof(struct pollfd));
+    slots = (int*)malloc((2 * set->used + 1) * sizeof(int));
+    kinds = (int*)malloc((2 * set->used + 1) * sizeof(int));
+    if (!fds || !slots || !kinds) {
+        free(fds);
+        free(slots);
+        free(kinds);
+        return -1;
+    }
+
+    while (1) {
+        pending = set_check_exits(set);
+        if (set->ready_count > 0) timeout_ms = 0;
+
+        nfds = 0;
+        for (i = 0; i < set->used; i++) {
+            if (!set->entries[i].proc) continue;
+            for (kind = SET_KIND_OUTPUT; kind <= SET_KIND_ERROR; kind += SET_KIND_ERROR) {
+                if ((set->entries[i].watching & (1 << kind)) &&
+                    set_kind_fd(set->entries[i].proc, kind) >= 0) {
+                    fds[nfds].fd = set_kind_fd(set->entries[i].proc, kind);
+                    fds[nfds].events = POLLIN;
+                    fds[nfds].revents = 0;
+                    slots[nfds] = i;
+                    kinds[nfds++] = kind;
+                }
+            }
+        }
+
+        slice = set_wait_slice(timeout_ms, deadline, pending);
+        n = poll(fds, nfds, (int)slice);
+        if (n < 0 && errno != EINTR) {
+            set->ready_count = -1;
+            break;
+        }
+        for (i = 0; n > 0 && i < nfds; i++) {
+            if (fds[i].revents) {
+                set_handle_event(set, slots[i], kinds[i], (fds[i].revents & (POLLHUP | POLLERR)) != 0);
+            }
+        }
+        if (set->ready_count > 0 || timeout_ms == 0 || (timeout_ms > 0 && monotonic_ms() >= deadline)) break;
+    }
 
-    return proc;
+    free(fds);
+    free(slots);
+    free(kinds);
+    if (set->ready_count < 0) {
+        set->ready_count = 0;
+        return -1;
+    }
+    return set->ready_count;
 }
 
-int sp_is_running(sp_async_process* proc) {
-    DWORD exit_code;
-    if (!proc || !proc->started || proc->hProcess == NULL) {
-        return 0;
+int sp_process_set_wait(sp_process_set* set, int timeout_ms) {
+    if (!set) return -1;
+    set_clear_ready(set);
+    set_check_buffered(set);
+    if (set->count == 0) return 0;  /* Nothing could become ready */
+#ifdef __linux__
+    if (set->epoll_fd >= 0) {
+        return set_wait_epoll(set, timeout_ms);
     }
-    if (GetExitCodeProcess(proc->hProcess, &exit_code)) {
-        return (exit_code == STILL_ACTIVE) ? 1 : 0;
-    }
-    return 0;
+#endif
+    return set_wait_poll(set, timeout_ms);
 }
 
-DWORD sp_get_pid(sp_async_process* proc) {
-    if (!proc || !proc->started) return 0;
-    return proc->processId;
+sp_process_set* sp_process_set_create(void) {
+    sp_process_set* set = (sp_process_set*)malloc(sizeof(sp_process_set));
+    if (!set) return NULL;
+    memset(set, 0, sizeof(sp_process_set));
+    set->free_slot = -1;
+#ifdef __linux__
+    set->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    set->epoll_fd = -1;
+#endif
+    return set;
 }
 
-int sp_wait_timeout(sp_async_process* proc, unsigned int timeout_ms) {
-    DWORD result;
-    if (!proc || !proc->started || proc->hProcess == NULL) {
-        return -1;
-    }
-    result = WaitForSingleObject(proc->hProcess, (DWORD)timeout_ms);
-    if (result == WAIT_OBJECT_0) {
-        return 1;  /* Process finished */
-    } else if (result == WAIT_TIMEOUT) {
-        return 0;  /* Timeout */
+void sp_process_set_destroy(sp_process_set* set) {
+    if (set) {
+        if (set->epoll_fd >= 0) close(set->epoll_fd);
+        set_release(set);
     }
-    return -1;  /* Error */
 }
 
-int sp_kill(sp_async_process* proc) {
-    if (!proc || !proc->started || proc->hProcess == NULL) {
+#endif
+
+int sp_process_set_add(sp_process_set* set, sp_async_process* proc) {
+    int slot;
+
+    if (!set || !proc || !proc->started) return 0;
+    if (proc->set == set) return 1;
+    if (proc->set) return 0;
+
+    slot = set_free_slot(set);
+    if (slot < 0) return 0;
+    set->entries[slot].proc = proc;
+    if (!set_watch(set, slot)) {
+        set_release_slot(set, slot);
         return 0;
     }
-    if (TerminateProcess(proc->hProcess, 1)) {
-        return 1;
-    }
-    return 0;
+    proc->set = set;
+    proc->set_slot = slot;
+    if (buffered_flags(proc)) set_list_add(set, SET_LIST_BUFFERED, slot);
+    set->count++;
+    return 1;
 }
 
-int sp_get_exit_code(sp_async_process* proc) {
-    DWORD exit_code;
-    if (!proc || !proc->started || proc->hProcess == NULL) {
-        return -1;
-    }
-    if (GetExitCodeProcess(proc->hProcess, &exit_code)) {
-        if (exit_code == STILL_ACTIVE) {
-            return -1;  /* Still running */
+int sp_process_set_remove(sp_process_set* set, sp_async_process* proc) {
+    int slot;
+    int i;
+
+    if (!set || !proc) return 0;
+    slot = set_find(set, proc);
+    if (slot < 0) return 0;
+
+    set_unwatch(set, slot);
+    for (i = 0; i < SET_LIST_COUNT; i++) set_list_remove(set, i, slot);
+    /* Drop it from the ready list of the current wait */
+    if (set->entries[slot].ready_flags) {
+        for (i = 0; i < set->ready_count; i++) {
+            if (set->ready[i] == slot) {
+                set->ready[i] = set->ready[--set->ready_count];
+                break;
+            }
         }
-        return (int)exit_code;
     }
-    return -1;
+    set_release_slot(set, slot);
+    proc->set = NULL;
+    set->count--;
+    return 1;
 }
 
-char* sp_read_output(sp_async_process* proc, int* out_length) {
-    char* buffer = NULL;
-    char read_buffer[4096];
-    DWORD bytes_available, bytes_read;
-    int total_size = 0;
-    int buffer_capacity = 0;
+int sp_process_set_count(sp_process_set* set) {
+    return set ? set->count : 0;
+}
 
-    *out_length = 0;
+int sp_process_set_ready_count(sp_process_set* set) {
+    return set ? set->ready_count : 0;
+}
 
-    if (!proc || !proc->started || proc->hStdOutRead == NULL) {
-        return NULL;
-    }
+sp_async_process* sp_process_set_ready_process(sp_process_set* set, int index) {
+    if (!set || index < 0 || index >= set->ready_count) return NULL;
+    return set->entries[set->ready[index]].proc;
+}
 
-    /* Check if data is available (non-blocking) */
-    if (!PeekNamedPipe(proc->hStdOutRead, NULL, 0, NULL, &bytes_available, NULL)) {
-        return NULL;
-    }
+int sp_process_set_ready_flags(sp_process_set* set, int index) {
+    if (!set || index < 0 || index >= set->ready_count) return 0;
+    return set->entries[set->ready[index]].ready_flags;
+}
 
-    if (bytes_available == 0) {
-        return NULL;  /* No data available */
-    }
+/* ============ BATCH EXECUTION ============ */
 
-    /* Allocate initial buffer */
-    buffer_capacity = (bytes_available > 4096) ? bytes_available + 1 : 4096;
-    buffer = (char*)malloc(buffer_capacity);
-    if (!buffer) return NULL;
+/*
+ * A batch keeps at most `max_parallel' async processes running, waits on
+ * all of them through one process set and starts the next command as soon
+ * as one finishes. Output of every running command is drained into its
+ * own capture buffer, so results match those of sp_execute_ex.
+ */
 
-    /* Read available data */
-    while (PeekNamedPipe(proc->hStdOutRead, NULL, 0, NULL, &bytes_available, NULL) && bytes_available > 0) {
-        DWORD to_read = (bytes_available > sizeof(read_buffer) - 1) ? sizeof(read_buffer) - 1 : bytes_available;
+#define BATCH_WAIT_SLICE_MS 100  /* Upper bound on one set wait (safety net, timeout checks) */
 
-        if (ReadFile(proc->hStdOutRead, read_buffer, to_read, &bytes_read, NULL) && bytes_read > 0) {
-            /* Expand buffer if needed */
-            if (total_size + bytes_read >= buffer_capacity) {
-                int new_capacity = buffer_capacity * 2;
-                char* new_buffer = (char*)realloc(buffer, new_capacity);
-                if (!new_buffer) break;
-                buffer = new_buffer;
-                buffer_capacity = new_capacity;
-            }
-            memcpy(buffer + total_size, read_buffer, bytes_read);
-            total_size += bytes_read;
-        } else {
-            break;
-        }
-    }
+typedef struct {
+    sp_async_process* proc;     /* Running command, or NULL for a free slot */
+    int index;                  /* Position of the command in the batch */
+    int killed;                 /* Stopped by fail-fast or timeout? */
+    int timed_out;              /* 1 after SIGTERM for timeout, 2 after SIGKILL */
+    sp_buffer output;
+    sp_buffer error_output;
+} sp_batch_slot;
 
-    buffer[total_size] = '\0';
-    *out_length = total_size;
-    return buffer;
+int sp_cpu_count(void) {
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
 }
 
-void sp_async_close(sp_async_process* proc) {
-    if (proc) {
-        if (proc->hProcess) CloseHandle(proc->hProcess);
-        if (proc->hThread) CloseHandle(proc->hThread);
-        if (proc->hStdOutRead) CloseHandle(proc->hStdOutRead);
-        if (proc->error_message) free(proc->error_message);
-        free(proc);
+/* Read everything available on `stream' of `proc' into `buffer'.
+ * Returns: 0 when nothing more is available yet, -1 at end of stream
+ */
+static int batch_drain(sp_async_process* proc, int stream, sp_buffer* buffer) {
+    char scratch[BUFFER_SIZE];
+    char* target;
+    int size, n;
+
+    while (1) {
+        target = buffer_target(buffer, scratch, &size);
+        n = stream_read_into(proc, stream, target, size);
+        if (n <= 0) return n;
+        buffer_commit(buffer, target, n);
     }
 }
 
-#else
-/* ============ POSIX ASYNC FUNCTIONS ============ */
-
-sp_async_process* sp_start_async(const char* command, const char* working_dir, int show_window) {
-    sp_async_process* proc;
-    int pipefd[2];
-    pid_t pid;
+/* Result of the finished command in `slot'; closes its process. */
+static sp_result* batch_finish(sp_batch_slot* slot) {
+    sp_result* result = (sp_result*)malloc(sizeof(sp_result));
 
-    (void)show_window;  /* Unused on POSIX */
+    if (result) {
+        memset(result, 0, sizeof(sp_result));
+        result->stage_exit_codes = (int*)malloc(sizeof(int));
+    }
+    if (!result || !result->stage_exit_codes) {
+        free(result);
+        free(slot->output.data);
+        free(slot->error_output.data);
+        result = error_result("Memory allocation failed");
+    } else {
+        result->success = 1;
+        result->exit_code = sp_get_exit_code(slot->proc);
+        result->stage_count = 1;
+        result->stage_exit_codes[0] = result->exit_code;
+        sp_get_usage(slot->proc, &result->usage);
+        result->output = buffer_finish(&slot->output, &result->output_length);
+        result->output_truncated = slot->output.truncated;
+        result->timed_out = slot->timed_out != 0;
+        if (slot->error_output.data) {
+            result->error_output = buffer_finish(&slot->error_output, &result->error_output_length);
+            result->output_truncated |= slot->error_output.truncated;
+        }
+        if (result->output_truncated) metrics_add(metrics.truncations, 1);
+    }
+    sp_async_close(slot->proc);
+    slot->proc = NULL;
+    return result;
+}
 
-    /* Allocate process structure */
-    proc = (sp_async_process*)malloc(sizeof(sp_async_process));
-    if (!proc) return NULL;
-    memset(proc, 0, sizeof(sp_async_process));
-    proc->stdout_fd = -1;
+/* Start command `index' of `commands' in free `slot'.
+ * Returns: 1 if it runs, 0 with results[index] set if it could not start
+ */
+static int batch_start(sp_batch_slot* slot, const sp_batch_command* commands, int index,
+                       const sp_options* options, sp_process_set* set, sp_result** results) {
+    const sp_batch_command* command = &commands[index];
+    sp_async_process* proc;
 
-    /* Create pipe for stdout */
-    if (pipe(pipefd) < 0) {
-        store_last_error();
-        proc->error_message = strdup(last_error_msg);
-        proc->started = 0;
-        return proc;
+    if (!command->command && !valid_argv(command->argv)) {
+        results[index] = error_result("Empty argument vector");
+        return 0;
     }
-
-    pid = fork();
-    if (pid < 0) {
-        store_last_error();
-        proc->error_message = strdup(last_error_msg);
-        proc->started = 0;
-        close(pipefd[0]);
-        close(pipefd[1]);
-        return proc;
+    proc = sp_start_async_ex(command->command, command->argv, command->working_dir, options);
+    if (!proc || !proc->started) {
+        results[index] = error_result((proc && proc->error_message) ? proc->error_message : "Failed to start process");
+        sp_async_close(proc);
+        return 0;
+    }
+    slot->output.data = NULL;
+    slot->error_output.data = NULL;
+    if (!buffer_init(&slot->output, SP_STREAM_OUTPUT, options) ||
+        (options->separate_stderr && !buffer_init(&slot->error_output, SP_STREAM_ERROR, options)) ||
+        !sp_process_set_add(set, proc)) {
+        free(slot->output.data);
+        free(slot->error_output.data);
+        sp_kill(proc);
+        sp_wait_timeout(proc, 5000);
+        sp_async_close(proc);
+        results[index] = error_result("Memory allocation failed");
+        return 0;
     }
+    slot->proc = proc;
+    slot->index = index;
+    slot->killed = 0;
+    slot->timed_out = 0;
+    return 1;
+}
 
-    if (pid == 0) {
-        /* Child process */
-        close(pipefd[0]);  /* Close read end */
+/* Stop the command in `slot' once it has run past options->timeout_ms:
+ * SIGTERM first, SIGKILL after the grace period (Windows: terminated at
+ * once). The deadline holds while anything the command started keeps its
+ * streams open, even after the command itself has exited; its process group
+ * is signaled then. Never blocks, so the other commands keep being drained. */
+static void batch_enforce_timeout(sp_batch_slot* slot, const sp_options* options) {
+    long long elapsed_ms;
+
+    if (options->timeout_ms <= 0 || slot->timed_out == 2) return;
+    if (!sp_is_running(slot->proc) && !sp_has_open_output(slot->proc)) return;
+    elapsed_ms = (monotonic_ns() - slot->proc->start_ns) / 1000000;  /* Not frozen at exit */
+    if (slot->timed_out == 0) {
+        if (elapsed_ms < options->timeout_ms) return;
+        slot->timed_out = 1;
+        slot->killed = 1;
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+        sp_kill(slot->proc);
+        slot->timed_out = 2;
+#else
+        signal_process(slot->proc, SIGTERM);
+#endif
+    } else if (elapsed_ms >= (long long)options->timeout_ms + options->kill_grace_ms) {
+        sp_kill(slot->proc);
+        slot->timed_out = 2;
+    }
+}
 
-        /* Redirect stdout and stderr to pipe */
-        dup2(pipefd[1], STDOUT_FILENO);
-        dup2(pipefd[1], STDERR_FILENO);
-        close(pipefd[1]);
+sp_result** sp_execute_batch(const sp_batch_command* commands, int count, int max_parallel,
+                             int mode, const sp_options* options) {
+    sp_options batch_options;
+    sp_result** results;
+    sp_batch_slot* slots;
+    sp_process_set* set;
+    int next = 0, running = 0, failed = 0;
+    int i, j, out_state, err_state;
+
+    if (!commands || count <= 0) return NULL;
+    if (max_parallel <= 0) max_parallel = sp_cpu_count();
+    if (max_parallel > count) max_parallel = count;
+
+    /* Every command gets its own copy of input_data; nothing is streamed */
+    if (options) {
+        batch_options = *options;
+    } else {
+        sp_options_init(&batch_options);
+    }
+    batch_options.on_output = NULL;
+    batch_options.input_fd = -1;
+    batch_options.keep_stdin_open = 0;
+    batch_options.output_mode = SP_OUTPUT_CAPTURE;
+
+    results = (sp_result**)calloc(count, sizeof(sp_result*));
+    slots = (sp_batch_slot*)calloc(max_parallel, sizeof(sp_batch_slot));
+    set = sp_process_set_create();
+    if (!results || !slots || !set) {
+        free(results);
+        free(slots);
+        sp_process_set_destroy(set);
+        return NULL;
+    }
 
-        /* Change working directory if specified */
-        if (working_dir && working_dir[0]) {
-            if (chdir(working_dir) < 0) {
-                _exit(127);
+    while (1) {
+        /* Fill free slots with the next commands */
+        for (i = 0; i < max_parallel && next < count && !failed; i++) {
+            if (slots[i].proc) continue;
+            while (next < count && !failed) {
+                if (batch_start(&slots[i], commands, next++, &batch_options, set, results)) {
+                    running++;
+                    break;
+                }
+                if (mode == SP_BATCH_FAIL_FAST) failed = 1;
             }
         }
+        if (running == 0) break;
+
+        sp_process_set_wait(set, BATCH_WAIT_SLICE_MS);
+
+        /* Drain every running command; a command is done once it has
+         * exited and both of its streams have ended (or it was killed, as
+         * its own children may still hold the pipes; a timed-out command
+         * waits for the SIGKILL that follows the grace period) */
+        for (i = 0; i < max_parallel; i++) {
+            if (!slots[i].proc) continue;
+            batch_enforce_timeout(&slots[i], &batch_options);
+            out_state = batch_drain(slots[i].proc, SP_STREAM_OUTPUT, &slots[i].output);
+            err_state = slots[i].error_output.data
+                ? batch_drain(slots[i].proc, SP_STREAM_ERROR, &slots[i].error_output) : -1;
+            if (((out_state < 0 && err_state < 0) || (slots[i].killed && slots[i].timed_out != 1))
+                && !sp_is_running(slots[i].proc)) {
+                sp_process_set_remove(set, slots[i].proc);
+                j = slots[i].index;
+                results[j] = batch_finish(&slots[i]);
+                running--;
+                if (mode == SP_BATCH_FAIL_FAST && !failed &&
+                    (!results[j] || !results[j]->success || results[j]->exit_code != 0)) {
+                    /* Stop the others; they finish through the loop as killed */
+                    failed = 1;
+                    for (j = 0; j < max_parallel; j++) {
+                        if (slots[j].proc) {
+                            sp_kill(slots[j].proc);
+                            slots[j].killed = 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
 
-        /* Execute command via shell */
-        execl("/bin/sh", "sh", "-c", command, (char*)NULL);
-        _exit(127);  /* exec failed */
+    /* Commands never started because of fail-fast */
+    for (i = 0; i < count; i++) {
+        if (!results[i]) results[i] = error_result("Cancelled after an earlier command failed");
     }
+    sp_process_set_destroy(set);
+    free(slots);
+    return results;
+}
 
-    /* Parent process */
-    close(pipefd[1]);  /* Close write end */
+void sp_free_batch(sp_result** results, int count) {
+    int i;
 
-    /* Set stdout_fd to non-blocking */
-    fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
+    if (!results) return;
+    for (i = 0; i < count; i++) {
+        sp_free_result(results[i]);
+    }
+    free(results);
+}
 
-    proc->pid = pid;
-    proc->stdout_fd = pipefd[0];
-    proc->started = 1;
+/* ============ SHELL SESSIONS ============ */
 
-    return proc;
+/*
+ * Each command is sent to the shell wrapped so that its output is followed
+ * by a sentinel line "<token>:<status>" on stdout (and "<token>:" on stderr
+ * when it is separate). The token changes with every command, so output
+ * that happens to contain an earlier token cannot end a later command.
+ * Bytes are committed to the capture buffer as they arrive, except for a
+ * short tail that could be the start of the sentinel.
+ */
+
+#define SESSION_TOKEN_SIZE 64       /* Room for a sentinel token */
+#define SESSION_PENDING_SIZE 128    /* Uncommitted tail: token, status, line end */
+#define SESSION_WAIT_SLICE_MS 100   /* Longest wait before checking the shell is alive */
+#define SESSION_START_TIMEOUT_MS 5000
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+#define SESSION_NEWLINE "\r\n"
+#else
+#define SESSION_NEWLINE "\n"
+#endif
+
+struct sp_shell_session {
+    sp_async_process* shell;    /* Running shell, or NULL until the next run */
+    char* working_dir;          /* Where a (re)started shell begins, or NULL */
+    sp_options options;         /* Options of every command */
+    char token_base[SESSION_TOKEN_SIZE / 2];
+    char token[SESSION_TOKEN_SIZE];
+    int token_length;
+    unsigned int sequence;      /* Commands sent, for fresh tokens */
+    int starts;                 /* Shells started */
+    char work[SESSION_PENDING_SIZE + BUFFER_SIZE];  /* Pending tail + one read */
+};
+
+/* Output of one stream of one command */
+typedef struct {
+    sp_buffer buffer;           /* Command output before the sentinel */
+    char pending[SESSION_PENDING_SIZE];  /* Tail that may hold a partial sentinel */
+    int pending_length;
+    int done;                   /* Sentinel line seen? */
+    int status;                 /* Number after the sentinel token */
+} sp_session_stream;
+
+/* Position of `token' in `data', or -1. */
+static int find_token(const char* data, int length, const char* token, int token_length) {
+    const char* p = data;
+    const char* end = data + length - token_length;
+
+    while (p <= end) {
+        p = (const char*)memchr(p, token[0], end - p + 1);
+        if (!p) return -1;
+        if (memcmp(p, token, token_length) == 0) return (int)(p - data);
+        p++;
+    }
+    return -1;
 }
 
-int sp_is_running(sp_async_process* proc) {
-    int status;
-    pid_t result;
+/* Parse the status after a sentinel token ("-12\r\n"). */
+static int parse_status(const char* p, const char* end) {
+    int sign = 1, value = 0;
 
-    if (!proc || !proc->started || proc->pid <= 0) {
-        return 0;
+    if (p < end && *p == '-') {
+        sign = -1;
+        p++;
     }
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p++ - '0');
+    }
+    return sign * value;
+}
 
-    result = waitpid(proc->pid, &status, WNOHANG);
-    if (result == 0) {
-        return 1;  /* Still running */
+/* Take `count' bytes read after the pending tail in the session's work area. */
+static void session_take(sp_shell_session* session, sp_session_stream* stream, int count) {
+    char* work = session->work;
+    int total = stream->pending_length + count;
+    int at, keep;
+    char* line_end;
+
+    at = find_token(work, total, session->token, session->token_length);
+    if (at >= 0) {
+        buffer_append(&stream->buffer, work, at);
+        line_end = (char*)memchr(work + at, '\n', total - at);
+        if (line_end) {
+            stream->status = parse_status(work + at + session->token_length + 1, line_end);
+            stream->done = 1;
+            stream->pending_length = 0;
+            return;
+        }
+        keep = total - at;
+    } else {
+        at = total - (session->token_length - 1);
+        if (at < 0) at = 0;
+        buffer_append(&stream->buffer, work, at);
+        keep = total - at;
     }
-    return 0;  /* Finished or error */
+    if (keep > SESSION_PENDING_SIZE) keep = SESSION_PENDING_SIZE;
+    memcpy(stream->pending, work + total - keep, keep);
+    stream->pending_length = keep;
 }
 
-pid_t sp_get_pid(sp_async_process* proc) {
-    if (!proc || !proc->started) return 0;
-    return proc->pid;
+/* Read everything available on `stream_id' until its sentinel.
+ * Returns: 0 when nothing more is available yet, -1 at end of stream
+ */
+static int session_drain(sp_shell_session* session, sp_session_stream* stream, int stream_id) {
+    int n;
+
+    while (!stream->done) {
+        memcpy(session->work, stream->pending, stream->pending_length);
+        n = stream_read_into(session->shell, stream_id, session->work + stream->pending_length, BUFFER_SIZE);
+        if (n <= 0) {
+            if (n < 0) buffer_append(&stream->buffer, stream->pending, stream->pending_length);
+            return n;
+        }
+        session_take(session, stream, n);
+    }
+    return 0;
 }
 
-int sp_wait_timeout(sp_async_process* proc, unsigned int timeout_ms) {
-    int status;
-    pid_t result;
-    unsigned int elapsed = 0;
-    unsigned int sleep_interval = 10;  /* 10ms */
+/* Text sent to the shell to run `command' (NULL: sentinels only).
+ * On POSIX the command is one single-quoted argument of `command eval', so
+ * an unbalanced quote or unterminated here-document is a parse error of the
+ * eval (status 2) instead of swallowing the sentinels; `command' keeps the
+ * error from ending the shell. */
+static char* session_script(sp_shell_session* session, const char* command, int* out_length) {
+    size_t size = (command ? 4 * strlen(command) : 0) + 3 * SESSION_TOKEN_SIZE + 64;
+    char* script = (char*)malloc(size);
+    int length = 0;
+#if !defined(_WIN32) && !defined(EIF_WINDOWS)
+    const char* c;
+#endif
 
-    if (!proc || !proc->started || proc->pid <= 0) {
-        return -1;
+    if (!script) return NULL;
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+    if (command) length += snprintf(script, size, "(%s\r\n) <NUL\r\n", command);
+    length += snprintf(script + length, size - length, "echo %s:%%ERRORLEVEL%%\r\n", session->token);
+    if (session->options.separate_stderr) {
+        length += snprintf(script + length, size - length, ">&2 echo %s:\r\n", session->token);
+    }
+#else
+    if (command) {
+        length += snprintf(script, size, "{ command eval '");
+        for (c = command; *c; c++) {
+            if (*c == '\'') {
+                memcpy(script + length, "'\\''", 4);
+                length += 4;
+            } else {
+                script[length++] = *c;
+            }
+        }
+        length += snprintf(script + length, size - length, "'\n} </dev/null\n");
     }
+    length += snprintf(script + length, size - length, "printf '%s:%%d\\n' \"$?\"\n", session->token);
+    if (session->options.separate_stderr) {
+        length += snprintf(script + length, size - length, "printf '%s:\\n' >&2\n", session->token);
+    }
+#endif
+    *out_length = length;
+    return script;
+}
 
-    while (elapsed < timeout_ms) {
-        result = waitpid(proc->pid, &status, WNOHANG);
-        if (result > 0) {
-            return 1;  /* Process finished */
-        } else if (result < 0) {
-            return -1;  /* Error */
+/* Kill and forget the shell. */
+static void session_stop(sp_shell_session* session) {
+    if (session->shell) {
+        if (sp_is_running(session->shell)) {
+            sp_kill(session->shell);
+            sp_wait_timeout(session->shell, 1000);
         }
-        usleep(sleep_interval * 1000);
-        elapsed += sleep_interval;
+        sp_async_close(session->shell);
+        session->shell = NULL;
     }
-    return 0;  /* Timeout */
 }
 
-int sp_kill(sp_async_process* proc) {
-    if (!proc || !proc->started || proc->pid <= 0) {
-        return 0;
+/* Send `command' and collect its output into `out' (and `err' when stderr
+ * is separate) up to the sentinels.
+ * Returns: 1 when the sentinels arrived, 0 if the shell ended first,
+ *          -1 on timeout or write failure (the shell is then stopped)
+ */
+static int session_exchange(sp_shell_session* session, const char* command, int timeout_ms,
+                            sp_session_stream* out, sp_session_stream* err) {
+    long long deadline = monotonic_ns() + (long long)timeout_ms * 1000000;
+    long long remaining;
+    int separate = session->options.separate_stderr;
+    char* script;
+    int length, out_state, err_state;
+
+    session->sequence++;
+    session->token_length = snprintf(session->token, sizeof(session->token), "%s%x",
+                                     session->token_base, session->sequence);
+    script = session_script(session, command, &length);
+    if (!script || sp_queue_input(session->shell, script, length) < 0) {
+        free(script);
+        session_stop(session);
+        return -1;
     }
-    if (kill(proc->pid, SIGKILL) == 0) {
-        return 1;
+    free(script);
+
+    while (1) {
+        out_state = session_drain(session, out, SP_STREAM_OUTPUT);
+        err_state = separate ? session_drain(session, err, SP_STREAM_ERROR) : 0;
+        if (out->done && (!separate || err->done)) return 1;
+        if (out_state < 0 || err_state < 0) break;
+
+        remaining = SESSION_WAIT_SLICE_MS;
+        if (timeout_ms > 0) {
+            remaining = (deadline - monotonic_ns()) / 1000000;
+            if (remaining <= 0) {
+                session_stop(session);
+                return -1;
+            }
+            if (remaining > SESSION_WAIT_SLICE_MS) remaining = SESSION_WAIT_SLICE_MS;
+        }
+        /* A dead shell whose pipes are held open by its children never
+         * sends end of stream, so check on it after each idle slice */
+        if (sp_wait_output(session->shell, (int)remaining) == 0 && !sp_is_running(session->shell)) {
+            session_drain(session, out, SP_STREAM_OUTPUT);
+            if (separate) session_drain(session, err, SP_STREAM_ERROR);
+            break;
+        }
     }
     return 0;
 }
 
-int sp_get_exit_code(sp_async_process* proc) {
-    int status;
-    pid_t result;
+/* Start a shell unless one is running.
+ * Returns: 1 if a shell is ready for commands, 0 on failure (last_error_msg)
+ */
+static int session_ensure_shell(sp_shell_session* session) {
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+    const char* shell_argv[] = {"cmd.exe", "/D", "/Q", NULL};
+#else
+    const char* shell_argv[] = {"/bin/sh", NULL};
+#endif
+    sp_options sync_options = session->options;
+    sp_session_stream out, err;
+    int state;
 
-    if (!proc || !proc->started || proc->pid <= 0) {
-        return -1;
+    if (session->shell) {
+        if (sp_is_running(session->shell) && sp_has_open_input(session->shell)) return 1;
+        session_stop(session);
+    }
+    session->shell = sp_start_async_ex(NULL, shell_argv, session->working_dir, &session->options);
+    if (!session->shell || !session->shell->started) {
+        snprintf(last_error_msg, sizeof(last_error_msg), "%s",
+                 (session->shell && session->shell->error_message) ? session->shell->error_message : "Failed to start shell");
+        sp_async_close(session->shell);
+        session->shell = NULL;
+        return 0;
     }
+    session->starts++;
+
+    /* Discard whatever the shell prints before its first sentinel (banner) */
+    sync_options.max_output = 0;
+    memset(&out, 0, sizeof(out));
+    memset(&err, 0, sizeof(err));
+    if (!buffer_init(&out.buffer, SP_STREAM_OUTPUT, &sync_options) ||
+        !buffer_init(&err.buffer, SP_STREAM_ERROR, &sync_options)) {
+        free(out.buffer.data);
+        session_stop(session);
+        snprintf(last_error_msg, sizeof(last_error_msg), "Memory allocation failed");
+        return 0;
+    }
+    state = session_exchange(session, NULL, SESSION_START_TIMEOUT_MS, &out, &err);
+    free(out.buffer.data);
+    free(err.buffer.data);
+    if (state != 1) {
+        session_stop(session);
+        snprintf(last_error_msg, sizeof(last_error_msg), "Shell did not answer");
+        return 0;
+    }
+    return 1;
+}
+
+sp_shell_session* sp_session_open(const char* working_dir, const sp_options* options) {
+    sp_shell_session* session = (sp_shell_session*)calloc(1, sizeof(sp_shell_session));
 
-    result = waitpid(proc->pid, &status, WNOHANG);
-    if (result > 0) {
-        if (WIFEXITED(status)) {
-            return WEXITSTATUS(status);
+    if (!session) return NULL;
+    if (options) {
+        session->options = *options;
+    } else {
+        sp_options_init(&session->options);
+    }
+    session->options.on_output = NULL;
+    session->options.input_data = NULL;
+    session->options.input_length = 0;
+    session->options.input_fd = -1;
+    session->options.keep_stdin_open = 1;
+    snprintf(session->token_base, sizeof(session->token_base), "SP%llx_%llx_",
+             (unsigned long long)monotonic_ns(), (unsigned long long)(size_t)session);
+    if (working_dir) {
+        session->working_dir = sp_strdup(working_dir);
+        if (!session->working_dir) {
+            free(session);
+            return NULL;
         }
-        return -1;
     }
-    return -1;  /* Still running or error */
+    if (!session_ensure_shell(session)) {
+        free(session->working_dir);
+        free(session);
+        return NULL;
+    }
+    return session;
 }
 
-char* sp_read_output(sp_async_process* proc, int* out_length) {
-    char* buffer = NULL;
-    char read_buffer[4096];
-    ssize_t bytes_read;
-    int total_size = 0;
-    int buffer_capacity = 4096;
-
-    *out_length = 0;
+sp_result* sp_session_run(sp_shell_session* session, const char* command, int timeout_ms) {
+    sp_session_stream out, err;
+    sp_result* result;
+    long long start = monotonic_ns();
+    int separate, state;
+
+    if (!session || !command) return error_result("Invalid arguments");
+    if (!session_ensure_shell(session)) return error_result(last_error_msg);
+
+    separate = session->options.separate_stderr;
+    memset(&out, 0, sizeof(out));
+    memset(&err, 0, sizeof(err));
+    result = (sp_result*)calloc(1, sizeof(sp_result));
+    if (!result || !(result->stage_exit_codes = (int*)malloc(sizeof(int))) ||
+        !buffer_init(&out.buffer, SP_STREAM_OUTPUT, &session->options) ||
+        (separate && !buffer_init(&err.buffer, SP_STREAM_ERROR, &session->options))) {
+        if (result) free(result->stage_exit_codes);
+        free(result);
+        free(out.buffer.data);
+        return error_result("Memory allocation failed");
+    }
 
-    if (!proc || !proc->started || proc->stdout_fd < 0) {
-        return NULL;
+    state = session_exchange(session, command, timeout_ms, &out, &err);
+    if (state < 0) {
+        free(out.buffer.data);
+        free(err.buffer.data);
+        free(result->stage_exit_codes);
+        free(result);
+        return error_result(timeout_ms > 0 ? "Command timed out; the session shell was stopped"
+                                           : "Session shell stopped accepting commands");
+    }
+    if (state == 1) {
+        result->exit_code = out.status;
+    } else {
+        /* The command ended the shell: report the shell's exit status */
+        sp_wait_timeout(session->shell, 1000);
+        result->exit_code = sp_get_exit_code(session->shell);
+        session_stop(session);
+    }
+    result->success = 1;
+    result->stage_count = 1;
+    result->stage_exit_codes[0] = result->exit_code;
+    result->usage.wall_time_ns = monotonic_ns() - start;
+    result->output = buffer_finish(&out.buffer, &result->output_length);
+    result->output_truncated = out.buffer.truncated;
+    if (separate) {
+        result->error_output = buffer_finish(&err.buffer, &result->error_output_length);
+        result->output_truncated |= err.buffer.truncated;
     }
+    return result;
+}
 
-    buffer = (char*)malloc(buffer_capacity);
-    if (!buffer) return NULL;
+int sp_session_restarts(sp_shell_session* session) {
+    return (session && session->starts > 1) ? session->starts - 1 : 0;
+}
 
-    /* Read available data (non-blocking) */
-    while ((bytes_read = read(proc->stdout_fd, read_buffer, sizeof(read_buffer) - 1)) > 0) {
-        /* Expand buffer if needed */
-        if (total_size + bytes_read >= buffer_capacity) {
-            int new_capacity = buffer_capacity * 2;
-            char* new_buffer = (char*)realloc(buffer, new_capacity);
-            if (!new_buffer) break;
-            buffer = new_buffer;
-            buffer_capacity = new_capacity;
+void sp_session_close(sp_shell_session* session) {
+    if (session) {
+        if (session->shell && sp_close_input(session->shell) >= 0) {
+            sp_wait_timeout(session->shell, 100);  /* Let it exit on end of input */
         }
-        memcpy(buffer + total_size, read_buffer, bytes_read);
-        total_size += bytes_read;
+        session_stop(session);
+        free(session->working_dir);
+        free(session);
     }
+}
 
-    if (total_size == 0) {
-        free(buffer);
-        return NULL;
-    }
+/* ============ UTF-8 DECODING ============ */
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#define SP_UTF8_SSE2
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define SP_UTF8_AVX2
+#define SP_AVX2_TARGET
+#define sp_cpu_has_avx2() 1
+#elif defined(__GNUC__)
+#define SP_UTF8_AVX2
+#define SP_AVX2_TARGET __attribute__((target("avx2")))
+#define sp_cpu_has_avx2() __builtin_cpu_supports("avx2")
+#endif
+#ifdef SP_UTF8_AVX2
+#include <immintrin.h>
+#endif
+#endif
 
-    buffer[total_size] = '\0';
-    *out_length = total_size;
-    return buffer;
+#ifdef SP_UTF8_AVX2
+/* Widen whole 32-byte blocks of ASCII; stops at the first block with a high bit */
+SP_AVX2_TARGET
+static int widen_ascii_avx2(const unsigned char* s, int n, unsigned int* d) {
+    int i = 0;
+    while (i + 32 <= n) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+        if (_mm256_movemask_epi8(v)) break;
+        _mm256_storeu_si256((__m256i*)(d + i), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(s + i))));
+        _mm256_storeu_si256((__m256i*)(d + i + 8), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(s + i + 8))));
+        _mm256_storeu_si256((__m256i*)(d + i + 16), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(s + i + 16))));
+        _mm256_storeu_si256((__m256i*)(d + i + 24), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(s + i + 24))));
+        i += 32;
+    }
+    return i;
 }
+#endif
 
-void sp_async_close(sp_async_process* proc) {
-    if (proc) {
-        if (proc->stdout_fd >= 0) close(proc->stdout_fd);
-        if (proc->error_message) free(proc->error_message);
-        free(proc);
+#ifdef SP_UTF8_SSE2
+/* Widen whole 16-byte blocks of ASCII */
+static int widen_ascii_blocks(const unsigned char* s, int n, unsigned int* d) {
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    while (i + 16 <= n) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i lo, hi;
+        if (_mm_movemask_epi8(v)) break;
+        lo = _mm_unpacklo_epi8(v, zero);
+        hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i*)(d + i), _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i*)(d + i + 4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i*)(d + i + 8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i*)(d + i + 12), _mm_unpackhi_epi16(hi, zero));
+        i += 16;
+    }
+    return i;
+}
+#else
+/* Widen whole 8-byte words of ASCII (portable fallback) */
+static int widen_ascii_blocks(const unsigned char* s, int n, unsigned int* d) {
+    int i = 0, k;
+    while (i + 8 <= n) {
+        unsigned long long w;
+        memcpy(&w, s + i, 8);
+        if (w & 0x8080808080808080ULL) break;
+        for (k = 0; k < 8; k++) d[i + k] = s[i + k];
+        i += 8;
     }
+    return i;
 }
+#endif
 
+/* Widen the run of ASCII bytes at the start of `s' into `d'
+ * Returns: length of the run
+ */
+static int widen_ascii(const unsigned char* s, int n, unsigned int* d) {
+    int i = 0;
+#ifdef SP_UTF8_AVX2
+    if (n >= 64 && sp_cpu_has_avx2()) i = widen_ascii_avx2(s, n, d);
 #endif
+    i += widen_ascii_blocks(s + i, n - i, d + i);
+    while (i < n && s[i] < 0x80) {
+        d[i] = s[i];
+        i++;
+    }
+    return i;
+}
+
+/* Decode the multibyte sequence at `s' (lead byte >= 0x80), `avail' bytes long
+ * Returns: its length with `*cp' set; -k when invalid, k being the length of
+ *          its maximal valid prefix (at least 1); 0 when cut short by the end
+ */
+static int utf8_sequence(const unsigned char* s, int avail, unsigned int* cp) {
+    unsigned int b = s[0], c;
+    unsigned char lo = 0x80, hi = 0xBF;
+    int need, k;
+
+    if (b >= 0xC2 && b <= 0xDF) {
+        need = 1;
+        c = b & 0x1F;
+    } else if (b >= 0xE0 && b <= 0xEF) {
+        need = 2;
+        c = b & 0x0F;
+        if (b == 0xE0) lo = 0xA0;       /* overlong */
+        else if (b == 0xED) hi = 0x9F;  /* surrogates */
+    } else if (b >= 0xF0 && b <= 0xF4) {
+        need = 3;
+        c = b & 0x07;
+        if (b == 0xF0) lo = 0x90;       /* overlong */
+        else if (b == 0xF4) hi = 0x8F;  /* above U+10FFFF */
+    } else {
+        return -1;
+    }
+    for (k = 1; k <= need; k++) {
+        if (k >= avail) return 0;
+        if (s[k] < lo || s[k] > hi) return -k;
+        c = (c << 6) | (s[k] & 0x3F);
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    *cp = c;
+    return need + 1;
+}
+
+int sp_utf8_decode(const char* src, int length, int is_final, unsigned int* dst, int* consumed) {
+    const unsigned char* s = (const unsigned char*)src;
+    int i = 0, n = 0, r;
+
+    if (!src || !dst) length = 0;
+    while (i < length) {
+        if (s[i] < 0x80) {
+            r = widen_ascii(s + i, length - i, dst + n);
+            i += r;
+            n += r;
+        } else {
+            r = utf8_sequence(s + i, length - i, dst + n);
+            if (r > 0) {
+                i += r;
+                n++;
+            } else if (r < 0) {
+                dst[n++] = 0xFFFD;
+                i -= r;
+            } else if (is_final) {
+                dst[n++] = 0xFFFD;
+                i = length;
+            } else {
+                break;  /* Rest arrives with the next chunk */
+            }
+        }
+    }
+    if (consumed) *consumed = i;
+    return n;
+}
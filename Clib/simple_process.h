@@ -2,7 +2,8 @@
  * simple_process.h - Cross-platform process execution wrapper for Eiffel
  *
  * Windows: Uses Win32 CreateProcess API
- * Linux: Uses POSIX fork/exec with pipes
+ * Linux: Uses clone(CLONE_VM|CLONE_VFORK) + exec with pipes
+ * Other POSIX: Uses fork/exec with pipes
  *
  * Provides SCOOP-compatible process execution without thread dependencies.
  * Uses synchronous I/O for output capture.
@@ -24,34 +25,228 @@
 extern "C" {
 #endif
 
+/* Resource usage of finished processes (pipeline stages are summed) */
+typedef struct {
+    long long user_time_us;     /* CPU time in user mode (microseconds) */
+    long long system_time_us;   /* CPU time in the kernel (microseconds) */
+    long long max_rss_kb;       /* Peak resident set size (KB; largest stage) */
+    long long minor_faults;     /* Page faults served without I/O (Windows: all faults) */
+    long long major_faults;     /* Page faults that needed I/O (0 on Windows) */
+    long long wall_time_ns;     /* Monotonic time from spawn to exit (nanoseconds) */
+} sp_usage;
+
 /* Process result structure */
 typedef struct {
     int exit_code;
     int success;
     char* output;
     int output_length;
+    char* error_output;     /* Captured stderr when kept separate, else NULL */
+    int error_output_length;
+    int output_truncated;   /* Was output past max_output dropped? */
+    int stage_count;        /* Number of stages run (1 unless a pipeline) */
+    int* stage_exit_codes;  /* Exit code of each stage; `exit_code' is the last */
+    sp_usage usage;         /* Resource usage of the run (when success) */
+    int timed_out;          /* Was the run killed for exceeding timeout_ms? */
+    const char* output_map; /* Read-only view of the output file, or NULL (see output_mode) */
+    long long output_size;  /* Bytes in the output file when output was not captured */
     char* error_message;
 } sp_result;
 
+/* Stream identifiers passed to sp_output_callback */
+#define SP_STREAM_OUTPUT 1
+#define SP_STREAM_ERROR  2
+
+/* max_output value that keeps all output */
+#define SP_UNLIMITED_OUTPUT (-1)
+
+/* Default kill_grace_ms: time between SIGTERM and SIGKILL on timeout */
+#define SP_DEFAULT_KILL_GRACE_MS 2000
+
+/* Where sp_execute_ex sends stdout (and stderr unless separate_stderr) */
+#define SP_OUTPUT_CAPTURE 0   /* Pipe into sp_result.output (default) */
+#define SP_OUTPUT_FILE    1   /* Straight into the file output_path */
+#define SP_OUTPUT_MEMORY  2   /* Into an anonymous memory file (memfd on Linux), mapped */
+
+/* Called by sp_execute_ex for each chunk as it is read, before any limit
+ * applies. `data' is only valid during the call and is not null-terminated.
+ */
+typedef void (*sp_output_callback)(void* context, int stream, const char* data, int length);
+
+/* I/O scheduling classes for sp_options.io_priority_class (Linux) */
+#define SP_IO_PRIORITY_REALTIME    1
+#define SP_IO_PRIORITY_BEST_EFFORT 2
+#define SP_IO_PRIORITY_IDLE        3
+
+/* Prepared environment for children (see sp_env_create) */
+typedef struct sp_environment sp_environment;
+
+/* Options for sp_execute_ex and sp_start_async_ex
+ * Initialize with sp_options_init before setting fields.
+ */
+typedef struct {
+    int show_window;        /* Show console window (Windows only) */
+    int separate_stderr;    /* Capture stderr apart from stdout */
+    int max_output;         /* Bytes kept per stream (default 1MB), SP_UNLIMITED_OUTPUT, or 0 */
+    sp_output_callback on_output;  /* Streaming callback (synchronous execution), or NULL */
+    void* callback_context; /* Passed to `on_output' */
+    const char* input_data; /* Bytes written to stdin, then EOF (NULL: no in-memory input) */
+    int input_length;       /* Length of `input_data' */
+    int input_fd;           /* Fd whose contents follow `input_data' on stdin, or -1 */
+    int keep_stdin_open;    /* Async: leave stdin open for sp_write_input */
+    int timeout_ms;         /* Sync, batch: stop the run after this long (0: no limit) */
+    int kill_grace_ms;      /* Sync, batch: SIGTERM to SIGKILL delay on timeout (POSIX) */
+    int output_mode;        /* Sync: SP_OUTPUT_CAPTURE, SP_OUTPUT_FILE or SP_OUTPUT_MEMORY */
+    const char* output_path;  /* File for SP_OUTPUT_FILE, created or truncated */
+    int map_output;         /* SP_OUTPUT_FILE: also map the file as sp_result.output_map */
+    const sp_environment* environment;  /* Children's environment, or NULL for the caller's */
+    /* Applied in each child before exec; a child that cannot apply them exits with 127 */
+    const int* cpus;        /* CPUs children may run on (Linux; Windows: CPUs 0..63), or NULL */
+    int cpu_count;          /* Entries in `cpus' */
+    int nice_increment;     /* Added to children's nice value (Windows: priority class), 0: none */
+    int io_priority_class;  /* SP_IO_PRIORITY_* (Linux), 0: inherited */
+    int io_priority_level;  /* 0 (highest) to 7 in the realtime and best-effort classes */
+    long long max_address_space;  /* RLIMIT_AS bytes (Windows: committed memory), 0: inherited */
+    long long max_cpu_seconds;    /* RLIMIT_CPU seconds (Windows: CPU time), 0: inherited */
+    long long max_open_files;     /* RLIMIT_NOFILE (POSIX), 0: inherited */
+    const char* cgroup;     /* cgroup v2 directory children join (Linux), or NULL */
+} sp_options;
+
+/* Stdin feed of an async process (internal) */
+struct sp_input_feed;
+
+/* Per-stream output ring of an async process (internal) */
+typedef struct {
+    char* data;             /* Ring storage, allocated on first use */
+    int start;              /* Offset of the oldest buffered byte */
+    int count;              /* Bytes buffered */
+} sp_ring;
+
+/* How far an async process has got; set once, when it is first seen to
+ * have ended, together with its exit code, signal and resource usage */
+#define SP_STATE_RUNNING  0   /* Still running (or not yet waited for) */
+#define SP_STATE_EXITED   1   /* Ended with an exit code */
+#define SP_STATE_SIGNALED 2   /* Killed by a signal (POSIX only) */
+
 /* Async process handle structure */
 #if defined(_WIN32) || defined(EIF_WINDOWS)
 typedef struct {
     HANDLE hProcess;        /* Process handle */
     HANDLE hThread;         /* Thread handle */
     HANDLE hStdOutRead;     /* Pipe read handle for output */
+    HANDLE hStdErrRead;     /* Pipe read handle for error output, or NULL */
+    HANDLE hJob;            /* Job holding the process and its descendants, or NULL */
+    sp_ring output_ring;    /* Output pumped from the pipe, not yet read */
+    sp_ring error_ring;     /* Error output pumped from the pipe, not yet read */
+    struct sp_input_feed* input;  /* Stdin pipe and queued input, or NULL */
     DWORD processId;        /* Process ID (PID) */
+    long long start_ns;     /* Monotonic time of spawn */
+    long long first_output_ns;  /* Monotonic time the first output byte was read, or 0 */
+    long long bytes_read;   /* Output bytes read from the pipes so far */
+    int state;              /* SP_STATE_RUNNING or SP_STATE_EXITED */
+    int exit_code;          /* Exit code once exited */
+    sp_usage usage;         /* Resource usage once exited */
+    struct sp_process_set* set;  /* Process set it is a member of, or NULL */
+    int set_slot;           /* Its slot in `set' */
     int started;            /* Was process started successfully? */
     char* error_message;    /* Error if start failed */
 } sp_async_process;
 #else
 typedef struct {
     pid_t pid;              /* Process ID */
+    int pidfd;              /* Exit notification fd (Linux 5.3+), or -1 */
+    int served;             /* Spawned by the spawn server: `pidfd' is its status pipe */
+    int own_group;          /* Leads its own process group (cleared once the group is seen empty)? */
     int stdout_fd;          /* Pipe read handle for output */
+    int stderr_fd;          /* Pipe read handle for error output, or -1 */
+    sp_ring output_ring;    /* Output pumped from the pipe, not yet read */
+    sp_ring error_ring;     /* Error output pumped from the pipe, not yet read */
+    struct sp_input_feed* input;  /* Stdin pipe and queued input, or NULL */
+    int state;              /* SP_STATE_*, set when the child is reaped */
+    int exit_code;          /* Exit code once exited, -1 if signaled */
+    int term_signal;        /* Signal that killed it once signaled, else 0 */
+    int core_dumped;        /* Did it dump core when signaled? */
+    long long start_ns;     /* Monotonic time of spawn */
+    long long first_output_ns;  /* Monotonic time the first output byte was read, or 0 */
+    long long bytes_read;   /* Output bytes read from the pipes so far */
+    sp_usage usage;         /* Resource usage once reaped */
+    struct sp_process_set* set;  /* Process set it is a member of, or NULL */
+    int set_slot;           /* Its slot in `set' */
     int started;            /* Was process started successfully? */
     char* error_message;    /* Error if start failed */
 } sp_async_process;
 #endif
 
+/* Reset `options' to defaults (hidden window, stderr merged into stdout,
+ * 1MB capture limit, no callback, stdin inherited, no timeout, output captured,
+ * caller's environment, scheduling and resource limits) */
+void sp_options_init(sp_options* options);
+
+/* Create an environment for children: a copy of the caller's current one
+ * (`inherit') or an empty one, changed by sp_env_set and sp_env_unset.
+ * Every change rebuilds the envp array (the environment block on Windows)
+ * in one allocation, so spawns given it through sp_options.environment use
+ * it as is, however many there are. Inherited variables are those of the
+ * caller at the last change. Do not change or free an environment while a
+ * spawn uses it.
+ * Returns: environment (free with sp_env_free), or NULL on allocation failure
+ */
+sp_environment* sp_env_create(int inherit);
+
+/* Set variable `name' (no '=') to `value' in `env', replacing any inherited value
+ * Returns: 1 on success, 0 on invalid name or allocation failure
+ */
+int sp_env_set(sp_environment* env, const char* name, const char* value);
+
+/* Remove variable `name' from `env' (inherited or set)
+ * Returns: 1 on success, 0 on invalid name or allocation failure
+ */
+int sp_env_unset(sp_environment* env, const char* name);
+
+/* Value of `name' in `env', or NULL; valid until `env' next changes */
+const char* sp_env_get(const sp_environment* env, const char* name);
+
+/* Number of variables in `env' */
+int sp_env_count(const sp_environment* env);
+
+/* NULL-terminated "NAME=VALUE" array of `env', as passed to execve */
+char* const* sp_env_vector(const sp_environment* env);
+
+/* Free an environment from sp_env_create */
+void sp_env_free(sp_environment* env);
+
+/* Execute `command' through the shell, or `argv' directly when `command' is NULL,
+ * and capture output synchronously. Both pipes are drained concurrently and
+ * to end of stream: output past max_output is passed to on_output but not kept.
+ * With input_data or input_fd, stdin is a pipe fed in step with the draining
+ * (input_fd is spliced in on Linux), so large inputs cannot deadlock.
+ * Children run in their own process group (a job object on Windows), unless
+ * stdin is the terminal the caller reads in the foreground. With timeout_ms,
+ * a run still going at the deadline gets SIGTERM, then SIGKILL kill_grace_ms
+ * later, each sent to the whole group (Windows: the job is terminated at
+ * once); output read so far is kept and timed_out is set.
+ * With output_mode SP_OUTPUT_FILE or SP_OUTPUT_MEMORY the child writes to
+ * that file itself: nothing is read, copied or limited by the caller,
+ * on_output is not called and `output' is NULL. output_size is the file's
+ * size once the run has ended, and output_map a read-only view of it (for
+ * SP_OUTPUT_MEMORY, or SP_OUTPUT_FILE with map_output; NULL when empty or
+ * if it cannot be mapped). A mapped file must not be truncated meanwhile.
+ * options: NULL for defaults
+ * Returns: sp_result pointer (caller must free with sp_free_result)
+ */
+sp_result* sp_execute_ex(const char* command, const char* const* argv, const char* working_dir, const sp_options* options);
+
+/* Execute `stage_count' programs as a pipeline without a shell: each stage's
+ * stdout is connected to the next stage's stdin by a pipe, and the last
+ * stage's output is captured as by sp_execute_ex (stderr of every stage goes
+ * to the output, or to error_output when separate; input feeds the first stage).
+ * stages: NULL-terminated argument vectors; each argv[0] is looked up in PATH
+ * options: NULL for defaults
+ * Returns: sp_result pointer (caller must free with sp_free_result) with
+ *          exit_code of the last stage and every stage's in stage_exit_codes
+ */
+sp_result* sp_execute_pipeline(const char* const* const* stages, int stage_count, const char* working_dir, const sp_options* options);
+
 /* Execute a command and capture output synchronously
  * Returns: sp_result pointer (caller must free with sp_free_result)
  */
@@ -62,15 +257,60 @@ sp_result* sp_execute_command(const char* command, const char* working_dir, int
  */
 sp_result* sp_execute_with_args(const char* program, const char* args, const char* working_dir, int show_window);
 
-/* Free result structure */
+/* Execute `argv[0]' directly (no shell) with arguments `argv[1..]'
+ * argv: NULL-terminated argument vector; argv[0] is looked up in PATH
+ * Returns: sp_result pointer (caller must free with sp_free_result)
+ */
+sp_result* sp_execute_argv(const char* const* argv, const char* working_dir, int show_window);
+
+/* Free result structure, including its output_map */
 void sp_free_result(sp_result* result);
 
-/* Get last Win32 error as string */
+/* Release an output view taken out of a result (output_map and output_size,
+ * with output_map then cleared so sp_free_result leaves it alone) */
+void sp_unmap_output(const char* map, long long size);
+
+/* Get the calling thread's last error as a string. Each thread has its own
+ * message, so concurrent callers never see one another's failures.
+ */
 const char* sp_get_last_error(void);
 
-/* Check if a file exists in system PATH */
+/* Check if a file exists in system PATH (see sp_resolve_command) */
 int sp_file_in_path(const char* filename);
 
+/* Resolve command `name' to the full path of the executable exec would run,
+ * scanning PATH in-process with access(X_OK) (SearchPath on Windows); names
+ * containing a slash are checked as given. POSIX lookups are cached, and the
+ * cache is dropped when PATH or the mtime of a PATH directory changes.
+ * Returns: length of the path written to `out', 0 if not found or too long
+ */
+int sp_resolve_command(const char* name, char* out, int out_size);
+
+/* Nanoseconds from the monotonic clock (performance counter on Windows),
+ * the clock used for wall times; for timing measurements */
+long long sp_monotonic_ns(void);
+
+/* ============ SPAWN SERVER ============ */
+
+/* Start the spawn server (POSIX): a small helper forked now, which creates
+ * every later child on the caller's behalf, so spawn cost no longer depends
+ * on the caller's heap size or thread count. Call it early, while the
+ * program is small and has no other threads, or set SP_SPAWN_SERVER=1 to
+ * start it when the library is loaded. Requests carry the caller's current
+ * environment, working directory, signal mask and ignored signals; children
+ * are reaped by the server and their status comes back through a pipe.
+ * If the server dies, spawning falls back to the calling process.
+ * Returns: 1 if the server is running, 0 on failure (always on Windows)
+ */
+int sp_spawn_server_start(void);
+
+/* Is spawning routed through the spawn server? */
+int sp_spawn_server_is_running(void);
+
+/* Spawn from the calling process again; the server exits once its
+ * remaining children have exited */
+void sp_spawn_server_stop(void);
+
 /* ============ ASYNC PROCESS FUNCTIONS ============ */
 
 /* Start a process asynchronously (does not wait)
@@ -78,6 +318,22 @@ int sp_file_in_path(const char* filename);
  */
 sp_async_process* sp_start_async(const char* command, const char* working_dir, int show_window);
 
+/* Start `command' through the shell, or `argv' directly when `command' is NULL,
+ * asynchronously
+ * input_fd becomes the child's stdin directly. Otherwise input_data or
+ * keep_stdin_open give it a pipe: input_data is queued for it, and it is
+ * closed once written unless keep_stdin_open is set.
+ * options: NULL for defaults
+ * Returns: sp_async_process pointer (caller must free with sp_async_close)
+ */
+sp_async_process* sp_start_async_ex(const char* command, const char* const* argv, const char* working_dir, const sp_options* options);
+
+/* Start `argv[0]' directly (no shell) asynchronously
+ * argv: NULL-terminated argument vector; argv[0] is looked up in PATH
+ * Returns: sp_async_process pointer (caller must free with sp_async_close)
+ */
+sp_async_process* sp_start_async_argv(const char* const* argv, const char* working_dir, int show_window);
+
 /* Check if async process is still running
  * Returns: 1 if running, 0 if finished
  */
@@ -93,28 +349,326 @@ pid_t sp_get_pid(sp_async_process* proc);
 #endif
 
 /* Wait for process with timeout
+ * Blocks until exit or timeout without polling (pidfd, or SIGCHLD on POSIX)
  * Returns: 1 if process finished, 0 if timeout, -1 on error
  */
 int sp_wait_timeout(sp_async_process* proc, unsigned int timeout_ms);
 
-/* Kill/terminate the process
+/* Kill the process and everything in its process group (job on Windows)
+ * with SIGKILL; what it started is killed even after it has exited
  * Returns: 1 on success, 0 on failure
  */
 int sp_kill(sp_async_process* proc);
 
+/* Ask the process group to stop with SIGTERM, then SIGKILL it if the
+ * process or anything left in its group is still running after `grace_ms'
+ * (Windows: terminate the job at once). Reaches what the process started
+ * even after the process itself has exited.
+ * Returns: 1 once the process has finished, 0 on failure
+ */
+int sp_terminate(sp_async_process* proc, unsigned int grace_ms);
+
 /* Get exit code (only valid after process finished)
- * Returns: exit code or -1 if still running
+ * Returns: exit code or -1 if still running or killed by a signal
  */
 int sp_get_exit_code(sp_async_process* proc);
 
+/* State of the process without blocking. The first call that finds it
+ * ended reaps it and keeps its exit code, signal and usage, so every later
+ * query (this, sp_is_running, sp_get_exit_code, sp_get_usage, ...) is
+ * answered from memory without a system call
+ * Returns: SP_STATE_RUNNING, SP_STATE_EXITED, SP_STATE_SIGNALED, or -1 on error
+ */
+int sp_get_state(sp_async_process* proc);
+
+/* Signal that killed the process
+ * Returns: signal number once SP_STATE_SIGNALED, 0 otherwise (always on Windows)
+ */
+int sp_get_termination_signal(sp_async_process* proc);
+
+/* Did the signal that killed the process make it dump core?
+ * Returns: 1 if so, 0 otherwise (always on Windows)
+ */
+int sp_core_dumped(sp_async_process* proc);
+
+/* Resource usage of a finished process (CPU times and faults from wait4 on
+ * POSIX, GetProcessTimes / GetProcessMemoryInfo on Windows)
+ * Returns: 1 with `usage' filled in, 0 while still running or on error
+ */
+int sp_get_usage(sp_async_process* proc, sp_usage* usage);
+
+/* Nanoseconds since the process was started on the monotonic clock,
+ * frozen at its run time once it has finished
+ * Returns: elapsed nanoseconds, 0 if not started
+ */
+long long sp_elapsed_ns(sp_async_process* proc);
+
 /* Read available output (non-blocking)
  * Returns: output string (caller must free) or NULL if none available
  */
 char* sp_read_output(sp_async_process* proc, int* out_length);
 
+/* Read available error output (non-blocking); only when stderr is separate
+ * Returns: output string (caller must free) or NULL if none available
+ */
+char* sp_read_error_output(sp_async_process* proc, int* out_length);
+
+/* Read available output (non-blocking) into caller-owned `buffer'
+ * No allocation: buffered bytes are copied first, then the pipe is read
+ * directly into `buffer'.
+ * Returns: bytes read (0 if none available), -1 once output has ended
+ */
+int sp_read_output_into(sp_async_process* proc, char* buffer, int capacity);
+
+/* Read available error output into caller-owned `buffer'; see sp_read_output_into */
+int sp_read_error_output_into(sp_async_process* proc, char* buffer, int capacity);
+
+/* Drain both pipes into the process's rings (up to 64KB each) without
+ * returning the data, so a chatty child does not block on a full pipe.
+ * Returns: bytes buffered by this call
+ */
+int sp_pump_output(sp_async_process* proc);
+
+/* Wait until output or error output can be read, or reaches end of stream,
+ * writing queued input meanwhile as stdin drains
+ * Returns: SP_READY_OUTPUT / SP_READY_ERROR_OUTPUT flags, 0 on timeout,
+ *          -1 on error or when both streams have ended
+ * timeout_ms: -1 waits indefinitely
+ */
+int sp_wait_output(sp_async_process* proc, int timeout_ms);
+
+/* Is any output stream still open (end of stream not yet read)?
+ * Returns: 1 if open, 0 once all output has been read
+ */
+int sp_has_open_output(sp_async_process* proc);
+
+/* Write to stdin without blocking (stdin must be a pipe: see sp_start_async_ex)
+ * Returns: bytes accepted (0 if the pipe is full or queued input is still
+ *          waiting), -1 if stdin is closed or closing
+ */
+int sp_write_input(sp_async_process* proc, const char* data, int length);
+
+/* Copy `data' to the stdin queue and write what the pipe takes now.
+ * The rest is written by sp_flush_input, sp_wait_output and output reads.
+ * Returns: bytes still queued, -1 if stdin is closed or closing
+ */
+int sp_queue_input(sp_async_process* proc, const char* data, int length);
+
+/* Write queued input without blocking
+ * Returns: bytes still queued, -1 once stdin is closed
+ */
+int sp_flush_input(sp_async_process* proc);
+
+/* Close stdin once queued input is written
+ * Returns: 1 if closed now, 0 if deferred until the queue drains, -1 if not open
+ */
+int sp_close_input(sp_async_process* proc);
+
+/* Is the stdin pipe still open?
+ * Returns: 1 if open, 0 if closed or stdin is not a pipe
+ */
+int sp_has_open_input(sp_async_process* proc);
+
 /* Cleanup async process handle */
 void sp_async_close(sp_async_process* proc);
 
+/* ============ PROCESS SETS ============ */
+
+/* Set of async processes waited on together (epoll on Linux).
+ * Wait cost grows with the number of ready members, not the set size
+ * (on Linux with pidfds; elsewhere exits are checked by a scan).
+ */
+typedef struct sp_process_set sp_process_set;
+
+/* Readiness flags reported by sp_process_set_ready_flags */
+#define SP_READY_OUTPUT 1   /* Output (or end of output) can be read */
+#define SP_READY_EXITED 2   /* Process has exited (reported once) */
+#define SP_READY_ERROR_OUTPUT 4  /* Error output (or its end) can be read */
+
+/* Create an empty set
+ * Returns: set pointer (caller must free with sp_process_set_destroy)
+ */
+sp_process_set* sp_process_set_create(void);
+
+/* Add a started process. A process is a member of at most one set;
+ * sp_async_close removes it.
+ * Returns: 1 on success (or already a member), 0 on failure or if it is
+ *          a member of another set
+ */
+int sp_process_set_add(sp_process_set* set, sp_async_process* proc);
+
+/* Remove a process
+ * Returns: 1 if it was a member, 0 otherwise
+ */
+int sp_process_set_remove(sp_process_set* set, sp_async_process* proc);
+
+/* Number of member processes */
+int sp_process_set_count(sp_process_set* set);
+
+/* Wait until at least one member has output or has exited
+ * Returns: number of ready members, 0 on timeout or when the set is empty,
+ *          -1 on error
+ * timeout_ms: -1 waits indefinitely, 0 only checks
+ */
+int sp_process_set_wait(sp_process_set* set, int timeout_ms);
+
+/* Number of members that were ready after the last wait */
+int sp_process_set_ready_count(sp_process_set* set);
+
+/* Ready member `index' (0-based) of the last wait, or NULL */
+sp_async_process* sp_process_set_ready_process(sp_process_set* set, int index);
+
+/* SP_READY_* flags of ready member `index' of the last wait */
+int sp_process_set_ready_flags(sp_process_set* set, int index);
+
+/* Free the set (member processes are not closed) */
+void sp_process_set_destroy(sp_process_set* set);
+
+/* ============ BATCH EXECUTION ============ */
+
+/* One command of a batch */
+typedef struct {
+    const char* command;        /* Shell command, or NULL to run `argv' directly */
+    const char* const* argv;    /* NULL-terminated argument vector when `command' is NULL */
+    const char* working_dir;    /* Working directory, or NULL for the current one */
+} sp_batch_command;
+
+/* Batch modes */
+#define SP_BATCH_COLLECT_ALL 0  /* Run every command whatever the others do */
+#define SP_BATCH_FAIL_FAST   1  /* After the first failure, kill the running and skip the rest */
+
+/* Number of online CPUs (at least 1) */
+int sp_cpu_count(void);
+
+/* Run `count' commands with at most `max_parallel' at a time (<= 0: one per
+ * CPU), each started with sp_start_async_ex and captured as by sp_execute_ex.
+ * In SP_BATCH_FAIL_FAST mode a command that fails to start or exits non-zero
+ * stops the batch: running commands are killed, the rest are not started and
+ * get a failed result ("Cancelled ...").
+ * options: applied to every command (NULL for defaults); on_output,
+ *          input_fd and output_mode are ignored, input_data is given to each command,
+ *          timeout_ms counts from each command's own start
+ * Returns: `count' results in input order (free with sp_free_batch),
+ *          NULL on invalid arguments or allocation failure
+ */
+sp_result** sp_execute_batch(const sp_batch_command* commands, int count, int max_parallel,
+                             int mode, const sp_options* options);
+
+/* Free the results of sp_execute_batch */
+void sp_free_batch(sp_result** results, int count);
+
+/* ============ SHELL SESSIONS ============ */
+
+/* A warm shell (/bin/sh, cmd.exe on Windows) that runs commands sent over
+ * its stdin, so a command costs a pipe round trip instead of a spawn and a
+ * shell startup. Each command runs in the shell itself, with stdin from
+ * /dev/null: `cd' and variable assignments carry over to later commands.
+ * Output and status are framed by a per-command sentinel that the command
+ * cannot predict. If the shell exits (`exit', a fatal error), the run
+ * reports its exit status and the next run starts a fresh shell in the
+ * original working directory.
+ */
+typedef struct sp_shell_session sp_shell_session;
+
+/* Open a session whose shell starts in `working_dir' (NULL: current).
+ * options: separate_stderr, max_output and show_window apply to every
+ *          command (NULL for defaults); input and on_output are ignored
+ * Returns: session (free with sp_session_close), NULL if the shell could
+ *          not be started (see sp_get_last_error)
+ */
+sp_shell_session* sp_session_open(const char* working_dir, const sp_options* options);
+
+/* Run `command' in the session's shell and capture its output.
+ * timeout_ms: <= 0 waits indefinitely; on timeout the shell is killed and
+ *             the next run restarts it
+ * Returns: sp_result pointer (caller must free with sp_free_result); usage
+ *          holds only wall_time_ns, as the command runs inside the shell
+ */
+sp_result* sp_session_run(sp_shell_session* session, const char* command, int timeout_ms);
+
+/* Number of times the shell was restarted after dying or timing out */
+int sp_session_restarts(sp_shell_session* session);
+
+/* End the shell and free the session */
+void sp_session_close(sp_shell_session* session);
+
+/* ============ METRICS ============ */
+
+/* Histogram bucket i counts values up to 2^(SP_HISTOGRAM_FIRST_SHIFT + i)
+ * (nanoseconds or bytes); the last bucket also counts everything larger */
+#define SP_HISTOGRAM_BUCKETS     32
+#define SP_HISTOGRAM_FIRST_SHIFT 10
+
+/* Error codes counted one by one in sp_metrics.failures_by_error */
+#define SP_METRICS_ERROR_CODES 256
+
+typedef struct {
+    long long count;        /* Values recorded */
+    long long sum;          /* Sum of the values */
+    long long buckets[SP_HISTOGRAM_BUCKETS];  /* Values in each bucket (not cumulative) */
+} sp_histogram;
+
+/* Library-wide counters, kept with atomic adds by every spawn, read and
+ * reap in the process. Every field is a long long. */
+typedef struct {
+    long long spawns;           /* Children started */
+    long long spawn_failures;   /* Spawns that failed, including exec failures the parent saw */
+    long long failures_by_error[SP_METRICS_ERROR_CODES];  /* Failures by errno (Windows: GetLastError); larger codes in 0 */
+    long long live_children;    /* Children started and not yet reaped or closed */
+    long long truncations;      /* Synchronous and batch runs whose output passed max_output */
+    sp_histogram spawn_latency_ns;  /* Spawn call until it returns; includes exec with clone (Linux) and the spawn server */
+    sp_histogram first_output_ns;   /* Spawn until the first output byte is read */
+    sp_histogram runtime_ns;        /* Spawn until exit: a synchronous run (whole pipeline) or an async process */
+    sp_histogram output_bytes;      /* Output captured by a synchronous run, or read from an async process by close */
+} sp_metrics;
+
+/* Copy the current counters into `metrics'. Each field is read atomically,
+ * but the snapshot as a whole is not: runs in other threads may land between
+ * fields. */
+void sp_metrics_snapshot(sp_metrics* metrics);
+
+/* Zero every counter except live_children */
+void sp_metrics_reset(void);
+
+/* Current counters in the Prometheus text exposition format (times in
+ * seconds, metric names prefixed with `simple_process_')
+ * Returns: text (caller must free), or NULL on allocation failure
+ */
+char* sp_metrics_prometheus(void);
+
+/* ============ TRACING ============ */
+
+/* Write the lifecycle of every child from now on to `path' as a Chrome
+ * trace (JSON array format; open it in chrome://tracing or
+ * ui.perfetto.dev). Each child gets a track named after its command and
+ * pid, with spawn requested, forked and exec done (POSIX, seen through a
+ * close-on-exec pipe), started (spawn server, Windows), first output, eof,
+ * reaped with its exit code, and a "process" slice from request to reap.
+ * Any trace already running is stopped first. Set SP_TRACE=<path> to start
+ * tracing when the library is loaded. While no trace runs, the hooks cost
+ * a flag test.
+ * Returns: 1 on success, 0 if the file cannot be created (see sp_get_last_error)
+ */
+int sp_trace_start(const char* path);
+
+/* Finish and close the trace file */
+void sp_trace_stop(void);
+
+/* Is a trace being written? */
+int sp_trace_is_active(void);
+
+/* ============ UTF-8 DECODING ============ */
+
+/* Decode `length' bytes of UTF-8 into code points at `dst', which must have
+ * room for `length' items. Runs of ASCII are widened 16 or 32 bytes at a time
+ * (SSE2/AVX2 on x86). Each maximal invalid subpart (bad lead or continuation
+ * byte, overlong form, surrogate, value above U+10FFFF) becomes one U+FFFD.
+ * A sequence cut short at the end is left unconsumed, so the next chunk can
+ * complete it, unless `is_final' (then it becomes U+FFFD).
+ * Returns: code points written; `consumed' (if not NULL) gets bytes used
+ */
+int sp_utf8_decode(const char* src, int length, int is_final, unsigned int* dst, int* consumed);
+
 #ifdef __cplusplus
 }
 #endif
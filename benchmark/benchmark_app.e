@@ -0,0 +1,357 @@
+note
+	description: "[
+		Benchmarks for the hot paths of SIMPLE_PROCESS and SIMPLE_ASYNC_PROCESS:
+		spawn latency, output capture throughput, polling of idle processes,
+		wake-up after exit and command lookup. Each case reports min, mean and
+		percentiles; with -j each case is printed as one JSON object per line.
+
+		Usage: simple_process_benchmark [-j] [-n iterations] [-p idle_processes]
+		See sp_bench.c for the same cases against the C layer alone.
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	BENCHMARK_APP
+
+inherit
+	ARGUMENTS_32
+
+create
+	make
+
+feature {NONE} -- Initialization
+
+	make
+			-- Run the benchmarks.
+		do
+			iterations := integer_option ("n", 200)
+			idle_process_count := integer_option ("p", 64)
+			is_json := index_of_word_option ("j") > 0
+
+			if not is_json then
+				print ("case           unit  samples         min        mean         p50         p90         p99         max%N")
+			end
+			bench_spawn_true
+			bench_capture ("capture_1mb", 1_048_576, iterations // 4 + 1)
+			bench_capture ("capture_100mb", 104_857_600, iterations // 40 + 1)
+			bench_poll_idle
+			bench_wait_wakeup
+			bench_has_command
+			bench_session_probe
+		end
+
+feature -- Settings
+
+	iterations: INTEGER
+			-- Samples per latency case.
+
+	idle_process_count: INTEGER
+			-- Processes polled by `bench_poll_idle'.
+
+	is_json: BOOLEAN
+			-- Print one JSON object per case instead of a table?
+
+feature -- Benchmarks
+
+	bench_spawn_true
+			-- Spawn, exit and reap of a program that does nothing.
+		local
+			l_process: SIMPLE_PROCESS
+			l_samples: ARRAYED_LIST [REAL_64]
+			l_start: REAL_64
+			i: INTEGER
+		do
+			create l_process.make
+			create l_samples.make (iterations)
+			from
+				i := 1
+			until
+				i > iterations
+			loop
+				l_start := now_us
+				if {PLATFORM}.is_windows then
+					l_process.execute_argv (<<"cmd", "/c", "exit", "0">>)
+				else
+					l_process.execute_argv (<<"true">>)
+				end
+				l_samples.extend (now_us - l_start)
+				i := i + 1
+			end
+			report ("spawn_true", "us", l_samples)
+		end
+
+	bench_capture (a_name: STRING; a_bytes, a_count: INTEGER)
+			-- Capture `a_bytes' of output into `last_output', `a_count' times.
+		local
+			l_process: SIMPLE_PROCESS
+			l_samples: ARRAYED_LIST [REAL_64]
+			l_start: REAL_64
+			i: INTEGER
+		do
+			create l_process.make
+			l_process.set_unlimited_output
+			create l_samples.make (a_count)
+			from
+				i := 1
+			until
+				i > a_count
+			loop
+				l_start := now_us
+				if {PLATFORM}.is_windows then
+					l_process.execute ("powershell -NoProfile -Command %"[Console]::Out.Write('x' * " + a_bytes.out + ")%"")
+				else
+					l_process.execute ("head -c " + a_bytes.out + " /dev/zero")
+				end
+				if attached l_process.last_output as l_output and then l_output.count = a_bytes then
+					l_samples.extend (a_bytes / (now_us - l_start))
+				end
+				i := i + 1
+			end
+			report (a_name, "MB/s", l_samples)
+		end
+
+	bench_poll_idle
+			-- One `read_available_output' sweep over idle processes.
+		local
+			l_processes: ARRAYED_LIST [SIMPLE_ASYNC_PROCESS]
+			l_process: SIMPLE_ASYNC_PROCESS
+			l_samples: ARRAYED_LIST [REAL_64]
+			l_start: REAL_64
+			i: INTEGER
+		do
+			create l_processes.make (idle_process_count)
+			from
+				i := 1
+			until
+				i > idle_process_count
+			loop
+				create l_process.make
+				l_process.start (idle_command)
+				l_processes.extend (l_process)
+				i := i + 1
+			end
+			create l_samples.make (iterations)
+			from
+				i := 1
+			until
+				i > iterations
+			loop
+				l_start := now_us
+				across l_processes as ic loop
+					if attached ic.item.read_available_output then
+						-- Idle processes print nothing
+					end
+				end
+				l_samples.extend (now_us - l_start)
+				i := i + 1
+			end
+			across l_processes as ic loop
+				if ic.item.kill then
+					ic.item.wait_seconds (5).do_nothing
+				end
+				ic.item.close
+			end
+			report ("poll_idle", "us", l_samples)
+		end
+
+	bench_wait_wakeup
+			-- Time from `kill' until `wait_seconds' returns.
+		local
+			l_process: SIMPLE_ASYNC_PROCESS
+			l_samples: ARRAYED_LIST [REAL_64]
+			l_start: REAL_64
+			i: INTEGER
+		do
+			create l_samples.make (iterations // 4 + 1)
+			from
+				i := 1
+			until
+				i > iterations // 4 + 1
+			loop
+				create l_process.make
+				l_process.start (idle_command)
+				if l_process.was_started_successfully then
+					l_start := now_us
+					if l_process.kill and then l_process.wait_seconds (5) then
+						l_samples.extend (now_us - l_start)
+					end
+				end
+				l_process.close
+				i := i + 1
+			end
+			report ("wait_wakeup", "us", l_samples)
+		end
+
+	bench_has_command
+			-- Cost of looking a command up in PATH.
+		local
+			l_process: SIMPLE_PROCESS
+			l_samples: ARRAYED_LIST [REAL_64]
+			l_start: REAL_64
+			i: INTEGER
+		do
+			create l_process.make
+			create l_samples.make (iterations * 10)
+			from
+				i := 1
+			until
+				i > iterations * 10
+			loop
+				l_start := now_us
+				if l_process.has_command (path_command) then
+					l_samples.extend (now_us - l_start)
+				end
+				i := i + 1
+			end
+			report ("has_command", "us", l_samples)
+		end
+
+	bench_session_probe
+			-- Round trip of a shell builtin through a warm SIMPLE_SHELL_SESSION.
+		local
+			l_session: SIMPLE_SHELL_SESSION
+			l_samples: ARRAYED_LIST [REAL_64]
+			l_start: REAL_64
+			i: INTEGER
+		do
+			create l_session.make
+			create l_samples.make (iterations * 10)
+			if l_session.is_open then
+				from
+					i := 1
+				until
+					i > iterations * 10
+				loop
+					l_start := now_us
+					l_session.run (probe_command)
+					l_samples.extend (now_us - l_start)
+					i := i + 1
+				end
+				l_session.close
+			end
+			report ("session_probe", "us", l_samples)
+		end
+
+feature {NONE} -- Reporting
+
+	report (a_name, a_unit: STRING; a_samples: ARRAYED_LIST [REAL_64])
+			-- Print min, mean, percentiles and max of `a_samples'.
+		local
+			l_sorter: QUICK_SORTER [REAL_64]
+			l_sum: REAL_64
+		do
+			if a_samples.is_empty then
+				io.error.put_string (a_name + ": no samples%N")
+			else
+				create l_sorter.make (create {COMPARABLE_COMPARATOR [REAL_64]})
+				l_sorter.sort (a_samples)
+				across a_samples as ic loop
+					l_sum := l_sum + ic.item
+				end
+				if is_json then
+					print ("{%"case%":%"" + a_name + "%",%"unit%":%"" + a_unit + "%",%"samples%":" + a_samples.count.out +
+						",%"min%":" + a_samples.first.out + ",%"mean%":" + (l_sum / a_samples.count).out +
+						",%"p50%":" + percentile (a_samples, 50).out + ",%"p90%":" + percentile (a_samples, 90).out +
+						",%"p99%":" + percentile (a_samples, 99).out + ",%"max%":" + a_samples.last.out + "}%N")
+				else
+					print (padded (a_name, 15) + padded (a_unit, 6) + aligned (a_samples.count.out, 7) +
+						aligned (rounded (a_samples.first), 12) + aligned (rounded (l_sum / a_samples.count), 12) +
+						aligned (rounded (percentile (a_samples, 50)), 12) + aligned (rounded (percentile (a_samples, 90)), 12) +
+						aligned (rounded (percentile (a_samples, 99)), 12) + aligned (rounded (a_samples.last), 12) + "%N")
+				end
+			end
+		end
+
+	percentile (a_sorted: ARRAYED_LIST [REAL_64]; a_percent: INTEGER): REAL_64
+			-- Value at `a_percent' of `a_sorted' (nearest rank).
+		require
+			not_empty: not a_sorted.is_empty
+			valid_percent: a_percent >= 0 and a_percent <= 100
+		do
+			Result := a_sorted [(a_percent * a_sorted.count / 100).rounded.max (1).min (a_sorted.count)]
+		end
+
+	rounded (a_value: REAL_64): STRING
+			-- `a_value' with one decimal.
+		local
+			l_format: FORMAT_DOUBLE
+		do
+			create l_format.make (0, 1)
+			Result := l_format.formatted (a_value)
+		end
+
+	padded (a_text: STRING; a_width: INTEGER): STRING
+			-- `a_text' left-aligned in `a_width' columns.
+		do
+			Result := a_text.twin
+			Result.append (create {STRING}.make_filled (' ', (a_width - a_text.count).max (1)))
+		end
+
+	aligned (a_text: STRING; a_width: INTEGER): STRING
+			-- `a_text' right-aligned in `a_width' columns.
+		do
+			Result := create {STRING}.make_filled (' ', (a_width - a_text.count).max (1))
+			Result.append (a_text)
+		end
+
+feature {NONE} -- Implementation
+
+	idle_command: STRING
+			-- Command that runs for a minute without output.
+		do
+			if {PLATFORM}.is_windows then
+				Result := "ping -n 60 127.0.0.1"
+			else
+				Result := "sleep 60"
+			end
+		end
+
+	path_command: STRING
+			-- Command found in PATH.
+		do
+			if {PLATFORM}.is_windows then
+				Result := "cmd.exe"
+			else
+				Result := "sh"
+			end
+		end
+
+	probe_command: STRING
+			-- Shell builtin run by `bench_session_probe'.
+		do
+			if {PLATFORM}.is_windows then
+				Result := "if exist . ver >NUL"
+			else
+				Result := "test -d ."
+			end
+		end
+
+	integer_option (a_option: STRING; a_default: INTEGER): INTEGER
+			-- Value following `-a_option', or `a_default'.
+		local
+			l_index: INTEGER
+		do
+			Result := a_default
+			l_index := index_of_word_option (a_option)
+			if l_index > 0 and l_index < argument_count and then argument (l_index + 1).is_integer then
+				Result := argument (l_index + 1).to_integer.max (1)
+			end
+		end
+
+	now_us: REAL_64
+			-- Microseconds from the monotonic clock.
+		do
+			Result := c_sp_monotonic_ns / 1_000
+		end
+
+	c_sp_monotonic_ns: INTEGER_64
+			-- Nanoseconds from the monotonic clock.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER_64)sp_monotonic_ns();"
+		end
+
+end
@@ -0,0 +1,298 @@
+/*
+ * sp_bench.c - Benchmarks for the hot paths of simple_process.c
+ *
+ * Cases:
+ *   spawn_true       sp_execute_argv of `true' (spawn + exit + reap), us
+ *   capture_1mb      sp_execute_ex capturing 1 MB of output, MB/s
+ *   capture_100mb    sp_execute_ex capturing 100 MB of output, MB/s
+ *   memory_100mb     sp_execute_ex writing 100 MB to a mapped memory file, MB/s
+ *   poll_idle        one sp_read_output sweep over N idle processes, us
+ *   wait_wakeup      sp_kill to sp_wait_timeout returning, us
+ *   has_command      sp_file_in_path of a command found in PATH, us
+ *   session_probe    sp_session_run of a shell builtin in a warm session, us
+ *
+ * Each case reports min, mean, p50, p90, p99 and max over its samples.
+ * With -j every case is printed as one JSON object per line instead of a
+ * table, so results can be stored and compared across releases.
+ *
+ * Build:
+ *   cc -O2 -I../Clib sp_bench.c ../Clib/simple_process.c -o sp_bench
+ *
+ * Usage:
+ *   ./sp_bench [-j] [-n iterations] [-p idle_processes] [case...]
+ *
+ * Copyright (c) 2025 Larry Rix - MIT License
+ */
+
+#include "simple_process.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+#define TRUE_COMMAND {"cmd", "/c", "exit", "0", NULL}
+#define OUTPUT_COMMAND "powershell -NoProfile -Command \"[Console]::Out.Write('x' * %d)\""
+#define IDLE_COMMAND "ping -n 60 127.0.0.1"
+#define PATH_COMMAND "cmd.exe"
+#define PROBE_COMMAND "if exist . ver >NUL"
+#else
+#define TRUE_COMMAND {"true", NULL}
+#define OUTPUT_COMMAND "head -c %d /dev/zero"
+#define IDLE_COMMAND "sleep 60"
+#define PATH_COMMAND "sh"
+#define PROBE_COMMAND "test -d ."
+#endif
+
+static double now_us(void) {
+    return sp_monotonic_ns() / 1e3;
+}
+
+/* ============ SAMPLES ============ */
+
+typedef struct {
+    double* values;
+    int count;
+} samples;
+
+static samples samples_new(int capacity) {
+    samples s;
+    s.values = (double*)malloc((capacity > 0 ? capacity : 1) * sizeof(double));
+    s.count = 0;
+    return s;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Value at percentile `p' (0..100) of sorted `s', nearest rank */
+static double percentile(const samples* s, double p) {
+    int rank = (int)(p / 100.0 * s->count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > s->count) rank = s->count;
+    return s->values[rank - 1];
+}
+
+static int json_output = 0;
+
+static void report(const char* name, const char* unit, samples* s) {
+    double sum = 0;
+    int i;
+
+    if (s->count == 0) {
+        fprintf(stderr, "%s: no samples\n", name);
+        free(s->values);
+        return;
+    }
+    qsort(s->values, s->count, sizeof(double), compare_doubles);
+    for (i = 0; i < s->count; i++) sum += s->values[i];
+    if (json_output) {
+        printf("{\"case\":\"%s\",\"unit\":\"%s\",\"samples\":%d,\"min\":%.3f,\"mean\":%.3f,"
+               "\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}\n",
+               name, unit, s->count, s->values[0], sum / s->count,
+               percentile(s, 50), percentile(s, 90), percentile(s, 99), s->values[s->count - 1]);
+    } else {
+        printf("%-14s %-5s %7d %11.1f %11.1f %11.1f %11.1f %11.1f %11.1f\n",
+               name, unit, s->count, s->values[0], sum / s->count,
+               percentile(s, 50), percentile(s, 90), percentile(s, 99), s->values[s->count - 1]);
+    }
+    fflush(stdout);
+    free(s->values);
+}
+
+/* ============ CASES ============ */
+
+static void bench_spawn_true(int iterations) {
+    const char* argv[] = TRUE_COMMAND;
+    samples s = samples_new(iterations);
+    double start;
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        start = now_us();
+        sp_free_result(sp_execute_argv(argv, NULL, 0));
+        s.values[s.count++] = now_us() - start;
+    }
+    report("spawn_true", "us", &s);
+}
+
+static void bench_capture(const char* name, int bytes, int iterations) {
+    char command[256];
+    sp_options options;
+    sp_result* result;
+    samples s = samples_new(iterations);
+    double start, elapsed;
+    int i;
+
+    snprintf(command, sizeof(command), OUTPUT_COMMAND, bytes);
+    sp_options_init(&options);
+    options.max_output = SP_UNLIMITED_OUTPUT;
+    for (i = 0; i < iterations; i++) {
+        start = now_us();
+        result = sp_execute_ex(command, NULL, NULL, &options);
+        elapsed = now_us() - start;
+        if (result && result->success && result->output_length == bytes) {
+            s.values[s.count++] = bytes / elapsed;  /* bytes per us = MB/s */
+        } else {
+            fprintf(stderr, "%s: captured %d of %d bytes\n", name, result ? result->output_length : 0, bytes);
+        }
+        sp_free_result(result);
+    }
+    report(name, "MB/s", &s);
+}
+
+static void bench_memory(const char* name, int bytes, int iterations) {
+    char command[256];
+    sp_options options;
+    sp_result* result;
+    samples s = samples_new(iterations);
+    double start, elapsed;
+    int i;
+
+    snprintf(command, sizeof(command), OUTPUT_COMMAND, bytes);
+    sp_options_init(&options);
+    options.output_mode = SP_OUTPUT_MEMORY;
+    for (i = 0; i < iterations; i++) {
+        start = now_us();
+        result = sp_execute_ex(command, NULL, NULL, &options);
+        elapsed = now_us() - start;
+        if (result && result->success && result->output_map && result->output_size == bytes) {
+            s.values[s.count++] = bytes / elapsed;
+        } else {
+            fprintf(stderr, "%s: wrote %lld of %d bytes\n", name, result ? result->output_size : 0, bytes);
+        }
+        sp_free_result(result);
+    }
+    report(name, "MB/s", &s);
+}
+
+static void bench_poll_idle(int processes, int iterations) {
+    sp_async_process** procs = (sp_async_process**)malloc(processes * sizeof(sp_async_process*));
+    samples s = samples_new(iterations);
+    double start;
+    char* output;
+    int length, i, k;
+
+    for (k = 0; k < processes; k++) {
+        procs[k] = sp_start_async(IDLE_COMMAND, NULL, 0);
+    }
+    for (i = 0; i < iterations; i++) {
+        start = now_us();
+        for (k = 0; k < processes; k++) {
+            output = sp_read_output(procs[k], &length);
+            free(output);
+        }
+        s.values[s.count++] = now_us() - start;
+    }
+    for (k = 0; k < processes; k++) {
+        sp_kill(procs[k]);
+        sp_wait_timeout(procs[k], 5000);
+        sp_async_close(procs[k]);
+    }
+    free(procs);
+    report("poll_idle", "us", &s);
+}
+
+static void bench_wait_wakeup(int iterations) {
+    samples s = samples_new(iterations);
+    sp_async_process* proc;
+    double start;
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        proc = sp_start_async(IDLE_COMMAND, NULL, 0);
+        if (!proc || !proc->started) {
+            if (proc) sp_async_close(proc);
+            continue;
+        }
+        start = now_us();
+        sp_kill(proc);
+        if (sp_wait_timeout(proc, 5000) == 1) {
+            s.values[s.count++] = now_us() - start;
+        }
+        sp_async_close(proc);
+    }
+    report("wait_wakeup", "us", &s);
+}
+
+static void bench_has_command(int iterations) {
+    samples s = samples_new(iterations);
+    double start;
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        start = now_us();
+        sp_file_in_path(PATH_COMMAND);
+        s.values[s.count++] = now_us() - start;
+    }
+    report("has_command", "us", &s);
+}
+
+static void bench_session_probe(int iterations) {
+    samples s = samples_new(iterations);
+    sp_shell_session* session = sp_session_open(NULL, NULL);
+    double start;
+    int i;
+
+    if (!session) {
+        fprintf(stderr, "session_probe: %s\n", sp_get_last_error());
+        free(s.values);
+        return;
+    }
+    for (i = 0; i < iterations; i++) {
+        start = now_us();
+        sp_free_result(sp_session_run(session, PROBE_COMMAND, 0));
+        s.values[s.count++] = now_us() - start;
+    }
+    sp_session_close(session);
+    report("session_probe", "us", &s);
+}
+
+/* ============ MAIN ============ */
+
+static int selected(int argc, char** argv, int first_case, const char* name) {
+    int i;
+    if (first_case >= argc) return 1;
+    for (i = first_case; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int iterations = 200;
+    int processes = 64;
+    int i = 1;
+
+    while (i < argc && argv[i][0] == '-') {
+        if (strcmp(argv[i], "-j") == 0) {
+            json_output = 1;
+            i++;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[i + 1]);
+            i += 2;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            processes = atoi(argv[i + 1]);
+            i += 2;
+        } else {
+            fprintf(stderr, "Usage: %s [-j] [-n iterations] [-p idle_processes] [case...]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations <= 0 || processes <= 0) return 2;
+
+    if (!json_output) {
+        printf("%-14s %-5s %7s %11s %11s %11s %11s %11s %11s\n",
+               "case", "unit", "samples", "min", "mean", "p50", "p90", "p99", "max");
+    }
+    if (selected(argc, argv, i, "spawn_true")) bench_spawn_true(iterations);
+    if (selected(argc, argv, i, "capture_1mb")) bench_capture("capture_1mb", 1024 * 1024, iterations / 4 + 1);
+    if (selected(argc, argv, i, "capture_100mb")) bench_capture("capture_100mb", 100 * 1024 * 1024, iterations / 40 + 1);
+    if (selected(argc, argv, i, "memory_100mb")) bench_memory("memory_100mb", 100 * 1024 * 1024, iterations / 40 + 1);
+    if (selected(argc, argv, i, "poll_idle")) bench_poll_idle(processes, iterations);
+    if (selected(argc, argv, i, "wait_wakeup")) bench_wait_wakeup(iterations / 4 + 1);
+    if (selected(argc, argv, i, "has_command")) bench_has_command(iterations * 10);
+    if (selected(argc, argv, i, "session_probe")) bench_session_probe(iterations * 10);
+    return 0;
+}
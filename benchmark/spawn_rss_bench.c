@@ -0,0 +1,83 @@
+/*
+ * spawn_rss_bench.c - Spawn latency versus parent RSS
+ *
+ * Grows the resident set of this process in steps and, at each step,
+ * measures the latency of sp_execute_command("true") next to a plain
+ * fork()+exec baseline. With the clone(CLONE_VM|CLONE_VFORK) backend the
+ * simple_process column stays flat while the fork() column grows with RSS.
+ *
+ * Build (POSIX):
+ *   cc -O2 -I../Clib spawn_rss_bench.c ../Clib/simple_process.c -o spawn_rss_bench
+ *
+ * Usage:
+ *   ./spawn_rss_bench [max_rss_mb] [iterations]
+ *
+ * Copyright (c) 2025 Larry Rix - MIT License
+ */
+
+#include "simple_process.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double bench_simple_process(int iterations) {
+    double start = now_us();
+    int i;
+    for (i = 0; i < iterations; i++) {
+        sp_free_result(sp_execute_command("true", NULL, 0));
+    }
+    return (now_us() - start) / iterations;
+}
+
+static double bench_fork(int iterations) {
+    double start = now_us();
+    int i;
+    for (i = 0; i < iterations; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execl("/bin/sh", "sh", "-c", "true", (char*)NULL);
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return (now_us() - start) / iterations;
+}
+
+int main(int argc, char** argv) {
+    int max_rss_mb = (argc > 1) ? atoi(argv[1]) : 2048;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 200;
+    int step_mb = 256;
+    int rss_mb = 0;
+    char** blocks;
+    int block_count = 0;
+
+    blocks = (char**)calloc(max_rss_mb / step_mb + 1, sizeof(char*));
+    if (!blocks) return 1;
+
+    printf("%10s %22s %18s\n", "rss_mb", "simple_process_us", "fork_exec_us");
+    while (1) {
+        printf("%10d %22.1f %18.1f\n", rss_mb,
+               bench_simple_process(iterations), bench_fork(iterations));
+        fflush(stdout);
+        if (rss_mb + step_mb > max_rss_mb) break;
+
+        /* Touch every page so it is really resident */
+        blocks[block_count] = (char*)malloc((size_t)step_mb * 1024 * 1024);
+        if (!blocks[block_count]) break;
+        memset(blocks[block_count], 1, (size_t)step_mb * 1024 * 1024);
+        block_count++;
+        rss_mb += step_mb;
+    }
+
+    while (block_count > 0) free(blocks[--block_count]);
+    free(blocks);
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * utf8_decode_bench.c - Decoding captured output into 32-bit characters
+ *
+ * Decodes a buffer of process output (100 MB by default) with
+ * sp_utf8_decode and with a per-byte loop shaped like the one SIMPLE_PROCESS
+ * used before: a bounds-checked byte read and a capacity-checked append for
+ * every byte, without any UTF-8 decoding. Runs on plain ASCII output and on
+ * text mixing in 2-, 3- and 4-byte characters.
+ *
+ * Build:
+ *   cc -O2 -I../Clib utf8_decode_bench.c ../Clib/simple_process.c -o utf8_decode_bench
+ *
+ * Usage:
+ *   ./utf8_decode_bench [size_mb] [rounds]
+ *
+ * Copyright (c) 2025 Larry Rix - MIT License
+ */
+
+#include "simple_process.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* ---- Per-byte loop, as read_natural_8 + append_character did it ---- */
+
+typedef struct {
+    unsigned int* area;
+    int count;
+    int capacity;
+} wide_string;
+
+static unsigned char (*volatile read_byte)(const char*, int, int);
+
+static unsigned char read_byte_checked(const char* data, int length, int index) {
+    if (index < 0 || index >= length) abort();
+    return (unsigned char)data[index];
+}
+
+static void append_character(wide_string* s, unsigned int c) {
+    if (s->count == s->capacity) {
+        s->capacity = s->capacity * 2 + 16;
+        s->area = realloc(s->area, (size_t)s->capacity * sizeof(unsigned int));
+    }
+    s->area[s->count++] = c;
+}
+
+static int byte_loop(const char* data, int length, wide_string* s) {
+    int i;
+    s->count = 0;
+    for (i = 0; i < length; i++) {
+        unsigned char c = read_byte(data, length, i);
+        if (c != 0) append_character(s, c);
+    }
+    return s->count;
+}
+
+/* ---- Input ---- */
+
+static void fill_ascii(char* data, int length) {
+    static const char line[] = "drwxr-xr-x  2 user group  4096 Jan  1 12:00 some_directory_name\n";
+    int i;
+    for (i = 0; i < length; i++) data[i] = line[i % (sizeof(line) - 1)];
+}
+
+static void fill_mixed(char* data, int length) {
+    static const char line[] = "Gr\xC3\xBC\xC3\x9F" "e, \xE2\x82\xAC" "42 \xF0\x9F\x98\x80 ok, na\xC3\xAFve caf\xC3\xA9 output line\n";
+    int i;
+    for (i = 0; i < length; i++) data[i] = line[i % (sizeof(line) - 1)];
+    /* Do not end inside a character */
+    while (length > 0 && ((unsigned char)data[length - 1] & 0xC0) == 0x80) data[--length] = 'x';
+    if (length > 0 && (unsigned char)data[length - 1] >= 0xC0) data[length - 1] = 'x';
+}
+
+static void run(const char* label, const char* data, int length, int rounds) {
+    unsigned int* decoded = malloc((size_t)length * sizeof(unsigned int));
+    wide_string s = {NULL, 0, 0};
+    double loop_us = 0, decode_us = 0, start;
+    int r, loop_count = 0, decode_count = 0;
+
+    /* Warm up both targets so page faults are not timed */
+    byte_loop(data, length, &s);
+    sp_utf8_decode(data, length, 1, decoded, NULL);
+
+    for (r = 0; r < rounds; r++) {
+        start = now_us();
+        loop_count = byte_loop(data, length, &s);
+        loop_us += now_us() - start;
+
+        start = now_us();
+        decode_count = sp_utf8_decode(data, length, 1, decoded, NULL);
+        decode_us += now_us() - start;
+    }
+    loop_us /= rounds;
+    decode_us /= rounds;
+    printf("%-8s %10d %10d %12.1f %12.1f %8.1fx\n", label, loop_count, decode_count,
+           length / loop_us, length / decode_us, loop_us / decode_us);
+    free(s.area);
+    free(decoded);
+}
+
+int main(int argc, char** argv) {
+    int size_mb = argc > 1 ? atoi(argv[1]) : 100;
+    int rounds = argc > 2 ? atoi(argv[2]) : 3;
+    int length = size_mb * 1024 * 1024;
+    char* data = malloc(length);
+
+    if (!data || size_mb <= 0 || rounds <= 0) return 1;
+    read_byte = read_byte_checked;
+
+    printf("%-8s %10s %10s %12s %12s %9s\n", "input", "loop_chars", "utf8_chars",
+           "loop_MB/s", "utf8_MB/s", "speedup");
+    fill_ascii(data, length);
+    run("ascii", data, length, rounds);
+    fill_mixed(data, length);
+    run("mixed", data, length, rounds);
+
+    free(data);
+    return 0;
+}
@@ -9,6 +9,7 @@ note
 		- Start a process and continue doing other work
 		- Poll for completion with timeout
 		- Read output as it becomes available
+		- Feed input incrementally with `write_input'
 		- Kill processes that exceed time limits
 
 		Usage:
@@ -43,11 +44,18 @@ feature {NONE} -- Initialization
 			-- Initialize async process.
 		do
 			show_window := False
+			is_accumulating_output := True
 			create accumulated_output.make_empty
+			create accumulated_error_output.make_empty
+			create partial_bytes.make (2 * Partial_size)
+			create partial_output_line.make_empty
+			create partial_error_line.make_empty
 		ensure
 			not_started: not is_started
 			no_output: accumulated_output.is_empty
+			no_error_output: accumulated_error_output.is_empty
 			window_hidden: not show_window
+			accumulating: is_accumulating_output
 		end
 
 feature -- Access
@@ -63,27 +71,63 @@ feature -- Access
 
 	exit_code: INTEGER
 			-- Exit code of finished process.
-			-- -1 if still running.
+			-- -1 if still running or killed by a signal.
+			-- Kept once the process has ended, so it can be read any number of times.
 		require
 			started: is_started
 		do
 			Result := c_sp_get_exit_code (async_handle)
 		end
 
+	termination_signal: INTEGER
+			-- Signal that killed the finished process, or 0 if it exited
+			-- (always 0 on Windows).
+		require
+			started: is_started
+		do
+			Result := c_sp_get_termination_signal (async_handle)
+		ensure
+			signaled_only: Result /= 0 implies was_signaled
+		end
+
 	last_error: detachable STRING_32
 			-- Error message if start failed.
 
 	accumulated_output: STRING_32
-			-- All output read so far.
+			-- All output read so far (while `is_accumulating_output').
+
+	accumulated_error_output: STRING_32
+			-- All error output read so far.
+			-- Stays empty unless `is_error_output_separate'.
 
 	elapsed_seconds: INTEGER
-			-- Seconds since process started.
+			-- Whole seconds since process started (its run time once finished).
+		do
+			Result := (elapsed_nanoseconds // 1_000_000_000).to_integer_32
+		end
+
+	elapsed_nanoseconds: INTEGER_64
+			-- Nanoseconds since process started on the monotonic clock,
+			-- or its run time once it has finished. 0 if not started.
+		do
+			if is_started then
+				Result := c_sp_elapsed_ns (async_handle)
+			end
+		ensure
+			not_negative: Result >= 0
+		end
+
+	usage: detachable SIMPLE_PROCESS_USAGE
+			-- CPU time, peak memory, page faults and wall time of the
+			-- finished process, or Void while it is still running.
 		local
-			l_now: SIMPLE_DATE_TIME
+			l_usage: MANAGED_POINTER
 		do
 			if is_started then
-				create l_now.make_now
-				Result := (l_now.to_timestamp - start_time).to_integer_32
+				create l_usage.make (c_sp_usage_size)
+				if c_sp_get_usage (async_handle, l_usage.item) /= 0 then
+					create Result.make_from_pointer (l_usage.item)
+				end
 			end
 		end
 
@@ -111,6 +155,43 @@ feature -- Status
 			definition: Result = (is_started and then not is_running)
 		end
 
+	was_signaled: BOOLEAN
+			-- Was the finished process killed by a signal (`termination_signal')?
+			-- Never on Windows.
+		do
+			if is_started then
+				Result := c_sp_get_state (async_handle) = c_sp_state_signaled
+			end
+		end
+
+	has_dumped_core: BOOLEAN
+			-- Did the signal that killed the process make it dump core?
+		do
+			if is_started then
+				Result := c_sp_core_dumped (async_handle) /= 0
+			end
+		ensure
+			signaled: Result implies was_signaled
+		end
+
+	has_open_output: BOOLEAN
+			-- Can more output still arrive?
+			-- False once the end of every output stream has been read.
+		do
+			if is_started then
+				Result := c_sp_has_open_output (async_handle) /= 0
+			end
+		end
+
+	has_open_input: BOOLEAN
+			-- Is stdin a pipe that is still open?
+			-- Requires `input' or `is_input_kept_open' at start.
+		do
+			if is_started then
+				Result := c_sp_has_open_input (async_handle) /= 0
+			end
+		end
+
 	was_started_successfully: BOOLEAN
 			-- Did the process start without error?
 		do
@@ -134,6 +215,147 @@ feature -- Settings
 			set: show_window = a_value
 		end
 
+	is_error_output_separate: BOOLEAN
+			-- Is stderr read with `read_available_error_output' instead of
+			-- being merged into the output?
+
+	set_separate_error_output (a_value: BOOLEAN)
+			-- Set whether stderr gets its own pipe.
+		require
+			not_started: not is_started
+		do
+			is_error_output_separate := a_value
+		ensure
+			set: is_error_output_separate = a_value
+		end
+
+	is_accumulating_output: BOOLEAN
+			-- Do reads append to `accumulated_output' and `accumulated_error_output'?
+
+	set_accumulate_output (a_value: BOOLEAN)
+			-- Set whether reads are accumulated.
+			-- Turn off when streaming large output chunk by chunk.
+		do
+			is_accumulating_output := a_value
+		ensure
+			set: is_accumulating_output = a_value
+		end
+
+	line_handler: detachable PROCEDURE [STRING_32]
+			-- Called with each complete line of output (without its line
+			-- break) as `read_available_output' reads it.
+
+	set_line_handler (a_handler: detachable PROCEDURE [STRING_32])
+			-- Pass each line of output to `a_handler' (Void to stop).
+		do
+			line_handler := a_handler
+		ensure
+			set: line_handler = a_handler
+		end
+
+	error_line_handler: detachable PROCEDURE [STRING_32]
+			-- Called with each complete line of separate error output.
+
+	set_error_line_handler (a_handler: detachable PROCEDURE [STRING_32])
+			-- Pass each line of separate error output to `a_handler' (Void to stop).
+		do
+			error_line_handler := a_handler
+		ensure
+			set: error_line_handler = a_handler
+		end
+
+	output_tail: detachable SIMPLE_PROCESS_TAIL
+			-- Last lines of output, or Void unless `keep_tail' was called.
+
+	error_output_tail: detachable SIMPLE_PROCESS_TAIL
+			-- Last lines of separate error output, or Void.
+
+	keep_tail (a_line_limit, a_character_limit: INTEGER)
+			-- Keep only the last `a_line_limit' lines (and at most `a_character_limit'
+			-- characters, 0 for no limit) of each stream in `output_tail' and
+			-- `error_output_tail', and stop accumulating, so memory stays flat
+			-- however long the process runs.
+		require
+			positive_line_limit: a_line_limit > 0
+			valid_character_limit: a_character_limit >= 0
+		do
+			create output_tail.make (a_line_limit, a_character_limit)
+			create error_output_tail.make (a_line_limit, a_character_limit)
+			is_accumulating_output := False
+		ensure
+			tails_kept: attached output_tail and attached error_output_tail
+			not_accumulating: not is_accumulating_output
+		end
+
+	input: detachable READABLE_STRING_GENERAL
+			-- Text queued (as UTF-8) for stdin at start, or Void.
+			-- Written while waiting for or reading output.
+
+	set_input (a_text: detachable READABLE_STRING_GENERAL)
+			-- Queue `a_text' for stdin at start.
+		require
+			not_started: not is_started
+		do
+			input := a_text
+		ensure
+			set: input = a_text
+		end
+
+	environment: detachable SIMPLE_PROCESS_ENVIRONMENT
+			-- Environment the process starts with, or Void for ours.
+
+	set_environment (a_environment: detachable SIMPLE_PROCESS_ENVIRONMENT)
+			-- Start the process in `a_environment' (Void for ours).
+		require
+			not_started: not is_started
+			open: attached a_environment implies a_environment.is_open
+		do
+			environment := a_environment
+		ensure
+			set: environment = a_environment
+		end
+
+	resources: detachable SIMPLE_PROCESS_RESOURCES
+			-- Scheduling and resource controls the process starts under, or Void for none.
+
+	set_resources (a_resources: detachable SIMPLE_PROCESS_RESOURCES)
+			-- Start the process under `a_resources' (Void for none).
+		require
+			not_started: not is_started
+		do
+			resources := a_resources
+		ensure
+			set: resources = a_resources
+		end
+
+	input_file: detachable FILE
+			-- Open file the process reads as its stdin, or Void.
+			-- Handed to the child directly; takes precedence over `input'.
+
+	set_input_file (a_file: detachable FILE)
+			-- Let the process read `a_file' as stdin.
+		require
+			not_started: not is_started
+			readable: attached a_file implies a_file.is_open_read
+		do
+			input_file := a_file
+		ensure
+			set: input_file = a_file
+		end
+
+	is_input_kept_open: BOOLEAN
+			-- Does stdin stay open after `input' for `write_input'?
+
+	set_keep_input_open (a_value: BOOLEAN)
+			-- Set whether stdin stays open until `close_input'.
+		require
+			not_started: not is_started
+		do
+			is_input_kept_open := a_value
+		ensure
+			set: is_input_kept_open = a_value
+		end
+
 feature -- Operations
 
 	start (a_command: READABLE_STRING_GENERAL)
@@ -157,14 +379,10 @@ feature -- Operations
 		local
 			l_cmd: C_STRING
 			l_dir: detachable C_STRING
-			l_now: SIMPLE_DATE_TIME
-			l_error_ptr: POINTER
+			l_options: SIMPLE_PROCESS_OPTIONS
 		do
-			-- Reset state
-			last_error := Void
-			accumulated_output.wipe_out
-			create l_now.make_now
-			start_time := l_now.to_timestamp
+			reset_start_state
+			l_options := new_options
 
 			-- Convert strings to C
 			create l_cmd.make (a_command.to_string_8)
@@ -174,24 +392,59 @@ feature -- Operations
 
 			-- Start process
 			if attached l_dir then
-				async_handle := c_sp_start_async (l_cmd.item, l_dir.item, show_window.to_integer)
+				async_handle := c_sp_start_async_ex (l_cmd.item, default_pointer, l_dir.item, l_options.item)
 			else
-				async_handle := c_sp_start_async (l_cmd.item, default_pointer, show_window.to_integer)
+				async_handle := c_sp_start_async_ex (l_cmd.item, default_pointer, default_pointer, l_options.item)
 			end
+			check_start_errors
+		ensure
+			started_or_error: is_started or last_error /= Void
+		end
 
-			-- Check for start errors
-			if async_handle /= default_pointer then
-				if c_sp_async_started (async_handle) = 0 then
-					l_error_ptr := c_sp_async_error (async_handle)
-					if l_error_ptr /= default_pointer then
-						last_error := pointer_to_string (l_error_ptr)
-					else
-						last_error := {STRING_32} "Failed to start process"
-					end
-				end
+	start_argv,
+	execute_argv (a_argv: ARRAY [READABLE_STRING_GENERAL])
+			-- Start program `a_argv [a_argv.lower]' directly, without a shell,
+			-- passing the remaining items as arguments.
+			-- Does not wait for completion.
+		require
+			argv_not_empty: not a_argv.is_empty
+			program_not_empty: not a_argv [a_argv.lower].is_empty
+			not_started: not is_started
+		do
+			start_argv_in_directory (a_argv, Void)
+		ensure
+			started_or_error: is_started or last_error /= Void
+		end
+
+	start_argv_in_directory,
+	execute_argv_in_directory (a_argv: ARRAY [READABLE_STRING_GENERAL]; a_directory: detachable READABLE_STRING_GENERAL)
+			-- Start program `a_argv [a_argv.lower]' directly in `a_directory'.
+			-- Does not wait for completion.
+		require
+			argv_not_empty: not a_argv.is_empty
+			program_not_empty: not a_argv [a_argv.lower].is_empty
+			not_started: not is_started
+		local
+			l_argv: SIMPLE_PROCESS_ARGV
+			l_dir: detachable C_STRING
+			l_options: SIMPLE_PROCESS_OPTIONS
+		do
+			reset_start_state
+			l_options := new_options
+
+			-- Convert strings to C
+			create l_argv.make (a_argv)
+			if attached a_directory as al_dir then
+				create l_dir.make (al_dir.to_string_8)
+			end
+
+			-- Start process
+			if attached l_dir then
+				async_handle := c_sp_start_async_ex (default_pointer, l_argv.item, l_dir.item, l_options.item)
 			else
-				last_error := {STRING_32} "Failed to allocate process structure"
+				async_handle := c_sp_start_async_ex (default_pointer, l_argv.item, default_pointer, l_options.item)
 			end
+			check_start_errors
 		ensure
 			started_or_error: is_started or last_error /= Void
 		end
@@ -199,28 +452,129 @@ feature -- Operations
 	read_available_output: detachable STRING_32
 			-- Read any available output (non-blocking).
 			-- Returns Void if no output available.
-			-- Appends to `accumulated_output'.
+			-- Appends to `accumulated_output', and passes the lines it
+			-- completes to `line_handler' and `output_tail'.
+		require
+			started: is_started
+		do
+			Result := read_stream (False)
+			if attached Result and is_accumulating_output then
+				accumulated_output.append (Result)
+			end
+			if line_handler /= Void or output_tail /= Void then
+				split_lines (Result, partial_output_line, line_handler, output_tail)
+			end
+		end
+
+	read_available_error_output: detachable STRING_32
+			-- Read any available error output (non-blocking).
+			-- Returns Void if none available or stderr is not separate.
+			-- Appends to `accumulated_error_output', and passes the lines it
+			-- completes to `error_line_handler' and `error_output_tail'.
 		require
 			started: is_started
+		do
+			Result := read_stream (True)
+			if attached Result and is_accumulating_output then
+				accumulated_error_output.append (Result)
+			end
+			if error_line_handler /= Void or error_output_tail /= Void then
+				split_lines (Result, partial_error_line, error_line_handler, error_output_tail)
+			end
+		end
+
+	read_output_into (a_buffer: MANAGED_POINTER): INTEGER
+			-- Read available output bytes into `a_buffer' (non-blocking),
+			-- without allocating. Not added to `accumulated_output'.
+			-- Returns: bytes read (0 if none available), -1 once output has ended.
+		require
+			started: is_started
+			buffer_not_empty: a_buffer.count > 0
+		do
+			Result := c_sp_read_output_into (async_handle, a_buffer.item, a_buffer.count)
+		ensure
+			valid_result: Result >= -1 and Result <= a_buffer.count
+		end
+
+	read_error_output_into (a_buffer: MANAGED_POINTER): INTEGER
+			-- Read available error output bytes into `a_buffer' (non-blocking),
+			-- without allocating. Not added to `accumulated_error_output'.
+			-- Returns: bytes read (0 if none available), -1 once it has ended.
+		require
+			started: is_started
+			buffer_not_empty: a_buffer.count > 0
+		do
+			Result := c_sp_read_error_output_into (async_handle, a_buffer.item, a_buffer.count)
+		ensure
+			valid_result: Result >= -1 and Result <= a_buffer.count
+		end
+
+	wait_for_output (a_timeout_ms: INTEGER): INTEGER
+			-- Wait up to `a_timeout_ms' (-1: no limit) until output or error
+			-- output can be read, or a stream has ended.
+			-- Returns: 0 on timeout, -1 on error or when `has_open_output' is False,
+			-- otherwise positive.
+		require
+			started: is_started
+			valid_timeout: a_timeout_ms >= -1
+		do
+			Result := c_sp_wait_output (async_handle, a_timeout_ms)
+		ensure
+			valid_result: Result >= -1
+		end
+
+	write_input (a_text: READABLE_STRING_GENERAL)
+			-- Queue `a_text' (as UTF-8) for stdin, writing what fits without blocking.
+			-- The rest is written by `flush_input', `wait_for_output' and output reads.
+		require
+			started: is_started
+			input_open: has_open_input
 		local
-			l_ptr: POINTER
-			l_len: INTEGER
-			l_managed: MANAGED_POINTER
-			l_chunk: STRING_32
+			l_bytes: C_STRING
+		do
+			create l_bytes.make (utf_8_bytes (a_text))
+			pending_input_count := c_sp_queue_input (async_handle, l_bytes.item, l_bytes.count).max (0)
+		end
+
+	write_input_bytes (a_buffer: MANAGED_POINTER; a_count: INTEGER): INTEGER
+			-- Write up to `a_count' bytes of `a_buffer' to stdin without
+			-- blocking or copying.
+			-- Returns: bytes written (0 if the pipe is full or queued input is
+			-- waiting), -1 if stdin is closed.
+		require
+			started: is_started
+			valid_count: a_count >= 0 and a_count <= a_buffer.count
+		do
+			Result := c_sp_write_input (async_handle, a_buffer.item, a_count)
+		ensure
+			valid_result: Result >= -1 and Result <= a_count
+		end
+
+	flush_input
+			-- Write queued input without blocking.
+		require
+			started: is_started
 		do
-			l_ptr := c_sp_read_output (async_handle, $l_len)
-			if l_ptr /= default_pointer and l_len > 0 then
-				create l_managed.share_from_pointer (l_ptr, l_len)
-				l_chunk := utf8_to_string_32 (l_managed, l_len)
-				accumulated_output.append (l_chunk)
-				Result := l_chunk
-				-- Free the returned buffer
-				c_free (l_ptr)
+			pending_input_count := c_sp_flush_input (async_handle).max (0)
+		end
+
+	close_input
+			-- Close stdin once queued input is written, signalling end of input.
+		require
+			started: is_started
+		do
+			if c_sp_close_input (async_handle) /= 0 then
+				pending_input_count := 0
 			end
 		end
 
+	pending_input_count: INTEGER
+			-- Bytes of input queued but not yet written, as of the last
+			-- `write_input' or `flush_input'.
+
 	wait (a_timeout_ms: INTEGER): INTEGER
 			-- Wait for process to finish with timeout.
+			-- Blocks without polling and returns as soon as the process exits.
 			-- Returns: 1 if finished, 0 if timeout, -1 on error.
 		require
 			started: is_started
@@ -242,7 +596,8 @@ feature -- Operations
 		end
 
 	kill: BOOLEAN
-			-- Kill the running process.
+			-- Kill the running process and everything it started
+			-- (its process group; its job on Windows).
 			-- Returns True on success.
 		require
 			started: is_started
@@ -253,6 +608,21 @@ feature -- Operations
 			still_started: is_started
 		end
 
+	terminate (a_grace_ms: INTEGER): BOOLEAN
+			-- Ask the process and everything it started to stop (SIGTERM),
+			-- then kill them if still running after `a_grace_ms'.
+			-- Windows has no such request, so they are terminated at once.
+			-- Returns True once the process has finished.
+		require
+			started: is_started
+			non_negative_grace: a_grace_ms >= 0
+		do
+			Result := c_sp_terminate (async_handle, a_grace_ms.to_natural_32) /= 0
+		ensure
+			still_started: is_started
+			finished: Result implies not is_running
+		end
+
 	close
 			-- Close and cleanup process handle.
 			-- Must be called when done with process.
@@ -262,6 +632,9 @@ feature -- Operations
 				if attached read_available_output then
 					-- Output captured
 				end
+				if attached read_available_error_output then
+					-- Error output captured
+				end
 				c_sp_async_close (async_handle)
 				async_handle := default_pointer
 			end
@@ -269,34 +642,236 @@ feature -- Operations
 			closed: not is_started
 		end
 
-feature {NONE} -- Implementation
+feature {SIMPLE_PROCESS_GROUP} -- Implementation
 
 	async_handle: POINTER
 			-- Handle to async process structure.
 
-	start_time: INTEGER_64
-			-- Time when process was started (epoch seconds).
+feature {NONE} -- Implementation
 
-feature {NONE} -- String conversion
+	reset_start_state
+			-- Clear state of a previous run.
+		do
+			last_error := Void
+			pending_input_count := 0
+			partial_output_count := 0
+			partial_error_count := 0
+			accumulated_output.wipe_out
+			accumulated_error_output.wipe_out
+			partial_output_line.wipe_out
+			partial_error_line.wipe_out
+			if attached output_tail as l_tail then
+				l_tail.wipe_out
+			end
+			if attached error_output_tail as l_tail then
+				l_tail.wipe_out
+			end
+		ensure
+			no_error: last_error = Void
+			no_output: accumulated_output.is_empty
+			no_error_output: accumulated_error_output.is_empty
+		end
+
+	new_options: SIMPLE_PROCESS_OPTIONS
+			-- C options reflecting current settings.
+		do
+			create Result.make
+			Result.set_show_window (show_window)
+			Result.set_separate_error_output (is_error_output_separate)
+			if attached input as l_input then
+				Result.set_input_data (utf_8_bytes (l_input))
+			end
+			if attached input_file as l_file then
+				Result.set_input_descriptor (l_file.descriptor)
+			end
+			Result.set_keep_input_open (is_input_kept_open)
+			if attached environment as l_environment and then l_environment.is_open then
+				Result.set_environment (l_environment)
+			end
+			Result.set_resources (resources)
+		end
+
+	read_buffer: detachable MANAGED_POINTER
+			-- Reused buffer for `read_stream', created on first read.
 
-	utf8_to_string_32 (a_data: MANAGED_POINTER; a_length: INTEGER): STRING_32
-			-- Convert UTF-8 data to STRING_32.
+	read_stream (a_error: BOOLEAN): detachable STRING_32
+			-- Available output (error output if `a_error') decoded, or Void if none.
+			-- Reads through `read_buffer' until a short read. A character split
+			-- across reads is completed from `partial_bytes' on the next read.
 		local
-			i: INTEGER
-			c: NATURAL_8
+			l_buffer: MANAGED_POINTER
+			l_partial: POINTER
+			l_kept, l_room, l_count, l_total: INTEGER
+			l_more: BOOLEAN
 		do
-			create Result.make (a_length)
+			if attached read_buffer as l_existing then
+				l_buffer := l_existing
+			else
+				create l_buffer.make (Read_buffer_size)
+				read_buffer := l_buffer
+			end
+			if a_error then
+				l_partial := partial_bytes.item + Partial_size
+				l_kept := partial_error_count
+			else
+				l_partial := partial_bytes.item
+				l_kept := partial_output_count
+			end
 			from
-				i := 0
+				l_more := True
 			until
-				i >= a_length
+				not l_more
 			loop
-				c := a_data.read_natural_8 (i)
-				if c /= 0 then
-					Result.append_character (c.to_character_32)
+				if l_kept > 0 then
+					l_buffer.item.memory_copy (l_partial, l_kept)
+				end
+				l_room := l_buffer.count - l_kept
+				if a_error then
+					l_count := c_sp_read_error_output_into (async_handle, l_buffer.item + l_kept, l_room)
+				else
+					l_count := c_sp_read_output_into (async_handle, l_buffer.item + l_kept, l_room)
+				end
+				l_more := l_count = l_room
+				has_read_stream_end := l_count < 0
+				if l_count > 0 or (l_count < 0 and l_kept > 0) then
+					l_total := l_kept + l_count.max (0)
+					if not attached Result then
+						create Result.make (l_total)
+					end
+					l_kept := l_total - append_utf8 (l_buffer.item, l_total, l_count < 0, Result)
+					if l_kept > 0 then
+						l_partial.memory_copy (l_buffer.item + (l_total - l_kept), l_kept)
+					end
+				end
+			end
+			if a_error then
+				partial_error_count := l_kept
+			else
+				partial_output_count := l_kept
+			end
+			if attached Result as l_text and then l_text.is_empty then
+				Result := Void
+			end
+		end
+
+	Read_buffer_size: INTEGER = 65_536
+			-- Size of `read_buffer' (one pipe's worth).
+
+	has_read_stream_end: BOOLEAN
+			-- Did the last `read_stream' reach the end of its stream?
+
+	split_lines (a_text: detachable STRING_32; a_partial: STRING_32;
+			a_handler: detachable PROCEDURE [STRING_32]; a_tail: detachable SIMPLE_PROCESS_TAIL)
+			-- Pass each line completed by `a_text' to `a_handler' and `a_tail'.
+			-- Only `a_text' is scanned; the unfinished last line waits in
+			-- `a_partial' until its line break, the end of the stream, or
+			-- `Longest_line' characters.
+		local
+			l_start, l_break: INTEGER
+			l_line: STRING_32
+		do
+			if attached a_text as l_text then
+				from
+					l_start := 1
+					l_break := l_text.index_of ('%N', l_start)
+				until
+					l_break = 0
+				loop
+					create l_line.make (a_partial.count + l_break - l_start)
+					l_line.append (a_partial)
+					l_line.append_substring (l_text, l_start, l_break - 1)
+					a_partial.wipe_out
+					if not l_line.is_empty and then l_line [l_line.count] = '%R' then
+						l_line.remove_tail (1)
+					end
+					deliver_line (l_line, a_handler, a_tail)
+					l_start := l_break + 1
+					l_break := l_text.index_of ('%N', l_start)
+				end
+				a_partial.append_substring (l_text, l_start, l_text.count)
+			end
+			if not a_partial.is_empty and (has_read_stream_end or a_partial.count >= Longest_line) then
+				deliver_line (a_partial.twin, a_handler, a_tail)
+				a_partial.wipe_out
+			end
+		end
+
+	deliver_line (a_line: STRING_32; a_handler: detachable PROCEDURE [STRING_32]; a_tail: detachable SIMPLE_PROCESS_TAIL)
+			-- Pass `a_line' to `a_handler' and keep it in `a_tail'.
+		do
+			if attached a_handler as l_handler then
+				l_handler.call ([a_line])
+			end
+			if attached a_tail as l_tail then
+				l_tail.extend (a_line)
+			end
+		end
+
+	partial_output_line, partial_error_line: STRING_32
+			-- Start of the line each stream is in the middle of.
+
+	Longest_line: INTEGER = 65_536
+			-- Characters after which a line with no break yet is passed on
+			-- as it is, so an endless line cannot grow without bound.
+
+	partial_bytes: MANAGED_POINTER
+			-- Start of a UTF-8 sequence cut off by the last read: output
+			-- bytes first, error output bytes at offset `Partial_size'.
+
+	partial_output_count, partial_error_count: INTEGER
+			-- Bytes of each stream held in `partial_bytes'.
+
+	Partial_size: INTEGER = 4
+			-- Room per stream in `partial_bytes' (longest UTF-8 sequence).
+
+	check_start_errors
+			-- Set `last_error' if `async_handle' did not start.
+		local
+			l_error_ptr: POINTER
+		do
+			if async_handle /= default_pointer then
+				if c_sp_async_started (async_handle) = 0 then
+					l_error_ptr := c_sp_async_error (async_handle)
+					if l_error_ptr /= default_pointer then
+						last_error := pointer_to_string (l_error_ptr)
+					else
+						last_error := {STRING_32} "Failed to start process"
+					end
 				end
-				i := i + 1
+			else
+				last_error := {STRING_32} "Failed to allocate process structure"
 			end
+		ensure
+			started_or_error: is_started or last_error /= Void
+		end
+
+feature {NONE} -- String conversion
+
+	utf_8_bytes (a_text: READABLE_STRING_GENERAL): STRING_8
+			-- `a_text' encoded as UTF-8.
+		local
+			l_converter: UTF_CONVERTER
+		do
+			Result := l_converter.utf_32_string_to_utf_8_string_8 (a_text)
+		end
+
+	append_utf8 (a_data: POINTER; a_length: INTEGER; a_final: BOOLEAN; a_target: STRING_32): INTEGER
+			-- Decode `a_length' bytes of UTF-8 at `a_data' onto `a_target' in one
+			-- pass and return the bytes used. Unless `a_final', an incomplete
+			-- sequence at the end is left for the caller to complete.
+		require
+			valid_length: a_length >= 0
+		local
+			l_count, l_consumed: INTEGER
+		do
+			a_target.grow (a_target.count + a_length)
+			l_count := c_sp_utf8_decode (a_data, a_length, a_final.to_integer,
+				a_target.area.base_address + a_target.count * {PLATFORM}.character_32_bytes, $l_consumed)
+			a_target.set_count (a_target.count + l_count)
+			Result := l_consumed
+		ensure
+			consumed_in_range: Result >= 0 and Result <= a_length
+			all_used_if_final: a_final implies Result = a_length
 		end
 
 	pointer_to_string (a_ptr: POINTER): STRING_32
@@ -310,12 +885,12 @@ feature {NONE} -- String conversion
 
 feature {NONE} -- C externals
 
-	c_sp_start_async (a_command, a_working_dir: POINTER; a_show_window: INTEGER): POINTER
-			-- Start async process and return handle.
+	c_sp_start_async_ex (a_command, a_argv, a_working_dir, a_options: POINTER): POINTER
+			-- Start command (or argument vector when `a_command' is null) and return handle.
 		external
 			"C inline use %"simple_process.h%""
 		alias
-			"return sp_start_async((const char*)$a_command, (const char*)$a_working_dir, (int)$a_show_window);"
+			"return sp_start_async_ex((const char*)$a_command, (const char* const*)$a_argv, (const char*)$a_working_dir, (const sp_options*)$a_options);"
 		end
 
 	c_sp_is_running (a_proc: POINTER): INTEGER
@@ -350,6 +925,14 @@ feature {NONE} -- C externals
 			"return sp_kill((sp_async_process*)$a_proc);"
 		end
 
+	c_sp_terminate (a_proc: POINTER; a_grace_ms: NATURAL_32): INTEGER
+			-- SIGTERM, then SIGKILL after `a_grace_ms'.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_terminate((sp_async_process*)$a_proc, (unsigned int)$a_grace_ms);"
+		end
+
 	c_sp_get_exit_code (a_proc: POINTER): INTEGER
 			-- Get exit code.
 		external
@@ -358,12 +941,140 @@ feature {NONE} -- C externals
 			"return sp_get_exit_code((sp_async_process*)$a_proc);"
 		end
 
-	c_sp_read_output (a_proc: POINTER; a_len: TYPED_POINTER [INTEGER]): POINTER
-			-- Read available output.
+	c_sp_get_state (a_proc: POINTER): INTEGER
+			-- Get cached state (SP_STATE_*), reaping the process if it has ended.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_get_state((sp_async_process*)$a_proc);"
+		end
+
+	c_sp_get_termination_signal (a_proc: POINTER): INTEGER
+			-- Get signal that killed the process.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_get_termination_signal((sp_async_process*)$a_proc);"
+		end
+
+	c_sp_core_dumped (a_proc: POINTER): INTEGER
+			-- Did the process dump core?
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_core_dumped((sp_async_process*)$a_proc);"
+		end
+
+	c_sp_state_signaled: INTEGER
+			-- SP_STATE_SIGNALED.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return SP_STATE_SIGNALED;"
+		end
+
+	c_sp_get_usage (a_proc, a_usage: POINTER): INTEGER
+			-- Copy usage of finished process into `a_usage'; 0 while running.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_get_usage((sp_async_process*)$a_proc, (sp_usage*)$a_usage);"
+		end
+
+	c_sp_usage_size: INTEGER
+			-- Size of sp_usage in bytes.
 		external
 			"C inline use %"simple_process.h%""
 		alias
-			"return sp_read_output((sp_async_process*)$a_proc, (int*)$a_len);"
+			"return (EIF_INTEGER)sizeof(sp_usage);"
+		end
+
+	c_sp_elapsed_ns (a_proc: POINTER): INTEGER_64
+			-- Get nanoseconds since start.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER_64)sp_elapsed_ns((sp_async_process*)$a_proc);"
+		end
+
+	c_sp_utf8_decode (a_source: POINTER; a_length, a_final: INTEGER; a_target, a_consumed: POINTER): INTEGER
+			-- Decode `a_length' UTF-8 bytes at `a_source' into `a_target', returning the character count.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_utf8_decode((const char*)$a_source, (int)$a_length, (int)$a_final, (unsigned int*)$a_target, (int*)$a_consumed);"
+		end
+
+	c_sp_read_output_into (a_proc, a_buffer: POINTER; a_capacity: INTEGER): INTEGER
+			-- Read available output into buffer.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_read_output_into((sp_async_process*)$a_proc, (char*)$a_buffer, (int)$a_capacity);"
+		end
+
+	c_sp_read_error_output_into (a_proc, a_buffer: POINTER; a_capacity: INTEGER): INTEGER
+			-- Read available error output into buffer.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_read_error_output_into((sp_async_process*)$a_proc, (char*)$a_buffer, (int)$a_capacity);"
+		end
+
+	c_sp_wait_output (a_proc: POINTER; a_timeout_ms: INTEGER): INTEGER
+			-- Wait for output.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_wait_output((sp_async_process*)$a_proc, (int)$a_timeout_ms);"
+		end
+
+	c_sp_has_open_output (a_proc: POINTER): INTEGER
+			-- Is any output stream still open?
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_has_open_output((sp_async_process*)$a_proc);"
+		end
+
+	c_sp_write_input (a_proc, a_data: POINTER; a_length: INTEGER): INTEGER
+			-- Write to stdin without blocking.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_write_input((sp_async_process*)$a_proc, (const char*)$a_data, (int)$a_length);"
+		end
+
+	c_sp_queue_input (a_proc, a_data: POINTER; a_length: INTEGER): INTEGER
+			-- Queue input for stdin.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_queue_input((sp_async_process*)$a_proc, (const char*)$a_data, (int)$a_length);"
+		end
+
+	c_sp_flush_input (a_proc: POINTER): INTEGER
+			-- Write queued input.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_flush_input((sp_async_process*)$a_proc);"
+		end
+
+	c_sp_close_input (a_proc: POINTER): INTEGER
+			-- Close stdin once queued input is written.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_close_input((sp_async_process*)$a_proc);"
+		end
+
+	c_sp_has_open_input (a_proc: POINTER): INTEGER
+			-- Is the stdin pipe open?
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_has_open_input((sp_async_process*)$a_proc);"
 		end
 
 	c_sp_async_close (a_proc: POINTER)
@@ -390,14 +1101,6 @@ feature {NONE} -- C externals
 			"return ((sp_async_process*)$a_proc)->error_message;"
 		end
 
-	c_free (a_ptr: POINTER)
-			-- Free C memory.
-		external
-			"C inline use <stdlib.h>"
-		alias
-			"free($a_ptr);"
-		end
-
 feature -- Model Queries
 
 	output_byte_count: INTEGER
@@ -412,6 +1115,8 @@ feature -- Model Queries
 
 invariant
 	output_exists: accumulated_output /= Void
+	error_output_exists: accumulated_error_output /= Void
 	output_count_consistent: output_byte_count = accumulated_output.count
+	partial_counts_valid: partial_output_count < Partial_size and partial_error_count < Partial_size
 
 end
\ No newline at end of file
@@ -19,9 +19,13 @@ feature {NONE} -- Initialization
 			-- Initialize process executor.
 		do
 			show_window := False
+			output_limit := {SIMPLE_PROCESS_OPTIONS}.Default_output_limit
+			kill_grace_period := {SIMPLE_PROCESS_OPTIONS}.Default_kill_grace_period
 			execution_count_impl := 0
 		ensure
 			window_hidden: not show_window
+			default_limit: output_limit = {SIMPLE_PROCESS_OPTIONS}.Default_output_limit
+			no_timeout: timeout = {SIMPLE_PROCESS_OPTIONS}.No_timeout
 			no_executions: execution_count = 0
 		end
 
@@ -40,12 +44,46 @@ feature -- Access
 	status_code: INTEGER
 			-- Exit code from last command execution
 
+	last_stage_exit_codes: detachable ARRAY [INTEGER]
+			-- Exit code of each stage of last execution, first stage first.
+			-- One item unless it was a pipeline; the last is `last_exit_code'.
+
+	last_usage: detachable SIMPLE_PROCESS_USAGE
+			-- CPU time, peak memory, page faults and wall time of last
+			-- execution (all stages of a pipeline), or Void if it failed.
+
 	last_error,
 	error_message,
 	stderr,
 	failure_reason: detachable STRING_32
 			-- Error message if execution failed
 
+	last_error_output,
+	error_output,
+	captured_error_output: detachable STRING_32
+			-- Standard error of last command execution.
+			-- Void unless `is_error_output_separate'; otherwise stderr
+			-- is part of `last_output'.
+
+	is_output_truncated,
+	output_truncated: BOOLEAN
+			-- Was output past `output_limit' dropped in last execution?
+			-- The child still ran to completion; handlers saw all of it.
+
+	has_timed_out,
+	timed_out: BOOLEAN
+			-- Was last execution stopped for running past `timeout'?
+			-- `last_output' holds what it wrote until then.
+
+	last_output_size: INTEGER_64
+			-- Bytes the last execution wrote to `output_file_name' or memory
+			-- (0 when output was captured into `last_output').
+
+	last_output_view: detachable SIMPLE_PROCESS_OUTPUT_VIEW
+			-- Mapped output of the last execution when `is_output_in_memory'
+			-- or `is_output_mapped', or Void (also when nothing was written).
+			-- Valid until the next execution or its `close'.
+
 	was_successful,
 	succeeded,
 	ok,
@@ -67,6 +105,233 @@ feature -- Settings
 			execution_count_unchanged: execution_count = old execution_count
 		end
 
+	output_limit: INTEGER
+			-- Bytes of output kept in `last_output' (and `last_error_output'),
+			-- or `{SIMPLE_PROCESS_OPTIONS}.Unlimited_output'.
+			-- Output past the limit is still read, so the child never
+			-- fails on a closed pipe.
+
+	set_output_limit (a_bytes: INTEGER)
+			-- Keep at most `a_bytes' of output per stream.
+		require
+			non_negative: a_bytes >= 0
+		do
+			output_limit := a_bytes
+		ensure
+			set: output_limit = a_bytes
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	set_unlimited_output
+			-- Keep all output, however large.
+		do
+			output_limit := {SIMPLE_PROCESS_OPTIONS}.Unlimited_output
+		ensure
+			unlimited: is_output_unlimited
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	is_output_unlimited: BOOLEAN
+			-- Is all output kept?
+		do
+			Result := output_limit = {SIMPLE_PROCESS_OPTIONS}.Unlimited_output
+		end
+
+	timeout: INTEGER
+			-- Milliseconds an execution may run before it is stopped,
+			-- or `{SIMPLE_PROCESS_OPTIONS}.No_timeout'.
+
+	set_timeout (a_milliseconds: INTEGER)
+			-- Stop executions still running after `a_milliseconds'
+			-- (`{SIMPLE_PROCESS_OPTIONS}.No_timeout' for no limit).
+			-- The child and everything it started get SIGTERM, then SIGKILL
+			-- after `kill_grace_period' (Windows: terminated at once).
+		require
+			non_negative: a_milliseconds >= 0
+		do
+			timeout := a_milliseconds
+		ensure
+			set: timeout = a_milliseconds
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	kill_grace_period: INTEGER
+			-- Milliseconds a timed-out child has between SIGTERM and SIGKILL.
+
+	set_kill_grace_period (a_milliseconds: INTEGER)
+			-- Give a timed-out child `a_milliseconds' to exit after SIGTERM.
+		require
+			non_negative: a_milliseconds >= 0
+		do
+			kill_grace_period := a_milliseconds
+		ensure
+			set: kill_grace_period = a_milliseconds
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	output_handler: detachable PROCEDURE [STRING_32]
+			-- Called with each chunk of output as it arrives.
+			-- Receives stderr too unless `is_error_output_separate'.
+
+	error_output_handler: detachable PROCEDURE [STRING_32]
+			-- Called with each chunk of separate error output as it arrives.
+
+	set_output_handler (a_handler: detachable PROCEDURE [STRING_32])
+			-- Stream output to `a_handler' (Void to stop streaming).
+		do
+			output_handler := a_handler
+		ensure
+			set: output_handler = a_handler
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	set_error_output_handler (a_handler: detachable PROCEDURE [STRING_32])
+			-- Stream separate error output to `a_handler' (Void to stop streaming).
+		do
+			error_output_handler := a_handler
+		ensure
+			set: error_output_handler = a_handler
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	is_streaming: BOOLEAN
+			-- Is output passed to a handler as it arrives?
+		do
+			Result := output_handler /= Void or error_output_handler /= Void
+		ensure
+			definition: Result = (output_handler /= Void or error_output_handler /= Void)
+		end
+
+	is_error_output_separate: BOOLEAN
+			-- Is stderr captured into `last_error_output' instead of `last_output'?
+
+	set_separate_error_output (a_value: BOOLEAN)
+			-- Set whether stderr is captured apart from stdout.
+			-- Both streams are drained concurrently, so neither can block the child.
+		do
+			is_error_output_separate := a_value
+		ensure
+			set: is_error_output_separate = a_value
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	input: detachable READABLE_STRING_GENERAL
+			-- Text written (as UTF-8) to stdin of each execution, or Void
+			-- to let the child inherit stdin.
+
+	set_input (a_text: detachable READABLE_STRING_GENERAL)
+			-- Feed `a_text' to stdin of each execution.
+			-- Input is written in step with reading output, so any size is safe.
+		do
+			input := a_text
+		ensure
+			set: input = a_text
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	output_file_name: detachable READABLE_STRING_GENERAL
+			-- File the child writes its output to directly, or Void.
+
+	set_output_file (a_name: detachable READABLE_STRING_GENERAL)
+			-- Let the child write stdout (and stderr unless separate) straight
+			-- into file `a_name', created or truncated (Void to capture again).
+			-- Nothing passes through this process: `last_output' stays empty,
+			-- `output_limit' and handlers do not apply, and the size is in
+			-- `last_output_size'.
+		require
+			name_not_empty: attached a_name implies not a_name.is_empty
+		do
+			output_file_name := a_name
+			if attached a_name then
+				is_output_in_memory := False
+			end
+		ensure
+			set: output_file_name = a_name
+			not_in_memory: attached a_name implies not is_output_in_memory
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	is_output_in_memory: BOOLEAN
+			-- Does the child write its output into an anonymous memory file
+			-- (memfd on Linux), read back through `last_output_view'?
+
+	set_output_in_memory (a_value: BOOLEAN)
+			-- Set whether the child writes its output into a memory file.
+			-- As with `set_output_file', nothing is copied or limited.
+		do
+			is_output_in_memory := a_value
+			if a_value then
+				output_file_name := Void
+			end
+		ensure
+			set: is_output_in_memory = a_value
+			no_file: a_value implies output_file_name = Void
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	is_output_mapped: BOOLEAN
+			-- Is `output_file_name' also mapped as `last_output_view'?
+
+	set_map_output (a_value: BOOLEAN)
+			-- Set whether the output file is mapped as `last_output_view'.
+			-- The file must not be truncated while the view is open.
+		do
+			is_output_mapped := a_value
+		ensure
+			set: is_output_mapped = a_value
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	is_output_redirected: BOOLEAN
+			-- Does the child write its output to a file instead of to us?
+		do
+			Result := output_file_name /= Void or is_output_in_memory
+		ensure
+			definition: Result = (output_file_name /= Void or is_output_in_memory)
+		end
+
+	environment: detachable SIMPLE_PROCESS_ENVIRONMENT
+			-- Environment of each execution, or Void to pass on ours.
+
+	set_environment (a_environment: detachable SIMPLE_PROCESS_ENVIRONMENT)
+			-- Run each execution in `a_environment' (Void for ours).
+			-- The same environment can serve any number of executions.
+		require
+			open: attached a_environment implies a_environment.is_open
+		do
+			environment := a_environment
+		ensure
+			set: environment = a_environment
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	resources: detachable SIMPLE_PROCESS_RESOURCES
+			-- Scheduling and resource controls of each execution, or Void for none.
+
+	set_resources (a_resources: detachable SIMPLE_PROCESS_RESOURCES)
+			-- Let each execution's children apply `a_resources' (Void for none).
+		do
+			resources := a_resources
+		ensure
+			set: resources = a_resources
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
+	input_file: detachable FILE
+			-- Open file whose remaining contents follow `input' on stdin, or Void.
+
+	set_input_file (a_file: detachable FILE)
+			-- Feed the contents of `a_file' to stdin of the next execution.
+			-- Copied in the kernel (splice) where the platform allows.
+		require
+			readable: attached a_file implies a_file.is_open_read
+		do
+			input_file := a_file
+		ensure
+			set: input_file = a_file
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
 feature -- Model Queries
 
 	execution_count: INTEGER
@@ -120,64 +385,164 @@ feature -- Execution
 		local
 			l_cmd: C_STRING
 			l_dir: detachable C_STRING
+			l_options: SIMPLE_PROCESS_OPTIONS
+			l_async: SIMPLE_ASYNC_PROCESS
 			l_result: POINTER
-			l_output_ptr: POINTER
-			l_output_len: INTEGER
-			l_error_ptr: POINTER
-			l_managed: MANAGED_POINTER
 		do
-			-- Reset state
-			last_output := Void
-			last_error := Void
-			last_exit_code := 0
-			was_successful := False
+			reset_last_result
+			if is_streaming and not is_output_redirected then
+				l_async := new_streaming_process
+				l_async.start_in_directory (a_command, a_directory)
+				store_streamed_result (l_async)
+			else
+				l_options := new_options
 
-			-- Convert strings to C
-			create l_cmd.make (a_command.to_string_8)
-			if attached a_directory as al_dir then
-				create l_dir.make (al_dir.to_string_8)
+				-- Convert strings to C
+				create l_cmd.make (a_command.to_string_8)
+				if attached a_directory as al_dir then
+					create l_dir.make (al_dir.to_string_8)
+				end
+
+				-- Execute command
+				if attached l_dir then
+					l_result := c_sp_execute_ex (l_cmd.item, default_pointer, l_dir.item, l_options.item)
+				else
+					l_result := c_sp_execute_ex (l_cmd.item, default_pointer, default_pointer, l_options.item)
+				end
+				store_result (l_result)
 			end
 
-			-- Execute command
-			if attached l_dir then
-				l_result := c_sp_execute_command (l_cmd.item, l_dir.item, show_window.to_integer)
+			-- Update model state
+			last_command := a_command
+			execution_count_impl := execution_count_impl + 1
+		ensure
+			execution_recorded: execution_count = old execution_count + 1
+			command_recorded: attached last_command as lc and then lc.same_string (a_command)
+		end
+
+	execute_argv,
+	run_argv (a_argv: ARRAY [READABLE_STRING_GENERAL])
+			-- Execute program `a_argv [a_argv.lower]' directly, without a shell,
+			-- passing the remaining items as arguments, and capture output.
+			-- The program is looked up in PATH; no quoting is needed.
+		require
+			argv_not_empty: not a_argv.is_empty
+			program_not_empty: not a_argv [a_argv.lower].is_empty
+		do
+			execute_argv_in_directory (a_argv, Void)
+		ensure
+			execution_recorded: execution_count = old execution_count + 1
+			command_recorded: last_command /= Void
+		end
+
+	execute_argv_in_directory,
+	run_argv_in (a_argv: ARRAY [READABLE_STRING_GENERAL]; a_directory: detachable READABLE_STRING_GENERAL)
+			-- Execute program `a_argv [a_argv.lower]' directly in `a_directory'
+			-- and capture output.
+		require
+			argv_not_empty: not a_argv.is_empty
+			program_not_empty: not a_argv [a_argv.lower].is_empty
+		local
+			l_argv: SIMPLE_PROCESS_ARGV
+			l_dir: detachable C_STRING
+			l_options: SIMPLE_PROCESS_OPTIONS
+			l_async: SIMPLE_ASYNC_PROCESS
+			l_result: POINTER
+		do
+			reset_last_result
+			if is_streaming and not is_output_redirected then
+				l_async := new_streaming_process
+				l_async.start_argv_in_directory (a_argv, a_directory)
+				store_streamed_result (l_async)
 			else
-				l_result := c_sp_execute_command (l_cmd.item, default_pointer, show_window.to_integer)
-			end
+				l_options := new_options
 
-			if l_result /= default_pointer then
-				-- Extract results from C structure
-				was_successful := c_sp_result_success (l_result) /= 0
-				last_exit_code := c_sp_result_exit_code (l_result)
+				-- Convert strings to C
+				create l_argv.make (a_argv)
+				if attached a_directory as al_dir then
+					create l_dir.make (al_dir.to_string_8)
+				end
 
-				if was_successful then
-					l_output_ptr := c_sp_result_output (l_result)
-					l_output_len := c_sp_result_output_length (l_result)
-					if l_output_ptr /= default_pointer and l_output_len > 0 then
-						create l_managed.share_from_pointer (l_output_ptr, l_output_len)
-						last_output := utf8_to_string_32 (l_managed, l_output_len)
-					else
-						create last_output.make_empty
-					end
+				-- Execute program
+				if attached l_dir then
+					l_result := c_sp_execute_ex (default_pointer, l_argv.item, l_dir.item, l_options.item)
 				else
-					l_error_ptr := c_sp_result_error (l_result)
-					if l_error_ptr /= default_pointer then
-						last_error := pointer_to_string (l_error_ptr)
-					end
+					l_result := c_sp_execute_ex (default_pointer, l_argv.item, default_pointer, l_options.item)
 				end
+				store_result (l_result)
+			end
 
-				-- Free C result
-				c_sp_free_result (l_result)
+			-- Update model state
+			last_command := joined_arguments (a_argv)
+			execution_count_impl := execution_count_impl + 1
+		ensure
+			execution_recorded: execution_count = old execution_count + 1
+			command_recorded: last_command /= Void
+		end
+
+	execute_pipeline,
+	run_pipeline (a_stages: ARRAY [ARRAY [READABLE_STRING_GENERAL]])
+			-- Execute the programs of `a_stages' directly, without a shell, each
+			-- stage's output feeding the next stage's input, and capture the
+			-- output of the last stage (like `a | b | c').
+			-- Every stage's status is in `last_stage_exit_codes'.
+		require
+			stages_not_empty: not a_stages.is_empty
+			programs_not_empty: across a_stages as ic all not ic.item.is_empty and then not ic.item [ic.item.lower].is_empty end
+		do
+			execute_pipeline_in_directory (a_stages, Void)
+		ensure
+			execution_recorded: execution_count = old execution_count + 1
+			command_recorded: last_command /= Void
+			stages_reported: was_successful implies attached last_stage_exit_codes as l_codes and then l_codes.count = a_stages.count
+		end
+
+	execute_pipeline_in_directory,
+	run_pipeline_in (a_stages: ARRAY [ARRAY [READABLE_STRING_GENERAL]]; a_directory: detachable READABLE_STRING_GENERAL)
+			-- Execute the pipeline `a_stages' in `a_directory' and capture the
+			-- output of the last stage. `input' feeds the first stage.
+			-- Handlers receive the output once the pipeline has finished.
+		require
+			stages_not_empty: not a_stages.is_empty
+			programs_not_empty: across a_stages as ic all not ic.item.is_empty and then not ic.item [ic.item.lower].is_empty end
+		local
+			l_argvs: ARRAYED_LIST [SIMPLE_PROCESS_ARGV]
+			l_stages: MANAGED_POINTER
+			l_dir: detachable C_STRING
+			l_options: SIMPLE_PROCESS_OPTIONS
+			l_result: POINTER
+		do
+			reset_last_result
+			l_options := new_options
+
+			-- Convert stages to a C array of argument vectors
+			create l_argvs.make (a_stages.count)
+			create l_stages.make (a_stages.count * {PLATFORM}.pointer_bytes)
+			across a_stages as ic loop
+				l_argvs.extend (create {SIMPLE_PROCESS_ARGV}.make (ic.item))
+				l_stages.put_pointer (l_argvs.last.item, (l_argvs.count - 1) * {PLATFORM}.pointer_bytes)
+			end
+			if attached a_directory as al_dir then
+				create l_dir.make (al_dir.to_string_8)
+			end
+
+			-- Execute pipeline
+			if attached l_dir then
+				l_result := c_sp_execute_pipeline (l_stages.item, a_stages.count, l_dir.item, l_options.item)
 			else
-				last_error := {STRING_32} "Failed to execute command"
+				l_result := c_sp_execute_pipeline (l_stages.item, a_stages.count, default_pointer, l_options.item)
+			end
+			store_result (l_result)
+			if is_streaming and not is_output_redirected then
+				deliver_captured_output
 			end
 
 			-- Update model state
-			last_command := a_command
+			last_command := joined_stages (a_stages)
 			execution_count_impl := execution_count_impl + 1
 		ensure
 			execution_recorded: execution_count = old execution_count + 1
-			command_recorded: attached last_command as lc and then lc.same_string (a_command)
+			command_recorded: last_command /= Void
 		end
 
 	output_of_command,
@@ -239,33 +604,440 @@ feature -- Query
 			execution_unchanged: execution_count = old execution_count
 		end
 
+	resolve_command,
+	command_path (a_name: READABLE_STRING_GENERAL): detachable STRING_32
+			-- Full path of the executable `a_name' runs as, found in PATH
+			-- without starting a shell, or Void if there is none.
+			-- Lookups are cached until PATH or one of its directories changes.
+		require
+			name_not_empty: not a_name.is_empty
+		local
+			l_name: C_STRING
+			l_path: MANAGED_POINTER
+			l_length: INTEGER
+		do
+			create l_name.make (a_name.to_string_8)
+			create l_path.make (Command_path_capacity)
+			l_length := c_sp_resolve_command (l_name.item, l_path.item, l_path.count)
+			if l_length > 0 then
+				Result := utf8_to_string_32 (l_path.item, l_length)
+			end
+		ensure
+			execution_unchanged: execution_count = old execution_count
+		end
+
+feature -- Spawn server
+
+	is_spawn_server_running: BOOLEAN
+			-- Are processes spawned by the spawn server instead of this process?
+		do
+			Result := c_sp_spawn_server_is_running /= 0
+		end
+
+	start_spawn_server
+			-- Fork a small helper that spawns all later processes for this one
+			-- (POSIX), so spawn cost stops depending on this process's heap and
+			-- threads. Call it early, before the program grows or starts threads;
+			-- setting SP_SPAWN_SERVER=1 starts it when the library is loaded.
+			-- Has no effect on Windows.
+		do
+			if c_sp_spawn_server_start = 0 then
+				last_error := pointer_to_string (c_sp_get_last_error)
+			end
+		ensure
+			execution_unchanged: execution_count = old execution_count
+		end
+
+	stop_spawn_server
+			-- Spawn from this process again.
+		do
+			c_sp_spawn_server_stop
+		ensure
+			stopped: not is_spawn_server_running
+		end
+
+feature -- Tracing
+
+	is_tracing: BOOLEAN
+			-- Is the lifecycle of every child being written to a trace file?
+		do
+			Result := c_sp_trace_is_active /= 0
+		end
+
+	start_trace (a_path: READABLE_STRING_GENERAL)
+			-- Write the lifecycle of every child started from now on, by any
+			-- process object in this program, to `a_path' as a Chrome trace
+			-- (open it in chrome://tracing or ui.perfetto.dev). Each child gets
+			-- a track with spawn requested, exec done, first output, eof and
+			-- reaped events; setting SP_TRACE=<path> traces the whole run.
+		require
+			path_not_empty: not a_path.is_empty
+		local
+			l_path: C_STRING
+		do
+			create l_path.make (a_path.to_string_8)
+			if c_sp_trace_start (l_path.item) = 0 then
+				last_error := pointer_to_string (c_sp_get_last_error)
+			end
+		ensure
+			execution_unchanged: execution_count = old execution_count
+		end
+
+	stop_trace
+			-- Finish and close the trace file.
+		do
+			c_sp_trace_stop
+		ensure
+			stopped: not is_tracing
+		end
+
 feature {NONE} -- Model Implementation
 
 	execution_count_impl: INTEGER
 			-- Internal counter for execution tracking.
 
-feature {NONE} -- String conversion
+feature {NONE} -- Implementation
 
-	utf8_to_string_32 (a_data: MANAGED_POINTER; a_length: INTEGER): STRING_32
-			-- Convert UTF-8 data to STRING_32.
+	reset_last_result
+			-- Clear results of the previous execution.
+		do
+			last_output := Void
+			last_error := Void
+			last_error_output := Void
+			last_exit_code := 0
+			last_stage_exit_codes := Void
+			last_usage := Void
+			is_output_truncated := False
+			has_timed_out := False
+			last_output_size := 0
+			if attached last_output_view as l_view then
+				l_view.close
+				last_output_view := Void
+			end
+			was_successful := False
+		ensure
+			not_successful: not was_successful
+		end
+
+	store_result (a_result: POINTER)
+			-- Extract results from C structure `a_result' and free it.
+		local
+			l_output_ptr: POINTER
+			l_output_len: INTEGER
+			l_error_ptr: POINTER
+			l_map: POINTER
+		do
+			if a_result /= default_pointer then
+				-- Extract results from C structure
+				was_successful := c_sp_result_success (a_result) /= 0
+				last_exit_code := c_sp_result_exit_code (a_result)
+				is_output_truncated := c_sp_result_output_truncated (a_result) /= 0
+				has_timed_out := c_sp_result_timed_out (a_result) /= 0
+
+				if was_successful then
+					store_stage_exit_codes (a_result)
+					create last_usage.make_from_pointer (c_sp_result_usage (a_result))
+					l_output_ptr := c_sp_result_output (a_result)
+					l_output_len := c_sp_result_output_length (a_result)
+					if l_output_ptr /= default_pointer and l_output_len > 0 then
+						last_output := utf8_to_string_32 (l_output_ptr, l_output_len)
+					else
+						create last_output.make_empty
+					end
+					l_output_ptr := c_sp_result_error_output (a_result)
+					if l_output_ptr /= default_pointer then
+						l_output_len := c_sp_result_error_output_length (a_result)
+						last_error_output := utf8_to_string_32 (l_output_ptr, l_output_len)
+					end
+					last_output_size := c_sp_result_output_size (a_result)
+					l_map := c_sp_result_output_map (a_result)
+					if l_map /= default_pointer then
+						-- The view owns the mapping from now on
+						create last_output_view.make (l_map, last_output_size)
+						c_sp_result_clear_output_map (a_result)
+					end
+				else
+					l_error_ptr := c_sp_result_error (a_result)
+					if l_error_ptr /= default_pointer then
+						last_error := pointer_to_string (l_error_ptr)
+					end
+				end
+
+				-- Free C result
+				c_sp_free_result (a_result)
+			else
+				last_error := {STRING_32} "Failed to execute command"
+			end
+		end
+
+	store_streamed_result (a_async: SIMPLE_ASYNC_PROCESS)
+			-- Pass output of started `a_async' to the handlers until it ends,
+			-- keep up to `output_limit' of it, then wait for exit and close.
+			-- Stops `a_async' once it has run for `timeout'.
+		local
+			l_output: STRING_32
+			l_error: detachable STRING_32
+			l_output_bytes, l_error_bytes: INTEGER
+		do
+			if a_async.was_started_successfully then
+				stream_start_time := c_sp_monotonic_ns - a_async.elapsed_nanoseconds
+				create l_output.make_empty
+				if is_error_output_separate then
+					create l_error.make_empty
+				end
+				from
+				until
+					has_timed_out or not a_async.has_open_output
+						or else a_async.wait_for_output (remaining_time (a_async)) < 0
+				loop
+					if attached a_async.read_available_output as l_chunk then
+						l_output_bytes := deliver_chunk (l_chunk, output_handler, l_output, l_output_bytes)
+					end
+					if attached l_error and then attached a_async.read_available_error_output as l_chunk then
+						l_error_bytes := deliver_chunk (l_chunk, error_output_handler, l_error, l_error_bytes)
+					end
+					enforce_timeout (a_async)
+				end
+				from
+				until
+					a_async.wait (exit_wait_time (a_async)) /= 0
+				loop
+					-- Output ended before exit
+					enforce_timeout (a_async)
+				end
+				last_exit_code := a_async.exit_code
+				last_stage_exit_codes := << last_exit_code >>
+				last_usage := a_async.usage
+				last_output := l_output
+				last_error_output := l_error
+				was_successful := True
+			else
+				last_error := a_async.last_error
+			end
+			a_async.close
+		end
+
+	stream_start_time: INTEGER_64
+			-- Monotonic nanoseconds at which the process being streamed started.
+
+	remaining_time (a_async: SIMPLE_ASYNC_PROCESS): INTEGER
+			-- Milliseconds `a_async' may still run under `timeout' (-1: no limit).
+			-- Counts on after `a_async' exits, while what it started holds its output open.
+		do
+			if timeout = {SIMPLE_PROCESS_OPTIONS}.No_timeout then
+				Result := -1
+			else
+				Result := (timeout.to_integer_64 - (c_sp_monotonic_ns - stream_start_time) // 1_000_000).max (0).to_integer_32
+			end
+		ensure
+			valid_result: Result >= -1
+		end
+
+	exit_wait_time (a_async: SIMPLE_ASYNC_PROCESS): INTEGER
+			-- Milliseconds to wait for `a_async' to exit before checking `timeout' again.
+		do
+			Result := remaining_time (a_async)
+			if Result < 0 or Result > 1_000 then
+				Result := 1_000
+			end
+		ensure
+			valid_result: Result >= 0 and Result <= 1_000
+		end
+
+	enforce_timeout (a_async: SIMPLE_ASYNC_PROCESS)
+			-- Stop `a_async' (and everything it started) once it has run for `timeout'.
+		do
+			if not has_timed_out and remaining_time (a_async) = 0 then
+				has_timed_out := True
+				if a_async.terminate (kill_grace_period) then
+					-- Finished; exit code is the signal's
+				end
+			end
+		end
+
+	store_stage_exit_codes (a_result: POINTER)
+			-- Copy the per-stage exit codes of C result `a_result'.
 		local
+			l_codes: ARRAY [INTEGER]
 			i: INTEGER
-			c: NATURAL_8
 		do
-			create Result.make (a_length)
+			create l_codes.make_filled (0, 1, c_sp_result_stage_count (a_result))
 			from
-				i := 0
+				i := 1
 			until
-				i >= a_length
+				i > l_codes.count
 			loop
-				c := a_data.read_natural_8 (i)
-				if c /= 0 then
-					Result.append_character (c.to_character_32)
+				l_codes [i] := c_sp_result_stage_exit_code (a_result, i - 1)
+				i := i + 1
+			end
+			last_stage_exit_codes := l_codes
+		end
+
+	deliver_captured_output
+			-- Pass the captured output of the last execution to the handlers.
+		do
+			if attached output_handler as l_handler and attached last_output as l_output then
+				l_handler.call ([l_output])
+			end
+			if attached error_output_handler as l_handler and attached last_error_output as l_error then
+				l_handler.call ([l_error])
+			end
+		end
+
+	deliver_chunk (a_chunk: STRING_32; a_handler: detachable PROCEDURE [STRING_32]; a_kept: STRING_32; a_kept_bytes: INTEGER): INTEGER
+			-- Pass `a_chunk' to `a_handler' and append the whole characters that
+			-- fit in `output_limit' to `a_kept', which holds `a_kept_bytes' bytes
+			-- of UTF-8 output. The limit counts bytes, as for captured output.
+			-- Returns: UTF-8 bytes held in `a_kept' afterwards.
+		local
+			i, l_bytes: INTEGER
+		do
+			if attached a_handler as l_handler then
+				l_handler.call ([a_chunk])
+			end
+			Result := a_kept_bytes + utf_8_byte_count (a_chunk)
+			if is_output_unlimited or else Result <= output_limit then
+				a_kept.append (a_chunk)
+			else
+				from
+					Result := a_kept_bytes
+					i := 1
+					l_bytes := 0
+				until
+					i > a_chunk.count or Result + l_bytes > output_limit
+				loop
+					l_bytes := character_utf_8_byte_count (a_chunk [i])
+					if Result + l_bytes <= output_limit then
+						a_kept.append_character (a_chunk [i])
+						Result := Result + l_bytes
+						l_bytes := 0
+					end
+					i := i + 1
 				end
+				is_output_truncated := True
+			end
+		end
+
+	utf_8_byte_count (a_text: READABLE_STRING_32): INTEGER
+			-- Bytes `a_text' takes encoded as UTF-8.
+		local
+			i: INTEGER
+		do
+			from
+				i := 1
+			until
+				i > a_text.count
+			loop
+				Result := Result + character_utf_8_byte_count (a_text [i])
 				i := i + 1
 			end
 		end
 
+	character_utf_8_byte_count (a_character: CHARACTER_32): INTEGER
+			-- Bytes `a_character' takes encoded as UTF-8.
+		do
+			if a_character.natural_32_code < 0x80 then
+				Result := 1
+			elseif a_character.natural_32_code < 0x800 then
+				Result := 2
+			elseif a_character.natural_32_code < 0x10000 then
+				Result := 3
+			else
+				Result := 4
+			end
+		end
+
+	new_streaming_process: SIMPLE_ASYNC_PROCESS
+			-- Unstarted async process reflecting current settings.
+		do
+			create Result.make
+			Result.set_show_window (show_window)
+			Result.set_separate_error_output (is_error_output_separate)
+			Result.set_accumulate_output (False)
+			Result.set_input (input)
+			Result.set_input_file (input_file)
+			if attached environment as l_environment and then l_environment.is_open then
+				Result.set_environment (l_environment)
+			end
+			Result.set_resources (resources)
+		end
+
+	new_options: SIMPLE_PROCESS_OPTIONS
+			-- C options reflecting current settings.
+		do
+			create Result.make
+			Result.set_show_window (show_window)
+			Result.set_separate_error_output (is_error_output_separate)
+			Result.set_output_limit (output_limit)
+			Result.set_timeout (timeout)
+			Result.set_kill_grace_period (kill_grace_period)
+			if attached environment as l_environment and then l_environment.is_open then
+				Result.set_environment (l_environment)
+			end
+			Result.set_resources (resources)
+			if attached output_file_name as l_name then
+				Result.set_output_file (l_name.to_string_8)
+				Result.set_map_output (is_output_mapped)
+			elseif is_output_in_memory then
+				Result.set_output_in_memory
+			end
+			if attached input as l_input then
+				Result.set_input_data (utf_8_bytes (l_input))
+			end
+			if attached input_file as l_file then
+				Result.set_input_descriptor (l_file.descriptor)
+			end
+		end
+
+	joined_arguments (a_argv: ARRAY [READABLE_STRING_GENERAL]): STRING_32
+			-- Items of `a_argv' separated by spaces (for `last_command').
+		do
+			create Result.make (32)
+			across a_argv as ic loop
+				if not Result.is_empty then
+					Result.append_character (' ')
+				end
+				Result.append_string_general (ic.item)
+			end
+		end
+
+	joined_stages (a_stages: ARRAY [ARRAY [READABLE_STRING_GENERAL]]): STRING_32
+			-- Stages of `a_stages' separated by ` | ' (for `last_command').
+		do
+			create Result.make (64)
+			across a_stages as ic loop
+				if not Result.is_empty then
+					Result.append ({STRING_32} " | ")
+				end
+				Result.append (joined_arguments (ic.item))
+			end
+		end
+
+	Command_path_capacity: INTEGER = 4096
+			-- Bytes available for a path from `resolve_command' (PATH_MAX).
+
+feature {NONE} -- String conversion
+
+	utf_8_bytes (a_text: READABLE_STRING_GENERAL): STRING_8
+			-- `a_text' encoded as UTF-8.
+		local
+			l_converter: UTF_CONVERTER
+		do
+			Result := l_converter.utf_32_string_to_utf_8_string_8 (a_text)
+		end
+
+	utf8_to_string_32 (a_data: POINTER; a_length: INTEGER): STRING_32
+			-- Decode `a_length' bytes of UTF-8 at `a_data' in one pass
+			-- (invalid sequences become U+FFFD).
+		require
+			valid_length: a_length >= 0
+		do
+			create Result.make (a_length)
+			Result.set_count (c_sp_utf8_decode (a_data, a_length, 1, Result.area.base_address, default_pointer))
+		ensure
+			not_longer: Result.count <= a_length
+		end
+
 	pointer_to_string (a_ptr: POINTER): STRING_32
 			-- Convert C string pointer to STRING_32.
 		local
@@ -277,12 +1049,28 @@ feature {NONE} -- String conversion
 
 feature {NONE} -- C externals
 
-	c_sp_execute_command (a_command, a_working_dir: POINTER; a_show_window: INTEGER): POINTER
-			-- Execute command and return result pointer.
+	c_sp_execute_ex (a_command, a_argv, a_working_dir, a_options: POINTER): POINTER
+			-- Execute command (or argument vector when `a_command' is null) and return result pointer.
 		external
 			"C inline use %"simple_process.h%""
 		alias
-			"return sp_execute_command((const char*)$a_command, (const char*)$a_working_dir, (int)$a_show_window);"
+			"return sp_execute_ex((const char*)$a_command, (const char* const*)$a_argv, (const char*)$a_working_dir, (const sp_options*)$a_options);"
+		end
+
+	c_sp_execute_pipeline (a_stages: POINTER; a_count: INTEGER; a_working_dir, a_options: POINTER): POINTER
+			-- Execute `a_count' argument vectors as a pipeline and return result pointer.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_execute_pipeline((const char* const* const*)$a_stages, (int)$a_count, (const char*)$a_working_dir, (const sp_options*)$a_options);"
+		end
+
+	c_sp_utf8_decode (a_source: POINTER; a_length, a_final: INTEGER; a_target, a_consumed: POINTER): INTEGER
+			-- Decode `a_length' UTF-8 bytes at `a_source' into `a_target', returning the character count.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_utf8_decode((const char*)$a_source, (int)$a_length, (int)$a_final, (unsigned int*)$a_target, (int*)$a_consumed);"
 		end
 
 	c_sp_free_result (a_result: POINTER)
@@ -325,6 +1113,86 @@ feature {NONE} -- C externals
 			"return ((sp_result*)$a_result)->output_length;"
 		end
 
+	c_sp_result_error_output (a_result: POINTER): POINTER
+			-- Get error output pointer from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->error_output;"
+		end
+
+	c_sp_result_error_output_length (a_result: POINTER): INTEGER
+			-- Get error output length from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->error_output_length;"
+		end
+
+	c_sp_result_output_truncated (a_result: POINTER): INTEGER
+			-- Get truncation flag from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->output_truncated;"
+		end
+
+	c_sp_result_timed_out (a_result: POINTER): INTEGER
+			-- Get timed_out flag from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->timed_out;"
+		end
+
+	c_sp_result_output_size (a_result: POINTER): INTEGER_64
+			-- Get output file size from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER_64)((sp_result*)$a_result)->output_size;"
+		end
+
+	c_sp_result_output_map (a_result: POINTER): POINTER
+			-- Get output view from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_POINTER)((sp_result*)$a_result)->output_map;"
+		end
+
+	c_sp_result_clear_output_map (a_result: POINTER)
+			-- Detach output view from result, so freeing it keeps the mapping.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_result*)$a_result)->output_map = NULL;"
+		end
+
+	c_sp_result_usage (a_result: POINTER): POINTER
+			-- Get address of usage in result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return &((sp_result*)$a_result)->usage;"
+		end
+
+	c_sp_result_stage_count (a_result: POINTER): INTEGER
+			-- Get number of stages from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->stage_count;"
+		end
+
+	c_sp_result_stage_exit_code (a_result: POINTER; a_index: INTEGER): INTEGER
+			-- Get exit code of stage `a_index' (0-based) from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->stage_exit_codes[$a_index];"
+		end
+
 	c_sp_result_error (a_result: POINTER): POINTER
 			-- Get error message pointer from result.
 		external
@@ -341,9 +1209,85 @@ feature {NONE} -- C externals
 			"return sp_file_in_path((const char*)$a_filename);"
 		end
 
+	c_sp_resolve_command (a_name, a_buffer: POINTER; a_capacity: INTEGER): INTEGER
+			-- Resolve command into `a_buffer', returning the path length (0 if not found).
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_resolve_command((const char*)$a_name, (char*)$a_buffer, (int)$a_capacity);"
+		end
+
+	c_sp_spawn_server_start: INTEGER
+			-- Start the spawn server.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_spawn_server_start();"
+		end
+
+	c_sp_spawn_server_is_running: INTEGER
+			-- Is the spawn server in use?
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_spawn_server_is_running();"
+		end
+
+	c_sp_spawn_server_stop
+			-- Stop routing spawns through the server.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"sp_spawn_server_stop();"
+		end
+
+	c_sp_trace_start (a_path: POINTER): INTEGER
+			-- Start writing a trace to `a_path'.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_trace_start((const char*)$a_path);"
+		end
+
+	c_sp_trace_is_active: INTEGER
+			-- Is a trace being written?
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_trace_is_active();"
+		end
+
+	c_sp_trace_stop
+			-- Close the trace file.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"sp_trace_stop();"
+		end
+
+	c_sp_monotonic_ns: INTEGER_64
+			-- Nanoseconds on the monotonic clock.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_monotonic_ns();"
+		end
+
+	c_sp_get_last_error: POINTER
+			-- Get last error message.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (char*)sp_get_last_error();"
+		end
+
 invariant
 	execution_count_non_negative: execution_count >= 0
 	has_executed_consistency: has_executed = (execution_count > 0)
 	success_state_consistency: was_successful implies last_output /= Void
+	valid_output_limit: output_limit >= 0 or is_output_unlimited
+	valid_timeout: timeout >= 0
+	output_file_or_memory: not (output_file_name /= Void and is_output_in_memory)
+	valid_kill_grace_period: kill_grace_period >= 0
 
 end
\ No newline at end of file
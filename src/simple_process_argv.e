@@ -0,0 +1,66 @@
+note
+	description: "[
+		NULL-terminated C argument vector (char**) built from Eiffel strings.
+		Keeps the underlying C strings alive while the vector is referenced.
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_PROCESS_ARGV
+
+create
+	make
+
+feature {NONE} -- Initialization
+
+	make (a_arguments: ITERABLE [READABLE_STRING_GENERAL])
+			-- Build vector from `a_arguments'.
+		local
+			i: INTEGER
+		do
+			create strings.make (8)
+			across a_arguments as ic loop
+				strings.extend (create {C_STRING}.make (ic.item.to_string_8))
+			end
+			create pointers.make ((strings.count + 1) * {PLATFORM}.pointer_bytes)
+			from
+				i := 1
+			until
+				i > strings.count
+			loop
+				pointers.put_pointer (strings.i_th (i).item, (i - 1) * {PLATFORM}.pointer_bytes)
+				i := i + 1
+			end
+			pointers.put_pointer (default_pointer, strings.count * {PLATFORM}.pointer_bytes)
+		end
+
+feature -- Access
+
+	item: POINTER
+			-- Address of the char* array.
+		do
+			Result := pointers.item
+		end
+
+	count: INTEGER
+			-- Number of arguments (excluding the NULL terminator).
+		do
+			Result := strings.count
+		ensure
+			definition: Result = strings.count
+		end
+
+feature {NONE} -- Implementation
+
+	strings: ARRAYED_LIST [C_STRING]
+			-- C copies of the arguments.
+
+	pointers: MANAGED_POINTER
+			-- char* array pointing into `strings'.
+
+invariant
+	terminated_array: pointers.count = (strings.count + 1) * {PLATFORM}.pointer_bytes
+
+end
@@ -0,0 +1,352 @@
+note
+	description: "[
+		Runs a list of commands with at most `max_parallel' running at once
+		and collects one SIMPLE_PROCESS_RESULT per command, in the order the
+		commands were added. By default every command runs; with fail-fast
+		the first failure kills the running commands and skips the rest.
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_PROCESS_BATCH
+
+create
+	make
+
+feature {NONE} -- Initialization
+
+	make
+			-- Create an empty batch running one command per CPU.
+		do
+			create commands.make (8)
+			create directories.make (8)
+			create argvs.make (8)
+			create results.make (0)
+			create options.make
+			max_parallel := c_sp_cpu_count
+		ensure
+			empty: count = 0
+			collect_all: not is_fail_fast
+			no_results: results.is_empty
+		end
+
+feature -- Access
+
+	count: INTEGER
+			-- Number of commands added.
+		do
+			Result := commands.count
+		end
+
+	max_parallel: INTEGER
+			-- Most commands running at once.
+
+	results: ARRAYED_LIST [SIMPLE_PROCESS_RESULT]
+			-- Results of the last `execute', in the order commands were added.
+
+	options: SIMPLE_PROCESS_OPTIONS
+			-- Options applied to every command (stdin descriptor not used).
+
+feature -- Status
+
+	is_fail_fast: BOOLEAN
+			-- Does the first failure stop the batch?
+
+	all_succeeded: BOOLEAN
+			-- Did every command of the last `execute' run and exit with code 0?
+		do
+			Result := across results as ic all ic.item.has_succeeded end
+		end
+
+feature -- Element change
+
+	add (a_command: READABLE_STRING_GENERAL; a_directory: detachable READABLE_STRING_GENERAL)
+			-- Add shell command `a_command', run in `a_directory' (Void: current directory).
+		require
+			command_not_empty: not a_command.is_empty
+		do
+			commands.extend (a_command.to_string_32)
+			argvs.extend (Void)
+			extend_directory (a_directory)
+		ensure
+			one_more: count = old count + 1
+		end
+
+	add_argv (a_argv: ARRAY [READABLE_STRING_GENERAL]; a_directory: detachable READABLE_STRING_GENERAL)
+			-- Add program `a_argv [1]' with arguments `a_argv [2..]', run directly
+			-- (no shell) in `a_directory' (Void: current directory).
+		require
+			has_program: not a_argv.is_empty and then not a_argv [a_argv.lower].is_empty
+		local
+			l_command: STRING_32
+		do
+			create l_command.make (40)
+			across a_argv as ic loop
+				if not l_command.is_empty then
+					l_command.append_character (' ')
+				end
+				l_command.append_string_general (ic.item)
+			end
+			commands.extend (l_command)
+			argvs.extend (create {SIMPLE_PROCESS_ARGV}.make (a_argv))
+			extend_directory (a_directory)
+		ensure
+			one_more: count = old count + 1
+		end
+
+	wipe_out
+			-- Remove all commands and results.
+		do
+			commands.wipe_out
+			directories.wipe_out
+			argvs.wipe_out
+			results.wipe_out
+		ensure
+			empty: count = 0
+			no_results: results.is_empty
+		end
+
+feature -- Settings
+
+	set_max_parallel (a_count: INTEGER)
+			-- Run at most `a_count' commands at once.
+		require
+			positive: a_count > 0
+		do
+			max_parallel := a_count
+		ensure
+			set: max_parallel = a_count
+		end
+
+	set_fail_fast (a_value: BOOLEAN)
+			-- Set whether the first failure (start error or non-zero exit) stops the batch.
+		do
+			is_fail_fast := a_value
+		ensure
+			set: is_fail_fast = a_value
+		end
+
+	set_separate_error_output (a_value: BOOLEAN)
+			-- Set whether stderr of each command is captured apart from stdout.
+		do
+			options.set_separate_error_output (a_value)
+		ensure
+			set: options.is_error_output_separate = a_value
+		end
+
+	set_output_limit (a_bytes: INTEGER)
+			-- Keep at most `a_bytes' of output per stream of each command.
+		require
+			valid_limit: a_bytes >= 0
+		do
+			options.set_output_limit (a_bytes)
+		ensure
+			set: options.output_limit = a_bytes
+		end
+
+	set_unlimited_output
+			-- Keep all output of each command.
+		do
+			options.set_output_limit ({SIMPLE_PROCESS_OPTIONS}.Unlimited_output)
+		ensure
+			unlimited: options.is_output_unlimited
+		end
+
+	set_timeout (a_milliseconds: INTEGER)
+			-- Stop each command still running `a_milliseconds' after it started
+			-- (`{SIMPLE_PROCESS_OPTIONS}.No_timeout' for no limit).
+		require
+			non_negative: a_milliseconds >= 0
+		do
+			options.set_timeout (a_milliseconds)
+		ensure
+			set: options.timeout = a_milliseconds
+		end
+
+	set_kill_grace_period (a_milliseconds: INTEGER)
+			-- Give a timed-out command `a_milliseconds' to exit after SIGTERM.
+		require
+			non_negative: a_milliseconds >= 0
+		do
+			options.set_kill_grace_period (a_milliseconds)
+		ensure
+			set: options.kill_grace_period = a_milliseconds
+		end
+
+	set_environment (a_environment: detachable SIMPLE_PROCESS_ENVIRONMENT)
+			-- Run each command in `a_environment' (Void for ours).
+		require
+			open: attached a_environment implies a_environment.is_open
+		do
+			options.set_environment (a_environment)
+		ensure
+			set: options.environment = a_environment
+		end
+
+	set_resources (a_resources: detachable SIMPLE_PROCESS_RESOURCES)
+			-- Let each command apply `a_resources' as they are now (Void for none).
+		do
+			options.set_resources (a_resources)
+		ensure
+			set: options.resources = a_resources
+		end
+
+feature -- Execution
+
+	execute
+			-- Run all commands and fill `results'.
+		require
+			has_commands: count > 0
+		local
+			l_entries: MANAGED_POINTER
+			l_strings: ARRAYED_LIST [C_STRING]
+			l_command, l_directory: POINTER
+			l_results: POINTER
+			l_entry_size, l_mode, i: INTEGER
+		do
+			l_entry_size := c_sp_batch_command_size
+			create l_entries.make (count * l_entry_size)
+			create l_strings.make (count * 2)
+			from
+				i := 1
+			until
+				i > count
+			loop
+				l_command := default_pointer
+				l_directory := default_pointer
+				if argvs.i_th (i) = Void then
+					l_strings.extend (create {C_STRING}.make (commands.i_th (i).to_string_8))
+					l_command := l_strings.last.item
+				end
+				if attached directories.i_th (i) as l_dir then
+					l_strings.extend (create {C_STRING}.make (l_dir.to_string_8))
+					l_directory := l_strings.last.item
+				end
+				if attached argvs.i_th (i) as l_argv then
+					c_set_batch_command (l_entries.item + (i - 1) * l_entry_size, l_command, l_argv.item, l_directory)
+				else
+					c_set_batch_command (l_entries.item + (i - 1) * l_entry_size, l_command, default_pointer, l_directory)
+				end
+				i := i + 1
+			end
+			if is_fail_fast then
+				l_mode := c_sp_batch_fail_fast
+			else
+				l_mode := c_sp_batch_collect_all
+			end
+
+			create results.make (count)
+			l_results := c_sp_execute_batch (l_entries.item, count, max_parallel, l_mode, options.item)
+			if l_results /= default_pointer then
+				from
+					i := 1
+				until
+					i > count
+				loop
+					results.extend (create {SIMPLE_PROCESS_RESULT}.make_from_pointer (c_batch_result (l_results, i - 1), commands.i_th (i)))
+					i := i + 1
+				end
+				c_sp_free_batch (l_results, count)
+			end
+		ensure
+			one_result_per_command: results.count = count or results.is_empty
+		end
+
+feature {NONE} -- Implementation
+
+	commands: ARRAYED_LIST [STRING_32]
+			-- Command lines (for argv entries, the arguments joined by spaces).
+
+	directories: ARRAYED_LIST [detachable STRING_32]
+			-- Working directory of each command.
+
+	argvs: ARRAYED_LIST [detachable SIMPLE_PROCESS_ARGV]
+			-- Argument vector of each command run without a shell.
+
+	extend_directory (a_directory: detachable READABLE_STRING_GENERAL)
+			-- Record `a_directory' for the command just added.
+		do
+			if attached a_directory as l_dir then
+				directories.extend (l_dir.to_string_32)
+			else
+				directories.extend (Void)
+			end
+		end
+
+feature {NONE} -- C externals
+
+	c_sp_cpu_count: INTEGER
+			-- Number of online CPUs.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_cpu_count();"
+		end
+
+	c_sp_batch_command_size: INTEGER
+			-- Size of sp_batch_command in bytes.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER)sizeof(sp_batch_command);"
+		end
+
+	c_sp_batch_collect_all: INTEGER
+			-- SP_BATCH_COLLECT_ALL.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return SP_BATCH_COLLECT_ALL;"
+		end
+
+	c_sp_batch_fail_fast: INTEGER
+			-- SP_BATCH_FAIL_FAST.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return SP_BATCH_FAIL_FAST;"
+		end
+
+	c_set_batch_command (a_entry, a_command, a_argv, a_directory: POINTER)
+			-- Fill the sp_batch_command at `a_entry'.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"[
+				((sp_batch_command*)$a_entry)->command = (const char*)$a_command;
+				((sp_batch_command*)$a_entry)->argv = (const char* const*)$a_argv;
+				((sp_batch_command*)$a_entry)->working_dir = (const char*)$a_directory;
+			]"
+		end
+
+	c_sp_execute_batch (a_commands: POINTER; a_count, a_max_parallel, a_mode: INTEGER; a_options: POINTER): POINTER
+			-- Run the batch; returns an array of sp_result*.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_execute_batch((const sp_batch_command*)$a_commands, (int)$a_count, (int)$a_max_parallel, (int)$a_mode, (const sp_options*)$a_options);"
+		end
+
+	c_batch_result (a_results: POINTER; a_index: INTEGER): POINTER
+			-- Result at zero-based `a_index'.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result**)$a_results)[$a_index];"
+		end
+
+	c_sp_free_batch (a_results: POINTER; a_count: INTEGER)
+			-- Free the batch results.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"sp_free_batch((sp_result**)$a_results, (int)$a_count);"
+		end
+
+invariant
+	aligned_lists: directories.count = commands.count and argvs.count = commands.count
+	positive_parallelism: max_parallel > 0
+
+end
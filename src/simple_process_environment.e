@@ -0,0 +1,198 @@
+note
+	description: "[
+		Environment for child processes, prepared once and given to any
+		number of executions. Starts as a copy of this process's environment
+		(`make_inherited') or empty (`make_empty'). Each change rebuilds a
+		ready envp array in one C allocation, so spawning with it parses
+		and copies nothing. Released by `close'.
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_PROCESS_ENVIRONMENT
+
+create
+	make_inherited,
+	make_empty
+
+feature {NONE} -- Initialization
+
+	make_inherited
+			-- Start from the current environment of this process.
+		do
+			item := c_sp_env_create (1)
+		end
+
+	make_empty
+			-- Start with no variables.
+		do
+			item := c_sp_env_create (0)
+		ensure
+			empty: is_open implies count = 0
+		end
+
+feature -- Access
+
+	item: POINTER
+			-- Address of the sp_environment, or null once closed.
+
+	count: INTEGER
+			-- Number of variables children get.
+		require
+			open: is_open
+		do
+			Result := c_sp_env_count (item)
+		end
+
+	value (a_name: READABLE_STRING_GENERAL): detachable STRING_32
+			-- Value of variable `a_name', or Void if children do not get it.
+		require
+			open: is_open
+			valid_name: is_valid_name (a_name)
+		local
+			l_name: C_STRING
+			l_value: POINTER
+			l_converter: UTF_CONVERTER
+		do
+			create l_name.make (utf_8_bytes (a_name))
+			l_value := c_sp_env_get (item, l_name.item)
+			if l_value /= default_pointer then
+				Result := l_converter.utf_8_string_8_to_string_32 ((create {C_STRING}.make_by_pointer (l_value)).string)
+			end
+		end
+
+feature -- Status
+
+	is_open: BOOLEAN
+			-- Can the environment still be used?
+		do
+			Result := item /= default_pointer
+		end
+
+	has (a_name: READABLE_STRING_GENERAL): BOOLEAN
+			-- Do children get variable `a_name'?
+		require
+			open: is_open
+			valid_name: is_valid_name (a_name)
+		do
+			Result := value (a_name) /= Void
+		end
+
+	is_valid_name (a_name: READABLE_STRING_GENERAL): BOOLEAN
+			-- Can `a_name' name a variable?
+		do
+			Result := not a_name.is_empty and not a_name.has ('=')
+		end
+
+feature -- Element change
+
+	set_variable (a_name, a_value: READABLE_STRING_GENERAL)
+			-- Give children variable `a_name' with `a_value', replacing an inherited value.
+			-- Do not change the environment while an execution using it is starting.
+		require
+			open: is_open
+			valid_name: is_valid_name (a_name)
+		local
+			l_name, l_value: C_STRING
+		do
+			create l_name.make (utf_8_bytes (a_name))
+			create l_value.make (utf_8_bytes (a_value))
+			last_change_succeeded := c_sp_env_set (item, l_name.item, l_value.item) /= 0
+		ensure
+			set: last_change_succeeded implies (attached value (a_name) as l_set and then l_set.same_string_general (a_value))
+		end
+
+	remove_variable (a_name: READABLE_STRING_GENERAL)
+			-- Do not give children variable `a_name', inherited or set.
+		require
+			open: is_open
+			valid_name: is_valid_name (a_name)
+		local
+			l_name: C_STRING
+		do
+			create l_name.make (utf_8_bytes (a_name))
+			last_change_succeeded := c_sp_env_unset (item, l_name.item) /= 0
+		ensure
+			removed: last_change_succeeded implies not has (a_name)
+		end
+
+	last_change_succeeded: BOOLEAN
+			-- Did the last `set_variable' or `remove_variable' take effect?
+			-- False only if memory ran out.
+
+feature -- Basic operations
+
+	close
+			-- Release the environment. Executions must no longer use it.
+		do
+			if is_open then
+				c_sp_env_free (item)
+				item := default_pointer
+			end
+		ensure
+			closed: not is_open
+		end
+
+feature {NONE} -- Implementation
+
+	utf_8_bytes (a_text: READABLE_STRING_GENERAL): STRING_8
+			-- `a_text' encoded as UTF-8.
+		local
+			l_converter: UTF_CONVERTER
+		do
+			Result := l_converter.utf_32_string_to_utf_8_string_8 (a_text)
+		end
+
+feature {NONE} -- C externals
+
+	c_sp_env_create (a_inherit: INTEGER): POINTER
+			-- Create an environment, inheriting ours unless `a_inherit' is 0.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_env_create((int)$a_inherit);"
+		end
+
+	c_sp_env_set (a_env, a_name, a_value: POINTER): INTEGER
+			-- Set a variable.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_env_set((sp_environment*)$a_env, (const char*)$a_name, (const char*)$a_value);"
+		end
+
+	c_sp_env_unset (a_env, a_name: POINTER): INTEGER
+			-- Remove a variable.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_env_unset((sp_environment*)$a_env, (const char*)$a_name);"
+		end
+
+	c_sp_env_get (a_env, a_name: POINTER): POINTER
+			-- Value of a variable, or null.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_POINTER)sp_env_get((const sp_environment*)$a_env, (const char*)$a_name);"
+		end
+
+	c_sp_env_count (a_env: POINTER): INTEGER
+			-- Number of variables.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_env_count((const sp_environment*)$a_env);"
+		end
+
+	c_sp_env_free (a_env: POINTER)
+			-- Free the environment.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"sp_env_free((sp_environment*)$a_env);"
+		end
+
+end
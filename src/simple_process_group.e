@@ -0,0 +1,283 @@
+note
+	description: "[
+		Group of asynchronous processes supervised together.
+
+		Members share one C process set (epoll on Linux), so a supervisor
+		waits on all of them at once and only visits the ones that have
+		output or have exited - O(ready) per wait instead of O(members)
+		on Linux. A process is a member of at most one group at a time.
+
+		Usage:
+			group: SIMPLE_PROCESS_GROUP
+			create group.make
+			group.add (async_1)
+			group.add (async_2)
+			from until group.is_empty loop
+				if group.wait_any (1_000) > 0 then
+					across group.processes_with_output as ic loop
+						if attached ic.item.read_available_output as out then
+							print (out)
+						end
+					end
+					across group.exited_processes as ic loop
+						group.remove (ic.item)
+						ic.item.close
+					end
+				end
+			end
+			group.close
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_PROCESS_GROUP
+
+create
+	make
+
+feature {NONE} -- Initialization
+
+	make
+			-- Initialize empty group.
+		do
+			set_handle := c_sp_process_set_create
+			create members.make (16)
+			create processes_with_output.make (0)
+			create processes_with_error_output.make (0)
+			create exited_processes.make (0)
+		ensure
+			empty: is_empty
+		end
+
+feature -- Access
+
+	count: INTEGER
+			-- Number of member processes.
+		do
+			Result := members.count
+		ensure
+			non_negative: Result >= 0
+		end
+
+	processes_with_output: ARRAYED_LIST [SIMPLE_ASYNC_PROCESS]
+			-- Members with output (or end of output) to read after last `wait_any'.
+			-- Snapshot: not updated by `remove'.
+
+	processes_with_error_output: ARRAYED_LIST [SIMPLE_ASYNC_PROCESS]
+			-- Members with separate error output (or its end) to read after last `wait_any'.
+			-- Snapshot: not updated by `remove'.
+
+	exited_processes: ARRAYED_LIST [SIMPLE_ASYNC_PROCESS]
+			-- Members that exited since the previous `wait_any'.
+			-- Each exit is reported once. Snapshot: not updated by `remove'.
+
+feature -- Status
+
+	is_empty: BOOLEAN
+			-- Does the group have no members?
+		do
+			Result := count = 0
+		ensure
+			definition: Result = (count = 0)
+		end
+
+	is_open: BOOLEAN
+			-- Is the underlying process set available?
+		do
+			Result := set_handle /= default_pointer
+		end
+
+	has (a_process: SIMPLE_ASYNC_PROCESS): BOOLEAN
+			-- Is `a_process' a member?
+		do
+			if a_process.is_started then
+				Result := attached members.item (a_process.async_handle) as l_member and then l_member = a_process
+			end
+		end
+
+feature -- Element change
+
+	add (a_process: SIMPLE_ASYNC_PROCESS)
+			-- Add started `a_process' to the group.
+			-- Remove it again before closing it.
+		require
+			open: is_open
+			started: a_process.is_started
+			started_successfully: a_process.was_started_successfully
+			not_member: not has (a_process)
+		do
+			if c_sp_process_set_add (set_handle, a_process.async_handle) /= 0 then
+				members.put (a_process, a_process.async_handle)
+			end
+		ensure
+			added_or_failed: has (a_process) or count = old count
+		end
+
+	remove (a_process: SIMPLE_ASYNC_PROCESS)
+			-- Remove `a_process' from the group.
+		require
+			open: is_open
+			member: has (a_process)
+		do
+			c_sp_process_set_remove (set_handle, a_process.async_handle).do_nothing
+			members.remove (a_process.async_handle)
+		ensure
+			removed: not has (a_process)
+			one_less: count = old count - 1
+		end
+
+feature -- Waiting
+
+	wait_any (a_timeout_ms: INTEGER): INTEGER
+			-- Wait up to `a_timeout_ms' (-1: no limit) for any member to have output or exit.
+			-- Fills `processes_with_output', `processes_with_error_output'
+			-- and `exited_processes'.
+			-- Returns: number of ready members, 0 on timeout or when empty, -1 on error.
+		require
+			open: is_open
+			valid_timeout: a_timeout_ms >= -1
+		local
+			i, l_flags: INTEGER
+		do
+			processes_with_output.wipe_out
+			processes_with_error_output.wipe_out
+			exited_processes.wipe_out
+			Result := c_sp_process_set_wait (set_handle, a_timeout_ms)
+			from
+				i := 0
+			until
+				i >= Result
+			loop
+				if attached members.item (c_sp_process_set_ready_process (set_handle, i)) as l_process then
+					l_flags := c_sp_process_set_ready_flags (set_handle, i)
+					if (l_flags & c_sp_ready_output) /= 0 then
+						processes_with_output.extend (l_process)
+					end
+					if (l_flags & c_sp_ready_error_output) /= 0 then
+						processes_with_error_output.extend (l_process)
+					end
+					if (l_flags & c_sp_ready_exited) /= 0 then
+						exited_processes.extend (l_process)
+					end
+				end
+				i := i + 1
+			end
+		ensure
+			valid_result: Result >= -1 and Result <= count
+		end
+
+feature -- Disposal
+
+	close
+			-- Release the process set. Member processes are not closed.
+		do
+			if set_handle /= default_pointer then
+				c_sp_process_set_destroy (set_handle)
+				set_handle := default_pointer
+			end
+			members.wipe_out
+			processes_with_output.wipe_out
+			processes_with_error_output.wipe_out
+			exited_processes.wipe_out
+		ensure
+			closed: not is_open
+			empty: is_empty
+		end
+
+feature {NONE} -- Implementation
+
+	set_handle: POINTER
+			-- Handle to C process set.
+
+	members: HASH_TABLE [SIMPLE_ASYNC_PROCESS, POINTER]
+			-- Member processes by C handle.
+
+feature {NONE} -- C externals
+
+	c_sp_process_set_create: POINTER
+			-- Create process set.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_process_set_create();"
+		end
+
+	c_sp_process_set_add (a_set, a_proc: POINTER): INTEGER
+			-- Add process to set.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_process_set_add((sp_process_set*)$a_set, (sp_async_process*)$a_proc);"
+		end
+
+	c_sp_process_set_remove (a_set, a_proc: POINTER): INTEGER
+			-- Remove process from set.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_process_set_remove((sp_process_set*)$a_set, (sp_async_process*)$a_proc);"
+		end
+
+	c_sp_process_set_wait (a_set: POINTER; a_timeout_ms: INTEGER): INTEGER
+			-- Wait for any member to be ready.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_process_set_wait((sp_process_set*)$a_set, (int)$a_timeout_ms);"
+		end
+
+	c_sp_process_set_ready_process (a_set: POINTER; a_index: INTEGER): POINTER
+			-- Ready member at `a_index'.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_process_set_ready_process((sp_process_set*)$a_set, (int)$a_index);"
+		end
+
+	c_sp_process_set_ready_flags (a_set: POINTER; a_index: INTEGER): INTEGER
+			-- Readiness flags of ready member at `a_index'.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_process_set_ready_flags((sp_process_set*)$a_set, (int)$a_index);"
+		end
+
+	c_sp_process_set_destroy (a_set: POINTER)
+			-- Free process set.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"sp_process_set_destroy((sp_process_set*)$a_set);"
+		end
+
+	c_sp_ready_output: INTEGER
+			-- Flag: output can be read.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return SP_READY_OUTPUT;"
+		end
+
+	c_sp_ready_error_output: INTEGER
+			-- Flag: error output can be read.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return SP_READY_ERROR_OUTPUT;"
+		end
+
+	c_sp_ready_exited: INTEGER
+			-- Flag: process has exited.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return SP_READY_EXITED;"
+		end
+
+invariant
+	members_exist: members /= Void
+	empty_when_closed: not is_open implies is_empty
+
+end
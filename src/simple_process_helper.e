@@ -29,6 +29,19 @@ feature -- Status Report
 			execution_count_unchanged: execution_count = old execution_count
 		end
 
+	resolve_command (a_name: STRING): detachable STRING_32
+			-- Full path of the executable `a_name' in the system PATH, or Void.
+		require
+			name_not_empty: not a_name.is_empty
+		local
+			l_process: SIMPLE_PROCESS
+		do
+			create l_process.make
+			Result := l_process.resolve_command (a_name)
+		ensure
+			execution_count_unchanged: execution_count = old execution_count
+		end
+
 feature -- Model Queries
 
 	execution_count: INTEGER
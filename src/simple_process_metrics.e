@@ -0,0 +1,346 @@
+note
+	description: "[
+		Snapshot of the library-wide process metrics: spawns, spawn failures
+		by error code, live children, truncated captures, and histograms of
+		spawn latency, time to first output byte, runtime and output bytes.
+		The counters are kept in C by every SIMPLE_PROCESS, async process,
+		batch and session in this program; `refresh' copies them again and
+		`prometheus_text' renders the current ones for a scraper.
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_PROCESS_METRICS
+
+create
+	make
+
+feature {NONE} -- Initialization
+
+	make
+			-- Take a snapshot of the current counters.
+		do
+			create data.make (c_sp_metrics_size)
+			refresh
+		end
+
+feature -- Constants
+
+	Spawn_latency: INTEGER = 1
+			-- Histogram of nanoseconds from a spawn call to its return
+			-- (including exec on Linux and through the spawn server).
+
+	First_output_latency: INTEGER = 2
+			-- Histogram of nanoseconds from spawn to the first output byte read.
+
+	Runtime: INTEGER = 3
+			-- Histogram of nanoseconds from spawn to exit.
+
+	Output_bytes: INTEGER = 4
+			-- Histogram of output bytes captured per run.
+
+	Bucket_count: INTEGER = 32
+			-- Buckets per histogram.
+
+	Error_code_count: INTEGER = 256
+			-- Error codes counted one by one by `failure_count'.
+
+feature -- Access
+
+	spawn_count: INTEGER_64
+			-- Children started.
+		do
+			Result := c_metrics_word (data.item, c_spawns_offset)
+		end
+
+	spawn_failure_count: INTEGER_64
+			-- Spawns that failed, including exec failures the parent saw.
+		do
+			Result := c_metrics_word (data.item, c_spawn_failures_offset)
+		end
+
+	failure_count (a_error: INTEGER): INTEGER_64
+			-- Spawn failures with errno (GetLastError on Windows) `a_error';
+			-- 0 counts larger codes.
+		require
+			valid_error: a_error >= 0 and a_error < Error_code_count
+		do
+			Result := c_metrics_word (data.item, c_failures_offset + a_error)
+		end
+
+	live_children: INTEGER_64
+			-- Children started and not yet reaped or closed.
+		do
+			Result := c_metrics_word (data.item, c_live_children_offset)
+		end
+
+	truncation_count: INTEGER_64
+			-- Synchronous and batch runs whose output passed the output limit.
+		do
+			Result := c_metrics_word (data.item, c_truncations_offset)
+		end
+
+	sample_count (a_histogram: INTEGER): INTEGER_64
+			-- Values recorded in `a_histogram'.
+		require
+			valid_histogram: is_valid_histogram (a_histogram)
+		do
+			Result := c_metrics_word (data.item, c_histogram_offset (a_histogram))
+		end
+
+	sample_sum (a_histogram: INTEGER): INTEGER_64
+			-- Sum of the values recorded in `a_histogram'.
+		require
+			valid_histogram: is_valid_histogram (a_histogram)
+		do
+			Result := c_metrics_word (data.item, c_histogram_offset (a_histogram) + 1)
+		end
+
+	mean (a_histogram: INTEGER): REAL_64
+			-- Mean value in `a_histogram', or 0 if empty.
+		require
+			valid_histogram: is_valid_histogram (a_histogram)
+		do
+			if sample_count (a_histogram) > 0 then
+				Result := sample_sum (a_histogram) / sample_count (a_histogram)
+			end
+		end
+
+	bucket (a_histogram, i: INTEGER): INTEGER_64
+			-- Values of `a_histogram' in bucket `i', up to `bucket_bound (i)'.
+		require
+			valid_histogram: is_valid_histogram (a_histogram)
+			valid_bucket: i >= 1 and i <= Bucket_count
+		do
+			Result := c_metrics_word (data.item, c_histogram_offset (a_histogram) + 1 + i)
+		end
+
+	bucket_bound (i: INTEGER): INTEGER_64
+			-- Largest value in bucket `i' (nanoseconds or bytes); the last
+			-- bucket also holds every larger value.
+		require
+			valid_bucket: i >= 1 and i <= Bucket_count
+		do
+			Result := {INTEGER_64} 1 |<< (c_first_shift + i - 1)
+		end
+
+	percentile_bound (a_histogram: INTEGER; a_percent: REAL_64): INTEGER_64
+			-- Bound of the bucket holding the `a_percent' percentile of
+			-- `a_histogram', or 0 if empty.
+		require
+			valid_histogram: is_valid_histogram (a_histogram)
+			valid_percent: a_percent >= 0 and a_percent <= 100
+		local
+			l_rank, l_seen: INTEGER_64
+			i: INTEGER
+		do
+			l_rank := (a_percent / 100 * sample_count (a_histogram)).ceiling_real_64.truncated_to_integer_64.max (1)
+			from
+				i := 1
+			until
+				i > Bucket_count or Result > 0
+			loop
+				l_seen := l_seen + bucket (a_histogram, i)
+				if l_seen >= l_rank and sample_count (a_histogram) > 0 then
+					Result := bucket_bound (i)
+				end
+				i := i + 1
+			end
+		end
+
+	prometheus_text: STRING_8
+			-- Current counters (not the snapshot) in the Prometheus text
+			-- exposition format, times in seconds.
+		local
+			l_text: POINTER
+		do
+			l_text := c_sp_metrics_prometheus
+			if l_text /= default_pointer then
+				Result := (create {C_STRING}.make_by_pointer (l_text)).string
+				c_free (l_text)
+			else
+				create Result.make_empty
+			end
+		end
+
+feature -- Status
+
+	is_valid_histogram (a_histogram: INTEGER): BOOLEAN
+			-- Is `a_histogram' one of the histogram constants?
+		do
+			Result := a_histogram >= Spawn_latency and a_histogram <= Output_bytes
+		end
+
+feature -- Basic operations
+
+	refresh
+			-- Copy the current counters again.
+		do
+			c_sp_metrics_snapshot (data.item)
+		end
+
+	reset
+			-- Zero the library-wide counters, except `live_children', and refresh.
+		do
+			c_sp_metrics_reset
+			refresh
+		end
+
+feature {NONE} -- Implementation
+
+	data: MANAGED_POINTER
+			-- Storage for the sp_metrics snapshot.
+
+	c_histogram_offset (a_histogram: INTEGER): INTEGER
+			-- Word offset of histogram `a_histogram' in sp_metrics.
+		require
+			valid_histogram: is_valid_histogram (a_histogram)
+		do
+			inspect a_histogram
+			when Spawn_latency then
+				Result := c_spawn_latency_offset
+			when First_output_latency then
+				Result := c_first_output_offset
+			when Runtime then
+				Result := c_runtime_offset
+			else
+				Result := c_output_bytes_offset
+			end
+		end
+
+feature {NONE} -- C externals
+
+	c_sp_metrics_size: INTEGER
+			-- Size of sp_metrics in bytes.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER)sizeof(sp_metrics);"
+		end
+
+	c_sp_metrics_snapshot (a_metrics: POINTER)
+			-- Copy the current counters into `a_metrics'.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"sp_metrics_snapshot((sp_metrics*)$a_metrics);"
+		end
+
+	c_sp_metrics_reset
+			-- Zero the counters.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"sp_metrics_reset();"
+		end
+
+	c_sp_metrics_prometheus: POINTER
+			-- Counters as Prometheus text (free with `c_free').
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_metrics_prometheus();"
+		end
+
+	c_free (a_pointer: POINTER)
+			-- Free memory allocated by the C library.
+		external
+			"C inline use <stdlib.h>"
+		alias
+			"free($a_pointer);"
+		end
+
+	c_metrics_word (a_metrics: POINTER; a_index: INTEGER): INTEGER_64
+			-- `a_index'-th long long of the sp_metrics at `a_metrics'.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER_64)((long long*)$a_metrics)[$a_index];"
+		end
+
+	c_first_shift: INTEGER
+			-- SP_HISTOGRAM_FIRST_SHIFT.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return SP_HISTOGRAM_FIRST_SHIFT;"
+		end
+
+	c_spawns_offset: INTEGER
+			-- Word offset of spawns.
+		external
+			"C inline use %"simple_process.h%", <stddef.h>"
+		alias
+			"return (EIF_INTEGER)(offsetof(sp_metrics, spawns) / sizeof(long long));"
+		end
+
+	c_spawn_failures_offset: INTEGER
+			-- Word offset of spawn_failures.
+		external
+			"C inline use %"simple_process.h%", <stddef.h>"
+		alias
+			"return (EIF_INTEGER)(offsetof(sp_metrics, spawn_failures) / sizeof(long long));"
+		end
+
+	c_failures_offset: INTEGER
+			-- Word offset of failures_by_error.
+		external
+			"C inline use %"simple_process.h%", <stddef.h>"
+		alias
+			"return (EIF_INTEGER)(offsetof(sp_metrics, failures_by_error) / sizeof(long long));"
+		end
+
+	c_live_children_offset: INTEGER
+			-- Word offset of live_children.
+		external
+			"C inline use %"simple_process.h%", <stddef.h>"
+		alias
+			"return (EIF_INTEGER)(offsetof(sp_metrics, live_children) / sizeof(long long));"
+		end
+
+	c_truncations_offset: INTEGER
+			-- Word offset of truncations.
+		external
+			"C inline use %"simple_process.h%", <stddef.h>"
+		alias
+			"return (EIF_INTEGER)(offsetof(sp_metrics, truncations) / sizeof(long long));"
+		end
+
+	c_spawn_latency_offset: INTEGER
+			-- Word offset of spawn_latency_ns.
+		external
+			"C inline use %"simple_process.h%", <stddef.h>"
+		alias
+			"return (EIF_INTEGER)(offsetof(sp_metrics, spawn_latency_ns) / sizeof(long long));"
+		end
+
+	c_first_output_offset: INTEGER
+			-- Word offset of first_output_ns.
+		external
+			"C inline use %"simple_process.h%", <stddef.h>"
+		alias
+			"return (EIF_INTEGER)(offsetof(sp_metrics, first_output_ns) / sizeof(long long));"
+		end
+
+	c_runtime_offset: INTEGER
+			-- Word offset of runtime_ns.
+		external
+			"C inline use %"simple_process.h%", <stddef.h>"
+		alias
+			"return (EIF_INTEGER)(offsetof(sp_metrics, runtime_ns) / sizeof(long long));"
+		end
+
+	c_output_bytes_offset: INTEGER
+			-- Word offset of output_bytes.
+		external
+			"C inline use %"simple_process.h%", <stddef.h>"
+		alias
+			"return (EIF_INTEGER)(offsetof(sp_metrics, output_bytes) / sizeof(long long));"
+		end
+
+invariant
+	data_sized: data.count >= c_sp_metrics_size
+
+end
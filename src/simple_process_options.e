@@ -0,0 +1,559 @@
+note
+	description: "[
+		C `sp_options' structure passed to sp_execute_ex and sp_start_async_ex.
+		Starts with library defaults: hidden window, stderr merged into stdout,
+		output captured with 1 MB kept per stream, stdin inherited, no timeout.
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_PROCESS_OPTIONS
+
+create
+	make
+
+feature {NONE} -- Initialization
+
+	make
+			-- Create options with defaults.
+		do
+			create memory.make (c_sp_options_size)
+			c_sp_options_init (memory.item)
+		ensure
+			window_hidden: not show_window
+			stderr_merged: not is_error_output_separate
+			default_limit: output_limit = Default_output_limit
+			no_input: not has_input_data and input_descriptor = No_input_descriptor
+			no_timeout: timeout = No_timeout
+			default_grace: kill_grace_period = Default_kill_grace_period
+			captured: output_mode = Output_captured
+		end
+
+feature -- Constants
+
+	Default_output_limit: INTEGER = 1_048_576
+			-- Bytes of output kept per stream unless changed (1 MB).
+
+	Unlimited_output: INTEGER = -1
+			-- `output_limit' value that keeps all output.
+
+	No_input_descriptor: INTEGER = -1
+			-- `input_descriptor' value for no input file.
+
+	No_timeout: INTEGER = 0
+			-- `timeout' value that lets a run take as long as it needs.
+
+	Default_kill_grace_period: INTEGER = 2_000
+			-- Milliseconds between SIGTERM and SIGKILL unless changed.
+
+	Output_captured: INTEGER = 0
+			-- `output_mode': output is read into the result (default).
+
+	Output_to_file: INTEGER = 1
+			-- `output_mode': the child writes straight into `output_path'.
+
+	Output_to_memory: INTEGER = 2
+			-- `output_mode': the child writes into an anonymous memory file,
+			-- mapped into the result.
+
+feature -- Access
+
+	item: POINTER
+			-- Address of the sp_options structure.
+		do
+			Result := memory.item
+		end
+
+feature -- Status
+
+	show_window: BOOLEAN
+			-- Show console window (Windows only)?
+		do
+			Result := c_sp_options_show_window (memory.item) /= 0
+		end
+
+	is_error_output_separate: BOOLEAN
+			-- Is stderr captured apart from stdout?
+		do
+			Result := c_sp_options_separate_stderr (memory.item) /= 0
+		end
+
+	output_limit: INTEGER
+			-- Bytes of output kept per stream, or `Unlimited_output'.
+			-- Output past the limit is still read (and streamed) but dropped.
+		do
+			Result := c_sp_options_max_output (memory.item)
+		end
+
+	is_output_unlimited: BOOLEAN
+			-- Is all output kept?
+		do
+			Result := output_limit = Unlimited_output
+		ensure
+			definition: Result = (output_limit = Unlimited_output)
+		end
+
+	has_input_data: BOOLEAN
+			-- Are bytes set to be written to stdin?
+		do
+			Result := input_data /= Void
+		end
+
+	input_descriptor: INTEGER
+			-- File descriptor whose contents are fed to stdin, or `No_input_descriptor'.
+		do
+			Result := c_sp_options_input_fd (memory.item)
+		end
+
+	is_input_kept_open: BOOLEAN
+			-- Does stdin of an async process stay open for more input?
+		do
+			Result := c_sp_options_keep_stdin_open (memory.item) /= 0
+		end
+
+	timeout: INTEGER
+			-- Milliseconds a synchronous run may take, or `No_timeout'.
+		do
+			Result := c_sp_options_timeout_ms (memory.item)
+		end
+
+	kill_grace_period: INTEGER
+			-- Milliseconds between SIGTERM and SIGKILL when a run times out.
+		do
+			Result := c_sp_options_kill_grace_ms (memory.item)
+		end
+
+	output_mode: INTEGER
+			-- Where a synchronous run sends stdout (and stderr unless separate):
+			-- `Output_captured', `Output_to_file' or `Output_to_memory'.
+		do
+			Result := c_sp_options_output_mode (memory.item)
+		end
+
+	output_path: detachable STRING_8
+			-- File written by `Output_to_file', or Void.
+		do
+			if attached output_path_data as l_path then
+				Result := l_path.string
+			end
+		end
+
+	is_output_mapped: BOOLEAN
+			-- Is the output file also mapped into the result?
+		do
+			Result := c_sp_options_map_output (memory.item) /= 0
+		end
+
+	environment: detachable SIMPLE_PROCESS_ENVIRONMENT
+			-- Environment children get, or Void for ours.
+
+	resources: detachable SIMPLE_PROCESS_RESOURCES
+			-- Scheduling and resource controls children apply, or Void for none.
+
+feature -- Element change
+
+	set_show_window (a_value: BOOLEAN)
+			-- Set whether to show the console window.
+		do
+			c_sp_options_set_show_window (memory.item, a_value.to_integer)
+		ensure
+			set: show_window = a_value
+		end
+
+	set_separate_error_output (a_value: BOOLEAN)
+			-- Set whether stderr is captured apart from stdout.
+		do
+			c_sp_options_set_separate_stderr (memory.item, a_value.to_integer)
+		ensure
+			set: is_error_output_separate = a_value
+		end
+
+	set_output_limit (a_bytes: INTEGER)
+			-- Keep at most `a_bytes' of output per stream
+			-- (`Unlimited_output' for no limit).
+		require
+			valid_limit: a_bytes >= 0 or a_bytes = Unlimited_output
+		do
+			c_sp_options_set_max_output (memory.item, a_bytes)
+		ensure
+			set: output_limit = a_bytes
+		end
+
+	set_input_data (a_bytes: READABLE_STRING_8)
+			-- Write `a_bytes' to stdin, then close it (unless `is_input_kept_open').
+		local
+			l_data: C_STRING
+		do
+			create l_data.make (a_bytes)
+			input_data := l_data
+			c_sp_options_set_input_data (memory.item, l_data.item, a_bytes.count)
+		ensure
+			has_input: has_input_data
+		end
+
+	set_input_descriptor (a_fd: INTEGER)
+			-- Feed the contents of open descriptor `a_fd' to stdin
+			-- (after any input data). An async process reads `a_fd' itself.
+		require
+			valid_descriptor: a_fd >= 0 or a_fd = No_input_descriptor
+		do
+			c_sp_options_set_input_fd (memory.item, a_fd)
+		ensure
+			set: input_descriptor = a_fd
+		end
+
+	set_keep_input_open (a_value: BOOLEAN)
+			-- Set whether stdin of an async process stays open for more input.
+		do
+			c_sp_options_set_keep_stdin_open (memory.item, a_value.to_integer)
+		ensure
+			set: is_input_kept_open = a_value
+		end
+
+	set_timeout (a_milliseconds: INTEGER)
+			-- Stop a synchronous run still going after `a_milliseconds'
+			-- (`No_timeout' for no limit).
+		require
+			non_negative: a_milliseconds >= 0
+		do
+			c_sp_options_set_timeout_ms (memory.item, a_milliseconds)
+		ensure
+			set: timeout = a_milliseconds
+		end
+
+	set_kill_grace_period (a_milliseconds: INTEGER)
+			-- Wait `a_milliseconds' after SIGTERM before SIGKILL on timeout.
+		require
+			non_negative: a_milliseconds >= 0
+		do
+			c_sp_options_set_kill_grace_ms (memory.item, a_milliseconds)
+		ensure
+			set: kill_grace_period = a_milliseconds
+		end
+
+	set_output_file (a_path: READABLE_STRING_8)
+			-- Let the child write its output straight into `a_path',
+			-- created or truncated.
+		require
+			path_not_empty: not a_path.is_empty
+		local
+			l_path: C_STRING
+		do
+			create l_path.make (a_path)
+			output_path_data := l_path
+			c_sp_options_set_output_path (memory.item, l_path.item)
+			c_sp_options_set_output_mode (memory.item, Output_to_file)
+		ensure
+			to_file: output_mode = Output_to_file
+			path_set: attached output_path as l_path and then l_path.same_string (a_path)
+		end
+
+	set_output_in_memory
+			-- Let the child write its output into an anonymous memory file.
+		do
+			c_sp_options_set_output_mode (memory.item, Output_to_memory)
+		ensure
+			to_memory: output_mode = Output_to_memory
+		end
+
+	set_map_output (a_value: BOOLEAN)
+			-- Set whether a file written by `Output_to_file' is also mapped.
+		do
+			c_sp_options_set_map_output (memory.item, a_value.to_integer)
+		ensure
+			set: is_output_mapped = a_value
+		end
+
+	set_environment (a_environment: detachable SIMPLE_PROCESS_ENVIRONMENT)
+			-- Give children `a_environment' (Void for ours).
+		require
+			open: attached a_environment implies a_environment.is_open
+		do
+			environment := a_environment
+			if attached a_environment then
+				c_sp_options_set_environment (memory.item, a_environment.item)
+			else
+				c_sp_options_set_environment (memory.item, default_pointer)
+			end
+		ensure
+			set: environment = a_environment
+		end
+
+	set_resources (a_resources: detachable SIMPLE_PROCESS_RESOURCES)
+			-- Let children apply `a_resources' (Void for none), as they are now.
+		local
+			l_cpus: MANAGED_POINTER
+			l_cgroup: C_STRING
+			l_cgroup_item: POINTER
+			i: INTEGER
+		do
+			resources := a_resources
+			cpu_data := Void
+			cgroup_data := Void
+			if attached a_resources as l_resources then
+				create l_cpus.make ((l_resources.cpus.count * c_int_size).max (1))
+				from
+					i := 1
+				until
+					i > l_resources.cpus.count
+				loop
+					l_cpus.put_integer_32 (l_resources.cpus [l_resources.cpus.lower + i - 1], (i - 1) * c_int_size)
+					i := i + 1
+				end
+				cpu_data := l_cpus
+				if attached l_resources.cgroup as l_directory then
+					create l_cgroup.make (l_directory)
+					cgroup_data := l_cgroup
+					l_cgroup_item := l_cgroup.item
+				end
+				c_sp_options_set_resources (memory.item, l_cpus.item, l_resources.cpus.count,
+					l_resources.nice_increment, l_resources.io_priority_class, l_resources.io_priority_level,
+					l_resources.max_address_space, l_resources.max_cpu_seconds, l_resources.max_open_files,
+					l_cgroup_item)
+			else
+				c_sp_options_set_resources (memory.item, default_pointer, 0, 0, 0, 0, 0, 0, 0, default_pointer)
+			end
+		ensure
+			set: resources = a_resources
+		end
+
+feature {NONE} -- Implementation
+
+	memory: MANAGED_POINTER
+			-- Storage for the C structure.
+
+	input_data: detachable C_STRING
+			-- Bytes referenced by the C structure, kept alive with it.
+
+	output_path_data: detachable C_STRING
+			-- Output file name referenced by the C structure, kept alive with it.
+
+	cpu_data: detachable MANAGED_POINTER
+			-- CPU numbers referenced by the C structure, kept alive with it.
+
+	cgroup_data: detachable C_STRING
+			-- cgroup directory referenced by the C structure, kept alive with it.
+
+feature {NONE} -- C externals
+
+	c_sp_options_size: INTEGER
+			-- Size of sp_options in bytes.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER)sizeof(sp_options);"
+		end
+
+	c_sp_options_init (a_options: POINTER)
+			-- Reset options to defaults.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"sp_options_init((sp_options*)$a_options);"
+		end
+
+	c_sp_options_show_window (a_options: POINTER): INTEGER
+			-- Get show_window flag.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_options*)$a_options)->show_window;"
+		end
+
+	c_sp_options_set_show_window (a_options: POINTER; a_value: INTEGER)
+			-- Set show_window flag.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_options*)$a_options)->show_window = (int)$a_value;"
+		end
+
+	c_sp_options_separate_stderr (a_options: POINTER): INTEGER
+			-- Get separate_stderr flag.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_options*)$a_options)->separate_stderr;"
+		end
+
+	c_sp_options_set_separate_stderr (a_options: POINTER; a_value: INTEGER)
+			-- Set separate_stderr flag.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_options*)$a_options)->separate_stderr = (int)$a_value;"
+		end
+
+	c_sp_options_max_output (a_options: POINTER): INTEGER
+			-- Get max_output.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_options*)$a_options)->max_output;"
+		end
+
+	c_sp_options_set_max_output (a_options: POINTER; a_value: INTEGER)
+			-- Set max_output.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_options*)$a_options)->max_output = (int)$a_value;"
+		end
+
+	c_sp_options_set_input_data (a_options, a_data: POINTER; a_length: INTEGER)
+			-- Set input_data and input_length.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"[
+				((sp_options*)$a_options)->input_data = (const char*)$a_data;
+				((sp_options*)$a_options)->input_length = (int)$a_length;
+			]"
+		end
+
+	c_sp_options_input_fd (a_options: POINTER): INTEGER
+			-- Get input_fd.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_options*)$a_options)->input_fd;"
+		end
+
+	c_sp_options_set_input_fd (a_options: POINTER; a_value: INTEGER)
+			-- Set input_fd.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_options*)$a_options)->input_fd = (int)$a_value;"
+		end
+
+	c_sp_options_keep_stdin_open (a_options: POINTER): INTEGER
+			-- Get keep_stdin_open flag.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_options*)$a_options)->keep_stdin_open;"
+		end
+
+	c_sp_options_set_keep_stdin_open (a_options: POINTER; a_value: INTEGER)
+			-- Set keep_stdin_open flag.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_options*)$a_options)->keep_stdin_open = (int)$a_value;"
+		end
+
+	c_sp_options_timeout_ms (a_options: POINTER): INTEGER
+			-- Get timeout_ms.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_options*)$a_options)->timeout_ms;"
+		end
+
+	c_sp_options_set_timeout_ms (a_options: POINTER; a_value: INTEGER)
+			-- Set timeout_ms.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_options*)$a_options)->timeout_ms = (int)$a_value;"
+		end
+
+	c_sp_options_kill_grace_ms (a_options: POINTER): INTEGER
+			-- Get kill_grace_ms.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_options*)$a_options)->kill_grace_ms;"
+		end
+
+	c_sp_options_set_kill_grace_ms (a_options: POINTER; a_value: INTEGER)
+			-- Set kill_grace_ms.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_options*)$a_options)->kill_grace_ms = (int)$a_value;"
+		end
+
+	c_sp_options_output_mode (a_options: POINTER): INTEGER
+			-- Get output_mode.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_options*)$a_options)->output_mode;"
+		end
+
+	c_sp_options_set_output_mode (a_options: POINTER; a_value: INTEGER)
+			-- Set output_mode.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_options*)$a_options)->output_mode = (int)$a_value;"
+		end
+
+	c_sp_options_set_output_path (a_options, a_path: POINTER)
+			-- Set output_path.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_options*)$a_options)->output_path = (const char*)$a_path;"
+		end
+
+	c_sp_options_map_output (a_options: POINTER): INTEGER
+			-- Get map_output flag.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_options*)$a_options)->map_output;"
+		end
+
+	c_sp_options_set_map_output (a_options: POINTER; a_value: INTEGER)
+			-- Set map_output flag.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_options*)$a_options)->map_output = (int)$a_value;"
+		end
+
+	c_sp_options_set_environment (a_options, a_environment: POINTER)
+			-- Set environment.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"((sp_options*)$a_options)->environment = (const sp_environment*)$a_environment;"
+		end
+
+	c_sp_options_set_resources (a_options, a_cpus: POINTER; a_cpu_count, a_nice, a_io_class, a_io_level: INTEGER;
+			a_address_space, a_cpu_seconds, a_open_files: INTEGER_64; a_cgroup: POINTER)
+			-- Set cpus, cpu_count, nice_increment, io_priority_*, the max_* limits and cgroup.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"[
+				sp_options* o = (sp_options*)$a_options;
+				o->cpus = (const int*)$a_cpus;
+				o->cpu_count = (int)$a_cpu_count;
+				o->nice_increment = (int)$a_nice;
+				o->io_priority_class = (int)$a_io_class;
+				o->io_priority_level = (int)$a_io_level;
+				o->max_address_space = (long long)$a_address_space;
+				o->max_cpu_seconds = (long long)$a_cpu_seconds;
+				o->max_open_files = (long long)$a_open_files;
+				o->cgroup = (const char*)$a_cgroup;
+			]"
+		end
+
+	c_int_size: INTEGER
+			-- Size of a C int in bytes.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER)sizeof(int);"
+		end
+
+invariant
+	memory_sized: memory.count >= c_sp_options_size
+
+end
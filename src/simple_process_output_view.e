@@ -0,0 +1,128 @@
+note
+	description: "[
+		Read-only view of the output a child wrote to a memory file (or to a
+		mapped output file). The bytes are the file's own pages, mapped into
+		this process: nothing was copied through a pipe. Released by `close'.
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_PROCESS_OUTPUT_VIEW
+
+create {SIMPLE_PROCESS}
+	make
+
+feature {NONE} -- Initialization
+
+	make (a_item: POINTER; a_count: INTEGER_64)
+			-- View `a_count' mapped bytes at `a_item'.
+		require
+			item_not_null: a_item /= default_pointer
+			positive_count: a_count > 0
+		do
+			item := a_item
+			count := a_count
+		ensure
+			item_set: item = a_item
+			count_set: count = a_count
+			open: is_open
+		end
+
+feature -- Access
+
+	item: POINTER
+			-- Address of the first byte, or null once closed.
+
+	count: INTEGER_64
+			-- Number of bytes viewed.
+
+	data: MANAGED_POINTER
+			-- All bytes, shared (not copied).
+		require
+			open: is_open
+			addressable: count <= {INTEGER}.max_value
+		do
+			create Result.share_from_pointer (item, count.to_integer_32)
+		ensure
+			shared: Result.is_shared
+			same_count: Result.count = count
+		end
+
+	window (a_offset: INTEGER_64; a_length: INTEGER): MANAGED_POINTER
+			-- `a_length' bytes from `a_offset' (0-based), shared (not copied).
+			-- Reaches past the 2 GB a single MANAGED_POINTER can address.
+		require
+			open: is_open
+			valid_offset: a_offset >= 0
+			valid_length: a_length >= 0
+			in_bounds: a_offset + a_length <= count
+		do
+			create Result.share_from_pointer (c_offset_pointer (item, a_offset), a_length)
+		ensure
+			shared: Result.is_shared
+			same_count: Result.count = a_length
+		end
+
+	text: STRING_32
+			-- All bytes decoded as UTF-8 (a copy).
+		require
+			open: is_open
+			addressable: count <= {INTEGER}.max_value
+		do
+			create Result.make (count.to_integer_32)
+			Result.set_count (c_sp_utf8_decode (item, count.to_integer_32, 1, Result.area.base_address, default_pointer))
+		end
+
+feature -- Status
+
+	is_open: BOOLEAN
+			-- Are the bytes still mapped?
+		do
+			Result := item /= default_pointer
+		end
+
+feature -- Basic operations
+
+	close
+			-- Unmap the bytes. Views from `data' and `window' become invalid.
+		do
+			if is_open then
+				c_sp_unmap_output (item, count)
+				item := default_pointer
+			end
+		ensure
+			closed: not is_open
+		end
+
+feature {NONE} -- C externals
+
+	c_offset_pointer (a_item: POINTER; a_offset: INTEGER_64): POINTER
+			-- Address `a_offset' bytes past `a_item'.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (char*)$a_item + $a_offset;"
+		end
+
+	c_sp_utf8_decode (a_source: POINTER; a_length, a_final: INTEGER; a_target, a_consumed: POINTER): INTEGER
+			-- Decode `a_length' UTF-8 bytes at `a_source' into `a_target', returning the character count.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_utf8_decode((const char*)$a_source, (int)$a_length, (int)$a_final, (unsigned int*)$a_target, (int*)$a_consumed);"
+		end
+
+	c_sp_unmap_output (a_item: POINTER; a_count: INTEGER_64)
+			-- Unmap `a_count' bytes at `a_item'.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"sp_unmap_output((const char*)$a_item, (long long)$a_count);"
+		end
+
+invariant
+	positive_count: count > 0
+
+end
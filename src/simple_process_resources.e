@@ -0,0 +1,167 @@
+note
+	description: "[
+		Scheduling and resource controls for child processes: the CPUs they
+		may run on, a nice increment, an I/O priority, limits on address
+		space, CPU time and open files, and a cgroup v2 to join. Each child
+		applies them to itself between fork and exec, so the caller is never
+		touched. CPU affinity, I/O priority and cgroups are Linux only; on
+		Windows the child's job enforces CPUs, memory and CPU time, and the
+		nice increment picks a priority class.
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_PROCESS_RESOURCES
+
+create
+	make
+
+feature {NONE} -- Initialization
+
+	make
+			-- Create controls that change nothing.
+		do
+			create cpus.make_empty
+		ensure
+			no_cpus: cpus.is_empty
+			no_nice: nice_increment = 0
+			inherited_io_priority: io_priority_class = Io_priority_inherited
+			no_limits: max_address_space = No_limit and max_cpu_seconds = No_limit and max_open_files = No_limit
+			no_cgroup: cgroup = Void
+		end
+
+feature -- Constants
+
+	No_limit: INTEGER_64 = 0
+			-- Limit value that keeps the one children inherit.
+
+	Io_priority_inherited: INTEGER = 0
+			-- `io_priority_class' that keeps the inherited I/O priority.
+
+	Io_priority_realtime: INTEGER = 1
+			-- I/O served before every other class.
+
+	Io_priority_best_effort: INTEGER = 2
+			-- Default I/O class, ordered by `io_priority_level'.
+
+	Io_priority_idle: INTEGER = 3
+			-- I/O served only when no other process needs the disk.
+
+feature -- Access
+
+	cpus: ARRAY [INTEGER]
+			-- CPUs children may run on (numbered from 0), or empty for all.
+
+	nice_increment: INTEGER
+			-- Added to children's nice value, as by nice(1).
+
+	io_priority_class: INTEGER
+			-- One of the `Io_priority_*' constants.
+
+	io_priority_level: INTEGER
+			-- Level within the realtime and best-effort classes, 0 (highest) to 7.
+
+	max_address_space: INTEGER_64
+			-- Bytes of virtual memory each child may map, or `No_limit'.
+
+	max_cpu_seconds: INTEGER_64
+			-- CPU seconds each child may use, or `No_limit'.
+
+	max_open_files: INTEGER_64
+			-- Descriptors each child may open, or `No_limit'.
+
+	cgroup: detachable STRING_8
+			-- cgroup v2 directory children join, or Void.
+
+feature -- Status
+
+	is_valid_io_priority (a_class, a_level: INTEGER): BOOLEAN
+			-- Are `a_class' and `a_level' a valid I/O priority?
+		do
+			Result := a_class >= Io_priority_inherited and a_class <= Io_priority_idle
+				and a_level >= 0 and a_level <= 7
+		end
+
+feature -- Element change
+
+	set_cpus (a_cpus: ARRAY [INTEGER])
+			-- Let children run only on `a_cpus' (empty for all).
+		require
+			non_negative: across a_cpus as ic all ic.item >= 0 end
+		do
+			cpus := a_cpus.twin
+		ensure
+			set: cpus ~ a_cpus
+		end
+
+	set_nice_increment (a_increment: INTEGER)
+			-- Add `a_increment' to children's nice value (negative needs privilege).
+		require
+			valid_increment: a_increment >= -39 and a_increment <= 39
+		do
+			nice_increment := a_increment
+		ensure
+			set: nice_increment = a_increment
+		end
+
+	set_io_priority (a_class, a_level: INTEGER)
+			-- Give children I/O class `a_class' at level `a_level'.
+		require
+			valid_priority: is_valid_io_priority (a_class, a_level)
+		do
+			io_priority_class := a_class
+			io_priority_level := a_level
+		ensure
+			class_set: io_priority_class = a_class
+			level_set: io_priority_level = a_level
+		end
+
+	set_max_address_space (a_bytes: INTEGER_64)
+			-- Limit each child to `a_bytes' of virtual memory.
+		require
+			non_negative: a_bytes >= 0
+		do
+			max_address_space := a_bytes
+		ensure
+			set: max_address_space = a_bytes
+		end
+
+	set_max_cpu_seconds (a_seconds: INTEGER_64)
+			-- Limit each child to `a_seconds' of CPU time.
+		require
+			non_negative: a_seconds >= 0
+		do
+			max_cpu_seconds := a_seconds
+		ensure
+			set: max_cpu_seconds = a_seconds
+		end
+
+	set_max_open_files (a_count: INTEGER_64)
+			-- Limit each child to `a_count' open descriptors.
+		require
+			non_negative: a_count >= 0
+		do
+			max_open_files := a_count
+		ensure
+			set: max_open_files = a_count
+		end
+
+	set_cgroup (a_directory: detachable READABLE_STRING_8)
+			-- Move children into cgroup v2 directory `a_directory' (Void for none).
+		require
+			not_empty: attached a_directory implies not a_directory.is_empty
+		do
+			if attached a_directory then
+				cgroup := a_directory.to_string_8
+			else
+				cgroup := Void
+			end
+		end
+
+invariant
+	valid_io_priority: is_valid_io_priority (io_priority_class, io_priority_level)
+	non_negative_limits: max_address_space >= 0 and max_cpu_seconds >= 0 and max_open_files >= 0
+
+end
@@ -0,0 +1,197 @@
+note
+	description: "[
+		Outcome of one command run by SIMPLE_PROCESS_BATCH: the same data
+		SIMPLE_PROCESS keeps in its `last_*' queries, copied from a C
+		`sp_result' so it outlives the next run.
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_PROCESS_RESULT
+
+create
+	make_from_pointer
+
+feature {NONE} -- Initialization
+
+	make_from_pointer (a_result: POINTER; a_command: READABLE_STRING_GENERAL)
+			-- Copy the sp_result at `a_result' of running `a_command'.
+		require
+			result_exists: a_result /= default_pointer
+		local
+			l_data: POINTER
+		do
+			command := a_command.to_string_32
+			was_successful := c_sp_result_success (a_result) /= 0
+			if was_successful then
+				exit_code := c_sp_result_exit_code (a_result)
+				is_output_truncated := c_sp_result_output_truncated (a_result) /= 0
+				has_timed_out := c_sp_result_timed_out (a_result) /= 0
+				output := utf8_to_string_32 (c_sp_result_output (a_result), c_sp_result_output_length (a_result))
+				l_data := c_sp_result_error_output (a_result)
+				if l_data /= default_pointer then
+					error_output := utf8_to_string_32 (l_data, c_sp_result_error_output_length (a_result))
+				end
+				create usage.make_from_pointer (c_sp_result_usage (a_result))
+			else
+				exit_code := -1
+				create output.make_empty
+				l_data := c_sp_result_error (a_result)
+				if l_data /= default_pointer then
+					error := (create {C_STRING}.make_by_pointer (l_data)).string.to_string_32
+				else
+					error := {STRING_32} "Failed to execute command"
+				end
+			end
+		ensure
+			command_set: command.same_string_general (a_command)
+			error_if_failed: not was_successful implies error /= Void
+		end
+
+feature -- Access
+
+	command: STRING_32
+			-- Command that was run.
+
+	exit_code: INTEGER
+			-- Exit code (-1 if it did not run or was killed by a signal).
+
+	output: STRING_32
+			-- Captured output (with stderr unless it was kept separate).
+
+	error_output: detachable STRING_32
+			-- Captured standard error when kept separate.
+
+	usage: detachable SIMPLE_PROCESS_USAGE
+			-- Resource usage, or Void if the command did not run.
+
+	error: detachable STRING_32
+			-- Why the command did not run (start failure, or cancelled by fail-fast).
+
+feature -- Status
+
+	was_successful: BOOLEAN
+			-- Did the command run to completion (whatever its exit code)?
+
+	has_succeeded: BOOLEAN
+			-- Did the command run and exit with code 0?
+		do
+			Result := was_successful and exit_code = 0
+		ensure
+			definition: Result = (was_successful and exit_code = 0)
+		end
+
+	is_output_truncated: BOOLEAN
+			-- Was output past the limit dropped?
+
+	has_timed_out: BOOLEAN
+			-- Was the command stopped for running past its timeout?
+
+feature {NONE} -- Implementation
+
+	utf8_to_string_32 (a_data: POINTER; a_length: INTEGER): STRING_32
+			-- Decode `a_length' bytes of UTF-8 at `a_data'.
+		do
+			create Result.make (a_length)
+			if a_length > 0 then
+				Result.set_count (c_sp_utf8_decode (a_data, a_length, 1, Result.area.base_address, default_pointer))
+			end
+		end
+
+feature {NONE} -- C externals
+
+	c_sp_result_success (a_result: POINTER): INTEGER
+			-- Get success flag from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->success;"
+		end
+
+	c_sp_result_exit_code (a_result: POINTER): INTEGER
+			-- Get exit code from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->exit_code;"
+		end
+
+	c_sp_result_output (a_result: POINTER): POINTER
+			-- Get output pointer from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->output;"
+		end
+
+	c_sp_result_output_length (a_result: POINTER): INTEGER
+			-- Get output length from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->output_length;"
+		end
+
+	c_sp_result_error_output (a_result: POINTER): POINTER
+			-- Get error output pointer from result (NULL unless separate).
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->error_output;"
+		end
+
+	c_sp_result_error_output_length (a_result: POINTER): INTEGER
+			-- Get error output length from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->error_output_length;"
+		end
+
+	c_sp_result_output_truncated (a_result: POINTER): INTEGER
+			-- Get output_truncated flag from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->output_truncated;"
+		end
+
+	c_sp_result_timed_out (a_result: POINTER): INTEGER
+			-- Get timed_out flag from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->timed_out;"
+		end
+
+	c_sp_result_usage (a_result: POINTER): POINTER
+			-- Get address of usage in result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return &((sp_result*)$a_result)->usage;"
+		end
+
+	c_sp_result_error (a_result: POINTER): POINTER
+			-- Get error message pointer from result.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return ((sp_result*)$a_result)->error_message;"
+		end
+
+	c_sp_utf8_decode (a_source: POINTER; a_length, a_final: INTEGER; a_target, a_consumed: POINTER): INTEGER
+			-- Decode `a_length' UTF-8 bytes at `a_source' into `a_target', returning the character count.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_utf8_decode((const char*)$a_source, (int)$a_length, (int)$a_final, (unsigned int*)$a_target, (int*)$a_consumed);"
+		end
+
+invariant
+	failure_explained: not was_successful implies error /= Void
+	usage_when_run: was_successful implies usage /= Void
+
+end
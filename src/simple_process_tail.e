@@ -0,0 +1,196 @@
+note
+	description: "[
+		Last lines of an output stream, kept in a fixed ring of at most
+		`line_limit' lines and `character_limit' characters. The oldest
+		lines are dropped as new ones arrive, so memory stays flat however
+		long the process runs.
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_PROCESS_TAIL
+
+create
+	make
+
+feature {NONE} -- Initialization
+
+	make (a_line_limit, a_character_limit: INTEGER)
+			-- Keep at most `a_line_limit' lines and `a_character_limit'
+			-- characters (`No_character_limit' for lines only).
+		require
+			positive_line_limit: a_line_limit > 0
+			valid_character_limit: a_character_limit >= 0
+		do
+			line_limit := a_line_limit
+			character_limit := a_character_limit
+			create ring.make_filled (create {STRING_32}.make_empty, a_line_limit)
+		ensure
+			line_limit_set: line_limit = a_line_limit
+			character_limit_set: character_limit = a_character_limit
+			empty: is_empty
+		end
+
+feature -- Constants
+
+	No_character_limit: INTEGER = 0
+			-- `character_limit' value that bounds the tail by lines only.
+
+feature -- Access
+
+	line_limit: INTEGER
+			-- Most lines kept.
+
+	character_limit: INTEGER
+			-- Most characters kept over all lines, or `No_character_limit'.
+
+	count: INTEGER
+			-- Number of lines kept.
+
+	character_count: INTEGER
+			-- Characters in the lines kept (line breaks not counted).
+
+	dropped_count: INTEGER_64
+			-- Lines dropped to make room since creation or `wipe_out'.
+
+	item alias "[]" (i: INTEGER): STRING_32
+			-- `i'-th line kept, oldest first.
+		require
+			valid_index: i >= 1 and i <= count
+		do
+			Result := ring [(first + i - 1) \\ line_limit]
+		end
+
+	last_line: STRING_32
+			-- Most recent line.
+		require
+			not_empty: not is_empty
+		do
+			Result := item (count)
+		end
+
+	lines: ARRAYED_LIST [STRING_32]
+			-- Lines kept, oldest first.
+		local
+			i: INTEGER
+		do
+			create Result.make (count)
+			from
+				i := 1
+			until
+				i > count
+			loop
+				Result.extend (item (i))
+				i := i + 1
+			end
+		ensure
+			same_count: Result.count = count
+		end
+
+	text: STRING_32
+			-- Lines kept, oldest first, each followed by a line break.
+		local
+			i: INTEGER
+		do
+			create Result.make (character_count + count)
+			from
+				i := 1
+			until
+				i > count
+			loop
+				Result.append (item (i))
+				Result.append_character ('%N')
+				i := i + 1
+			end
+		end
+
+feature -- Status
+
+	is_empty: BOOLEAN
+			-- Are no lines kept?
+		do
+			Result := count = 0
+		end
+
+feature -- Element change
+
+	extend (a_line: STRING_32)
+			-- Keep `a_line' as the most recent line, dropping the oldest ones
+			-- as needed. A line longer than `character_limit' keeps its end.
+		local
+			l_line: STRING_32
+		do
+			l_line := a_line
+			if character_limit /= No_character_limit and then l_line.count > character_limit then
+				l_line := l_line.substring (l_line.count - character_limit + 1, l_line.count)
+			end
+			if count = line_limit then
+				remove_oldest
+			end
+			from
+			until
+				character_limit = No_character_limit or else count = 0
+					or else character_count + l_line.count <= character_limit
+			loop
+				remove_oldest
+			end
+			ring [(first + count) \\ line_limit] := l_line
+			count := count + 1
+			character_count := character_count + l_line.count
+		ensure
+			last_line_set: last_line.same_string (a_line) or last_line.count = character_limit
+		end
+
+	wipe_out
+			-- Drop all lines.
+		do
+			from
+			until
+				is_empty
+			loop
+				remove_oldest
+			end
+			first := 0
+			dropped_count := 0
+		ensure
+			empty: is_empty
+			no_characters: character_count = 0
+		end
+
+feature {NONE} -- Implementation
+
+	ring: SPECIAL [STRING_32]
+			-- Line storage; the oldest line is at `first'.
+
+	first: INTEGER
+			-- Index in `ring' of the oldest line.
+
+	remove_oldest
+			-- Drop the oldest line.
+		require
+			not_empty: not is_empty
+		do
+			character_count := character_count - ring [first].count
+			ring [first] := empty_line
+			first := (first + 1) \\ line_limit
+			count := count - 1
+			dropped_count := dropped_count + 1
+		end
+
+	empty_line: STRING_32
+			-- Placeholder for free slots of `ring', so dropped lines can be collected.
+		once
+			create Result.make_empty
+		end
+
+invariant
+	positive_line_limit: line_limit > 0
+	valid_character_limit: character_limit >= 0
+	ring_sized: ring.count = line_limit
+	count_in_range: count >= 0 and count <= line_limit
+	characters_in_range: character_limit /= No_character_limit implies character_count <= character_limit
+	first_in_range: first >= 0 and first < line_limit
+
+end
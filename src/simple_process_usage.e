@@ -0,0 +1,121 @@
+note
+	description: "[
+		Resource usage of a finished process: CPU time, peak memory, page
+		faults and wall time. For a pipeline, times and faults are summed
+		over the stages and the peak is that of the largest stage.
+		Copied from a C `sp_usage' structure.
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_PROCESS_USAGE
+
+create
+	make_from_pointer
+
+feature {NONE} -- Initialization
+
+	make_from_pointer (a_usage: POINTER)
+			-- Copy the sp_usage structure at `a_usage'.
+		require
+			usage_exists: a_usage /= default_pointer
+		do
+			user_time_microseconds := c_user_time_us (a_usage)
+			system_time_microseconds := c_system_time_us (a_usage)
+			max_resident_kilobytes := c_max_rss_kb (a_usage)
+			minor_page_faults := c_minor_faults (a_usage)
+			major_page_faults := c_major_faults (a_usage)
+			wall_time_nanoseconds := c_wall_time_ns (a_usage)
+		end
+
+feature -- Access
+
+	user_time_microseconds: INTEGER_64
+			-- CPU time spent in user mode.
+
+	system_time_microseconds: INTEGER_64
+			-- CPU time spent in the kernel.
+
+	cpu_time_microseconds: INTEGER_64
+			-- Total CPU time (user and kernel).
+		do
+			Result := user_time_microseconds + system_time_microseconds
+		ensure
+			definition: Result = user_time_microseconds + system_time_microseconds
+		end
+
+	max_resident_kilobytes: INTEGER_64
+			-- Peak resident set size (peak working set on Windows).
+
+	minor_page_faults: INTEGER_64
+			-- Page faults served without I/O (all page faults on Windows).
+
+	major_page_faults: INTEGER_64
+			-- Page faults that needed I/O (always 0 on Windows).
+
+	wall_time_nanoseconds: INTEGER_64
+			-- Time from spawn to exit on the monotonic clock.
+
+	wall_time_seconds: REAL_64
+			-- `wall_time_nanoseconds' in seconds.
+		do
+			Result := wall_time_nanoseconds / 1_000_000_000
+		end
+
+feature {NONE} -- C externals
+
+	c_user_time_us (a_usage: POINTER): INTEGER_64
+			-- Get user_time_us.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER_64)((sp_usage*)$a_usage)->user_time_us;"
+		end
+
+	c_system_time_us (a_usage: POINTER): INTEGER_64
+			-- Get system_time_us.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER_64)((sp_usage*)$a_usage)->system_time_us;"
+		end
+
+	c_max_rss_kb (a_usage: POINTER): INTEGER_64
+			-- Get max_rss_kb.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER_64)((sp_usage*)$a_usage)->max_rss_kb;"
+		end
+
+	c_minor_faults (a_usage: POINTER): INTEGER_64
+			-- Get minor_faults.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER_64)((sp_usage*)$a_usage)->minor_faults;"
+		end
+
+	c_major_faults (a_usage: POINTER): INTEGER_64
+			-- Get major_faults.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER_64)((sp_usage*)$a_usage)->major_faults;"
+		end
+
+	c_wall_time_ns (a_usage: POINTER): INTEGER_64
+			-- Get wall_time_ns.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (EIF_INTEGER_64)((sp_usage*)$a_usage)->wall_time_ns;"
+		end
+
+invariant
+	times_not_negative: user_time_microseconds >= 0 and system_time_microseconds >= 0
+	wall_time_not_negative: wall_time_nanoseconds >= 0
+
+end
@@ -0,0 +1,251 @@
+note
+	description: "[
+		Warm shell (/bin/sh, cmd.exe on Windows) that runs many small commands
+		without a spawn and shell startup per command.
+
+		Commands are sent over the shell's stdin and framed by sentinels the
+		command cannot predict; a builtin costs a pipe round trip (tens of
+		microseconds) instead of a process start (about a millisecond).
+		Commands share the shell, so `cd' and variables carry over. A command
+		that does not parse fails with a non-zero `last_exit_code' and leaves
+		the shell as it was. If a command ends the shell (`exit') or times
+		out, the next `run' starts a fresh shell in the original directory.
+
+		Usage:
+			session: SIMPLE_SHELL_SESSION
+			create session.make
+			session.run ("test -f config.h")
+			if session.last_exit_code = 0 then ... end
+			print (session.output_of ("uname -m"))
+			session.close
+	]"
+	author: "Larry Rix"
+	date: "$Date$"
+	revision: "$Revision$"
+
+class
+	SIMPLE_SHELL_SESSION
+
+create
+	make,
+	make_in_directory,
+	make_with_options
+
+feature {NONE} -- Initialization
+
+	make
+			-- Open a session in the current directory with default options.
+		do
+			make_with_options (Void, create {SIMPLE_PROCESS_OPTIONS}.make)
+		end
+
+	make_in_directory (a_directory: READABLE_STRING_GENERAL)
+			-- Open a session whose shell starts in `a_directory'.
+		require
+			directory_not_empty: not a_directory.is_empty
+		do
+			make_with_options (a_directory, create {SIMPLE_PROCESS_OPTIONS}.make)
+		end
+
+	make_with_options (a_directory: detachable READABLE_STRING_GENERAL; a_options: SIMPLE_PROCESS_OPTIONS)
+			-- Open a session in `a_directory' (Void: current directory).
+			-- Separate stderr, output limit and window visibility of `a_options'
+			-- apply to every command; its input settings are ignored.
+		local
+			l_dir: detachable C_STRING
+			l_dir_ptr: POINTER
+		do
+			if attached a_directory as d then
+				create l_dir.make (d.to_string_8)
+				l_dir_ptr := l_dir.item
+			end
+			session_handle := c_sp_session_open (l_dir_ptr, a_options.item)
+			if session_handle = default_pointer then
+				last_error := (create {C_STRING}.make_by_pointer (c_sp_get_last_error)).string.to_string_32
+			end
+		ensure
+			opened_or_error: is_open or last_error /= Void
+		end
+
+feature -- Access
+
+	last_result: detachable SIMPLE_PROCESS_RESULT
+			-- Outcome of the last `run'.
+
+	last_output: detachable STRING_32
+			-- Output of the last `run' (Void if it did not run).
+		do
+			if attached last_result as r and then r.was_successful then
+				Result := r.output
+			end
+		end
+
+	last_error_output: detachable STRING_32
+			-- Separate error output of the last `run'.
+		do
+			if attached last_result as r then
+				Result := r.error_output
+			end
+		end
+
+	last_exit_code: INTEGER
+			-- Exit status of the last command (-1 if it did not run).
+		do
+			if attached last_result as r then
+				Result := r.exit_code
+			else
+				Result := -1
+			end
+		end
+
+	last_error: detachable STRING_32
+			-- Why the session could not open or the last command did not run.
+
+	timeout_milliseconds: INTEGER
+			-- Longest a command may run before the shell is stopped (0: no limit).
+
+	restart_count: INTEGER
+			-- Times the shell was restarted after dying or timing out.
+		require
+			open: is_open
+		do
+			Result := c_sp_session_restarts (session_handle)
+		end
+
+feature -- Status
+
+	is_open: BOOLEAN
+			-- Is the session available for commands?
+		do
+			Result := session_handle /= default_pointer
+		end
+
+	was_successful: BOOLEAN
+			-- Did the last command run to completion (whatever its exit code)?
+		do
+			Result := attached last_result as r and then r.was_successful
+		end
+
+feature -- Settings
+
+	set_timeout (a_milliseconds: INTEGER)
+			-- Stop a command (and its shell) after `a_milliseconds'; 0 for no limit.
+		require
+			non_negative: a_milliseconds >= 0
+		do
+			timeout_milliseconds := a_milliseconds
+		ensure
+			set: timeout_milliseconds = a_milliseconds
+		end
+
+feature -- Execution
+
+	run (a_command: READABLE_STRING_GENERAL)
+			-- Run `a_command' in the session's shell.
+		require
+			open: is_open
+			command_not_empty: not a_command.is_empty
+		local
+			l_cmd: C_STRING
+			l_result: POINTER
+		do
+			create l_cmd.make (a_command.to_string_8)
+			l_result := c_sp_session_run (session_handle, l_cmd.item, timeout_milliseconds)
+			if l_result /= default_pointer then
+				create last_result.make_from_pointer (l_result, a_command)
+				c_sp_free_result (l_result)
+				if attached last_result as r then
+					last_error := r.error
+				end
+			else
+				last_result := Void
+				last_error := {STRING_32} "Memory allocation failed"
+			end
+		end
+
+	output_of (a_command: READABLE_STRING_GENERAL): STRING_32
+			-- Output of running `a_command' (empty if it did not run).
+		require
+			open: is_open
+			command_not_empty: not a_command.is_empty
+		do
+			run (a_command)
+			if attached last_output as l_out then
+				Result := l_out
+			else
+				create Result.make_empty
+			end
+		end
+
+feature -- Disposal
+
+	close
+			-- End the shell and release the session.
+		do
+			if session_handle /= default_pointer then
+				c_sp_session_close (session_handle)
+				session_handle := default_pointer
+			end
+		ensure
+			closed: not is_open
+		end
+
+feature {NONE} -- Implementation
+
+	session_handle: POINTER
+			-- C sp_shell_session, or default_pointer when closed.
+
+feature {NONE} -- C externals
+
+	c_sp_session_open (a_directory, a_options: POINTER): POINTER
+			-- Start a session shell.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_session_open((const char*)$a_directory, (const sp_options*)$a_options);"
+		end
+
+	c_sp_session_run (a_session, a_command: POINTER; a_timeout: INTEGER): POINTER
+			-- Run a command in the session shell.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_session_run((sp_shell_session*)$a_session, (const char*)$a_command, (int)$a_timeout);"
+		end
+
+	c_sp_session_restarts (a_session: POINTER): INTEGER
+			-- Number of shell restarts.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return sp_session_restarts((sp_shell_session*)$a_session);"
+		end
+
+	c_sp_session_close (a_session: POINTER)
+			-- End the shell and free the session.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"sp_session_close((sp_shell_session*)$a_session);"
+		end
+
+	c_sp_free_result (a_result: POINTER)
+			-- Free result structure.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"sp_free_result((sp_result*)$a_result);"
+		end
+
+	c_sp_get_last_error: POINTER
+			-- Get last error message.
+		external
+			"C inline use %"simple_process.h%""
+		alias
+			"return (char*)sp_get_last_error();"
+		end
+
+invariant
+	non_negative_timeout: timeout_milliseconds >= 0
+
+end
@@ -40,6 +40,32 @@ feature -- Test: Process Helper
 			assert_true ("cmd.exe in path", helper.has_file_in_path ("cmd.exe"))
 		end
 
+	test_resolve_command
+			-- Test resolving a command to its full path without a shell.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.resolve_command"
+			testing: "covers/{SIMPLE_PROCESS}.has_command"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+			l_name: STRING
+		do
+			create process.make
+			if {PLATFORM}.is_windows then
+				l_name := "cmd.exe"
+			else
+				l_name := "sh"
+			end
+			assert_attached ("resolved", process.resolve_command (l_name))
+			if attached process.resolve_command (l_name) as l_path then
+				assert_string_contains ("full path", l_path, l_name)
+				assert_true ("absolute", l_path.count > l_name.count)
+			end
+			assert_true ("cached lookup agrees", process.has_command (l_name))
+			assert_true ("missing not resolved", process.resolve_command ("no_such_command_simple_process") = Void)
+			assert_false ("no shell injection", process.has_command ("sh; exit 0"))
+		end
+
 	test_show_process_flag
 			-- Test show_process flag toggling.
 		note
@@ -110,6 +136,943 @@ feature -- Test: Async Process
 			assert_attached ("async process created", async)
 		end
 
+feature -- Test: Direct Execution
+
+	test_execute_argv
+			-- Test running a program directly from an argument vector.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.execute_argv"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+		do
+			create process.make
+			if {PLATFORM}.is_windows then
+				process.execute_argv (<<"cmd", "/c", "echo", "argv test">>)
+			else
+				process.execute_argv (<<"printf", "%%s", "argv test">>)
+			end
+			assert_true ("successful", process.was_successful)
+			assert_attached ("has output", process.last_output)
+			if attached process.last_output as l_out then
+				assert_string_contains ("argument kept intact", l_out, "argv test")
+			end
+		end
+
+	test_async_start_argv
+			-- Test starting a program directly from an argument vector.
+		note
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.start_argv"
+			testing: "execution/isolated"
+		local
+			async: SIMPLE_ASYNC_PROCESS
+		do
+			create async.make
+			if {PLATFORM}.is_windows then
+				async.start_argv (<<"cmd", "/c", "echo", "async argv">>)
+			else
+				async.start_argv (<<"echo", "async argv">>)
+			end
+			assert_true ("started", async.was_started_successfully)
+			assert_true ("finished", async.wait_seconds (10))
+			async.close
+			assert_string_contains ("has output", async.accumulated_output, "async argv")
+		end
+
+feature -- Test: Error Output
+
+	test_separate_error_output
+			-- Test capturing stderr apart from stdout.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.set_separate_error_output"
+			testing: "covers/{SIMPLE_PROCESS}.last_error_output"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+		do
+			create process.make
+			process.set_separate_error_output (True)
+			if {PLATFORM}.is_windows then
+				process.execute ("cmd /c echo to_out & echo to_err 1>&2")
+			else
+				process.execute ("echo to_out; echo to_err >&2")
+			end
+			assert_true ("successful", process.was_successful)
+			if attached process.last_output as l_out then
+				assert_string_contains ("stdout captured", l_out, "to_out")
+				assert_false ("stderr not in stdout", l_out.has_substring ("to_err"))
+			end
+			assert_attached ("has error output", process.last_error_output)
+			if attached process.last_error_output as l_err then
+				assert_string_contains ("stderr captured", l_err, "to_err")
+			end
+		end
+
+feature -- Test: Streaming Output
+
+	test_output_handler_streaming
+			-- Test passing output to an agent as it arrives.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.set_output_handler"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+			streamed: STRING_32
+		do
+			create process.make
+			create streamed.make_empty
+			process.set_output_handler (agent (a_chunk, a_all: STRING_32) do a_all.append (a_chunk) end (?, streamed))
+			if {PLATFORM}.is_windows then
+				process.execute ("cmd /c echo first & echo second")
+			else
+				process.execute ("echo first; echo second")
+			end
+			assert_true ("successful", process.was_successful)
+			assert_string_contains ("first streamed", streamed, "first")
+			assert_string_contains ("second streamed", streamed, "second")
+			if attached process.last_output as l_out then
+				assert_true ("kept output matches", l_out.same_string (streamed))
+			end
+		end
+
+	test_output_limit
+			-- Test that output past the limit is dropped, not the child.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.set_output_limit"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+		do
+			create process.make
+			process.set_output_limit (5)
+			if {PLATFORM}.is_windows then
+				process.execute ("cmd /c echo 0123456789 & exit 3")
+			else
+				process.execute ("echo 0123456789; exit 3")
+			end
+			assert_true ("successful", process.was_successful)
+			assert_true ("truncated", process.is_output_truncated)
+			assert_true ("child ran to completion", process.last_exit_code = 3)
+			if attached process.last_output as l_out then
+				assert_true ("kept limit", l_out.count = 5)
+			end
+		end
+
+	test_output_limit_streaming_bytes
+			-- Test that a handler does not change how much multibyte output is kept.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.set_output_limit"
+			testing: "covers/{SIMPLE_PROCESS}.set_output_handler"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+		do
+			if not {PLATFORM}.is_windows then
+				create process.make
+				process.set_output_limit (5)
+				process.set_output_handler (agent (a_chunk: STRING_32) do end)
+				process.execute ("printf '\303\251\303\251\303\251'")
+				assert_true ("truncated", process.is_output_truncated)
+				if attached process.last_output as l_out then
+					assert_true ("whole characters within 5 bytes", l_out.count = 2)
+					assert_true ("decoded", l_out [1].natural_32_code = 0xE9)
+				end
+			end
+		end
+
+feature -- Test: Buffered Reads
+
+	test_read_output_into
+			-- Test reading output into a caller-owned buffer.
+		note
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.read_output_into"
+			testing: "execution/isolated"
+		local
+			async: SIMPLE_ASYNC_PROCESS
+			buffer: MANAGED_POINTER
+			l_count, l_total, l_rounds: INTEGER
+		do
+			create async.make
+			create buffer.make (4)
+			if {PLATFORM}.is_windows then
+				async.start ("cmd /c echo 0123456789")
+			else
+				async.start ("echo 0123456789")
+			end
+			assert_true ("started", async.was_started_successfully)
+			from until l_count < 0 or l_rounds > 1_000 loop
+				if async.wait_for_output (1_000) > 0 then
+					l_count := async.read_output_into (buffer)
+					if l_count > 0 then
+						l_total := l_total + l_count
+					end
+				else
+					l_count := -1
+				end
+				l_rounds := l_rounds + 1
+			end
+			assert_true ("all bytes read", l_total >= 10)
+			assert_false ("output ended", async.has_open_output)
+			assert_true ("nothing accumulated", async.accumulated_output.is_empty)
+			async.close
+		end
+
+feature -- Test: Standard Input
+
+	test_execute_with_input
+			-- Test feeding text to stdin of a synchronous execution.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.set_input"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+		do
+			create process.make
+			process.set_input ("banana%Napple%N")
+			process.execute ("sort")
+			assert_true ("successful", process.was_successful)
+			if attached process.last_output as l_out then
+				assert_true ("input sorted", l_out.substring_index ("apple", 1) > 0 and
+					l_out.substring_index ("apple", 1) < l_out.substring_index ("banana", 1))
+			end
+		end
+
+	test_async_write_input
+			-- Test writing stdin incrementally while reading output.
+		note
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.write_input"
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.close_input"
+			testing: "execution/isolated"
+		local
+			async: SIMPLE_ASYNC_PROCESS
+			l_rounds: INTEGER
+		do
+			create async.make
+			async.set_keep_input_open (True)
+			async.start ("sort")
+			assert_true ("started", async.was_started_successfully)
+			assert_true ("input open", async.has_open_input)
+			async.write_input ("pear%N")
+			async.write_input ("fig%N")
+			async.close_input
+			from until not async.has_open_output or l_rounds > 100 loop
+				if async.wait_for_output (1_000) > 0 and then attached async.read_available_output then
+					-- Output accumulated
+				end
+				l_rounds := l_rounds + 1
+			end
+			assert_false ("input closed", async.has_open_input)
+			assert_true ("finished", async.wait_seconds (10))
+			async.close
+			assert_true ("fig before pear", async.accumulated_output.substring_index ("fig", 1) > 0 and
+				async.accumulated_output.substring_index ("fig", 1) < async.accumulated_output.substring_index ("pear", 1))
+		end
+
+feature -- Test: Output Decoding
+
+	test_utf8_output
+			-- Test that multibyte UTF-8 output decodes to the same characters.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.last_output"
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.read_available_output"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+			async: SIMPLE_ASYNC_PROCESS
+			l_text: STRING_32
+		do
+			if not {PLATFORM}.is_windows then
+				l_text := {STRING_32} "caf%/233/ %/8364/5 %/128512/%N"
+				create process.make
+				process.set_input (l_text)
+				process.execute_argv (<<"cat">>)
+				assert_true ("successful", process.was_successful)
+				if attached process.last_output as l_out then
+					assert_true ("decoded", l_out.same_string (l_text))
+				end
+
+				create async.make
+				async.set_input (l_text)
+				async.start_argv (<<"cat">>)
+				assert_true ("finished", async.wait_seconds (10))
+				if attached async.read_available_output as l_out then
+					assert_true ("async decoded", l_out.same_string (l_text))
+				end
+				async.close
+			end
+		end
+
+feature -- Test: Resource Usage
+
+	test_resource_usage
+			-- Test CPU, memory and wall time reported for finished processes.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.last_usage"
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.usage"
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.elapsed_nanoseconds"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+			async: SIMPLE_ASYNC_PROCESS
+		do
+			create process.make
+			process.execute ("echo usage")
+			assert_true ("successful", process.was_successful)
+			assert_attached ("has usage", process.last_usage)
+			if attached process.last_usage as l_usage then
+				assert_true ("wall time measured", l_usage.wall_time_nanoseconds > 0)
+				assert_true ("memory measured", l_usage.max_resident_kilobytes > 0)
+			end
+
+			create async.make
+			if {PLATFORM}.is_windows then
+				async.start ("ping -n 2 127.0.0.1")
+			else
+				async.start ("sleep 1")
+			end
+			assert_true ("no usage while running", async.usage = Void)
+			assert_true ("finished", async.wait_seconds (10))
+			assert_attached ("async usage", async.usage)
+			if attached async.usage as l_usage then
+				assert_true ("ran about a second", l_usage.wall_time_nanoseconds >= 500_000_000)
+				assert_true ("elapsed frozen at exit", async.elapsed_nanoseconds = l_usage.wall_time_nanoseconds)
+			end
+			async.close
+		end
+
+feature -- Test: Pipelines
+
+	test_execute_pipeline
+			-- Test running stages connected by pipes without a shell.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.execute_pipeline"
+			testing: "covers/{SIMPLE_PROCESS}.last_stage_exit_codes"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+		do
+			create process.make
+			process.set_input ("banana%Napple%N")
+			if {PLATFORM}.is_windows then
+				process.execute_pipeline (<< <<"sort">>, <<"findstr", "apple">> >>)
+			else
+				process.execute_pipeline (<< <<"sort">>, <<"grep", "apple">> >>)
+			end
+			assert_true ("successful", process.was_successful)
+			if attached process.last_output as l_out then
+				assert_string_contains ("last stage output", l_out, "apple")
+				assert_false ("filtered", l_out.has_substring ("banana"))
+			end
+			assert_attached ("stage codes", process.last_stage_exit_codes)
+			if attached process.last_stage_exit_codes as l_codes then
+				assert_true ("two stages", l_codes.count = 2)
+				assert_true ("all succeeded", l_codes [1] = 0 and l_codes [2] = 0)
+			end
+		end
+
+feature -- Test: Batch Execution
+
+	test_batch_execution
+			-- Test running commands with bounded parallelism, results in input order.
+		note
+			testing: "covers/{SIMPLE_PROCESS_BATCH}.execute"
+			testing: "covers/{SIMPLE_PROCESS_BATCH}.set_fail_fast"
+			testing: "execution/isolated"
+		local
+			batch: SIMPLE_PROCESS_BATCH
+			i: INTEGER
+		do
+			create batch.make
+			batch.set_max_parallel (2)
+			from i := 1 until i > 4 loop
+				if {PLATFORM}.is_windows then
+					batch.add ("cmd /c echo job" + i.out, Void)
+				else
+					batch.add ("echo job" + i.out, Void)
+				end
+				i := i + 1
+			end
+			batch.execute
+			assert_true ("four results", batch.results.count = 4)
+			assert_true ("all succeeded", batch.all_succeeded)
+			from i := 1 until i > 4 loop
+				assert_string_contains ("in order", batch.results.i_th (i).output, "job" + i.out)
+				i := i + 1
+			end
+
+			batch.wipe_out
+			batch.set_fail_fast (True)
+			batch.set_max_parallel (1)
+			if {PLATFORM}.is_windows then
+				batch.add ("cmd /c exit 3", Void)
+				batch.add ("cmd /c echo skipped", Void)
+			else
+				batch.add ("exit 3", Void)
+				batch.add ("echo skipped", Void)
+			end
+			batch.execute
+			assert_false ("not all succeeded", batch.all_succeeded)
+			assert_true ("failure code", batch.results.first.exit_code = 3)
+			assert_false ("rest cancelled", batch.results.last.was_successful)
+			assert_attached ("cancel reason", batch.results.last.error)
+		end
+
+feature -- Test: Shell Session
+
+	test_shell_session
+			-- Test running several commands in one warm shell.
+		note
+			testing: "covers/{SIMPLE_SHELL_SESSION}.run"
+			testing: "covers/{SIMPLE_SHELL_SESSION}.restart_count"
+			testing: "execution/isolated"
+		local
+			session: SIMPLE_SHELL_SESSION
+		do
+			create session.make
+			assert_true ("open", session.is_open)
+			if {PLATFORM}.is_windows then
+				session.run ("set SP_TEST=kept")
+				assert_string_contains ("state kept", session.output_of ("echo %%SP_TEST%%"), "kept")
+				session.run ("cmd /c exit 4")
+			else
+				session.run ("SP_TEST=kept")
+				assert_string_contains ("state kept", session.output_of ("echo $SP_TEST"), "kept")
+				session.run ("false")
+			end
+			assert_true ("ran", session.was_successful)
+			assert_false ("non-zero status", session.last_exit_code = 0)
+
+			session.run ("exit 3")
+			assert_true ("shell exit status", session.last_exit_code = 3)
+			assert_string_contains ("restarted", session.output_of ("echo again"), "again")
+			assert_true ("one restart", session.restart_count = 1)
+			session.close
+			assert_false ("closed", session.is_open)
+		end
+
+	test_shell_session_parse_error
+			-- Test that a command that does not parse keeps the shell and its state.
+		note
+			testing: "covers/{SIMPLE_SHELL_SESSION}.run"
+			testing: "execution/isolated"
+		local
+			session: SIMPLE_SHELL_SESSION
+		do
+			if not {PLATFORM}.is_windows then
+				create session.make
+				session.set_timeout (10_000)
+				session.run ("SP_TEST=kept")
+				session.run ("echo 'unbalanced")
+				assert_true ("ran", session.was_successful)
+				assert_false ("parse error status", session.last_exit_code = 0)
+				assert_string_contains ("state kept", session.output_of ("echo $SP_TEST"), "kept")
+				assert_string_contains ("quotes intact", session.output_of ("echo 'it'\''s'"), "it's")
+				assert_true ("no restart", session.restart_count = 0)
+				session.close
+			end
+		end
+
+feature -- Test: Spawn Server
+
+	test_spawn_server
+			-- Test that commands behave the same when spawned by the spawn server.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.start_spawn_server"
+			testing: "covers/{SIMPLE_PROCESS}.stop_spawn_server"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+			async: SIMPLE_ASYNC_PROCESS
+		do
+			create process.make
+			process.start_spawn_server
+			if {PLATFORM}.is_windows then
+				assert_false ("no server on Windows", process.is_spawn_server_running)
+			else
+				assert_true ("server running", process.is_spawn_server_running)
+				process.execute ("echo served; exit 3")
+				assert_true ("ran", process.was_successful)
+				assert_true ("exit code", process.last_exit_code = 3)
+				if attached process.last_output as l_out then
+					assert_string_contains ("output", l_out, "served")
+				end
+
+				create async.make
+				async.start ("echo async")
+				assert_true ("async finished", async.wait_seconds (10))
+				assert_true ("async exit code", async.exit_code = 0)
+				async.close
+				process.stop_spawn_server
+				assert_false ("stopped", process.is_spawn_server_running)
+			end
+		end
+
+feature -- Test: Timeouts
+
+	test_execution_timeout
+			-- Test that a run past its timeout is stopped with its children.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.set_timeout"
+			testing: "covers/{SIMPLE_PROCESS}.has_timed_out"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+			streamed: STRING_32
+		do
+			create process.make
+			process.set_timeout (300)
+			process.set_kill_grace_period (200)
+			if {PLATFORM}.is_windows then
+				process.execute ("cmd /c echo begun & ping -n 10 127.0.0.1 >NUL")
+			else
+				process.execute ("echo begun; sleep 10")
+			end
+			assert_true ("ran", process.was_successful)
+			assert_true ("timed out", process.has_timed_out)
+			if attached process.last_output as l_out then
+				assert_string_contains ("output before timeout kept", l_out, "begun")
+			end
+			if attached process.last_usage as l_usage then
+				assert_true ("stopped early", l_usage.wall_time_seconds < 5.0)
+			end
+
+			create streamed.make_empty
+			process.set_output_handler (agent (a_chunk, a_all: STRING_32) do a_all.append (a_chunk) end (?, streamed))
+			if {PLATFORM}.is_windows then
+				process.execute ("cmd /c echo streamed & ping -n 10 127.0.0.1 >NUL")
+			else
+				process.execute ("echo streamed; sleep 10")
+			end
+			assert_true ("streamed run timed out", process.has_timed_out)
+			assert_string_contains ("streamed before timeout", streamed, "streamed")
+
+			process.set_output_handler (Void)
+			process.execute ("echo quick")
+			assert_false ("quick run not timed out", process.has_timed_out)
+			assert_true ("quick exit code", process.last_exit_code = 0)
+		end
+
+	test_timeout_background_child
+			-- Test that a timeout still stops what a finished command left holding its output.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.set_timeout"
+			testing: "covers/{SIMPLE_PROCESS_BATCH}.set_timeout"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+			batch: SIMPLE_PROCESS_BATCH
+			streamed: STRING_32
+		do
+			if not {PLATFORM}.is_windows then
+				create process.make
+				process.set_timeout (300)
+				process.set_kill_grace_period (200)
+				create streamed.make_empty
+				process.set_output_handler (agent (a_chunk, a_all: STRING_32) do a_all.append (a_chunk) end (?, streamed))
+				process.execute ("echo begun; sleep 10 &")
+				assert_true ("streamed run timed out", process.has_timed_out)
+				assert_string_contains ("streamed before timeout", streamed, "begun")
+				if attached process.last_usage as l_usage then
+					assert_true ("leader exited at once", l_usage.wall_time_seconds < 5.0)
+				end
+
+				create batch.make
+				batch.set_timeout (300)
+				batch.add ("echo begun; sleep 10 &", Void)
+				batch.execute
+				assert_true ("batch run timed out", batch.results.first.has_timed_out)
+				assert_string_contains ("batch output kept", batch.results.first.output, "begun")
+			end
+		end
+
+feature -- Test: Termination Status
+
+	test_termination_status
+			-- Test that exit code and killing signal survive repeated queries.
+		note
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.exit_code"
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.was_signaled"
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.termination_signal"
+			testing: "execution/isolated"
+		local
+			async: SIMPLE_ASYNC_PROCESS
+		do
+			create async.make
+			if {PLATFORM}.is_windows then
+				async.start ("cmd /c exit 3")
+			else
+				async.start ("exit 3")
+			end
+			from until not async.is_running or async.elapsed_seconds > 10 loop end
+			assert_true ("finished", async.has_finished)
+			assert_true ("exit code after is_running", async.exit_code = 3)
+			assert_true ("exit code again", async.exit_code = 3)
+			assert_false ("exited, not signaled", async.was_signaled)
+			assert_true ("no signal", async.termination_signal = 0)
+			async.close
+
+			create async.make
+			if {PLATFORM}.is_windows then
+				async.start ("ping -n 10 127.0.0.1")
+			else
+				async.start ("sleep 10")
+			end
+			assert_true ("killed", async.kill)
+			assert_true ("ended", async.wait_seconds (5))
+			if {PLATFORM}.is_windows then
+				assert_false ("no signals on Windows", async.was_signaled)
+			else
+				assert_true ("signaled", async.was_signaled)
+				assert_true ("SIGKILL", async.termination_signal = 9)
+				assert_true ("no exit code", async.exit_code = -1)
+			end
+			async.close
+		end
+
+feature -- Test: Line Streaming
+
+	test_line_streaming
+			-- Test splitting output into lines and keeping only a bounded tail.
+		note
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.set_line_handler"
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.keep_tail"
+			testing: "covers/{SIMPLE_PROCESS_TAIL}"
+			testing: "execution/isolated"
+		local
+			async: SIMPLE_ASYNC_PROCESS
+			tail: SIMPLE_PROCESS_TAIL
+			lines: ARRAYED_LIST [STRING_32]
+		do
+			create tail.make (3, 5)
+			tail.extend ("abc")
+			tail.extend ("de")
+			tail.extend ("fgh")
+			assert_true ("dropped for characters", tail.count = 2 and tail.character_count = 5)
+			assert_true ("oldest kept", tail [1].same_string ("de"))
+			tail.extend ("0123456789")
+			assert_true ("long line keeps its end", tail.count = 1 and tail.last_line.same_string ("56789"))
+
+			create lines.make (1_000)
+			create async.make
+			async.set_line_handler (agent lines.extend)
+			async.keep_tail (10, 0)
+			if {PLATFORM}.is_windows then
+				async.start ("cmd /c for /L %%i in (1,1,1000) do @echo %%i")
+			else
+				async.start ("i=1; while [ $i -le 1000 ]; do echo $i; i=$((i+1)); done; printf 'no break'")
+			end
+			from until not async.has_open_output or else async.wait_for_output (10_000) <= 0 loop
+				if attached async.read_available_output then
+					-- Lines delivered
+				end
+			end
+			assert_true ("every line", lines.count >= 1_000)
+			assert_true ("first line", lines.first.same_string ("1"))
+			assert_true ("no line breaks", not lines.i_th (500).has ('%N') and not lines.i_th (500).has ('%R'))
+			assert_true ("nothing accumulated", async.accumulated_output.is_empty)
+			if attached async.output_tail as l_tail then
+				assert_true ("tail bounded", l_tail.count = 10)
+				assert_true ("older lines dropped", l_tail.dropped_count = lines.count - 10)
+				if not {PLATFORM}.is_windows then
+					assert_true ("unfinished last line", l_tail.last_line.same_string ("no break"))
+					assert_true ("tail start", l_tail [1].same_string ("992"))
+				end
+			else
+				assert_true ("tail kept", False)
+			end
+			async.close
+		end
+
+feature -- Test: Output Redirection
+
+	test_output_to_file
+			-- Test that output written straight to a file or memory is not captured.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.set_output_file"
+			testing: "covers/{SIMPLE_PROCESS}.set_output_in_memory"
+			testing: "covers/{SIMPLE_PROCESS_OUTPUT_VIEW}"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+			file: PLAIN_TEXT_FILE
+			command: STRING
+		do
+			if {PLATFORM}.is_windows then
+				command := "cmd /c echo redirected"
+			else
+				command := "echo redirected"
+			end
+			create process.make
+			process.set_output_file ("simple_process_output_test.txt")
+			process.execute (command)
+			assert_true ("ran", process.was_successful)
+			if attached process.last_output as l_out then
+				assert_true ("nothing captured", l_out.is_empty)
+			end
+			assert_true ("size reported", process.last_output_size >= 11)
+			assert_true ("no view unless mapped", process.last_output_view = Void)
+			create file.make_open_read ("simple_process_output_test.txt")
+			file.read_line
+			assert_string_contains ("written to file", file.last_string, "redirected")
+			assert_true ("file size", file.count.to_integer_64 = process.last_output_size)
+			file.close
+
+			process.set_map_output (True)
+			process.execute (command)
+			if attached process.last_output_view as l_view then
+				assert_string_contains ("file mapped", l_view.text, "redirected")
+				l_view.close
+				assert_false ("closed", l_view.is_open)
+			else
+				assert_true ("view of file", False)
+			end
+			file.delete
+
+			process.set_output_in_memory (True)
+			process.execute (command)
+			assert_true ("memory run", process.was_successful)
+			if attached process.last_output_view as l_view then
+				assert_true ("view size", l_view.count = process.last_output_size)
+				assert_string_contains ("in memory", l_view.text, "redirected")
+				assert_true ("window", l_view.window (0, 5).read_natural_8 (0) = ('r').code.to_natural_8)
+			else
+				assert_true ("view of memory", False)
+			end
+		end
+
+feature -- Test: Child Environment
+
+	test_child_environment
+			-- Test that a prepared environment reaches sync and async children.
+		note
+			testing: "covers/{SIMPLE_PROCESS_ENVIRONMENT}"
+			testing: "covers/{SIMPLE_PROCESS}.set_environment"
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.set_environment"
+			testing: "execution/isolated"
+		local
+			environment: SIMPLE_PROCESS_ENVIRONMENT
+			process: SIMPLE_PROCESS
+			async: SIMPLE_ASYNC_PROCESS
+			command: STRING
+		do
+			create environment.make_inherited
+			assert_true ("inherits PATH", environment.has ("PATH"))
+			environment.set_variable ("SP_TENANT", "acme")
+			environment.set_variable ("SP_TENANT", "globex")
+			assert_true ("replaced", attached environment.value ("SP_TENANT") as l_value and then l_value.same_string ("globex"))
+			environment.remove_variable ("PATH")
+			assert_false ("removed", environment.has ("PATH"))
+			assert_false ("invalid name", environment.is_valid_name ("A=B"))
+
+			if {PLATFORM}.is_windows then
+				command := "cmd /c echo tenant=%%SP_TENANT%%"
+			else
+				command := "echo tenant=$SP_TENANT"
+			end
+			create process.make
+			process.set_environment (environment)
+			process.execute (command)
+			process.execute (command)
+			if attached process.last_output as l_out then
+				assert_string_contains ("sync child sees it", l_out, "tenant=globex")
+			end
+
+			create async.make
+			async.set_environment (environment)
+			async.start (command)
+			from until not async.has_open_output or else async.wait_for_output (10_000) <= 0 loop
+				if attached async.read_available_output then
+					-- Accumulated
+				end
+			end
+			assert_string_contains ("async child sees it", async.accumulated_output, "tenant=globex")
+			async.close
+
+			process.set_environment (Void)
+			process.execute (command)
+			if attached process.last_output as l_out then
+				assert_false ("own environment again", l_out.has_substring ("globex"))
+			end
+			environment.close
+			assert_false ("closed", environment.is_open)
+		end
+
+feature -- Test: Child Resources
+
+	test_child_resources
+			-- Test that resource controls apply to the child only.
+		note
+			testing: "covers/{SIMPLE_PROCESS_RESOURCES}"
+			testing: "covers/{SIMPLE_PROCESS}.set_resources"
+			testing: "covers/{SIMPLE_ASYNC_PROCESS}.set_resources"
+			testing: "execution/isolated"
+		local
+			resources: SIMPLE_PROCESS_RESOURCES
+			process: SIMPLE_PROCESS
+			async: SIMPLE_ASYNC_PROCESS
+			command: STRING
+		do
+			create resources.make
+			resources.set_nice_increment (5)
+			resources.set_max_open_files (64)
+			resources.set_max_cpu_seconds (60)
+			resources.set_cpus (<<0>>)
+			assert_false ("invalid io priority", resources.is_valid_io_priority (resources.Io_priority_idle, 8))
+
+			if {PLATFORM}.is_windows then
+				command := "cmd /c echo limited"
+			else
+				command := "echo nice=$(nice) files=$(ulimit -n)"
+			end
+			create process.make
+			process.set_resources (resources)
+			process.execute (command)
+			assert_true ("sync ran", process.was_successful)
+			if not {PLATFORM}.is_windows and attached process.last_output as l_out then
+				assert_string_contains ("sync nice", l_out, "nice=5")
+				assert_string_contains ("sync open files", l_out, "files=64")
+			end
+
+			create async.make
+			async.set_resources (resources)
+			async.start (command)
+			from until not async.has_open_output or else async.wait_for_output (10_000) <= 0 loop
+				if attached async.read_available_output then
+					-- Accumulated
+				end
+			end
+			if not {PLATFORM}.is_windows then
+				assert_string_contains ("async open files", async.accumulated_output, "files=64")
+			end
+			async.close
+
+			process.set_resources (Void)
+			process.execute (command)
+			if not {PLATFORM}.is_windows and attached process.last_output as l_out then
+				assert_false ("caller untouched", l_out.has_substring ("files=64"))
+			end
+		end
+
+feature -- Test: Process Metrics
+
+	test_process_metrics
+			-- Test that runs show up in the library-wide metrics.
+		note
+			testing: "covers/{SIMPLE_PROCESS_METRICS}"
+			testing: "execution/isolated"
+		local
+			metrics: SIMPLE_PROCESS_METRICS
+			process: SIMPLE_PROCESS
+			spawns, runs: INTEGER_64
+		do
+			create metrics.make
+			spawns := metrics.spawn_count
+			runs := metrics.sample_count (metrics.Runtime)
+
+			create process.make
+			if {PLATFORM}.is_windows then
+				process.execute ("cmd /c echo metrics")
+				process.execute ("cmd /c echo metrics")
+			else
+				process.execute ("echo metrics")
+				process.execute ("echo metrics")
+			end
+			metrics.refresh
+			assert_true ("spawns counted", metrics.spawn_count >= spawns + 2)
+			assert_true ("runtimes recorded", metrics.sample_count (metrics.Runtime) >= runs + 2)
+			assert_true ("spawn latency recorded", metrics.sample_count (metrics.Spawn_latency) > 0)
+			assert_true ("percentile in a bucket", metrics.percentile_bound (metrics.Runtime, 50) >= metrics.bucket_bound (1))
+			assert_true ("bounds double", metrics.bucket_bound (2) = 2 * metrics.bucket_bound (1))
+			assert_string_contains ("prometheus counter", metrics.prometheus_text, "simple_process_spawns_total")
+			assert_string_contains ("prometheus histogram", metrics.prometheus_text, "simple_process_runtime_seconds_bucket{le=%"+Inf%"}")
+		end
+
+feature -- Test: Process Trace
+
+	test_process_trace
+			-- Test that a run is written to the trace file as a child track.
+		note
+			testing: "covers/{SIMPLE_PROCESS}.start_trace"
+			testing: "covers/{SIMPLE_PROCESS}.stop_trace"
+			testing: "execution/isolated"
+		local
+			process: SIMPLE_PROCESS
+			file: PLAIN_TEXT_FILE
+		do
+			create process.make
+			process.start_trace ("simple_process_trace_test.json")
+			assert_true ("tracing", process.is_tracing)
+			if {PLATFORM}.is_windows then
+				process.execute ("cmd /c echo traced")
+			else
+				process.execute ("echo traced")
+			end
+			process.stop_trace
+			assert_false ("stopped", process.is_tracing)
+
+			create file.make_open_read ("simple_process_trace_test.json")
+			file.read_stream (file.count)
+			assert_true ("array", file.last_string.starts_with ("["))
+			assert_string_contains ("requested", file.last_string, "spawn requested")
+			assert_string_contains ("first output", file.last_string, "first output")
+			assert_string_contains ("process span", file.last_string, "%\"ph%\":%\"X%\"")
+			if not {PLATFORM}.is_windows then
+				assert_string_contains ("exec seen", file.last_string, "exec done")
+				assert_string_contains ("reaped", file.last_string, "reaped")
+			end
+			file.close
+			file.delete
+		end
+
+feature -- Test: Process Group
+
+	test_process_group_wait_any
+			-- Test supervising several processes through one group.
+		note
+			testing: "covers/{SIMPLE_PROCESS_GROUP}.wait_any"
+			testing: "covers/{SIMPLE_PROCESS_GROUP}.add"
+			testing: "covers/{SIMPLE_PROCESS_GROUP}.remove"
+			testing: "execution/isolated"
+		local
+			group: SIMPLE_PROCESS_GROUP
+			async: SIMPLE_ASYNC_PROCESS
+			i, l_exited, l_rounds: INTEGER
+		do
+			create group.make
+			from i := 1 until i > 3 loop
+				create async.make
+				if {PLATFORM}.is_windows then
+					async.start ("cmd /c echo member" + i.out)
+				else
+					async.start ("echo member" + i.out)
+				end
+				group.add (async)
+				i := i + 1
+			end
+			assert_true ("three members", group.count = 3)
+
+			from until l_exited = 3 or l_rounds > 100 loop
+				if group.wait_any (-1) > 0 then
+					across group.processes_with_output as ic loop
+						if attached ic.item.read_available_output then
+							-- Output accumulated
+						end
+					end
+					across group.exited_processes as ic loop
+						group.remove (ic.item)
+						ic.item.close
+						assert_string_contains ("member output", ic.item.accumulated_output, "member")
+						l_exited := l_exited + 1
+					end
+				end
+				l_rounds := l_rounds + 1
+			end
+			assert_true ("all exited", l_exited = 3)
+			assert_true ("group empty", group.is_empty)
+			assert_true ("empty group does not block", group.wait_any (-1) = 0)
+			group.close
+		end
+
 feature -- Test: Command with Directory
 
 	test_output_with_directory
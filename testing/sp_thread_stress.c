@@ -0,0 +1,242 @@
+/*
+ * sp_thread_stress.c - Concurrent spawning from many threads
+ *
+ * Starts T threads that each run N processes through simple_process.c at
+ * the same time, with no locking on the caller's side, and checks that:
+ *
+ *   - every child's output is the token its own thread sent it
+ *     (argv, shell command, stdin round trip and async runs in turn)
+ *   - every exit code is the one that thread asked for
+ *   - no run hangs: a child holding another thread's pipe would keep that
+ *     thread from seeing EOF, so each run is bounded by a wait timeout
+ *   - no descriptors are left open once all threads are done (POSIX)
+ *
+ * Build:
+ *   cc -O2 -I../Clib sp_thread_stress.c ../Clib/simple_process.c -o sp_thread_stress -lpthread
+ *
+ * Usage:
+ *   ./sp_thread_stress [threads] [runs_per_thread]
+ *
+ * Exits 0 when every run passed. Set SP_SPAWN_SERVER=1 to run the same
+ * load through the spawn server.
+ *
+ * Copyright (c) 2025 Larry Rix - MIT License
+ */
+
+#include "simple_process.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+#include <windows.h>
+#define ECHO_ARGV(token) {"cmd", "/c", "echo", token, NULL}
+#define ECHO_COMMAND "cmd /c echo %s"
+#define CAT_COMMAND "findstr \"^\""
+#define EXIT_COMMAND "cmd /c echo %s& exit %d"
+#else
+#include <pthread.h>
+#include <dirent.h>
+#define ECHO_ARGV(token) {"echo", token, NULL}
+#define ECHO_COMMAND "echo %s"
+#define CAT_COMMAND "cat"
+#define EXIT_COMMAND "echo %s; exit %d"
+#endif
+
+#define WAIT_LIMIT_MS 30000
+
+typedef struct {
+    int index;
+    int runs;
+    int failures;
+} worker;
+
+static int runs_per_thread = 128;
+
+/* Report a failed run of `w' and count it. */
+static void fail(worker* w, int run, const char* what, const char* detail) {
+    fprintf(stderr, "thread %d run %d: %s%s%s\n", w->index, run, what,
+            detail ? ": " : "", detail ? detail : "");
+    w->failures++;
+}
+
+/* Does `result' hold `token' with exit code `code'? */
+static void check_result(worker* w, int run, const char* what, sp_result* result,
+                         const char* token, int code) {
+    if (!result) {
+        fail(w, run, what, "no result");
+    } else if (!result->success) {
+        fail(w, run, what, result->error_message);
+    } else if (!result->output || !strstr(result->output, token)) {
+        fail(w, run, what, "output of another run");
+    } else if (result->exit_code != code) {
+        fail(w, run, what, "wrong exit code");
+    }
+    sp_free_result(result);
+}
+
+static void run_async(worker* w, int run, const char* token) {
+    char command[128];
+    sp_async_process* proc;
+    char* output;
+    int length, code = (w->index + run) % 100;
+
+    snprintf(command, sizeof(command), EXIT_COMMAND, token, code);
+    proc = sp_start_async(command, NULL, 0);
+    if (!proc || !proc->started) {
+        fail(w, run, "async", proc ? proc->error_message : "no process");
+    } else if (sp_wait_timeout(proc, WAIT_LIMIT_MS) != 1) {
+        fail(w, run, "async", "did not finish");
+        sp_kill(proc);
+    } else {
+        output = sp_read_output(proc, &length);
+        if (!output || !strstr(output, token)) {
+            fail(w, run, "async", "output of another run");
+        } else if (sp_get_exit_code(proc) != code) {
+            fail(w, run, "async", "wrong exit code");
+        }
+        free(output);
+    }
+    if (proc) sp_async_close(proc);
+}
+
+static void run_worker(worker* w) {
+    char token[64];
+    char command[128];
+    sp_options options;
+    int run;
+
+    for (run = 0; run < w->runs; run++) {
+        snprintf(token, sizeof(token), "T%d_R%d_END", w->index, run);
+        switch (run % 4) {
+        case 0: {
+            const char* argv[] = ECHO_ARGV(token);
+            check_result(w, run, "argv", sp_execute_argv(argv, NULL, 0), token, 0);
+            break;
+        }
+        case 1:
+            snprintf(command, sizeof(command), ECHO_COMMAND, token);
+            check_result(w, run, "command", sp_execute_command(command, NULL, 0), token, 0);
+            break;
+        case 2:
+            sp_options_init(&options);
+            options.input_data = token;
+            options.input_length = (int)strlen(token);
+            check_result(w, run, "stdin", sp_execute_ex(CAT_COMMAND, NULL, NULL, &options), token, 0);
+            break;
+        default:
+            run_async(w, run, token);
+            break;
+        }
+    }
+}
+
+/* ============ THREADS ============ */
+
+#if defined(_WIN32) || defined(EIF_WINDOWS)
+static DWORD WINAPI thread_main(LPVOID data) {
+    run_worker((worker*)data);
+    return 0;
+}
+
+static int run_threads(worker* workers, int count) {
+    HANDLE* threads = (HANDLE*)malloc(count * sizeof(HANDLE));
+    int i;
+
+    if (!threads) return 0;
+    for (i = 0; i < count; i++) {
+        threads[i] = CreateThread(NULL, 0, thread_main, &workers[i], 0, NULL);
+        if (!threads[i]) return 0;
+    }
+    for (i = 0; i < count; i++) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    free(threads);
+    return 1;
+}
+
+static int open_descriptors(void) {
+    return -1;  /* Not counted on Windows */
+}
+#else
+static void* thread_main(void* data) {
+    run_worker((worker*)data);
+    return NULL;
+}
+
+static int run_threads(worker* workers, int count) {
+    pthread_t* threads = (pthread_t*)malloc(count * sizeof(pthread_t));
+    int i;
+
+    if (!threads) return 0;
+    for (i = 0; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, thread_main, &workers[i]) != 0) return 0;
+    }
+    for (i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return 1;
+}
+
+/* Number of open descriptors, or -1 if they cannot be listed. */
+static int open_descriptors(void) {
+    DIR* dir = opendir("/proc/self/fd");
+    int count = 0;
+
+    if (!dir) dir = opendir("/dev/fd");
+    if (!dir) return -1;
+    while (readdir(dir)) count++;
+    closedir(dir);
+    return count;
+}
+#endif
+
+/* ============ MAIN ============ */
+
+int main(int argc, char** argv) {
+    int thread_count = 32;
+    int fds_before, fds_after, failures = 0, i;
+    long long start;
+    double seconds;
+    worker* workers;
+
+    if (argc > 1) thread_count = atoi(argv[1]);
+    if (argc > 2) runs_per_thread = atoi(argv[2]);
+    if (thread_count <= 0 || runs_per_thread <= 0) {
+        fprintf(stderr, "Usage: %s [threads] [runs_per_thread]\n", argv[0]);
+        return 2;
+    }
+
+    workers = (worker*)calloc(thread_count, sizeof(worker));
+    if (!workers) return 2;
+    for (i = 0; i < thread_count; i++) {
+        workers[i].index = i;
+        workers[i].runs = runs_per_thread;
+    }
+
+    /* Warm up: the first wait may set up descriptors kept for the whole run */
+    workers[0].runs = 4;
+    run_worker(&workers[0]);
+    workers[0].runs = runs_per_thread;
+    fds_before = open_descriptors();
+    start = sp_monotonic_ns();
+    if (!run_threads(workers, thread_count)) {
+        fprintf(stderr, "could not start %d threads\n", thread_count);
+        return 2;
+    }
+    seconds = (sp_monotonic_ns() - start) / 1e9;
+    fds_after = open_descriptors();
+
+    for (i = 0; i < thread_count; i++) failures += workers[i].failures;
+    if (fds_before >= 0 && fds_after != fds_before) {
+        fprintf(stderr, "descriptors: %d open before, %d after\n", fds_before, fds_after);
+        failures++;
+    }
+    printf("%d threads x %d runs = %d processes in %.2f s (%.0f/s), %d failures\n",
+           thread_count, runs_per_thread, thread_count * runs_per_thread,
+           seconds, thread_count * runs_per_thread / seconds, failures);
+    free(workers);
+    return failures == 0 ? 0 : 1;
+}
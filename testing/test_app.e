@@ -37,12 +37,39 @@ feature {NONE} -- Test Runners
 			create lib_tests
 			run_test (agent lib_tests.test_output_of_command, "test_output_of_command")
 			run_test (agent lib_tests.test_has_file_in_path, "test_has_file_in_path")
+			run_test (agent lib_tests.test_resolve_command, "test_resolve_command")
 			run_test (agent lib_tests.test_show_process_flag, "test_show_process_flag")
 			run_test (agent lib_tests.test_wait_for_exit_flag, "test_wait_for_exit_flag")
 			run_test (agent lib_tests.test_simple_process_make, "test_simple_process_make")
 			run_test (agent lib_tests.test_simple_process_show_window, "test_simple_process_show_window")
 			run_test (agent lib_tests.test_async_process_make, "test_async_process_make")
 			run_test (agent lib_tests.test_output_with_directory, "test_output_with_directory")
+			run_test (agent lib_tests.test_execute_argv, "test_execute_argv")
+			run_test (agent lib_tests.test_async_start_argv, "test_async_start_argv")
+			run_test (agent lib_tests.test_separate_error_output, "test_separate_error_output")
+			run_test (agent lib_tests.test_output_handler_streaming, "test_output_handler_streaming")
+			run_test (agent lib_tests.test_output_limit, "test_output_limit")
+			run_test (agent lib_tests.test_output_limit_streaming_bytes, "test_output_limit_streaming_bytes")
+			run_test (agent lib_tests.test_read_output_into, "test_read_output_into")
+			run_test (agent lib_tests.test_execute_with_input, "test_execute_with_input")
+			run_test (agent lib_tests.test_async_write_input, "test_async_write_input")
+			run_test (agent lib_tests.test_utf8_output, "test_utf8_output")
+			run_test (agent lib_tests.test_resource_usage, "test_resource_usage")
+			run_test (agent lib_tests.test_execute_pipeline, "test_execute_pipeline")
+			run_test (agent lib_tests.test_batch_execution, "test_batch_execution")
+			run_test (agent lib_tests.test_shell_session, "test_shell_session")
+			run_test (agent lib_tests.test_shell_session_parse_error, "test_shell_session_parse_error")
+			run_test (agent lib_tests.test_spawn_server, "test_spawn_server")
+			run_test (agent lib_tests.test_execution_timeout, "test_execution_timeout")
+			run_test (agent lib_tests.test_timeout_background_child, "test_timeout_background_child")
+			run_test (agent lib_tests.test_termination_status, "test_termination_status")
+			run_test (agent lib_tests.test_line_streaming, "test_line_streaming")
+			run_test (agent lib_tests.test_output_to_file, "test_output_to_file")
+			run_test (agent lib_tests.test_child_environment, "test_child_environment")
+			run_test (agent lib_tests.test_child_resources, "test_child_resources")
+			run_test (agent lib_tests.test_process_metrics, "test_process_metrics")
+			run_test (agent lib_tests.test_process_trace, "test_process_trace")
+			run_test (agent lib_tests.test_process_group_wait_any, "test_process_group_wait_any")
 		end
 
 	run_simple_process_tests